@@ -0,0 +1,27 @@
+// Shared by the terrain_generate_*.comp passes, must match TerrainGpuGenerator
+// A batch generates one tile per z slice of the dispatch, u_Tiles gives the map tile of a slice
+
+#define GENERATOR_LOCAL_SIZE 16
+#define FLT_MAX 3.402823466e+38
+
+layout(push_constant) uniform block
+{
+    // x map width, y map height, z tile size, w tiles on a row of the map
+    uvec4 u_Grid;
+    // x octave count, y noise type, z min/max level written by terrain_generate_minmax.comp
+    uvec4 u_Noise;
+    // x ridge offset, y sum of the octave amplitudes, z exponent, w max height
+    vec4 u_Params;
+};
+
+// Texel of the map at the min corner of the tile of a slice
+ivec2 get_tile_origin(uint tileIndex)
+{
+    uint tileSize = u_Grid.z;
+    return ivec2(tileIndex % u_Grid.w, tileIndex / u_Grid.w) * int(tileSize);
+}
+
+bool is_inside_map(ivec2 texel)
+{
+    return texel.x < int(u_Grid.x) && texel.y < int(u_Grid.y);
+}
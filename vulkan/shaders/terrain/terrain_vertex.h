@@ -0,0 +1,200 @@
+// Terrain vertices pulled from the chunk storage buffers with gl_VertexIndex
+// must match TerrainVertex, TerrainChunkGpuData and the buffers of TerrainChunkManager
+// In TerrainMeshMode::VertexTextureFetch the heights are sampled from u_Heightmap instead
+// TerrainClipmap uses the same buffers with a level per chunk, see get_clipmap_vertex
+
+struct TerrainChunkData
+{
+    // xy min, zw size
+    vec4 rect;
+    // x height of a quantized 0, y height of a quantization step, z lod level
+    vec4 heightRange;
+};
+
+layout(binding = 6, std430) readonly buffer TerrainChunkBuffer
+{
+    // x vertex count of a side, y vertex per row including the border, z vertex per chunk
+    // w 0 cpu mesh, 1 texture fetch, 2 clipmap
+    uvec4 u_TerrainGrid;
+    // xy terrain size, z max height, w lod distance of the quadtree or clipmap morph width in cell
+    vec4 u_TerrainParams;
+    // xy camera position the lod has been selected from, the morph is centered on it
+    vec4 u_TerrainCamera;
+    TerrainChunkData u_TerrainChunks[];
+};
+
+layout(binding = 7, std430) readonly buffer TerrainVertexBuffer
+{
+    // Three 16 bits value per vertex: height, morph height and octahedral normal
+    uint u_TerrainVertices[];
+};
+
+layout(binding = 8) uniform sampler2D u_Heightmap;
+
+struct TerrainVertex
+{
+    // position.y is already morphed between the vertex and its morph height
+    vec3 position;
+    float morphHeight;
+    vec3 normal;
+    float morph;
+};
+
+uint read_terrain_half(uint index)
+{
+    uint word = u_TerrainVertices[index >> 1];
+    return (index & 1u) != 0u ? (word >> 16) : (word & 0xFFFFu);
+}
+
+vec3 decode_octahedral(uint n)
+{
+    vec2 e = vec2(float(n & 0xFFu), float(n >> 8)) / 255.0 * 2.0 - 1.0;
+    vec3 v = vec3(e.x, 1.0 - abs(e.x) - abs(e.y), e.y);
+    float t = max(-v.y, 0.0);
+    v.x += v.x >= 0.0 ? -t : t;
+    v.z += v.z >= 0.0 ? -t : t;
+    return normalize(v);
+}
+
+float fetch_height_texel(ivec2 p, ivec2 size)
+{
+    if (any(lessThan(p, ivec2(0))) || any(greaterThanEqual(p, size)))
+        return 0.0;
+    return texelFetch(u_Heightmap, p, 0).r;
+}
+
+// Same filtering and edge falloff as get_height in terrain_chunk.cpp
+float sample_terrain_height(vec2 p)
+{
+    ivec2 size = textureSize(u_Heightmap, 0);
+    ivec2 i = ivec2(p);
+    float a = fetch_height_texel(i, size);
+    float b = fetch_height_texel(i + ivec2(1, 0), size);
+    float c = fetch_height_texel(i + ivec2(0, 1), size);
+    float d = fetch_height_texel(i + ivec2(1, 1), size);
+
+    vec2 f = p - vec2(i);
+    float h = mix(mix(a, b, f.x), mix(c, d, f.x), f.y) * 2.0 - 1.0;
+
+    float maxHeight = u_TerrainParams.z;
+    const float transitionRegion = 200.0;
+    vec2 halfSize = vec2(size) * 0.5;
+    float radius = max(halfSize.x, halfSize.y) - transitionRegion;
+    float edgeDistance = length(p - halfSize) - radius;
+    if (edgeDistance < 0.0)
+        return h * maxHeight;
+    float factor = smoothstep(0.0, 1.0, edgeDistance / transitionRegion);
+    return mix(h * maxHeight, -maxHeight, factor);
+}
+
+vec2 get_chunk_position(TerrainChunkData chunk, ivec2 grid)
+{
+    return chunk.rect.xy + vec2(grid) / float(u_TerrainGrid.x) * chunk.rect.zw;
+}
+
+// Same mapping as create_mesh
+vec2 get_heightmap_uv(vec2 xz)
+{
+    vec2 size = vec2(textureSize(u_Heightmap, 0));
+    return xz / u_TerrainParams.xy * (size - 3.0) + 1.0;
+}
+
+// CDLOD morph of a quadtree chunk, 0 up to half the split distance of its parent and 1 at the split distance
+// where a coarser neighbour can start. Same distance as QuadTree::split, the lod distance must be above 2 * sqrt(2)
+// so that the vertices of a finer neighbour are still at 0 on a shared edge
+float get_chunk_morph(vec2 xz, float size)
+{
+    float lodDistance = u_TerrainParams.w;
+    float morphEnd = lodDistance * size;
+    float morphStart = 0.5 * lodDistance * size + 1.41421356 * size;
+    return clamp((length(xz - u_TerrainCamera.xy) - morphStart) / (morphEnd - morphStart), 0.0, 1.0);
+}
+
+TerrainVertex fetch_terrain_vertex(TerrainChunkData chunk, ivec2 grid)
+{
+    vec2 xz = get_chunk_position(chunk, grid);
+    vec2 uv = get_heightmap_uv(xz);
+
+    float a = sample_terrain_height(uv + vec2(1.0, 0.0));
+    float b = sample_terrain_height(uv - vec2(1.0, 0.0));
+    float c = sample_terrain_height(uv + vec2(0.0, 1.0));
+    float d = sample_terrain_height(uv - vec2(0.0, 1.0));
+
+    TerrainVertex vertex;
+    vertex.position = vec3(xz.x, sample_terrain_height(uv), xz.y);
+    vertex.morphHeight = vertex.position.y;
+    vertex.normal = normalize(vec3(a - b, 1.0, d - c));
+
+    // Morph target of create_mesh, odd vertices take the average of their neighbours on the parent grid
+    ivec2 offset = grid & 1;
+    if (offset.x + offset.y > 0)
+    {
+        if (offset.x + offset.y == 2)
+            offset.y = -1;
+        float h1 = sample_terrain_height(get_heightmap_uv(get_chunk_position(chunk, grid + offset)));
+        float h2 = sample_terrain_height(get_heightmap_uv(get_chunk_position(chunk, grid - offset)));
+        vertex.morphHeight = (h1 + h2) * 0.5;
+    }
+    return vertex;
+}
+
+// Clipmap level data: rect is the min corner, size and toroidal slot of the min corner,
+// heightRange the quantization range
+TerrainVertex get_clipmap_vertex(uint vertexIndex)
+{
+    uint level = vertexIndex / u_TerrainGrid.z;
+    uint local = vertexIndex - level * u_TerrainGrid.z;
+    TerrainChunkData data = u_TerrainChunks[level];
+
+    uint rowSize = u_TerrainGrid.y;
+    uvec2 grid = uvec2(local % rowSize, local / rowSize);
+    uint slotOrigin = uint(data.rect.w);
+    uvec2 slot = (uvec2(slotOrigin % rowSize, slotOrigin / rowSize) + grid) % rowSize;
+    uint base = (level * u_TerrainGrid.z + slot.y * rowSize + slot.x) * 3u;
+
+    float spacing = data.rect.z / float(u_TerrainGrid.x);
+    vec2 xz = data.rect.xy + vec2(grid) * spacing;
+    float height = data.heightRange.x + float(read_terrain_half(base)) * data.heightRange.y;
+    float morphHeight = data.heightRange.x + float(read_terrain_half(base + 1u)) * data.heightRange.y;
+
+    // Vertices reach the next level surface before the border of the level
+    float width = u_TerrainParams.w;
+    vec2 fromCamera = abs(xz - u_TerrainCamera.xy) / spacing;
+    float morph = clamp((max(fromCamera.x, fromCamera.y) - (float(u_TerrainGrid.x) * 0.5 - 2.0 - width)) / width, 0.0, 1.0);
+
+    TerrainVertex vertex;
+    vertex.position = vec3(xz.x, mix(height, morphHeight, morph), xz.y);
+    vertex.morphHeight = morphHeight;
+    vertex.normal = decode_octahedral(read_terrain_half(base + 2u));
+    vertex.morph = morph;
+    return vertex;
+}
+
+// vertexIndex includes the vertex offset of the draw which selects the chunk slot
+TerrainVertex get_terrain_vertex(uint vertexIndex)
+{
+    if (u_TerrainGrid.w == 2u)
+        return get_clipmap_vertex(vertexIndex);
+
+    uint chunkIndex = vertexIndex / u_TerrainGrid.z;
+    uint local = vertexIndex - chunkIndex * u_TerrainGrid.z;
+    TerrainChunkData chunk = u_TerrainChunks[chunkIndex];
+
+    // Same mapping as create_mesh, the grid has one extra vertex on each side
+    ivec2 grid = ivec2(local % u_TerrainGrid.y, local / u_TerrainGrid.y) - 1;
+    TerrainVertex vertex;
+    if (u_TerrainGrid.w == 1u)
+        vertex = fetch_terrain_vertex(chunk, grid);
+    else
+    {
+        uint base = vertexIndex * 3u;
+        vec2 xz = get_chunk_position(chunk, grid);
+        vertex.position = vec3(xz.x, chunk.heightRange.x + float(read_terrain_half(base)) * chunk.heightRange.y, xz.y);
+        vertex.morphHeight = chunk.heightRange.x + float(read_terrain_half(base + 1u)) * chunk.heightRange.y;
+        vertex.normal = decode_octahedral(read_terrain_half(base + 2u));
+    }
+
+    vertex.morph = get_chunk_morph(vertex.position.xz, chunk.rect.z);
+    vertex.position.y = mix(vertex.position.y, vertex.morphHeight, vertex.morph);
+    return vertex;
+}
@@ -24,31 +24,18 @@ public:
 		for (int i = 0; i < 6; ++i)
 		{
 			glm::vec3 p = min;
-			glm::vec3 n = max;
 
 			glm::vec3 normal = m_planes[i].normal;
 			if (normal.x >= 0.0f)
-			{
 				p.x = max.x;
-				n.x = min.x;
-			}
 			if (normal.y >= 0.0f)
-			{
 				p.y = max.y;
-				n.y = min.y;
-			}
 			if (normal.z >= 0.0f)
-			{
 				p.z = max.z;
-				n.z = min.z;
-			}
 
+			// Box straddling a plane can still be outside of another one
 			if (m_planes[i].get_distance_to(p) < 0.0f)
 				return false;
-			else if (m_planes[i].get_distance_to(n) < 0.0f)
-				return true;
-			//if (outside)
-				//return false;
 		}
 		return true;
 	}
@@ -58,6 +45,12 @@ public:
 		return m_points;
 	}
 
+	// Left, Right, Top, Bottom, Near, Far with normal facing inside
+	const std::array<Plane, 6>& get_planes() const
+	{
+		return m_planes;
+	}
+
 private:
 	std::array<glm::vec3, 8> m_points = {};
 	std::array<Plane, 6> m_planes = {};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// 64 bit mix of splitmix64, every bit of the input affects every bit of the output
+inline uint64_t hash_mix(uint64_t value)
+{
+	value ^= value >> 30;
+	value *= 0xbf58476d1ce4e5b9ull;
+	value ^= value >> 27;
+	value *= 0x94d049bb133111ebull;
+	value ^= value >> 31;
+	return value;
+}
+
+inline uint64_t hash_combine(uint64_t seed, uint64_t value)
+{
+	return hash_mix(seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2)));
+}
+
+// Not meant to be cryptographic, reads 8 byte at a time so that it can go over a whole heightmap
+inline uint64_t hash_bytes(const void* data, uint64_t size, uint64_t seed = 0)
+{
+	const uint8_t* bytes = static_cast<const uint8_t*>(data);
+	uint64_t hash = hash_combine(seed, size);
+	uint64_t i = 0;
+	for (; i + 8 <= size; i += 8)
+	{
+		uint64_t word;
+		memcpy(&word, bytes + i, sizeof(word));
+		hash = (hash ^ hash_mix(word)) * 0x9e3779b97f4a7c15ull;
+	}
+
+	uint64_t tail = 0;
+	memcpy(&tail, bytes + i, size_t(size - i));
+	return hash_combine(hash, tail);
+}
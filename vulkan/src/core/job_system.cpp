@@ -0,0 +1,83 @@
+#include "job_system.h"
+
+JobSystem::JobSystem(uint32_t workerCount)
+{
+	m_workers.reserve(workerCount);
+	for (uint32_t i = 0; i < workerCount; ++i)
+		m_workers.emplace_back(&JobSystem::worker_loop, this);
+}
+
+uint32_t JobSystem::get_default_worker_count()
+{
+	uint32_t coreCount = std::thread::hardware_concurrency();
+	return coreCount > 1 ? coreCount - 1 : 1;
+}
+
+void JobSystem::execute(const std::function<void()>& job)
+{
+	if (m_workers.size() == 0)
+	{
+		job();
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_jobs.push(job);
+	}
+	m_jobAvailable.notify_one();
+}
+
+void JobSystem::wait()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_jobFinished.wait(lock, [this]() { return m_jobs.empty() && m_activeJobs == 0; });
+}
+
+bool JobSystem::is_busy()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return !m_jobs.empty() || m_activeJobs > 0;
+}
+
+void JobSystem::worker_loop()
+{
+	while (true)
+	{
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_jobAvailable.wait(lock, [this]() { return !m_running || !m_jobs.empty(); });
+			if (!m_running)
+				return;
+
+			job = std::move(m_jobs.front());
+			m_jobs.pop();
+			m_activeJobs++;
+		}
+
+		job();
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_activeJobs--;
+		}
+		m_jobFinished.notify_all();
+	}
+}
+
+void JobSystem::destroy()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_running = false;
+		// Pending job are dropped, only the one already running are completed
+		m_jobs = {};
+	}
+	m_jobAvailable.notify_all();
+
+	for (auto& worker : m_workers)
+		worker.join();
+	m_workers.clear();
+	m_jobFinished.notify_all();
+}
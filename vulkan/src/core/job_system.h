@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Simple fixed size worker pool
+// With zero worker, job are executed immediately on the calling thread
+class JobSystem
+{
+public:
+	JobSystem(uint32_t workerCount);
+
+	void execute(const std::function<void()>& job);
+	// Block until every queued job has finished
+	void wait();
+
+	bool is_busy();
+	uint32_t get_worker_count() const { return static_cast<uint32_t>(m_workers.size()); }
+
+	// Number of worker to use when all the core except the main thread are available
+	static uint32_t get_default_worker_count();
+
+	void destroy();
+private:
+	std::vector<std::thread> m_workers;
+	std::queue<std::function<void()>> m_jobs;
+
+	std::mutex m_mutex;
+	std::condition_variable m_jobAvailable;
+	std::condition_variable m_jobFinished;
+	uint32_t m_activeJobs = 0;
+	bool m_running = true;
+
+	void worker_loop();
+};
@@ -0,0 +1,111 @@
+#include "mapped_file.h"
+
+#ifdef PLATFORM_LINUX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef PLATFORM_WINDOWS
+MappedFile::MappedFile(const char* filename)
+{
+	m_file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (m_file == INVALID_HANDLE_VALUE)
+		return;
+
+	LARGE_INTEGER size = {};
+	GetFileSizeEx(m_file, &size);
+	m_size = static_cast<uint64_t>(size.QuadPart);
+	if (m_size == 0)
+		return;
+
+	m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (m_mapping == nullptr)
+		return;
+	m_data = static_cast<const uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+}
+
+MappedFile::MappedFile(const char* filename, uint64_t size)
+{
+	m_file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (m_file == INVALID_HANDLE_VALUE || size == 0)
+		return;
+
+	LARGE_INTEGER fileSize = {};
+	fileSize.QuadPart = static_cast<LONGLONG>(size);
+	if (!SetFilePointerEx(m_file, fileSize, nullptr, FILE_BEGIN) || !SetEndOfFile(m_file))
+		return;
+	m_size = size;
+
+	m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+	if (m_mapping == nullptr)
+		return;
+	m_data = static_cast<const uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_WRITE, 0, 0, 0));
+	m_writable = m_data != nullptr;
+}
+
+void MappedFile::destroy()
+{
+	if (m_data)
+		UnmapViewOfFile(m_data);
+	if (m_mapping)
+		CloseHandle(m_mapping);
+	if (m_file != INVALID_HANDLE_VALUE)
+		CloseHandle(m_file);
+
+	m_data = nullptr;
+	m_mapping = nullptr;
+	m_file = INVALID_HANDLE_VALUE;
+	m_size = 0;
+	m_writable = false;
+}
+#else
+MappedFile::MappedFile(const char* filename)
+{
+	m_file = open(filename, O_RDONLY);
+	if (m_file < 0)
+		return;
+
+	struct stat fileStat = {};
+	fstat(m_file, &fileStat);
+	m_size = static_cast<uint64_t>(fileStat.st_size);
+	if (m_size == 0)
+		return;
+
+	void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_file, 0);
+	if (data != MAP_FAILED)
+		m_data = static_cast<const uint8_t*>(data);
+}
+
+MappedFile::MappedFile(const char* filename, uint64_t size)
+{
+	m_file = open(filename, O_RDWR | O_CREAT, 0644);
+	if (m_file < 0 || size == 0)
+		return;
+
+	if (ftruncate(m_file, static_cast<off_t>(size)) != 0)
+		return;
+	m_size = size;
+
+	void* data = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_file, 0);
+	if (data != MAP_FAILED)
+	{
+		m_data = static_cast<const uint8_t*>(data);
+		m_writable = true;
+	}
+}
+
+void MappedFile::destroy()
+{
+	if (m_data)
+		munmap(const_cast<uint8_t*>(m_data), m_size);
+	if (m_file >= 0)
+		close(m_file);
+
+	m_data = nullptr;
+	m_file = -1;
+	m_size = 0;
+	m_writable = false;
+}
+#endif
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "core/base.h"
+
+// Memory mapping of a whole file, pages are read from disk on first access
+class MappedFile
+{
+public:
+	// Read only mapping of an existing file
+	MappedFile(const char* filename);
+	// Read write mapping of a file created or resized to size byte, the
+	// written pages are flushed to disk by the os
+	MappedFile(const char* filename, uint64_t size);
+
+	bool is_valid() const { return m_data != nullptr; }
+	bool is_writable() const { return m_writable; }
+	const uint8_t* get_data() const { return m_data; }
+	uint8_t* get_writable_data() { ASSERT(m_writable); return const_cast<uint8_t*>(m_data); }
+	uint64_t get_size() const { return m_size; }
+
+	void destroy();
+private:
+	const uint8_t* m_data = nullptr;
+	uint64_t m_size = 0;
+	bool m_writable = false;
+
+#ifdef PLATFORM_WINDOWS
+	HANDLE m_file = INVALID_HANDLE_VALUE;
+	HANDLE m_mapping = nullptr;
+#else
+	int m_file = -1;
+#endif
+};
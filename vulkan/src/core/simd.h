@@ -0,0 +1,15 @@
+#pragma once
+
+// Instruction sets available at compile time
+// SSE2 is part of x64, AVX2 needs /arch:AVX2 (-mavx2)
+#if defined(__AVX2__)
+#define SIMD_AVX2
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_SSE2
+#endif
+
+#if defined(SIMD_AVX2) || defined(SIMD_SSE2)
+#include <immintrin.h>
+#endif
@@ -35,6 +35,8 @@ public:
 	void run()
 	{
 		m_window->run(60.0);
+		// Frames can still be in flight when the window is closed
+		Device::wait_idle();
 	}
 
 	virtual void update(float dt) = 0;
@@ -72,6 +74,9 @@ protected:
 
 			float gpuMemory = float(Device::get_total_memory_allocated()) / (1024.0f * 1024.0f);
 			ImGui::Text("GPU Memory: %.1fMB", gpuMemory);
+
+			UploadStatistics uploadStats = m_context->get_upload_statistics();
+			ImGui::Text("Staged: %.2fMB, stalls: %d(%d)", float(uploadStats.bytesStagedLastFrame) / (1024.0f * 1024.0f), uploadStats.stallsLastFrame, static_cast<int>(uploadStats.totalStalls));
 			ImGui::End();
 		}
 
@@ -1,5 +1,6 @@
 #include "gizmo_example.h"
 #include "terrain_example.h"
+#include "terrain_generator_example.h"
 #include "water_example.h"
 #include "atmosphere_example.h"
 #include "pbr_example.h"
@@ -23,6 +24,7 @@ int main()
 {
 	Register("Gizmo", CreateGizmoExampleFn);
 	Register("Terrain", CreateTerrainExampleFn);
+	Register("TerrainGenerator", CreateTerrainGeneratorExampleFn);
 	Register("Water", CreateWaterExampleFn);
 	Register("Atmosphere", CreateAtmosphereExampleFn);
 	Register("PBR", CreatePBRExampleFn);
@@ -17,6 +17,13 @@ class Framebuffer;
 class GraphicsWindow;
 class GpuTimestampQuery;
 
+struct UploadStatistics
+{
+	uint64_t bytesStagedLastFrame = 0;
+	uint32_t stallsLastFrame = 0;
+	uint64_t totalStalls = 0;
+};
+
 class Context
 {
 public:
@@ -32,6 +39,11 @@ public:
 	virtual void begin_compute() = 0;
 	virtual void end_compute() = 0;
 
+	// Compute work recorded between these calls runs on the async compute queue when available,
+	// the graphics work of the current frame waits for it without blocking the CPU
+	virtual void begin_async_compute() = 0;
+	virtual void end_async_compute() = 0;
+
 
 	virtual void end() = 0;
 	virtual void present() = 0;
@@ -42,11 +54,20 @@ public:
 	virtual void copy(ShaderStorageBuffer* buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte) = 0;
 	virtual void copy(IndirectBuffer* buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte) = 0;
 
+	// Blocking readback that waits for the work submitted so far, the buffer must be created with BufferUsageHint::StaticRead
+	virtual void read(ShaderStorageBuffer* buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte) = 0;
+
+	// Both texture copies are staged with the buffer uploads and land before the commands of the frame
 	virtual void copy(Texture* texture, void* data, uint32_t sizeInByte) = 0;
+	// Update the texel rect of width x height at (x, y), data is tightly packed and the other texels are kept
+	virtual void copy(Texture* texture, void* data, uint32_t sizeInByte, uint32_t x, uint32_t y, uint32_t width, uint32_t height) = 0;
 
 	virtual void draw(uint32_t vertexCount) = 0;
 	virtual void draw_indexed(uint32_t indexCount) = 0;
 	virtual void draw_indexed_indirect(IndirectBuffer* buffer, uint32_t offset, uint32_t drawCount, uint32_t stride) = 0;
+	// Draw count is read on the gpu from countBuffer, only valid if is_draw_indirect_count_supported()
+	virtual void draw_indexed_indirect_count(IndirectBuffer* buffer, uint32_t offset, IndirectBuffer* countBuffer, uint32_t countOffset, uint32_t maxDrawCount, uint32_t stride) = 0;
+	virtual bool is_draw_indirect_count_supported() = 0;
 
 	virtual void dispatch_compute(uint32_t workGroupSizeX, uint32_t workGroupSizeY, uint32_t workGroupSizeZ) = 0;
 
@@ -83,6 +104,13 @@ public:
 
 	virtual RenderPass* get_global_renderpass() = 0;
 
+	virtual UploadStatistics get_upload_statistics() = 0;
+
+	// Resources written by the cpu every frame need one copy per frame in flight
+	virtual uint32_t get_frames_in_flight() = 0;
+	// Index of the frame being recorded, in [0, get_frames_in_flight())
+	virtual uint32_t get_frame_index() = 0;
+
 	virtual ~Context(){}
 
 protected:
@@ -32,6 +32,11 @@ Framebuffer* Device::create_framebuffer(const FramebufferDescription& desc, Rend
 	return new VulkanFramebuffer(std::static_pointer_cast<VulkanAPI>(Device::graphicsAPI), desc, rp);
 }
 
+void Device::wait_idle()
+{
+	Device::graphicsAPI->wait_idle();
+}
+
 Context* Device::create_context(GraphicsWindow* window)
 {
 	static Context* context = new VulkanContext(std::static_pointer_cast<VulkanAPI>(Device::graphicsAPI), reinterpret_cast<VulkanGraphicsWindow*>(window));
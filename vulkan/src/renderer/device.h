@@ -69,6 +69,9 @@ public:
 	static void destroy_shader_bindings(ShaderBindings* bindings);
 	static void destroy_query(GpuTimestampQuery* query);
 
+	// Block until every submitted frame has finished, required before destroying resources
+	static void wait_idle();
+
 	static uint64_t get_total_memory_allocated() { return totalMemoryAllocated; }
 private:
 	static std::shared_ptr<GraphicsAPI> graphicsAPI;
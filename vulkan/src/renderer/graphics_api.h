@@ -5,5 +5,6 @@
 class GraphicsAPI
 {
 public:
+	virtual void wait_idle() = 0;
 	virtual void destroy() = 0;
 };
\ No newline at end of file
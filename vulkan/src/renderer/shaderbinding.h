@@ -5,6 +5,7 @@
 class UniformBuffer;
 class Texture;
 class ShaderStorageBuffer;
+class IndirectBuffer;
 
 
 class ShaderBindings
@@ -14,6 +15,8 @@ public:
 
 	// Shader Storage Buffer
 	virtual void set_buffer(ShaderStorageBuffer* ubo, uint32_t binding) = 0;
+	// Bound as Shader Storage Buffer
+	virtual void set_buffer(IndirectBuffer* buffer, uint32_t binding) = 0;
 	
 	// Image Sampler
 	virtual void set_texture_sampler(Texture* texture, uint32_t binding) = 0;
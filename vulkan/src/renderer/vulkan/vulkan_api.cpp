@@ -90,11 +90,19 @@ VkDebugUtilsMessengerEXT VulkanAPI::create_debug_messenger(VkInstance instance)
 
 VkDevice VulkanAPI::create_device(VkInstance instance, VkPhysicalDevice physicalDevice, QueueFamilyIndices queueFamilyIndices)
 {
+	float queuePriority = 1.0f;
+	std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
 	VkDeviceQueueCreateInfo queueCreateInfo = { VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO };
 	queueCreateInfo.queueCount = 1;
 	queueCreateInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily;
-	float queuePriority = 1.0f;
 	queueCreateInfo.pQueuePriorities = &queuePriority;
+	queueCreateInfos.push_back(queueCreateInfo);
+
+	if (queueFamilyIndices.computeFamily != queueFamilyIndices.graphicsFamily)
+	{
+		queueCreateInfo.queueFamilyIndex = queueFamilyIndices.computeFamily;
+		queueCreateInfos.push_back(queueCreateInfo);
+	}
 
 	const char* extensions[] = {
 		VK_KHR_SWAPCHAIN_EXTENSION_NAME,
@@ -125,8 +133,8 @@ VkDevice VulkanAPI::create_device(VkInstance instance, VkPhysicalDevice physical
 	assert(allExtensionAvailable != false);
 
 	VkDeviceCreateInfo createInfo = { VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO };
-	createInfo.queueCreateInfoCount = 1;
-	createInfo.pQueueCreateInfos = &queueCreateInfo;
+	createInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
+	createInfo.pQueueCreateInfos = queueCreateInfos.data();
 	createInfo.enabledExtensionCount = ARRAYSIZE(extensions);;
 	createInfo.ppEnabledExtensionNames = extensions;
 
@@ -140,6 +148,17 @@ VkDevice VulkanAPI::create_device(VkInstance instance, VkPhysicalDevice physical
 	features.samplerAnisotropy = true;
 	createInfo.pEnabledFeatures = &features;
 
+	// Used by the gpu driven draws, caller fallback to cpu generated draws when missing
+	VkPhysicalDeviceVulkan12Features supportedFeatures12 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES };
+	VkPhysicalDeviceFeatures2 supportedFeatures = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2 };
+	supportedFeatures.pNext = &supportedFeatures12;
+	vkGetPhysicalDeviceFeatures2(physicalDevice, &supportedFeatures);
+	m_drawIndirectCountSupported = supportedFeatures12.drawIndirectCount == VK_TRUE;
+
+	VkPhysicalDeviceVulkan12Features features12 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES };
+	features12.drawIndirectCount = supportedFeatures12.drawIndirectCount;
+	createInfo.pNext = &features12;
+
 
 	VkDevice device = 0;
 	VK_CHECK(vkCreateDevice(physicalDevice, &createInfo, 0, &device));
@@ -192,11 +211,19 @@ VulkanAPI::VulkanAPI(GLFWwindow* window)
 	m_DescriptorPool = create_descriptor_pool(m_Device);
 
 	vkGetDeviceQueue(m_Device, m_QueueFamilyIndices.graphicsFamily, 0, &m_GraphicsQueue);
+	vkGetDeviceQueue(m_Device, m_QueueFamilyIndices.computeFamily, 0, &m_ComputeQueue);
+	if (m_QueueFamilyIndices.computeFamily != m_QueueFamilyIndices.graphicsFamily)
+		Debug_Log("Using dedicated compute queue family");
 
 	vkGetPhysicalDeviceMemoryProperties(m_PhysicalDevice, &m_MemoryProps);
 	vkGetPhysicalDeviceProperties(m_PhysicalDevice, &m_physicalDeviceProperties);
 }
 
+void VulkanAPI::wait_idle()
+{
+	VK_CHECK(vkDeviceWaitIdle(m_Device));
+}
+
 void VulkanAPI::destroy()
 {
 	vkDestroyDescriptorPool(m_Device, m_DescriptorPool, 0);
@@ -37,9 +37,14 @@ public:
 	VkPhysicalDevice get_physical_device() { return m_PhysicalDevice; }
 	QueueFamilyIndices get_queue_family_indices() { return m_QueueFamilyIndices; }
 	VkQueue get_queue() { return m_GraphicsQueue; }
+	// Same as the graphics queue if the device has no dedicated compute family
+	VkQueue get_compute_queue() { return m_ComputeQueue; }
+	bool has_async_compute_queue() { return m_QueueFamilyIndices.computeFamily != m_QueueFamilyIndices.graphicsFamily; }
+	bool is_draw_indirect_count_supported() { return m_drawIndirectCountSupported; }
 
 	VkDescriptorPool get_descriptor_pool() { return m_DescriptorPool; }
 
+	void wait_idle() override;
 	void destroy() override;
 private:
 	VkInstance m_Instance;
@@ -47,10 +52,12 @@ private:
 	VkPhysicalDevice m_PhysicalDevice;
 	VkDevice m_Device;
 	VkQueue m_GraphicsQueue;
+	VkQueue m_ComputeQueue;
 	QueueFamilyIndices m_QueueFamilyIndices;
 	VkPhysicalDeviceMemoryProperties m_MemoryProps;
 	VkPhysicalDeviceProperties m_physicalDeviceProperties;
 	VkDescriptorPool m_DescriptorPool;
+	bool m_drawIndirectCountSupported = false;
 
 	VkInstance create_instance(GLFWwindow* window);
 	VkDebugUtilsMessengerEXT create_debug_messenger(VkInstance instance);
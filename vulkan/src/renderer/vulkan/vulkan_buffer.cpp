@@ -1,12 +1,35 @@
 #include "vulkan_buffer.h"
 #include "vulkan_api.h"
 #include "vulkan_type_converter.h"
+#include "vulkan_staging_ring.h"
 
-VulkanBuffer::VulkanBuffer(std::shared_ptr<VulkanAPI> api, VkBufferUsageFlags usage, VkMemoryPropertyFlags memoryFlags, uint32_t sizeInByte) : size(sizeInByte), buffer(0), memory(0), pointer(nullptr)
+// Largest offset alignment allowed by the specification for uniform and storage buffer
+static const uint32_t BUFFER_VERSION_ALIGNMENT = 256;
+
+// Cpu written buffer need one more version than the number of frame in flight,
+// the active one can still be referenced by the frame being recorded when it is replaced
+static uint32_t get_version_count(VkMemoryPropertyFlags memoryFlags)
+{
+	return (memoryFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) ? MAX_FRAMES_IN_FLIGHT + 1 : 1;
+}
+
+VulkanBuffer::VulkanBuffer(std::shared_ptr<VulkanAPI> api, VkBufferUsageFlags usage, VkMemoryPropertyFlags memoryFlags, uint32_t sizeInByte, uint32_t versionCount) : size(sizeInByte), buffer(0), memory(0), pointer(nullptr), versionCount(versionCount)
 {
+	ASSERT(versionCount > 0);
+	versionStride = sizeInByte;
+	if (versionCount > 1)
+	{
+		ASSERT(memoryFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+		versionStride = (sizeInByte + BUFFER_VERSION_ALIGNMENT - 1) & ~(BUFFER_VERSION_ALIGNMENT - 1);
+		m_versionFreeFrame.resize(versionCount, 0);
+		m_versionFence.resize(versionCount, VK_NULL_HANDLE);
+		m_shadowData.resize(sizeInByte);
+	}
+	uint32_t allocationSize = versionStride * versionCount;
+
 	VkDevice device = api->m_Device;
 	VkBufferCreateInfo createInfo = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
-	createInfo.size = sizeInByte;
+	createInfo.size = allocationSize;
 	createInfo.usage = usage;
 	createInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 	
@@ -23,46 +46,49 @@ VulkanBuffer::VulkanBuffer(std::shared_ptr<VulkanAPI> api, VkBufferUsageFlags us
 	VK_CHECK(vkBindBufferMemory(device, buffer, memory, 0));
 
 	if (memoryFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
-		VK_CHECK(vkMapMemory(device, memory, 0, sizeInByte, 0, &pointer));
+	{
+		VK_CHECK(vkMapMemory(device, memory, 0, allocationSize, 0, &pointer));
+	}
 }
 
-void VulkanBuffer::copy(std::shared_ptr<VulkanAPI> api, VkCommandBuffer commandBuffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte)
+void VulkanBuffer::copy(std::shared_ptr<VulkanAPI> api, VulkanStagingRing* stagingRing, void* data, uint32_t offsetInByte, uint32_t sizeInByte, uint64_t frameNumber, VkFence frameFence)
 {
 	if (pointer == nullptr)
+		stagingRing->copy(api, buffer, data, offsetInByte, sizeInByte);
+	else
 	{
-		VkCommandBufferBeginInfo beginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
-		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-
-		vkResetCommandBuffer(commandBuffer, 0);
-		VK_CHECK(vkBeginCommandBuffer(commandBuffer, &beginInfo));
-
-		VkBufferUsageFlags bufferUsage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-		VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
-		VulkanBuffer stagingBuffer(api, bufferUsage, properties, sizeInByte);
-		stagingBuffer.copy(data, 0, sizeInByte);
-
-		VkBufferCopy copyRegion;
-		copyRegion.dstOffset = offsetInByte;
-		copyRegion.size = sizeInByte;
-		copyRegion.srcOffset = 0;
-		vkCmdCopyBuffer(commandBuffer, stagingBuffer.buffer, buffer, 1, &copyRegion);
-
-		VK_CHECK(vkEndCommandBuffer(commandBuffer));
-
-		VkSubmitInfo submitInfo = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
-		submitInfo.commandBufferCount = 1;
-		submitInfo.pCommandBuffers = &commandBuffer;
-		VkQueue queue = api->m_GraphicsQueue;
-
-		vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE);
-		vkDeviceWaitIdle(api->m_Device);
-		stagingBuffer.destroy(api);
+		if (versionCount > 1 && m_activeVersionFrame != frameNumber)
+			next_version(api, frameNumber, frameFence);
+		copy(data, offsetInByte, sizeInByte);
+	}
+}
 
+void VulkanBuffer::next_version(std::shared_ptr<VulkanAPI> api, uint64_t frameNumber, VkFence frameFence)
+{
+	// Version released the earliest
+	uint32_t version = activeVersion == 0 ? 1 : 0;
+	for (uint32_t i = 0; i < versionCount; ++i)
+	{
+		if (i != activeVersion && m_versionFreeFrame[i] < m_versionFreeFrame[version])
+			version = i;
 	}
-	else
+
+	// Every version is still in flight, the frame that last read the oldest one has been submitted
+	if (m_versionFreeFrame[version] > frameNumber)
 	{
-		copy(data, offsetInByte, sizeInByte);
+		VK_CHECK(vkWaitForFences(api->get_device(), 1, &m_versionFence[version], VK_TRUE, UINT64_MAX));
+		m_versionFreeFrame[version] = frameNumber;
 	}
+
+	// The new version start with the latest content so that partial update are preserved
+	uint8_t* base = reinterpret_cast<uint8_t*>(pointer);
+	memcpy(base + version * versionStride, m_shadowData.data(), size);
+
+	// Frame recorded up to this one can still read the previous version
+	m_versionFreeFrame[activeVersion] = frameNumber + MAX_FRAMES_IN_FLIGHT;
+	m_versionFence[activeVersion] = frameFence;
+	activeVersion = version;
+	m_activeVersionFrame = frameNumber;
 }
 
 void VulkanBuffer::destroy(std::shared_ptr<VulkanAPI> api)
@@ -77,19 +103,21 @@ void VulkanBuffer::copy(void* data, uint32_t offsetInByte, uint32_t sizeInByte)
 {
 	ASSERT_MSG((offsetInByte + sizeInByte) <= size, "Insufficient Memory to Copy Data");
 	ASSERT(pointer != nullptr);
-	memcpy(reinterpret_cast<uint8_t*>(pointer) + offsetInByte, (uint8_t*)data, sizeInByte);
+	memcpy(reinterpret_cast<uint8_t*>(pointer) + get_offset() + offsetInByte, (uint8_t*)data, sizeInByte);
+	if (versionCount > 1)
+		memcpy(m_shadowData.data() + offsetInByte, data, sizeInByte);
 }
 
 VulkanVertexBuffer::VulkanVertexBuffer(std::shared_ptr<VulkanAPI> api, BufferUsageHint usage, uint32_t sizeInByte) : m_usage(usage)
 {
 	VkBufferUsageFlags bufferUsage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
 	VkMemoryPropertyFlags properties = VkTypeConverter::from(usage, bufferUsage);
-	m_buffer = std::make_shared<VulkanBuffer>(api, bufferUsage, properties, sizeInByte);
+	m_buffer = std::make_shared<VulkanBuffer>(api, bufferUsage, properties, sizeInByte, get_version_count(properties));
 }
 
-void VulkanVertexBuffer::copy(std::shared_ptr<VulkanAPI> api, VkCommandBuffer commandBuffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte)
+void VulkanVertexBuffer::copy(std::shared_ptr<VulkanAPI> api, VulkanStagingRing* stagingRing, void* data, uint32_t offsetInByte, uint32_t sizeInByte, uint64_t frameNumber, VkFence frameFence)
 {
-	m_buffer->copy(api, commandBuffer, data, offsetInByte, sizeInByte);
+	m_buffer->copy(api, stagingRing, data, offsetInByte, sizeInByte, frameNumber, frameFence);
 }
 
 void VulkanVertexBuffer::destroy(std::shared_ptr<VulkanAPI> api)
@@ -104,12 +132,12 @@ VulkanIndexBuffer::VulkanIndexBuffer(std::shared_ptr<VulkanAPI> api, IndexType i
 	VkBufferUsageFlags bufferUsage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
 
 	VkMemoryPropertyFlags properties = VkTypeConverter::from(usage, bufferUsage);
-	m_buffer = std::make_shared<VulkanBuffer>(api, bufferUsage, properties, sizeInByte);
+	m_buffer = std::make_shared<VulkanBuffer>(api, bufferUsage, properties, sizeInByte, get_version_count(properties));
 }
 
-void VulkanIndexBuffer::copy(std::shared_ptr<VulkanAPI> api, VkCommandBuffer commandBuffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte)
+void VulkanIndexBuffer::copy(std::shared_ptr<VulkanAPI> api, VulkanStagingRing* stagingRing, void* data, uint32_t offsetInByte, uint32_t sizeInByte, uint64_t frameNumber, VkFence frameFence)
 {
-	m_buffer->copy(api, commandBuffer, data, offsetInByte, sizeInByte);
+	m_buffer->copy(api, stagingRing, data, offsetInByte, sizeInByte, frameNumber, frameFence);
 }
 
 void VulkanIndexBuffer::destroy(std::shared_ptr<VulkanAPI> api)
@@ -123,16 +151,17 @@ VulkanUniformBuffer::VulkanUniformBuffer(std::shared_ptr<VulkanAPI> api, BufferU
 	VkBufferUsageFlags bufferUsage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
 
 	VkMemoryPropertyFlags properties = VkTypeConverter::from(usage, bufferUsage);
-	m_buffer = std::make_shared<VulkanBuffer>(api, bufferUsage, properties, sizeInByte);
+	m_buffer = std::make_shared<VulkanBuffer>(api, bufferUsage, properties, sizeInByte, get_version_count(properties));
 	
 	m_bufferInfo.buffer = m_buffer->buffer;
 	m_bufferInfo.offset = 0;
-	m_bufferInfo.range = VK_WHOLE_SIZE;
+	m_bufferInfo.range = sizeInByte;
 }
 
-void VulkanUniformBuffer::copy(std::shared_ptr<VulkanAPI> api, VkCommandBuffer commandBuffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte)
+void VulkanUniformBuffer::copy(std::shared_ptr<VulkanAPI> api, VulkanStagingRing* stagingRing, void* data, uint32_t offsetInByte, uint32_t sizeInByte, uint64_t frameNumber, VkFence frameFence)
 {
-	m_buffer->copy(api, commandBuffer, data, offsetInByte, sizeInByte);
+	m_buffer->copy(api, stagingRing, data, offsetInByte, sizeInByte, frameNumber, frameFence);
+	m_bufferInfo.offset = m_buffer->get_offset();
 }
 
 void VulkanUniformBuffer::destroy(std::shared_ptr<VulkanAPI> api)
@@ -145,16 +174,17 @@ VulkanShaderStorageBuffer::VulkanShaderStorageBuffer(std::shared_ptr<VulkanAPI>
 	VkBufferUsageFlags bufferUsage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
 
 	VkMemoryPropertyFlags properties = VkTypeConverter::from(usage, bufferUsage);
-	m_buffer = std::make_shared<VulkanBuffer>(api, bufferUsage, properties, sizeInByte);
+	m_buffer = std::make_shared<VulkanBuffer>(api, bufferUsage, properties, sizeInByte, get_version_count(properties));
 
 	m_bufferInfo.buffer = m_buffer->buffer;
 	m_bufferInfo.offset = 0;
-	m_bufferInfo.range = VK_WHOLE_SIZE;
+	m_bufferInfo.range = sizeInByte;
 }
 
-void VulkanShaderStorageBuffer::copy(std::shared_ptr<VulkanAPI> api, VkCommandBuffer commandBuffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte)
+void VulkanShaderStorageBuffer::copy(std::shared_ptr<VulkanAPI> api, VulkanStagingRing* stagingRing, void* data, uint32_t offsetInByte, uint32_t sizeInByte, uint64_t frameNumber, VkFence frameFence)
 {
-	m_buffer->copy(api, commandBuffer, data, offsetInByte, sizeInByte);
+	m_buffer->copy(api, stagingRing, data, offsetInByte, sizeInByte, frameNumber, frameFence);
+	m_bufferInfo.offset = m_buffer->get_offset();
 }
 
 void VulkanShaderStorageBuffer::destroy(std::shared_ptr<VulkanAPI> api)
@@ -164,19 +194,21 @@ void VulkanShaderStorageBuffer::destroy(std::shared_ptr<VulkanAPI> api)
 
 VulkanIndirectBuffer::VulkanIndirectBuffer(std::shared_ptr<VulkanAPI> api, BufferUsageHint usage, uint32_t sizeInByte)
 {
-	VkBufferUsageFlags bufferUsage = VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
+	// Storage usage so that the draws can be generated by a compute shader
+	VkBufferUsageFlags bufferUsage = VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
 
 	VkMemoryPropertyFlags properties = VkTypeConverter::from(usage, bufferUsage);
-	m_buffer = std::make_shared<VulkanBuffer>(api, bufferUsage, properties, sizeInByte);
+	m_buffer = std::make_shared<VulkanBuffer>(api, bufferUsage, properties, sizeInByte, get_version_count(properties));
 
 	m_bufferInfo.buffer = m_buffer->buffer;
 	m_bufferInfo.offset = 0;
-	m_bufferInfo.range = VK_WHOLE_SIZE;
+	m_bufferInfo.range = sizeInByte;
 }
 
-void VulkanIndirectBuffer::copy(std::shared_ptr<VulkanAPI> api, VkCommandBuffer commandBuffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte)
+void VulkanIndirectBuffer::copy(std::shared_ptr<VulkanAPI> api, VulkanStagingRing* stagingRing, void* data, uint32_t offsetInByte, uint32_t sizeInByte, uint64_t frameNumber, VkFence frameFence)
 {
-	m_buffer->copy(api, commandBuffer, data, offsetInByte, sizeInByte);
+	m_buffer->copy(api, stagingRing, data, offsetInByte, sizeInByte, frameNumber, frameFence);
+	m_bufferInfo.offset = m_buffer->get_offset();
 }
 
 void VulkanIndirectBuffer::destroy(std::shared_ptr<VulkanAPI> api)
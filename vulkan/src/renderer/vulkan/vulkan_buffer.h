@@ -3,20 +3,44 @@
 #include "renderer/buffer.h"
 #include "vulkan_common.h"
 #include <stdint.h>
+#include <vector>
 
 class VulkanAPI;
+class VulkanStagingRing;
+
+// Host visible buffer can be created with multiple version so that the CPU never writes
+// the region a frame still in flight is reading, the first write of a frame moves to a free version
 class VulkanBuffer
 {
 public:
-	VulkanBuffer(std::shared_ptr<VulkanAPI> api, VkBufferUsageFlags usage, VkMemoryPropertyFlags flags, uint32_t sizeInByte);
+	VulkanBuffer(std::shared_ptr<VulkanAPI> api, VkBufferUsageFlags usage, VkMemoryPropertyFlags flags, uint32_t sizeInByte, uint32_t versionCount = 1);
 	void copy(void* data, uint32_t offsetInByte, uint32_t sizeInByte);
-	void copy(std::shared_ptr<VulkanAPI> api, VkCommandBuffer commandBuffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte);
+	// Device local buffer are uploaded through the staging ring, the copy is executed on its next flush
+	// frameFence is signaled once the frame being recorded has completed
+	void copy(std::shared_ptr<VulkanAPI> api, VulkanStagingRing* stagingRing, void* data, uint32_t offsetInByte, uint32_t sizeInByte, uint64_t frameNumber, VkFence frameFence);
+
+	// Offset of the version used by the frame being recorded
+	uint32_t get_offset() const { return activeVersion * versionStride; }
 
 	void destroy(std::shared_ptr<VulkanAPI> api);
 	VkDeviceMemory memory;
 	void* pointer;
 	VkBuffer buffer;
 	uint32_t size;
+
+	uint32_t versionCount;
+	uint32_t versionStride;
+	uint32_t activeVersion = 0;
+private:
+	uint64_t m_activeVersionFrame = 0;
+	// First frame number from which the version is no longer read by the GPU
+	std::vector<uint64_t> m_versionFreeFrame;
+	// Fence of the last frame that read the version
+	std::vector<VkFence> m_versionFence;
+	// Cpu copy of the latest content, reading back from the mapped memory is slow
+	std::vector<uint8_t> m_shadowData;
+
+	void next_version(std::shared_ptr<VulkanAPI> api, uint64_t frameNumber, VkFence frameFence);
 };
 
 class VulkanVertexBuffer : public VertexBuffer
@@ -34,7 +58,8 @@ public:
 	}
 
 	VkBuffer get_buffer() { return m_buffer->buffer; }
-	void copy(std::shared_ptr<VulkanAPI> api, VkCommandBuffer commandBuffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte);
+	uint32_t get_offset() { return m_buffer->get_offset(); }
+	void copy(std::shared_ptr<VulkanAPI> api, VulkanStagingRing* stagingRing, void* data, uint32_t offsetInByte, uint32_t sizeInByte, uint64_t frameNumber, VkFence frameFence);
 
 	void destroy(std::shared_ptr<VulkanAPI> api);
 
@@ -64,9 +89,11 @@ public:
 		return m_buffer->buffer;
 	}
 
+	uint32_t get_offset() { return m_buffer->get_offset(); }
+
 	VkIndexType get_index_type(){ return m_indexType; }
 
-	void copy(std::shared_ptr<VulkanAPI> api, VkCommandBuffer commandBuffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte);
+	void copy(std::shared_ptr<VulkanAPI> api, VulkanStagingRing* stagingRing, void* data, uint32_t offsetInByte, uint32_t sizeInByte, uint64_t frameNumber, VkFence frameFence);
 	void destroy(std::shared_ptr<VulkanAPI> api);
 
 private:
@@ -95,9 +122,11 @@ public:
 		return m_buffer->buffer;
 	}
 
+	uint32_t get_offset() { return m_buffer->get_offset(); }
+
 	VkDescriptorBufferInfo* get_buffer_info() { return &m_bufferInfo; }
 
-	void copy(std::shared_ptr<VulkanAPI> api, VkCommandBuffer commandBuffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte);
+	void copy(std::shared_ptr<VulkanAPI> api, VulkanStagingRing* stagingRing, void* data, uint32_t offsetInByte, uint32_t sizeInByte, uint64_t frameNumber, VkFence frameFence);
 	void destroy(std::shared_ptr<VulkanAPI> api);
 
 private:
@@ -127,9 +156,11 @@ public:
 		return m_buffer->buffer;
 	}
 
+	uint32_t get_offset() { return m_buffer->get_offset(); }
+
 	VkDescriptorBufferInfo* get_buffer_info() { return &m_bufferInfo; }
 
-	void copy(std::shared_ptr<VulkanAPI> api, VkCommandBuffer commandBuffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte);
+	void copy(std::shared_ptr<VulkanAPI> api, VulkanStagingRing* stagingRing, void* data, uint32_t offsetInByte, uint32_t sizeInByte, uint64_t frameNumber, VkFence frameFence);
 	void destroy(std::shared_ptr<VulkanAPI> api);
 
 private:
@@ -158,9 +189,11 @@ public:
 		return m_buffer->buffer;
 	}
 
+	uint32_t get_offset() { return m_buffer->get_offset(); }
+
 	VkDescriptorBufferInfo* get_buffer_info() { return &m_bufferInfo; }
 
-	void copy(std::shared_ptr<VulkanAPI> api, VkCommandBuffer commandBuffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte);
+	void copy(std::shared_ptr<VulkanAPI> api, VulkanStagingRing* stagingRing, void* data, uint32_t offsetInByte, uint32_t sizeInByte, uint64_t frameNumber, VkFence frameFence);
 	void destroy(std::shared_ptr<VulkanAPI> api);
 
 private:
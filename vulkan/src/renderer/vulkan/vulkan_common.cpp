@@ -19,6 +19,17 @@ QueueFamilyIndices find_queue_families_indices(VkPhysicalDevice physicalDevice)
 			break;
 		}
 	}
+
+	familyIndices.computeFamily = familyIndices.graphicsFamily;
+	for (uint32_t i = 0; i < queueFamilyCount; ++i)
+	{
+		VkQueueFlags flag = queueFamilies[i].queueFlags;
+		if ((flag & VK_QUEUE_COMPUTE_BIT) && !(flag & VK_QUEUE_GRAPHICS_BIT))
+		{
+			familyIndices.computeFamily = i;
+			break;
+		}
+	}
 	return familyIndices;
 }
 
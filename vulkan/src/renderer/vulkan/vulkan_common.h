@@ -8,6 +8,11 @@
 
 #define USE_DISCRETE_GPU 1
 
+// Number of frame the CPU can record ahead of the GPU
+#ifndef MAX_FRAMES_IN_FLIGHT
+#define MAX_FRAMES_IN_FLIGHT 2
+#endif
+
 /*
  *  This causes crash in release build
  *  #define VK_CHECK(expr) assert(expr == VK_SUCCESS)
@@ -21,10 +26,13 @@ __debugbreak();\
 }\
 
 static constexpr uint32_t MAX_UINT32 = ~0u;
+static constexpr uint64_t MAX_UINT64 = ~0ull;
 
 struct QueueFamilyIndices
 {
 	uint32_t graphicsFamily = MAX_UINT32;
+	// Dedicated compute family when the device has one, graphics family otherwise
+	uint32_t computeFamily = MAX_UINT32;
 	bool is_complete()
 	{
 		return (graphicsFamily != MAX_UINT32);
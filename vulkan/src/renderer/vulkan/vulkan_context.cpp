@@ -8,6 +8,7 @@
 #include "vulkan_shaderbidings.h"
 #include "vulkan_framebuffer.h"
 #include "vulkan_query.h"
+#include "vulkan_staging_ring.h"
 
 #include "imgui/imgui_impl_vulkan.h"
 
@@ -20,6 +21,14 @@ static void check_vk_result(VkResult err)
 		abort();
 }
 
+VkPipelineStageFlags VulkanContext::get_barrier_dst_stages()
+{
+	// Graphics stages are not supported on a compute only queue
+	if (m_recordingAsyncCompute)
+		return VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+	return VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+}
+
 VkCommandPool VulkanContext::create_command_pool(VkDevice device, uint32_t familyIndex)
 {
 	VkCommandPoolCreateInfo createInfo = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
@@ -107,12 +116,16 @@ VulkanContext::VulkanContext(std::shared_ptr<VulkanAPI> api, VulkanGraphicsWindo
 	m_swapchain->create_required_attachments(api, renderPass);
 
 	uint32_t graphicsFamilyIndex = api->m_QueueFamilyIndices.graphicsFamily;
-	m_commandPool = create_command_pool(device, graphicsFamilyIndex);
 	VkCommandBufferAllocateInfo allocateInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
-	allocateInfo.commandBufferCount = 1;
-	allocateInfo.commandPool = m_commandPool;
-	allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	VK_CHECK(vkAllocateCommandBuffers(api->m_Device, &allocateInfo, &m_commandBuffer));
+	for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i)
+	{
+		m_commandPools[i] = create_command_pool(device, graphicsFamilyIndex);
+		allocateInfo.commandBufferCount = 1;
+		allocateInfo.commandPool = m_commandPools[i];
+		allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		VK_CHECK(vkAllocateCommandBuffers(api->m_Device, &allocateInfo, &m_commandBuffers[i]));
+	}
+	m_commandBuffer = m_commandBuffers[m_swapchain->get_current_frame()];
 
 
 	m_tempCommandPool = create_command_pool(device, graphicsFamilyIndex);
@@ -121,6 +134,9 @@ VulkanContext::VulkanContext(std::shared_ptr<VulkanAPI> api, VulkanGraphicsWindo
 	allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
 	VK_CHECK(vkAllocateCommandBuffers(api->m_Device, &allocateInfo, &m_tempCommandBuffer));
 
+	const uint32_t stagingRingSize = 32 * 1024 * 1024;
+	m_stagingRing = std::make_shared<VulkanStagingRing>(api, stagingRingSize);
+
 	{
 		ImGui_ImplVulkan_InitInfo initInfo = {};
 		initInfo.Instance = m_api->get_instance();
@@ -137,9 +153,20 @@ VulkanContext::VulkanContext(std::shared_ptr<VulkanAPI> api, VulkanGraphicsWindo
 		m_window->init_imgui(&initInfo, m_globalRenderPass->get_renderpass(), m_tempCommandBuffer, m_tempCommandPool);
 	}
 
+	uint32_t computeFamilyIndex = api->m_QueueFamilyIndices.computeFamily;
 	VkSemaphoreCreateInfo semaphoreCreateInfo = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO };
-	VK_CHECK(vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &m_computeReleaseSemaphore));
-	VK_CHECK(vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &m_computeAcquireSemaphore));
+	for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i)
+	{
+		m_computeCommandPools[i] = create_command_pool(device, computeFamilyIndex);
+		allocateInfo.commandBufferCount = 1;
+		allocateInfo.commandPool = m_computeCommandPools[i];
+		allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		VK_CHECK(vkAllocateCommandBuffers(device, &allocateInfo, &m_computeCommandBuffers[i]));
+		VK_CHECK(vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &m_computeSemaphores[i]));
+	}
+
+	VkFenceCreateInfo fenceCreateInfo = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
+	VK_CHECK(vkCreateFence(device, &fenceCreateInfo, nullptr, &m_computeFence));
 }
 
 void VulkanContext::acquire_swapchain_image()
@@ -158,32 +185,86 @@ void VulkanContext::acquire_swapchain_image()
 
 void VulkanContext::begin()
 {
-	VK_CHECK(vkResetCommandPool(m_api->m_Device, m_commandPool, 0));
+	uint32_t frameIndex = get_frame_index();
+	m_commandBuffer = m_commandBuffers[frameIndex];
+	VK_CHECK(vkResetCommandPool(m_api->m_Device, m_commandPools[frameIndex], 0));
 	VkCommandBufferBeginInfo beginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
 	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 	VK_CHECK(vkBeginCommandBuffer(m_commandBuffer, &beginInfo));
 
+	// Uploads are always submitted before this command buffer, even the one recorded later in the frame
+	VulkanStagingRing::record_barrier(m_commandBuffer);
 }
 
 void VulkanContext::begin_compute()
 {
-	VK_CHECK(vkResetCommandPool(m_api->m_Device, m_commandPool, 0));
+	// The compute submission is waited in end_compute so it can share the frame command buffer
+	uint32_t frameIndex = get_frame_index();
+	m_commandBuffer = m_commandBuffers[frameIndex];
+	VK_CHECK(vkResetCommandPool(m_api->m_Device, m_commandPools[frameIndex], 0));
 	VkCommandBufferBeginInfo beginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
 	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 	VK_CHECK(vkBeginCommandBuffer(m_commandBuffer, &beginInfo));
+
+	VulkanStagingRing::record_barrier(m_commandBuffer);
+	// Previous frames can still be reading the images written by the dispatches
+	vkCmdPipelineBarrier(m_commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 0, nullptr);
 }
 
 void VulkanContext::end_compute()
 {
 	VK_CHECK(vkEndCommandBuffer(m_commandBuffer));
+	m_stagingRing->flush(m_api);
+
 	VkPipelineStageFlags submitStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
 	VkSubmitInfo submitInfo = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
 
 	submitInfo.commandBufferCount = 1;
 	submitInfo.pCommandBuffers = &m_commandBuffer;
 	submitInfo.pWaitDstStageMask = &submitStageMask;
-	VK_CHECK(vkQueueSubmit(m_api->get_queue(), 1, &submitInfo, 0));
-	vkDeviceWaitIdle(m_api->get_device());
+	VK_CHECK(vkQueueSubmit(m_api->get_queue(), 1, &submitInfo, m_computeFence));
+
+	VkDevice device = m_api->get_device();
+	VK_CHECK(vkWaitForFences(device, 1, &m_computeFence, VK_TRUE, UINT64_MAX));
+	VK_CHECK(vkResetFences(device, 1, &m_computeFence));
+}
+
+void VulkanContext::begin_async_compute()
+{
+	ASSERT_MSG(!m_asyncComputeSubmitted, "Async compute already submitted for this frame");
+
+	// The graphics submission that waited on the previous use of this command buffer has completed
+	uint32_t frameIndex = get_frame_index();
+	VK_CHECK(vkResetCommandPool(m_api->m_Device, m_computeCommandPools[frameIndex], 0));
+	m_commandBuffer = m_computeCommandBuffers[frameIndex];
+
+	VkCommandBufferBeginInfo beginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	VK_CHECK(vkBeginCommandBuffer(m_commandBuffer, &beginInfo));
+	m_recordingAsyncCompute = true;
+
+	// Intermediate textures are shared between frames, previous submission may still be writing them
+	VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(m_commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void VulkanContext::end_async_compute()
+{
+	VK_CHECK(vkEndCommandBuffer(m_commandBuffer));
+
+	uint32_t frameIndex = get_frame_index();
+	VkSubmitInfo submitInfo = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &m_commandBuffer;
+	submitInfo.signalSemaphoreCount = 1;
+	submitInfo.pSignalSemaphores = &m_computeSemaphores[frameIndex];
+	VK_CHECK(vkQueueSubmit(m_api->get_compute_queue(), 1, &submitInfo, VK_NULL_HANDLE));
+
+	m_recordingAsyncCompute = false;
+	m_asyncComputeSubmitted = true;
+	m_commandBuffer = m_commandBuffers[frameIndex];
 }
 
 void VulkanContext::begin_renderpass(RenderPass* rp, Framebuffer* framebuffer)
@@ -251,7 +332,7 @@ void VulkanContext::set_pipeline(Pipeline* pipeline)
 	m_activePipeline = reinterpret_cast<VulkanPipeline*>(pipeline);
 	vkCmdBindPipeline(m_commandBuffer, m_activePipeline->get_bind_point(), m_activePipeline->get_pipeline());
 
-	VkDescriptorSet descriptorSet = m_activePipeline->get_descriptor_set();
+	VkDescriptorSet descriptorSet = m_activePipeline->get_descriptor_set(m_api->get_device(), get_frame_index(), m_frameNumber);
 	vkCmdBindDescriptorSets(m_commandBuffer, m_activePipeline->get_bind_point(), m_activePipeline->get_layout(), 0, 1, &descriptorSet, 0, 0);
 }
 
@@ -259,35 +340,39 @@ void VulkanContext::set_pipeline(Pipeline* pipeline)
 void VulkanContext::copy(VertexBuffer* buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte)
 {
 	VulkanVertexBuffer* vkBuffer = reinterpret_cast<VulkanVertexBuffer*>(buffer);
-	vkBuffer->copy(m_api, m_tempCommandBuffer, data, offsetInByte, sizeInByte);
+	vkBuffer->copy(m_api, m_stagingRing.get(), data, offsetInByte, sizeInByte, m_frameNumber, m_swapchain->get_frame_fence());
 }
 
 void VulkanContext::copy(IndexBuffer* buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte)
 {
 	VulkanIndexBuffer* vkBuffer = reinterpret_cast<VulkanIndexBuffer*>(buffer);
-	vkBuffer->copy(m_api, m_tempCommandBuffer, data, offsetInByte, sizeInByte);
+	vkBuffer->copy(m_api, m_stagingRing.get(), data, offsetInByte, sizeInByte, m_frameNumber, m_swapchain->get_frame_fence());
 }
 
 void VulkanContext::copy(UniformBuffer* buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte)
 {
 	VulkanUniformBuffer* vkBuffer = reinterpret_cast<VulkanUniformBuffer*>(buffer);
-	vkBuffer->copy(m_api, m_tempCommandBuffer, data, offsetInByte, sizeInByte);
+	vkBuffer->copy(m_api, m_stagingRing.get(), data, offsetInByte, sizeInByte, m_frameNumber, m_swapchain->get_frame_fence());
 }
 
 void VulkanContext::copy(ShaderStorageBuffer* buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte)
 {
 	VulkanShaderStorageBuffer* vkBuffer = reinterpret_cast<VulkanShaderStorageBuffer*>(buffer);
-	vkBuffer->copy(m_api, m_tempCommandBuffer, data, offsetInByte, sizeInByte);
+	vkBuffer->copy(m_api, m_stagingRing.get(), data, offsetInByte, sizeInByte, m_frameNumber, m_swapchain->get_frame_fence());
 }
 
 void VulkanContext::copy(IndirectBuffer* buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte)
 {
 	VulkanIndirectBuffer* vkBuffer = reinterpret_cast<VulkanIndirectBuffer*>(buffer);
-	vkBuffer->copy(m_api, m_tempCommandBuffer, data, offsetInByte, sizeInByte);
+	vkBuffer->copy(m_api, m_stagingRing.get(), data, offsetInByte, sizeInByte, m_frameNumber, m_swapchain->get_frame_fence());
 }
 
-void VulkanContext::copy(Texture* texture, void* data, uint32_t sizeInByte)
+void VulkanContext::read(ShaderStorageBuffer* buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte)
 {
+	VulkanShaderStorageBuffer* vkBuffer = reinterpret_cast<VulkanShaderStorageBuffer*>(buffer);
+	ASSERT(vkBuffer->get_usage_hint() == BufferUsageHint::StaticRead);
+	ASSERT(offsetInByte + sizeInByte <= uint32_t(vkBuffer->get_size()));
+
 	VkCommandBufferBeginInfo beginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
 	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
@@ -295,41 +380,72 @@ void VulkanContext::copy(Texture* texture, void* data, uint32_t sizeInByte)
 	vkResetCommandBuffer(commandBuffer, 0);
 	VK_CHECK(vkBeginCommandBuffer(commandBuffer, &beginInfo));
 
-	VkBufferUsageFlags bufferUsage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+	VkBufferUsageFlags bufferUsage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
 	VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
-	VulkanBuffer stagingBuffer(m_api, bufferUsage, properties, sizeInByte);
-	stagingBuffer.copy(data, 0, sizeInByte);
-
-	VulkanTexture* vkTexture = reinterpret_cast<VulkanTexture*>(texture);
-	
-	VkImageMemoryBarrier barrier = image_barrier(vkTexture->get_image(), 0, 0, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, vkTexture->get_image_aspect());
-	vkCmdPipelineBarrier(m_tempCommandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, 0, 0, 0, 1, &barrier);
-	vkTexture->set_layout(VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+	VulkanBuffer readbackBuffer(m_api, bufferUsage, properties, sizeInByte);
 
-	VkBufferImageCopy region = {};
-	region.bufferOffset = 0;
-	region.bufferRowLength = 0;
-	region.bufferImageHeight = 0;
+	// Shader writes of the previous submissions are made visible to the copy
+	VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
 
-	region.imageSubresource.aspectMask = vkTexture->get_image_aspect();
-	region.imageSubresource.layerCount = 1;
-	region.imageSubresource.baseArrayLayer = 0;
-	region.imageSubresource.mipLevel = 0;
+	VkBufferCopy region = {};
+	region.srcOffset = vkBuffer->get_offset() + offsetInByte;
+	region.dstOffset = 0;
+	region.size = sizeInByte;
+	vkCmdCopyBuffer(commandBuffer, vkBuffer->get_buffer(), readbackBuffer.buffer, 1, &region);
 
-	region.imageOffset = { 0, 0, 0 };
-	region.imageExtent = { vkTexture->get_width(), vkTexture->get_height(), 1};
-	vkCmdCopyBufferToImage(commandBuffer, stagingBuffer.buffer, vkTexture->get_image(), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
 
 	VK_CHECK(vkEndCommandBuffer(commandBuffer));
 
+	// Staged uploads are submitted first, then only this submission is waited on instead of the whole device
+	m_stagingRing->flush(m_api);
+
 	VkSubmitInfo submitInfo = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
 	submitInfo.commandBufferCount = 1;
 	submitInfo.pCommandBuffers = &commandBuffer;
-	VkQueue queue = m_api->m_GraphicsQueue;
+	VK_CHECK(vkQueueSubmit(m_api->get_queue(), 1, &submitInfo, m_computeFence));
 
-	vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE);
-	vkDeviceWaitIdle(m_api->m_Device);
-	stagingBuffer.destroy(m_api);
+	VkDevice device = m_api->get_device();
+	VK_CHECK(vkWaitForFences(device, 1, &m_computeFence, VK_TRUE, UINT64_MAX));
+	VK_CHECK(vkResetFences(device, 1, &m_computeFence));
+	memcpy(data, readbackBuffer.pointer, sizeInByte);
+	readbackBuffer.destroy(m_api);
+}
+
+void VulkanContext::copy(Texture* texture, void* data, uint32_t sizeInByte)
+{
+	VulkanTexture* vkTexture = reinterpret_cast<VulkanTexture*>(texture);
+	uint32_t width = vkTexture->get_width();
+	uint32_t height = vkTexture->get_height();
+	ASSERT(sizeInByte % (width * height) == 0);
+
+	// Staged like the rect copies, the previous content is discarded and the texture stays a transfer destination
+	vkTexture->set_layout(VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+	m_stagingRing->copy(m_api, vkTexture->get_image(), vkTexture->get_image_aspect(), VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		data, sizeInByte / (width * height), 0, 0, width, height);
+}
+
+void VulkanContext::copy(Texture* texture, void* data, uint32_t sizeInByte, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+	VulkanTexture* vkTexture = reinterpret_cast<VulkanTexture*>(texture);
+	ASSERT(x + width <= vkTexture->get_width() && y + height <= vkTexture->get_height());
+	ASSERT(sizeInByte % (width * height) == 0);
+
+	// Recorded in the upload batch submitted before the frame, back to the layout the texture had
+	// a texture that was never read stays a transfer destination
+	VkImageLayout layout = vkTexture->get_layout();
+	VkImageLayout finalLayout = layout;
+	if (layout == VK_IMAGE_LAYOUT_UNDEFINED)
+	{
+		finalLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		vkTexture->set_layout(finalLayout);
+	}
+	m_stagingRing->copy(m_api, vkTexture->get_image(), vkTexture->get_image_aspect(), layout, finalLayout, data, sizeInByte / (width * height), x, y, width, height);
 }
 
 void VulkanContext::update_pipeline(Pipeline* pipeline, ShaderBindings** shaderBindings, uint32_t count)
@@ -346,11 +462,7 @@ void VulkanContext::update_pipeline(Pipeline* pipeline, ShaderBindings** shaderB
 	}
 
 	VulkanPipeline* vkPipeline = reinterpret_cast<VulkanPipeline*>(pipeline);
-	VkDescriptorSet descriptorSet = vkPipeline->get_descriptor_set();
-	for (auto& writeSets : writeSetsTotal)
-		writeSets.dstSet = descriptorSet;
-
-	vkUpdateDescriptorSets(m_api->get_device(), static_cast<uint32_t>(writeSetsTotal.size()), writeSetsTotal.data(), 0, nullptr);
+	vkPipeline->update_descriptor_set(m_api->get_device(), writeSetsTotal, get_frame_index(), m_frameNumber);
 }
 
 void VulkanContext::set_buffer(VertexBuffer* buffer, uint32_t offsetInByte)
@@ -358,20 +470,20 @@ void VulkanContext::set_buffer(VertexBuffer* buffer, uint32_t offsetInByte)
 	VulkanVertexBuffer* vkBuffer = reinterpret_cast<VulkanVertexBuffer*>(buffer);
 	VkBuffer buffers[] = {vkBuffer->get_buffer()};
 
-	VkDeviceSize offset = offsetInByte;
+	VkDeviceSize offset = vkBuffer->get_offset() + offsetInByte;
 	vkCmdBindVertexBuffers(m_commandBuffer, 0, ARRAYSIZE(buffers), buffers, &offset);
 }
 
 void VulkanContext::set_buffer(IndexBuffer* buffer, uint32_t offsetInByte)
 {
 	VulkanIndexBuffer* vkBuffer = reinterpret_cast<VulkanIndexBuffer*>(buffer);
-	VkDeviceSize offset = offsetInByte;
+	VkDeviceSize offset = vkBuffer->get_offset() + offsetInByte;
 	vkCmdBindIndexBuffer(m_commandBuffer, vkBuffer->get_buffer(), offset, vkBuffer->get_index_type());
 }
 
 void VulkanContext::transition_layout_for_shader_read(Texture** texture, uint32_t count)
 {
-	std::vector<VkImageMemoryBarrier> barriers(count);
+	std::vector<VkImageMemoryBarrier> barriers;
 	for (uint32_t i = 0; i < count; ++i)
 	{
 		VulkanTexture* vkTexture = reinterpret_cast<VulkanTexture*>(texture[i]);
@@ -380,18 +492,22 @@ void VulkanContext::transition_layout_for_shader_read(Texture** texture, uint32_
 
 		VkImageAspectFlagBits aspect = vkTexture->get_image_aspect();
 		if (vkTexture->get_layout() == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL)
-			return;
+			continue;
 
-		barriers[i] = image_barrier(vkTexture->get_image(), 0, 0,
+		barriers.push_back(image_barrier(vkTexture->get_image(), 0, 0,
 			vkTexture->get_layout(),
-			VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, aspect);
+			VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, aspect));
 		vkTexture->set_layout(VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
 	}
+
+	if (barriers.size() == 0)
+		return;
+
 	vkCmdPipelineBarrier(m_commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
-		VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT,
+		get_barrier_dst_stages(),
 		0, 0, nullptr,
 		0, nullptr,
-		count, barriers.data());
+		static_cast<uint32_t>(barriers.size()), barriers.data());
 
 }
 
@@ -415,8 +531,11 @@ void VulkanContext::transition_layout_for_compute_read(Texture** texture, uint32
 		vkTexture->set_layout(VK_IMAGE_LAYOUT_GENERAL);
 	}
 
+	if (barriers.size() == 0)
+		return;
+
 	vkCmdPipelineBarrier(m_commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
-		VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT,
+		get_barrier_dst_stages(),
 		0, 0, nullptr,
 		0, nullptr,
 		static_cast<uint32_t>(barriers.size()), barriers.data());
@@ -446,12 +565,33 @@ void VulkanContext::draw_indexed(uint32_t indexCount)
 void VulkanContext::draw_indexed_indirect(IndirectBuffer* buffer, uint32_t offset, uint32_t drawCount, uint32_t stride)
 {
 	VulkanIndirectBuffer* vkBuffer = reinterpret_cast<VulkanIndirectBuffer*>(buffer);
-	vkCmdDrawIndexedIndirect(m_commandBuffer, vkBuffer->get_buffer(), offset, drawCount, stride);
+	vkCmdDrawIndexedIndirect(m_commandBuffer, vkBuffer->get_buffer(), vkBuffer->get_offset() + offset, drawCount, stride);
+}
+
+void VulkanContext::draw_indexed_indirect_count(IndirectBuffer* buffer, uint32_t offset, IndirectBuffer* countBuffer, uint32_t countOffset, uint32_t maxDrawCount, uint32_t stride)
+{
+	ASSERT(m_api->is_draw_indirect_count_supported());
+	VulkanIndirectBuffer* vkBuffer = reinterpret_cast<VulkanIndirectBuffer*>(buffer);
+	VulkanIndirectBuffer* vkCountBuffer = reinterpret_cast<VulkanIndirectBuffer*>(countBuffer);
+	vkCmdDrawIndexedIndirectCount(m_commandBuffer, vkBuffer->get_buffer(), vkBuffer->get_offset() + offset,
+		vkCountBuffer->get_buffer(), vkCountBuffer->get_offset() + countOffset, maxDrawCount, stride);
+}
+
+bool VulkanContext::is_draw_indirect_count_supported()
+{
+	return m_api->is_draw_indirect_count_supported();
 }
 
 void VulkanContext::dispatch_compute(uint32_t workGroupSizeX, uint32_t workGroupSizeY, uint32_t workGroupSizeZ)
 {
 	vkCmdDispatch(m_commandBuffer, workGroupSizeX, workGroupSizeY, workGroupSizeZ);
+
+	// Dispatches are chained (FFT stages, inversion, normal map), the next one reads what this one wrote,
+	// indirect draws can also be generated by a dispatch
+	VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+	vkCmdPipelineBarrier(m_commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
 }
 
 void VulkanContext::reset_query(GpuTimestampQuery* query)
@@ -469,7 +609,21 @@ void VulkanContext::write_timestamp(GpuTimestampQuery* query, uint32_t queryInde
 void VulkanContext::get_result(GpuTimestampQuery* query, uint32_t firstQuery, uint32_t queryCount, void* output)
 {
 	VulkanQuery* vkQuery = reinterpret_cast<VulkanQuery*>(query);
-	VK_CHECK(vkGetQueryPoolResults(m_api->get_device(), vkQuery->get_query_pool(), firstQuery, queryCount, sizeof(uint64_t) * queryCount, output, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT));
+	VK_CHECK(vkGetQueryPoolResults(m_api->get_device(), vkQuery->get_query_pool(), firstQuery, queryCount, sizeof(uint64_t) * queryCount, output, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+}
+
+UploadStatistics VulkanContext::get_upload_statistics()
+{
+	UploadStatistics statistics = {};
+	statistics.bytesStagedLastFrame = m_stagingRing->get_bytes_staged_last_frame();
+	statistics.stallsLastFrame = m_stagingRing->get_stalls_last_frame();
+	statistics.totalStalls = m_stagingRing->get_total_stalls();
+	return statistics;
+}
+
+uint32_t VulkanContext::get_frame_index()
+{
+	return m_swapchain->get_current_frame();
 }
 
 GraphicsWindow* VulkanContext::get_window()
@@ -484,8 +638,14 @@ void VulkanContext::end()
 
 void VulkanContext::present()
 {
+	m_stagingRing->flush(m_api);
+	m_stagingRing->end_frame();
+
 	VkQueue queue = m_api->m_GraphicsQueue;
-	VkResult result = m_swapchain->present(m_commandBuffer, queue);
+	VkSemaphore computeSemaphore = m_asyncComputeSubmitted ? m_computeSemaphores[get_frame_index()] : VK_NULL_HANDLE;
+	m_asyncComputeSubmitted = false;
+
+	VkResult result = m_swapchain->present(m_commandBuffer, queue, computeSemaphore);
 	if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR)
 	{
 		uint32_t width = m_window->get_width();
@@ -494,18 +654,33 @@ void VulkanContext::present()
 		m_globalRenderPass->set_width(width);
 		m_globalRenderPass->set_height(height);
 	}
-	vkDeviceWaitIdle(m_api->m_Device);
+
+	// Only wait for the frame that used the next set of resources, the GPU can still
+	// work on the frame just submitted while the CPU is recording the next one
+	m_frameNumber++;
+	m_swapchain->wait_for_frame(m_api->m_Device);
+	m_commandBuffer = m_commandBuffers[get_frame_index()];
 }
 
 void VulkanContext::destroy()
 {
-	m_window->destroy_imgui();
 	VkDevice device = m_api->get_device();
-	vkDestroySemaphore(device, m_computeAcquireSemaphore, 0);
-	vkDestroySemaphore(device, m_computeReleaseSemaphore, 0);
+	VK_CHECK(vkDeviceWaitIdle(device));
+	m_window->destroy_imgui();
+	m_stagingRing->destroy(m_api);
+	for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i)
+	{
+		vkFreeCommandBuffers(device, m_computeCommandPools[i], 1, &m_computeCommandBuffers[i]);
+		vkDestroyCommandPool(device, m_computeCommandPools[i], 0);
+		vkDestroySemaphore(device, m_computeSemaphores[i], 0);
+	}
+	vkDestroyFence(device, m_computeFence, 0);
 
-	vkFreeCommandBuffers(device, m_commandPool, 1, &m_commandBuffer);
-	vkDestroyCommandPool(device, m_commandPool, 0);
+	for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i)
+	{
+		vkFreeCommandBuffers(device, m_commandPools[i], 1, &m_commandBuffers[i]);
+		vkDestroyCommandPool(device, m_commandPools[i], 0);
+	}
 
 	vkFreeCommandBuffers(device, m_tempCommandPool, 1, &m_tempCommandBuffer);
 	vkDestroyCommandPool(device, m_tempCommandPool, 0);
@@ -1,7 +1,7 @@
 #pragma once
 
 #include "renderer/context.h"
-#include "vulkan_includes.h"
+#include "vulkan_common.h"
 
 class VulkanAPI;
 class VulkanGraphicsWindow;
@@ -9,6 +9,7 @@ class VulkanRenderPass;
 class VulkanPipeline;
 class VulkanSwapchain;
 class Framebuffer;
+class VulkanStagingRing;
 
 class VulkanContext : public Context
 {
@@ -22,6 +23,9 @@ public:
 	void begin_compute() override;
 	void end_compute() override;
 
+	void begin_async_compute() override;
+	void end_async_compute() override;
+
 	void begin_renderpass(RenderPass* renderPass, Framebuffer* framebuffer) override;
 	void end_renderpass() override;
 
@@ -33,7 +37,10 @@ public:
 	void copy(ShaderStorageBuffer* buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte) override;
 	void copy(IndirectBuffer* buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte) override;
 
+	void read(ShaderStorageBuffer* buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte) override;
+
 	void copy(Texture* texture, void* data, uint32_t sizeInByte);
+	void copy(Texture* texture, void* data, uint32_t sizeInByte, uint32_t x, uint32_t y, uint32_t width, uint32_t height) override;
 
 
 	void update_pipeline(Pipeline* pipeline, ShaderBindings** bindings, uint32_t count) override;
@@ -49,6 +56,8 @@ public:
 	void draw(uint32_t vertexCount) override;
 	void draw_indexed(uint32_t indexCount) override;
 	void draw_indexed_indirect(IndirectBuffer* buffer, uint32_t offset, uint32_t drawCount, uint32_t stride);
+	void draw_indexed_indirect_count(IndirectBuffer* buffer, uint32_t offset, IndirectBuffer* countBuffer, uint32_t countOffset, uint32_t maxDrawCount, uint32_t stride) override;
+	bool is_draw_indirect_count_supported() override;
 
 	void dispatch_compute(uint32_t workGroupSizeX, uint32_t workGroupSizeY, uint32_t workGroupSizeZ) override;
 
@@ -61,6 +70,11 @@ public:
 		return reinterpret_cast<RenderPass*>(m_globalRenderPass);
 	}
 
+	UploadStatistics get_upload_statistics() override;
+
+	uint32_t get_frames_in_flight() override { return MAX_FRAMES_IN_FLIGHT; }
+	uint32_t get_frame_index() override;
+
 	GraphicsWindow* get_window() override;
 
 	void end() override;
@@ -68,14 +82,27 @@ public:
 	void destroy();
 
 private:
-	VkCommandPool m_commandPool;
+	// One pool per frame in flight, reset only once the fence of that frame is signaled
+	VkCommandPool m_commandPools[MAX_FRAMES_IN_FLIGHT];
+	VkCommandBuffer m_commandBuffers[MAX_FRAMES_IN_FLIGHT];
+	// Command buffer of the frame being recorded
 	VkCommandBuffer m_commandBuffer;
+	// Incremented on every present, used to know when cpu written buffer can be reused
+	uint64_t m_frameNumber = 0;
 	VkCommandBuffer m_tempCommandBuffer;
 	VkCommandPool m_tempCommandPool;
 
-	// Compute Shader Acquire and Release Semaphore
-	VkSemaphore m_computeAcquireSemaphore;
-	VkSemaphore m_computeReleaseSemaphore;
+	// Device local buffer uploads, flushed before every submission
+	std::shared_ptr<VulkanStagingRing> m_stagingRing;
+
+	// Async compute, submitted on the compute queue and waited by the graphics submission of the same frame
+	VkCommandPool m_computeCommandPools[MAX_FRAMES_IN_FLIGHT];
+	VkCommandBuffer m_computeCommandBuffers[MAX_FRAMES_IN_FLIGHT];
+	VkSemaphore m_computeSemaphores[MAX_FRAMES_IN_FLIGHT];
+	bool m_recordingAsyncCompute = false;
+	bool m_asyncComputeSubmitted = false;
+	// Signaled when the compute submission is done, waiting on it does not stall the frames in flight
+	VkFence m_computeFence;
 
 	std::shared_ptr<VulkanSwapchain> m_swapchain;
 	VulkanGraphicsWindow* m_window;
@@ -88,4 +115,5 @@ private:
 
 	VkRenderPass create_global_renderpass(VkDevice device, VkFormat format);
 	VkCommandPool create_command_pool(VkDevice device, uint32_t familyIndex);
+	VkPipelineStageFlags get_barrier_dst_stages();
 };
\ No newline at end of file
@@ -459,11 +459,15 @@ VulkanPipeline::VulkanPipeline(std::shared_ptr<VulkanAPI> m_api, const PipelineD
 	VK_CHECK(vkCreateDescriptorSetLayout(device, &layoutCreateInfo, 0, &setLayout));
 	m_descSetLayouts.push_back(setLayout);
 
+	std::vector<VkDescriptorSetLayout> frameSetLayouts(MAX_FRAMES_IN_FLIGHT, setLayout);
+	m_descriptorSets.resize(MAX_FRAMES_IN_FLIGHT);
+	m_descriptorSetFrames.resize(MAX_FRAMES_IN_FLIGHT, MAX_UINT64);
+
 	VkDescriptorSetAllocateInfo allocateInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
 	allocateInfo.descriptorPool = m_api->get_descriptor_pool();
-	allocateInfo.descriptorSetCount = static_cast<uint32_t>(m_descSetLayouts.size());
-	allocateInfo.pSetLayouts = m_descSetLayouts.data();
-	vkAllocateDescriptorSets(device, &allocateInfo, &m_descriptorSet);
+	allocateInfo.descriptorSetCount = MAX_FRAMES_IN_FLIGHT;
+	allocateInfo.pSetLayouts = frameSetLayouts.data();
+	vkAllocateDescriptorSets(device, &allocateInfo, m_descriptorSets.data());
 
 	m_layout = create_pipeline_layout(device, m_descSetLayouts, pushConstantRanges);
 
@@ -483,6 +487,38 @@ VulkanPipeline::VulkanPipeline(std::shared_ptr<VulkanAPI> m_api, const PipelineD
 		vkDestroyShaderModule(device, shader.module, 0);
 }
 
+void VulkanPipeline::update_descriptor_set(VkDevice device, const std::vector<VkWriteDescriptorSet>& writeSets, uint32_t frameIndex, uint64_t frameNumber)
+{
+	for (auto& writeSet : writeSets)
+	{
+		auto found = std::find_if(m_writeSets.begin(), m_writeSets.end(), [&writeSet](const VkWriteDescriptorSet& existing) {
+			return existing.dstBinding == writeSet.dstBinding;
+		});
+
+		if (found != m_writeSets.end())
+			*found = writeSet;
+		else
+			m_writeSets.push_back(writeSet);
+	}
+
+	// Force the replay so that the buffer offsets are read again
+	m_descriptorSetFrames[frameIndex] = MAX_UINT64;
+	get_descriptor_set(device, frameIndex, frameNumber);
+}
+
+VkDescriptorSet VulkanPipeline::get_descriptor_set(VkDevice device, uint32_t frameIndex, uint64_t frameNumber)
+{
+	VkDescriptorSet descriptorSet = m_descriptorSets[frameIndex];
+	if (m_descriptorSetFrames[frameIndex] != frameNumber && m_writeSets.size() > 0)
+	{
+		for (auto& writeSet : m_writeSets)
+			writeSet.dstSet = descriptorSet;
+		vkUpdateDescriptorSets(device, static_cast<uint32_t>(m_writeSets.size()), m_writeSets.data(), 0, nullptr);
+		m_descriptorSetFrames[frameIndex] = frameNumber;
+	}
+	return descriptorSet;
+}
+
 void VulkanPipeline::destroy(std::shared_ptr<VulkanAPI> m_api)
 {
 	VkDevice device = m_api->m_Device;
@@ -14,7 +14,11 @@ public:
 	VkPipelineLayout get_layout() { return m_layout; }
 
 	VkPipelineBindPoint get_bind_point() { return m_bindPoint; }
-	VkDescriptorSet get_descriptor_set() { return m_descriptorSet; }
+
+	// Each frame in flight owns a descriptor set, the last written bindings are replayed
+	// into the set of a frame the first time it is bound in that frame
+	void update_descriptor_set(VkDevice device, const std::vector<VkWriteDescriptorSet>& writeSets, uint32_t frameIndex, uint64_t frameNumber);
+	VkDescriptorSet get_descriptor_set(VkDevice device, uint32_t frameIndex, uint64_t frameNumber);
 
 	void destroy(std::shared_ptr<VulkanAPI> m_api);
 private:
@@ -26,5 +30,7 @@ private:
 	VkPipeline m_pipeline;
 	VkPipelineBindPoint m_bindPoint;
 	std::vector<VkDescriptorSetLayout> m_descSetLayouts;
-	VkDescriptorSet m_descriptorSet;
+	std::vector<VkDescriptorSet> m_descriptorSets;
+	std::vector<uint64_t> m_descriptorSetFrames;
+	std::vector<VkWriteDescriptorSet> m_writeSets;
 };
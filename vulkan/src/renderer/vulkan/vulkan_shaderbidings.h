@@ -52,6 +52,20 @@ public:
 		insert_descriptor(descriptor);
 	}
 
+	void set_buffer(IndirectBuffer* buffer, uint32_t binding) override
+	{
+		VkWriteDescriptorSet descriptor = { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+		descriptor.dstSet = 0;
+		descriptor.dstBinding = binding;
+		descriptor.descriptorCount = 1;
+		descriptor.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+
+		VulkanIndirectBuffer* vkBuffer = reinterpret_cast<VulkanIndirectBuffer*>(buffer);
+		descriptor.pBufferInfo = vkBuffer->get_buffer_info();
+
+		insert_descriptor(descriptor);
+	}
+
 	void set_texture_sampler(Texture* texture, uint32_t binding) override
 	{
 		VkWriteDescriptorSet descriptor = { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
@@ -0,0 +1,253 @@
+#include "vulkan_staging_ring.h"
+#include "vulkan_api.h"
+#include "vulkan_buffer.h"
+#include <algorithm>
+
+static const uint32_t STAGING_BATCH_COUNT = 8;
+static const uint32_t STAGING_ALIGNMENT = 16;
+
+VulkanStagingRing::VulkanStagingRing(std::shared_ptr<VulkanAPI> api, uint32_t sizeInByte) : m_size(sizeInByte)
+{
+	VkDevice device = api->get_device();
+
+	VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+	m_buffer = std::make_shared<VulkanBuffer>(api, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, properties, sizeInByte);
+
+	VkCommandPoolCreateInfo poolCreateInfo = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
+	poolCreateInfo.queueFamilyIndex = api->get_queue_family_indices().graphicsFamily;
+	poolCreateInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+	VK_CHECK(vkCreateCommandPool(device, &poolCreateInfo, nullptr, &m_commandPool));
+
+	std::vector<VkCommandBuffer> commandBuffers(STAGING_BATCH_COUNT);
+	VkCommandBufferAllocateInfo allocateInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+	allocateInfo.commandBufferCount = STAGING_BATCH_COUNT;
+	allocateInfo.commandPool = m_commandPool;
+	allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	VK_CHECK(vkAllocateCommandBuffers(device, &allocateInfo, commandBuffers.data()));
+
+	m_batches.resize(STAGING_BATCH_COUNT);
+	for (uint32_t i = 0; i < STAGING_BATCH_COUNT; ++i)
+	{
+		m_batches[i].commandBuffer = commandBuffers[i];
+		m_batches[i].ringEnd = 0;
+
+		VkFenceCreateInfo fenceCreateInfo = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
+		VK_CHECK(vkCreateFence(device, &fenceCreateInfo, nullptr, &m_batches[i].fence));
+		m_freeBatches.push_back(i);
+	}
+}
+
+void VulkanStagingRing::copy(std::shared_ptr<VulkanAPI> api, VkBuffer dstBuffer, void* data, uint32_t dstOffsetInByte, uint32_t sizeInByte)
+{
+	// Large upload are split so that a single copy never needs the whole ring
+	const uint32_t maxCopySize = m_size / 4;
+
+	uint8_t* src = reinterpret_cast<uint8_t*>(data);
+	while (sizeInByte > 0)
+	{
+		uint32_t copySize = std::min(sizeInByte, maxCopySize);
+		uint32_t ringOffset = stage(api, src, copySize);
+
+		Batch& batch = m_batches[m_recordingBatch];
+		VkBufferCopy copyRegion = {};
+		copyRegion.srcOffset = ringOffset;
+		copyRegion.dstOffset = dstOffsetInByte;
+		copyRegion.size = copySize;
+		vkCmdCopyBuffer(batch.commandBuffer, m_buffer->buffer, dstBuffer, 1, &copyRegion);
+
+		src += copySize;
+		dstOffsetInByte += copySize;
+		sizeInByte -= copySize;
+	}
+}
+
+void VulkanStagingRing::copy(std::shared_ptr<VulkanAPI> api, VkImage dstImage, VkImageAspectFlagBits aspect, VkImageLayout layout, VkImageLayout finalLayout,
+	void* data, uint32_t texelSizeInByte, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+	// Split on rows so that a single copy never needs more than a quarter of the ring
+	const uint32_t rowSize = width * texelSizeInByte;
+	const uint32_t maxRowCount = std::max(m_size / 4 / rowSize, 1u);
+
+	if (m_recordingBatch == MAX_UINT32)
+		begin_batch(api);
+
+	// The content outside of the rect is kept, the transition waits for the previous reads of the queue
+	VkImageMemoryBarrier barrier = image_barrier(dstImage, VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, layout, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, aspect);
+	vkCmdPipelineBarrier(m_batches[m_recordingBatch].commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+	uint8_t* src = reinterpret_cast<uint8_t*>(data);
+	for (uint32_t row = 0; row < height;)
+	{
+		uint32_t rowCount = std::min(height - row, maxRowCount);
+		uint32_t ringOffset = stage(api, src, rowCount * rowSize);
+
+		VkBufferImageCopy region = {};
+		region.bufferOffset = ringOffset;
+		region.imageSubresource.aspectMask = aspect;
+		region.imageSubresource.layerCount = 1;
+		region.imageOffset = { int32_t(x), int32_t(y + row), 0 };
+		region.imageExtent = { width, rowCount, 1 };
+		vkCmdCopyBufferToImage(m_batches[m_recordingBatch].commandBuffer, m_buffer->buffer, dstImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+		src += rowCount * rowSize;
+		row += rowCount;
+	}
+
+	if (finalLayout != VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL)
+	{
+		barrier = image_barrier(dstImage, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, finalLayout, aspect);
+		vkCmdPipelineBarrier(m_batches[m_recordingBatch].commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+	}
+}
+
+uint32_t VulkanStagingRing::stage(std::shared_ptr<VulkanAPI> api, const void* data, uint32_t sizeInByte)
+{
+	uint64_t position = allocate(api, sizeInByte);
+	uint32_t ringOffset = static_cast<uint32_t>(position % m_size);
+	memcpy(reinterpret_cast<uint8_t*>(m_buffer->pointer) + ringOffset, data, sizeInByte);
+
+	// The allocation can submit the batch being recorded when the ring is full
+	if (m_recordingBatch == MAX_UINT32)
+		begin_batch(api);
+	m_batches[m_recordingBatch].ringEnd = m_head;
+	m_bytesStaged += sizeInByte;
+	return ringOffset;
+}
+
+uint64_t VulkanStagingRing::allocate(std::shared_ptr<VulkanAPI> api, uint32_t sizeInByte)
+{
+	uint32_t alignedSize = (sizeInByte + STAGING_ALIGNMENT - 1) & ~(STAGING_ALIGNMENT - 1);
+	ASSERT(alignedSize <= m_size);
+
+	retire_batches(api, false);
+	while (true)
+	{
+		uint64_t position = m_head;
+		uint32_t ringOffset = static_cast<uint32_t>(position % m_size);
+		// Allocation never wraps around the end of the buffer
+		if (ringOffset + alignedSize > m_size)
+			position += m_size - ringOffset;
+
+		if (position + alignedSize - m_tail <= m_size)
+		{
+			m_head = position + alignedSize;
+			return position;
+		}
+
+		// Ring is full, if the only owner is the batch being recorded it has to be submitted first
+		if (m_submittedBatches.empty())
+			flush(api);
+
+		retire_batches(api, true);
+		m_stalls++;
+		m_totalStalls++;
+	}
+}
+
+void VulkanStagingRing::begin_batch(std::shared_ptr<VulkanAPI> api)
+{
+	if (m_freeBatches.empty())
+	{
+		retire_batches(api, true);
+		m_stalls++;
+		m_totalStalls++;
+	}
+	ASSERT(!m_freeBatches.empty());
+
+	m_recordingBatch = m_freeBatches.front();
+	m_freeBatches.pop_front();
+
+	Batch& batch = m_batches[m_recordingBatch];
+	batch.ringEnd = m_head;
+
+	VkCommandBufferBeginInfo beginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	VK_CHECK(vkResetCommandBuffer(batch.commandBuffer, 0));
+	VK_CHECK(vkBeginCommandBuffer(batch.commandBuffer, &beginInfo));
+
+	// Frames in flight can still read the region overwritten by these copies
+	vkCmdPipelineBarrier(batch.commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 0, nullptr);
+}
+
+bool VulkanStagingRing::flush(std::shared_ptr<VulkanAPI> api)
+{
+	if (m_recordingBatch == MAX_UINT32)
+		return false;
+
+	Batch& batch = m_batches[m_recordingBatch];
+	VK_CHECK(vkEndCommandBuffer(batch.commandBuffer));
+
+	VkSubmitInfo submitInfo = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &batch.commandBuffer;
+	VK_CHECK(vkQueueSubmit(api->get_queue(), 1, &submitInfo, batch.fence));
+
+	m_submittedBatches.push_back(m_recordingBatch);
+	m_recordingBatch = MAX_UINT32;
+	return true;
+}
+
+bool VulkanStagingRing::retire_batches(std::shared_ptr<VulkanAPI> api, bool wait)
+{
+	VkDevice device = api->get_device();
+
+	bool retired = false;
+	while (!m_submittedBatches.empty())
+	{
+		uint32_t batchIndex = m_submittedBatches.front();
+		Batch& batch = m_batches[batchIndex];
+
+		if (wait && !retired)
+		{
+			VK_CHECK(vkWaitForFences(device, 1, &batch.fence, VK_TRUE, UINT64_MAX));
+		}
+		else if (vkGetFenceStatus(device, batch.fence) != VK_SUCCESS)
+			break;
+
+		VK_CHECK(vkResetFences(device, 1, &batch.fence));
+		m_tail = batch.ringEnd;
+		m_submittedBatches.pop_front();
+		m_freeBatches.push_back(batchIndex);
+		retired = true;
+	}
+	return retired;
+}
+
+void VulkanStagingRing::record_barrier(VkCommandBuffer commandBuffer)
+{
+	VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT |
+		VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT;
+
+	VkPipelineStageFlags dstStages = VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+		VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_GEOMETRY_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT |
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, dstStages, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void VulkanStagingRing::end_frame()
+{
+	m_bytesStagedLastFrame = m_bytesStaged;
+	m_stallsLastFrame = m_stalls;
+	m_bytesStaged = 0;
+	m_stalls = 0;
+}
+
+void VulkanStagingRing::destroy(std::shared_ptr<VulkanAPI> api)
+{
+	VkDevice device = api->get_device();
+
+	flush(api);
+	while (!m_submittedBatches.empty())
+		retire_batches(api, true);
+
+	for (auto& batch : m_batches)
+	{
+		vkFreeCommandBuffers(device, m_commandPool, 1, &batch.commandBuffer);
+		vkDestroyFence(device, batch.fence, nullptr);
+	}
+	vkDestroyCommandPool(device, m_commandPool, nullptr);
+	m_buffer->destroy(api);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "vulkan_common.h"
+#include <deque>
+
+class VulkanAPI;
+class VulkanBuffer;
+
+// Persistently mapped staging buffer used as a ring
+// Copies are recorded into a batch command buffer and submitted on flush,
+// each submitted batch own a fence that releases its region of the ring once signaled
+class VulkanStagingRing
+{
+public:
+	VulkanStagingRing(std::shared_ptr<VulkanAPI> api, uint32_t sizeInByte);
+
+	void copy(std::shared_ptr<VulkanAPI> api, VkBuffer dstBuffer, void* data, uint32_t dstOffsetInByte, uint32_t sizeInByte);
+	// Tightly packed rows copied into the rect of the image, which goes from layout to TRANSFER_DST_OPTIMAL and then to finalLayout
+	void copy(std::shared_ptr<VulkanAPI> api, VkImage dstImage, VkImageAspectFlagBits aspect, VkImageLayout layout, VkImageLayout finalLayout,
+		void* data, uint32_t texelSizeInByte, uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+
+	// Submit the recorded copies, returns false if nothing has been recorded since last flush
+	bool flush(std::shared_ptr<VulkanAPI> api);
+
+	// Make the staged data visible to every later command on the queue
+	static void record_barrier(VkCommandBuffer commandBuffer);
+
+	void end_frame();
+
+	uint64_t get_bytes_staged_last_frame() const { return m_bytesStagedLastFrame; }
+	uint32_t get_stalls_last_frame() const { return m_stallsLastFrame; }
+	uint64_t get_total_stalls() const { return m_totalStalls; }
+
+	void destroy(std::shared_ptr<VulkanAPI> api);
+private:
+	struct Batch
+	{
+		VkCommandBuffer commandBuffer;
+		VkFence fence;
+		// Ring position after the last allocation of this batch
+		uint64_t ringEnd;
+	};
+
+	std::shared_ptr<VulkanBuffer> m_buffer;
+	uint32_t m_size;
+	// Monotonic position in byte, the offset in the buffer is position % m_size
+	uint64_t m_head = 0;
+	uint64_t m_tail = 0;
+
+	VkCommandPool m_commandPool;
+	std::vector<Batch> m_batches;
+	std::deque<uint32_t> m_freeBatches;
+	std::deque<uint32_t> m_submittedBatches;
+	uint32_t m_recordingBatch = MAX_UINT32;
+
+	uint64_t m_bytesStaged = 0;
+	uint64_t m_bytesStagedLastFrame = 0;
+	uint32_t m_stalls = 0;
+	uint32_t m_stallsLastFrame = 0;
+	uint64_t m_totalStalls = 0;
+
+	uint64_t allocate(std::shared_ptr<VulkanAPI> api, uint32_t sizeInByte);
+	// Allocate and fill a region of the ring, returns its offset in the buffer
+	uint32_t stage(std::shared_ptr<VulkanAPI> api, const void* data, uint32_t sizeInByte);
+	void begin_batch(std::shared_ptr<VulkanAPI> api);
+	// Release the region of the completed batch, wait for the oldest one if wait is true
+	bool retire_batches(std::shared_ptr<VulkanAPI> api, bool wait);
+};
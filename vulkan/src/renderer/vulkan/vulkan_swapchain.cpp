@@ -136,12 +136,12 @@ VulkanSwapchain::VulkanSwapchain(std::shared_ptr<VulkanAPI> api, GLFWwindow* win
 	assert(presentSupport != false);
 	create_swapchain(api, width, height);
 
-	m_acquireSemaphore.resize(MAX_FRAME_IN_FLIGHT);
-	m_releaseSemaphore.resize(MAX_FRAME_IN_FLIGHT);
-	m_inFlightFences.resize(MAX_FRAME_IN_FLIGHT);
+	m_acquireSemaphore.resize(MAX_FRAMES_IN_FLIGHT);
+	m_releaseSemaphore.resize(MAX_FRAMES_IN_FLIGHT);
+	m_inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
 
 	VkDevice device = api->m_Device;
-	for (uint32_t i = 0; i < MAX_FRAME_IN_FLIGHT; ++i)
+	for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i)
 	{
 		m_acquireSemaphore[i] = create_semaphore(device);
 		m_releaseSemaphore[i] = create_semaphore(device);
@@ -205,7 +205,12 @@ VkResult VulkanSwapchain::acquire_next_image(VkDevice device)
 	return result;
 }
 
-VkResult VulkanSwapchain::present(VkCommandBuffer commandBuffer, VkQueue queue)
+void VulkanSwapchain::wait_for_frame(VkDevice device)
+{
+	VK_CHECK(vkWaitForFences(device, 1, &m_inFlightFences[m_currentFrame], VK_TRUE, UINT64_MAX));
+}
+
+VkResult VulkanSwapchain::present(VkCommandBuffer commandBuffer, VkQueue queue, VkSemaphore computeSemaphore)
 {
 
 	//	After returning the swapchain image index, the image is not ready
@@ -213,16 +218,21 @@ VkResult VulkanSwapchain::present(VkCommandBuffer commandBuffer, VkQueue queue)
 
 	vkResetFences(m_api->m_Device, 1, &m_inFlightFences[m_currentFrame]);
 
-	VkPipelineStageFlags submitStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+	VkSemaphore waitSemaphores[] = { m_acquireSemaphore[m_currentFrame], computeSemaphore };
+	VkPipelineStageFlags submitStageMasks[] = {
+		VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+		VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT
+	};
+
 	VkSubmitInfo submitInfo = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
-	submitInfo.waitSemaphoreCount = 1;
-	submitInfo.pWaitSemaphores = &m_acquireSemaphore[m_currentFrame];
+	submitInfo.waitSemaphoreCount = computeSemaphore != VK_NULL_HANDLE ? 2 : 1;
+	submitInfo.pWaitSemaphores = waitSemaphores;
 	submitInfo.signalSemaphoreCount = 1;
 	submitInfo.pSignalSemaphores = &m_releaseSemaphore[m_currentFrame];
 
 	submitInfo.commandBufferCount = 1;
 	submitInfo.pCommandBuffers = &commandBuffer;
-	submitInfo.pWaitDstStageMask = &submitStageMask;
+	submitInfo.pWaitDstStageMask = submitStageMasks;
 
 	VK_CHECK(vkQueueSubmit(queue, 1, &submitInfo, m_inFlightFences[m_currentFrame]));
 
@@ -233,7 +243,7 @@ VkResult VulkanSwapchain::present(VkCommandBuffer commandBuffer, VkQueue queue)
 	presentInfo.waitSemaphoreCount = 1;
 	presentInfo.pWaitSemaphores = &m_releaseSemaphore[m_currentFrame];
 
-	m_currentFrame = (m_currentFrame + 1) % MAX_FRAME_IN_FLIGHT;
+	m_currentFrame = (m_currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
 	VkResult result = vkQueuePresentKHR(queue, &presentInfo);
 	return result;
 }
@@ -16,7 +16,10 @@ public:
 	VulkanSwapchain(std::shared_ptr<VulkanAPI> api, GLFWwindow* window, uint32_t width, uint32_t height);
 	void create_required_attachments(std::shared_ptr<VulkanAPI> api, VkRenderPass renderPass);
 	VkResult acquire_next_image(VkDevice device);
-	VkResult present(VkCommandBuffer commandBuffer, VkQueue queue);
+	// computeSemaphore is waited before the shader stages when not null
+	VkResult present(VkCommandBuffer commandBuffer, VkQueue queue, VkSemaphore computeSemaphore = VK_NULL_HANDLE);
+	// Block until the GPU has finished the last submission that used the current frame resources
+	void wait_for_frame(VkDevice device);
 	void destroy(std::shared_ptr<VulkanAPI> api);
 	void resize_swapchain(std::shared_ptr<VulkanAPI> api, VkRenderPass renderPass, uint32_t width, uint32_t height);
 
@@ -29,6 +32,9 @@ public:
 
 	uint32_t get_min_image_count() { return m_minImageCount; }
 	uint32_t get_image_count() { return m_imageCount; }
+	uint32_t get_current_frame() { return m_currentFrame; }
+	// Signaled once the frame being recorded has completed
+	VkFence get_frame_fence() { return m_inFlightFences[m_currentFrame]; }
 private:
 
 	std::shared_ptr<VulkanAPI> m_api;
@@ -47,7 +53,6 @@ private:
 
 	uint32_t m_minImageCount;
 	uint32_t m_imageCount;
-	const uint32_t MAX_FRAME_IN_FLIGHT = 2;
 	uint32_t m_currentFrame = 0;
 
 	std::vector<VkSemaphore> m_acquireSemaphore;
@@ -2,7 +2,7 @@
 #include "vulkan_api.h"
 #include "vulkan_type_converter.h"
 
-void VulkanTexture::create_image(VkDevice device, VkPhysicalDeviceMemoryProperties memProps, VkImageUsageFlags usage, VkImageType imageType, VkFormat format, uint32_t width, uint32_t height, uint32_t layerCount)
+void VulkanTexture::create_image(VkDevice device, VkPhysicalDeviceMemoryProperties memProps, VkImageUsageFlags usage, VkImageType imageType, VkFormat format, uint32_t width, uint32_t height, uint32_t layerCount, const std::vector<uint32_t>& queueFamilies)
 {
 	VkImageCreateInfo createInfo = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
 	if (layerCount == 6)
@@ -17,7 +17,13 @@ void VulkanTexture::create_image(VkDevice device, VkPhysicalDeviceMemoryProperti
 
 	createInfo.usage = usage;
 	createInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
-	createInfo.queueFamilyIndexCount = 0;
+	createInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	if (queueFamilies.size() > 1)
+	{
+		createInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+		createInfo.queueFamilyIndexCount = static_cast<uint32_t>(queueFamilies.size());
+		createInfo.pQueueFamilyIndices = queueFamilies.data();
+	}
 	createInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
 
 	VK_CHECK(vkCreateImage(device, &createInfo, nullptr, &m_image));
@@ -83,7 +89,13 @@ VulkanTexture::VulkanTexture(std::shared_ptr<VulkanAPI> api, const TextureDescri
 		layerCount = 6;
 	}
 
-	create_image(device, memoryProps, usage, imageType, format, desc.width, desc.height, layerCount);
+	// Storage image can be written by the async compute queue and read by the graphics queue
+	std::vector<uint32_t> queueFamilies;
+	QueueFamilyIndices familyIndices = api->get_queue_family_indices();
+	if ((desc.flags & TextureFlag::StorageImage) && api->has_async_compute_queue())
+		queueFamilies = { familyIndices.graphicsFamily, familyIndices.computeFamily };
+
+	create_image(device, memoryProps, usage, imageType, format, desc.width, desc.height, layerCount, queueFamilies);
 	create_image_view(device, m_aspect, format, imageViewType, layerCount);
 
 	m_layout = VK_IMAGE_LAYOUT_UNDEFINED;
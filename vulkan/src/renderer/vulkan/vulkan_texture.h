@@ -43,7 +43,8 @@ private:
 	uint32_t m_width;
 	uint32_t m_height;
 
-	void create_image(VkDevice device, VkPhysicalDeviceMemoryProperties memProps, VkImageUsageFlags usage, VkImageType imageType, VkFormat format, uint32_t width, uint32_t height, uint32_t layerCount);
+	// The image is shared concurrently when more than one queue family is given
+	void create_image(VkDevice device, VkPhysicalDeviceMemoryProperties memProps, VkImageUsageFlags usage, VkImageType imageType, VkFormat format, uint32_t width, uint32_t height, uint32_t layerCount, const std::vector<uint32_t>& queueFamilies);
 	void create_image_view(VkDevice device, VkImageAspectFlags aspectMask, VkFormat format, VkImageViewType imageViewType, uint32_t layerCount);
 	void create_sampler(VkDevice device, SamplerDescription* desc);
 };
\ No newline at end of file
@@ -224,6 +224,9 @@ public:
 		switch (usage)
 		{
 		case BufferUsageHint::StaticRead:
+			// Written on the gpu and read back with Context::read
+			usageFlags |= VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+			return VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
 		case BufferUsageHint::StaticDraw:
 			usageFlags |= VK_BUFFER_USAGE_TRANSFER_DST_BIT;
 			return VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
@@ -113,6 +113,8 @@ void Scene::update(Context* context, float dt)
 
 void Scene::prepass(Context* context)
 {
+	if (m_terrain)
+		m_terrain->prepass(context, m_camera);
 	m_sunLightShadowCascade->render(context, this, m_sun->cast_shadow());
 	if (m_water)
 	{
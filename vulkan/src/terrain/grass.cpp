@@ -7,7 +7,8 @@
 #include "renderer/texture.h"
 #include "scene/entity.h"
 #include "common/image_loader.h"
-#include "terrain_chunk.h"
+#include "terrain_quadtree.h"
+#include "terrain_clipmap.h"
 
 Texture* create_texture(Context* context, const char* filename)
 {
@@ -105,7 +106,7 @@ void Grass::render(Context* context, Entity* entity, ShaderBindings** bindings,
 	context->draw_indexed(entity->mesh->get_indices_count());
 }
 
-void Grass::render(Context* context, std::vector<TerrainChunk*> chunks, IndexBuffer* ib, uint32_t indicesCount, ShaderBindings** bindings, uint32_t count, float elapsedTime)
+void Grass::render(Context* context, QuadTree* quadTree, uint32_t firstDraw, uint32_t drawCount, ShaderBindings** bindings, uint32_t count, float elapsedTime)
 {
 	std::vector<ShaderBindings*> totalBindings;
 	for (uint32_t i = 0; i < count; ++i)
@@ -118,13 +119,21 @@ void Grass::render(Context* context, std::vector<TerrainChunk*> chunks, IndexBuf
 	glm::mat4 model = glm::mat4(1.0f);
 	context->set_uniform(ShaderStage::Vertex, 0, sizeof(glm::mat4), &model[0][0]);
 	context->set_uniform(ShaderStage::Geometry, sizeof(glm::mat4), sizeof(float), &elapsedTime);
-	context->set_buffer(ib, 0);
-	for (auto& chunk : chunks)
-	{
-		Ref<VertexBufferView> vb = chunk->vb;
-		context->set_buffer(vb->buffer, vb->offset);
-		context->draw_indexed(indicesCount);
-	}
+	quadTree->draw(context, firstDraw, drawCount);
+}
+
+void Grass::render(Context* context, TerrainClipmap* clipmap, uint32_t drawCount, ShaderBindings** bindings, uint32_t count, float elapsedTime)
+{
+	std::vector<ShaderBindings*> totalBindings(bindings, bindings + count);
+	totalBindings.push_back(m_bindings);
+
+	context->update_pipeline(m_pipeline, totalBindings.data(), static_cast<uint32_t>(totalBindings.size()));
+	context->set_pipeline(m_pipeline);
+
+	glm::mat4 model = glm::mat4(1.0f);
+	context->set_uniform(ShaderStage::Vertex, 0, sizeof(glm::mat4), &model[0][0]);
+	context->set_uniform(ShaderStage::Geometry, sizeof(glm::mat4), sizeof(float), &elapsedTime);
+	clipmap->draw(context, 0, drawCount);
 }
 
 void Grass::destroy()
@@ -8,15 +8,18 @@ class Pipeline;
 class Entity;
 class ShaderBindings;
 class Texture;
-class TerrainChunk;
-class IndexBuffer;
+class QuadTree;
+class TerrainClipmap;
 
 class Grass
 {
 public:
 	Grass(Context* context);
 	void render(Context* context, Entity* entity, ShaderBindings** bindings, uint32_t count, float elapsedTime);
-	void render(Context* context, std::vector<TerrainChunk*> chunks, IndexBuffer* ib, uint32_t indicesCount, ShaderBindings** bindings, uint32_t count, float elapsedTime);
+	// Draw the terrain chunks from the quadtree indirect buffer, see QuadTree::add_draws
+	void render(Context* context, QuadTree* quadTree, uint32_t firstDraw, uint32_t drawCount, ShaderBindings** bindings, uint32_t count, float elapsedTime);
+	// Draw the drawCount finest clipmap levels
+	void render(Context* context, TerrainClipmap* clipmap, uint32_t drawCount, ShaderBindings** bindings, uint32_t count, float elapsedTime);
 	void destroy();
 private:
 	Pipeline* m_pipeline;
@@ -1,9 +1,12 @@
 #include "terrain.h"
 #include "terrain_stream.h"
 #include "terrain_quadtree.h"
+#include "terrain_clipmap.h"
 #include "terrain_chunkmanager.h"
 #include "grass.h"
 #include "terrain_chunk.h"
+#include "terrain_raycast.h"
+#include "core/job_system.h"
 
 #include "renderer/buffer.h"
 #include "renderer/pipeline.h"
@@ -14,29 +17,22 @@
 #include "scene/camera.h"
 #include "renderer/graphics_window.h"
 
+#include <imgui/imgui.h>
 
 float sample_height(Ref<TerrainStream> stream, float x, float y, float maxHeight)
 {
-	int ix = static_cast<int>(x);
-	int iy = static_cast<int>(y);
-
-	float a = stream->get(ix, iy);
-	float b = stream->get(ix + 1, iy);
-	float c = stream->get(ix, iy + 1);
-	float d = stream->get(ix + 1, iy + 1);
-
-	float fx = x - ix;
-	float fy = y - iy;
-
-	float h0 = glm::mix(a, b, fx);
-	float h1 = glm::mix(c, d, fx);
-
-	float h = glm::mix(h0, h1, fy) * 2.0f - 1.0f;
+	float h = stream->sample(x, y) * 2.0f - 1.0f;
 	return  h * maxHeight;
 }
 
-Terrain::Terrain(Context* context, Ref<TerrainStream> stream): m_stream(stream)
+Terrain::Terrain(Context* context, Ref<TerrainStream> stream, TerrainMeshMode meshMode, TerrainBackend backend): m_stream(stream), m_backend(backend), m_meshMode(meshMode)
 {
+	if (m_meshMode == TerrainMeshMode::VertexTextureFetch && stream->is_tiled())
+	{
+		Debug_Error("Vertex texture fetch needs the heightmap in memory, using the cpu mesh");
+		m_meshMode = TerrainMeshMode::CpuMesh;
+	}
+
 	std::string vertexCode = load_file("spirv/terrain.vert.spv");
 	ASSERT(vertexCode.size() % 4 == 0);
 	std::string fragmentCode = load_file("spirv/terrain.frag.spv");
@@ -63,30 +59,53 @@ Terrain::Terrain(Context* context, Ref<TerrainStream> stream): m_stream(stream)
 
 	m_activePipeline = m_pipeline;
 
+	// World size is the power of two covering the heightmap, at least 2048
 	uint32_t terrainSize = static_cast<uint32_t>(std::pow(2, 11));
+	while (terrainSize < uint32_t(std::max(stream->get_width(), stream->get_height())))
+		terrainSize *= 2;
+	m_terrainSize = terrainSize;
 	uint32_t depth = static_cast<int>(std::log2(terrainSize / m_minchunkSize));
 	m_maxLod = depth;
 
-	m_quadTree = CreateRef<QuadTree>(context, stream, depth, terrainSize, m_maxHeight);
+	create_backend(context);
 	m_grass = CreateRef<Grass>(context);
+	m_rayCaster = CreateRef<TerrainRayCaster>(stream, float(m_maxHeight), JobSystem::get_default_worker_count());
+	m_brush = CreateRef<TerrainBrush>(stream, JobSystem::get_default_worker_count());
 }
 
-bool Terrain::ray_cast(const Ray& ray, glm::vec3& p_out)
+void Terrain::create_backend(Context* context)
 {
-	glm::vec3 p0 = ray.origin + 0.01f * ray.direction;
-	glm::vec3 p1 = ray.origin + m_maxRayCastDistance * ray.direction;
-
-	const float threshold = 0.001f;
-	if (binary_search(p0, p1, threshold, p_out))
-	{
-		m_terrainIntersection = glm::vec4(p_out, 1.0f);
-		return true;
-	}
+	if (m_backend == TerrainBackend::QuadTree)
+		m_quadTree = CreateRef<QuadTree>(context, m_stream, m_maxLod, m_terrainSize, m_maxHeight, m_meshMode, m_chunkPoolSize);
 	else
-	{
-		m_terrainIntersection = glm::vec4(p_out, 0.0f);
-		return false;
-	}
+		m_clipmap = CreateRef<TerrainClipmap>(context, m_stream, m_terrainSize, m_maxHeight, m_clipmapSpacing);
+}
+
+void Terrain::set_backend(Context* context, TerrainBackend backend)
+{
+	if (backend == m_backend)
+		return;
+
+	// Frames in flight still read the buffers of the current backend
+	Device::wait_idle();
+	if (m_quadTree)
+		m_quadTree->destroy();
+	if (m_clipmap)
+		m_clipmap->destroy();
+	m_quadTree = nullptr;
+	m_clipmap = nullptr;
+
+	m_backend = backend;
+	create_backend(context);
+}
+
+bool Terrain::ray_cast(const Ray& ray, glm::vec3& p_out)
+{
+	TerrainRayHit hit;
+	m_rayCaster->ray_cast(ray, m_maxRayCastDistance, hit);
+	p_out = hit.position;
+	m_terrainIntersection = glm::vec4(p_out, hit.hit ? 1.0f : 0.0f);
+	return hit.hit;
 }
 
 float Terrain::get_height(glm::vec3 position)
@@ -96,6 +115,22 @@ float Terrain::get_height(glm::vec3 position)
 	return sample_height(m_stream, x, y, float(m_maxHeight));
 }
 
+void Terrain::sculpt(bool active)
+{
+	if (!active)
+	{
+		m_brush->end_stroke();
+		return;
+	}
+	if (m_terrainIntersection.w == 0.0f)
+		return;
+
+	if (!m_brush->is_in_stroke())
+		m_brush->begin_stroke();
+	// World xz is the texel coordinate, as for the ray cast
+	m_brush->apply(glm::vec2(m_terrainIntersection.x, m_terrainIntersection.z), m_brushSettings);
+}
+
 void Terrain::update(Context* context, Ref<Camera> camera)
 {
 	if (context->get_window()->get_keyboard()->is_down(Key::B))
@@ -103,14 +138,98 @@ void Terrain::update(Context* context, Ref<Camera> camera)
 	if (context->get_window()->get_keyboard()->is_down(Key::N))
 		m_activePipeline = m_wireframePipeline;
 
-	m_quadTree->update(context, camera);
+	if (ImGui::CollapsingHeader("Terrain Backend"))
+	{
+		int backend = static_cast<int>(m_backend);
+		ImGui::RadioButton("quadtree", &backend, static_cast<int>(TerrainBackend::QuadTree));
+		ImGui::SameLine();
+		ImGui::RadioButton("clipmap", &backend, static_cast<int>(TerrainBackend::Clipmap));
+		set_backend(context, static_cast<TerrainBackend>(backend));
+	}
+
+	if (m_quadTree)
+		m_quadTree->update(context, camera);
+	else
+		m_clipmap->update(context, camera);
+
+	if (ImGui::CollapsingHeader("Terrain Height Storage"))
+	{
+		const float megaByte = 1.0f / (1024.0f * 1024.0f);
+		bool uint16Format = m_stream->get_format() == HeightFormat::UInt16;
+		ImGui::Text("format: %s, footprint: %.2fMB", uint16Format ? "uint16" : "float", float(m_stream->get_memory_footprint()) * megaByte);
+	}
+
+	if (ImGui::CollapsingHeader("Terrain Brush"))
+	{
+		const char* types[] = { "raise", "lower", "smooth", "flatten", "noise" };
+		const char* falloffs[] = { "constant", "linear", "smooth", "spherical" };
+		int type = static_cast<int>(m_brushSettings.type);
+		int falloff = static_cast<int>(m_brushSettings.falloff);
+		ImGui::Text("right click to sculpt");
+		ImGui::Combo("type", &type, types, 5);
+		ImGui::Combo("falloff", &falloff, falloffs, 4);
+		m_brushSettings.type = static_cast<BrushType>(type);
+		m_brushSettings.falloff = static_cast<BrushFalloff>(falloff);
+		ImGui::SliderFloat("radius", &m_brushSettings.radius, 1.0f, 256.0f);
+		ImGui::SliderFloat("strength", &m_brushSettings.strength, 0.0001f, 1.0f, "%.4f", ImGuiSliderFlags_Logarithmic);
+		if (m_brushSettings.type == BrushType::Flatten)
+			ImGui::SliderFloat("flatten height", &m_brushSettings.flattenHeight, 0.0f, 1.0f);
+		else if (m_brushSettings.type == BrushType::Smooth)
+			ImGui::SliderFloat("sigma", &m_brushSettings.smoothSigma, 0.5f, 5.0f);
+		else if (m_brushSettings.type == BrushType::Noise)
+			ImGui::SliderFloat("frequency", &m_brushSettings.noiseFrequency, 0.005f, 0.5f, "%.3f", ImGuiSliderFlags_Logarithmic);
+
+		if (ImGui::Button("Undo") && m_brush->can_undo())
+			m_brush->undo();
+		ImGui::SameLine();
+		if (ImGui::Button("Redo") && m_brush->can_redo())
+			m_brush->redo();
+
+		const float megaByte = 1.0f / (1024.0f * 1024.0f);
+		const TerrainBrush::Stats& stats = m_brush->get_stats();
+		ImGui::Text("history: %d undo, %d redo, %.2fMB / %.0fMB", m_brush->get_undo_count(), m_brush->get_redo_count(),
+			float(m_brush->get_history_size()) * megaByte, float(m_brush->get_history_budget()) * megaByte);
+		ImGui::Text("last apply: %d tiles, %d texels, %.3fms", stats.tileCount, uint32_t(stats.texelCount), stats.time);
+		ImGui::Text("last stroke: %.1fKB, undo %.1fKB", float(stats.strokeRawSize) / 1024.0f, float(stats.strokeCompressedSize) / 1024.0f);
+	}
+}
+
+void Terrain::prepass(Context* context, Ref<Camera> camera)
+{
+	if (m_quadTree)
+		m_quadTree->prepass(context, camera);
 }
 
 void Terrain::render(Context* context, Ref<Camera> camera, ShaderBindings** uniformBindings, int count, float elapsedTime, bool depthPass)
 {
+	// Terrain vertices are read from the chunk storage buffers
+	std::vector<ShaderBindings*> bindings(uniformBindings, uniformBindings + count);
+	bindings.push_back(get_chunk_bindings());
+	uint32_t bindingCount = static_cast<uint32_t>(bindings.size());
+
+	const float maxGrassDistance = 800.0f;
+	if (m_clipmap)
+	{
+		if (!depthPass)
+		{
+			context->update_pipeline(m_activePipeline, bindings.data(), bindingCount);
+			context->set_pipeline(m_activePipeline);
+
+			glm::mat4 model = glm::mat4(1.0f);
+			context->set_uniform(ShaderStage::Vertex, 0, sizeof(glm::mat4), &model[0][0]);
+			context->set_uniform(ShaderStage::Vertex, sizeof(glm::mat4), sizeof(glm::vec4), &m_terrainIntersection[0]);
+		}
+		m_clipmap->render(context);
+
+		// Levels are centered on the camera, grass grows on the one within its distance
+		if (!depthPass)
+			m_grass->render(context, m_clipmap.get(), m_clipmap->get_draw_count(maxGrassDistance), bindings.data(), bindingCount, elapsedTime);
+		return;
+	}
+
 	if (!depthPass)
 	{
-		context->update_pipeline(m_activePipeline, uniformBindings, count);
+		context->update_pipeline(m_activePipeline, bindings.data(), bindingCount);
 		context->set_pipeline(m_activePipeline);
 
 		glm::mat4 model = glm::mat4(1.0f);
@@ -121,19 +240,18 @@ void Terrain::render(Context* context, Ref<Camera> camera, ShaderBindings** unif
 		std::vector<TerrainChunk*>& chunks = m_quadTree->get_visible_list();
 		
 		glm::vec3 cameraPosition = camera->get_position();
-		const float maxGrassDistance = 800.0f;
 
-		std::vector<TerrainChunk*> grassChunk;
-		for (int i = 0; i < chunks.size(); ++i)
+		// Visible list is front to back, the grass subset keeps that order
+		m_grassChunks.clear();
+		for (TerrainChunk* chunk : chunks)
 		{
-			TerrainChunk* chunk = chunks[i];
 			glm::ivec2 chunkPos = chunk->get_center();
-			if (glm::distance(glm::vec3(chunkPos.x, cameraPosition.y, chunkPos.y), cameraPosition) < maxGrassDistance)
-				grassChunk.push_back(chunk);
+			if (glm::distance(glm::vec3(chunkPos.x, cameraPosition.y, chunkPos.y), cameraPosition) < maxGrassDistance && m_quadTree->is_visible(chunk))
+				m_grassChunks.push_back(chunk);
 		}
 
-		IndexBuffer* ib = m_quadTree->get_ib();
-		m_grass->render(context, grassChunk, ib, m_quadTree->get_indices_count(), uniformBindings, count, elapsedTime);
+		uint32_t firstGrassDraw = m_quadTree->add_draws(context, m_grassChunks);
+		m_grass->render(context, m_quadTree.get(), firstGrassDraw, static_cast<uint32_t>(m_grassChunks.size()), bindings.data(), bindingCount, elapsedTime);
 	}
 	else
 	{
@@ -141,62 +259,31 @@ void Terrain::render(Context* context, Ref<Camera> camera, ShaderBindings** unif
 	}
 }
 
+ShaderBindings* Terrain::get_chunk_bindings()
+{
+	if (m_clipmap)
+		return m_clipmap->get_bindings();
+	return m_quadTree->get_chunk_bindings();
+}
+
 void Terrain::render_no_renderpass(Context* context, Ref<Camera> camera)
 {
-	m_quadTree->render(context, camera);
+	if (m_clipmap)
+		m_clipmap->render(context);
+	else
+		m_quadTree->render(context, camera);
 }
 
 void Terrain::destroy()
 {
-	m_quadTree->destroy();
+	if (m_quadTree)
+		m_quadTree->destroy();
+	if (m_clipmap)
+		m_clipmap->destroy();
+	m_brush->destroy();
 	m_stream->destroy();
 	m_grass->destroy();
+	m_rayCaster->destroy();
 	Device::destroy_pipeline(m_pipeline);
 	Device::destroy_pipeline(m_wireframePipeline);
 }
-
-bool Terrain::binary_search(const glm::vec3& p0, const glm::vec3& p1, float t, glm::vec3& p_out)
-{
-	float distance = glm::length2(p0 - p1);
-	float h0 = p0.y - get_height(p0);
-	float h1 = p1.y - get_height(p1);
-
-	if (distance < t * t)
-	{
-		p_out = (p0 + p1) * 0.5f;
-		return h0 * h1 < 0.0f;
-	}
-	
-	glm::vec3 pm = (p0 + p1) * 0.5f;
-	float hm = pm.y - get_height(pm);
-
-	if (h0 * hm < 0.0f)
-		return binary_search(p0, pm, t, p_out);
-	else
-		return binary_search(pm, p1, t, p_out);
-}
-
-void Terrain::operation_average()
-{
-	int ix = static_cast<int>(glm::floor(m_terrainIntersection.x));
-	int iy = static_cast<int>(glm::floor(m_terrainIntersection.z));
-	
-	float avgHeight = 0.0f;
-	for (int i = -m_influenceRadius; i <= m_influenceRadius; i++)
-	{
-		for (int j = -m_influenceRadius; j <= m_influenceRadius; j++)
-		{
-			avgHeight += m_stream->get(ix + i, iy + j);
-		}
-	}
-
-	avgHeight /= float(m_influenceRadius + 1) * float(m_influenceRadius + 1);
-
-	for (int i = -m_influenceRadius; i <= m_influenceRadius; i++)
-	{
-		for (int j = -m_influenceRadius; j <= m_influenceRadius; j++)
-		{
-			m_stream->set(ix + i, iy + j, avgHeight);
-		}
-	}
-}
@@ -3,6 +3,8 @@
 #include "core/base.h"
 #include "core/math.h"
 #include "core/ray.h"
+#include "terrain_chunk.h"
+#include "terrain_brush.h"
 #include <vector>
 #include <stdint.h>
 
@@ -12,26 +14,42 @@ class Context;
 class ShaderBindings;
 
 class QuadTree;
+class TerrainClipmap;
 class Camera;
 class TerrainChunk;
 class TerrainStream;
 class Grass;
+class TerrainRayCaster;
+
+// How the terrain geometry is selected around the camera, both read the same stream
+enum class TerrainBackend
+{
+	QuadTree,
+	Clipmap
+};
 
 class Terrain
 {
 
 public:
-	Terrain(Context* context, Ref<TerrainStream> stream);
-	// Binary search method
-	// @TODO works for now but need improvement
-	// doesn't work properly in steep slope
+	// VertexTextureFetch needs a stream resident in memory, tiled streams always use the cpu mesh
+	Terrain(Context* context, Ref<TerrainStream> stream, TerrainMeshMode meshMode = TerrainMeshMode::CpuMesh, TerrainBackend backend = TerrainBackend::QuadTree);
+	// Closest intersection within m_maxRayCastDistance, traverse the stream min/max pyramid
 	bool ray_cast(const Ray& ray, glm::vec3& p_out);
 
 	float get_height(glm::vec3 position);
+	// Apply the brush at the last ray cast intersection, the applies of consecutive active frames are a single stroke
+	void sculpt(bool active);
 	void update(Context* context, Ref<Camera> camera);
+	// Prepare the draws of the frame, must be called outside of a renderpass
+	void prepass(Context* context, Ref<Camera> camera);
 
 	void render(Context* context, Ref<Camera> camera, ShaderBindings** uniformBindings, int count, float elapsedTime, bool depthPass = false);
 	void render_no_renderpass(Context* context, Ref<Camera> camera);
+	// Storage buffers holding the chunk vertices, every pipeline drawing the terrain must be updated with them
+	ShaderBindings* get_chunk_bindings();
+	// Destroy the current backend and create the other one, waits for the gpu to be idle
+	void set_backend(Context* context, TerrainBackend backend);
 	void destroy();
 private:
 	Pipeline* m_pipeline;
@@ -39,18 +57,30 @@ private:
 	Pipeline* m_activePipeline;
 
 	Ref<TerrainStream> m_stream;
+	// Only the one of the current backend exists
 	Ref<QuadTree> m_quadTree;
+	Ref<TerrainClipmap> m_clipmap;
+	TerrainBackend m_backend;
 	Ref<Grass> m_grass;
+	// Reused every frame, the chunks of the visible list close enough to grow grass
+	std::vector<TerrainChunk*> m_grassChunks;
+	Ref<TerrainRayCaster> m_rayCaster;
 
 	uint32_t m_minchunkSize = 64;
+	// Initial chunk pool of the quadtree, grown when a frame needs more
+	uint32_t m_chunkPoolSize = 150;
+	// Vertex spacing of the finest quadtree chunk, 128 vertices on a side
+	const float m_clipmapSpacing = 0.5f;
+	uint32_t m_terrainSize;
 	uint32_t m_maxLod;
-	int m_influenceRadius = 10;
-	
+	TerrainMeshMode m_meshMode;
+	Ref<TerrainBrush> m_brush;
+	BrushSettings m_brushSettings;
+
 	const float m_maxRayCastDistance = 500.0f;
 	const int m_maxHeight = 150;
 
 	glm::vec4 m_terrainIntersection = glm::vec4(0.0f);
-	bool binary_search(const glm::vec3& p0, const glm::vec3& p1, float minThreshold, glm::vec3& p_out);
 
-	void operation_average();
+	void create_backend(Context* context);
 };
\ No newline at end of file
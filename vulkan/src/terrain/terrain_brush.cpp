@@ -0,0 +1,598 @@
+#include "terrain_brush.h"
+#include "terrain_stream.h"
+#include "core/job_system.h"
+#include "core/hash.h"
+#include "core/simd.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+// Wider gaussians are cut, the tiles would mostly read their neighbours
+static const int MAX_GAUSSIAN_RADIUS = 16;
+
+// Same comparisons as _mm_max_ps and _mm_min_ps so that both kernels agree on signed zero
+static inline float max_zero(float v) { return v > 0.0f ? v : 0.0f; }
+static inline float min_one(float v) { return v < 1.0f ? v : 1.0f; }
+
+static float get_falloff(float d, BrushFalloff falloff)
+{
+	float t = max_zero(1.0f - d);
+	switch (falloff)
+	{
+	case BrushFalloff::Constant:
+		return d < 1.0f ? 1.0f : 0.0f;
+	case BrushFalloff::Linear:
+		return t;
+	case BrushFalloff::Smooth:
+		return t * t * (3.0f - 2.0f * t);
+	case BrushFalloff::Spherical:
+		return std::sqrt(max_zero(1.0f - d * d));
+	}
+	return 0.0f;
+}
+
+// Weight of count texels of a row starting at texel x, dy2 is the squared distance from the row to the center
+static void compute_weights_scalar(float* weights, int count, int x, float centerX, float dy2, float invRadius, BrushFalloff falloff)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		float dx = float(x + i) - centerX;
+		float d = std::sqrt(dx * dx + dy2) * invRadius;
+		weights[i] = get_falloff(d, falloff);
+	}
+}
+
+// Offset brushes, offsets is nullptr for a constant offset
+static void add_row_scalar(float* heights, const float* weights, const float* offsets, float offset, int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		float o = offsets ? offsets[i] : offset;
+		heights[i] = min_one(max_zero(heights[i] + weights[i] * o));
+	}
+}
+
+// Blend brushes, targets is nullptr for a constant target
+static void blend_row_scalar(float* heights, const float* weights, const float* targets, float target, float strength, int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		float t = targets ? targets[i] : target;
+		heights[i] = min_one(max_zero(heights[i] + (weights[i] * strength) * (t - heights[i])));
+	}
+}
+
+// out[x] is the sum of kernel[i] * src[x + i * stride] from the first tap to the last one
+static void convolve_scalar(const float* src, int stride, const float* kernel, int kernelSize, float* out, int count)
+{
+	for (int x = 0; x < count; ++x)
+	{
+		float sum = 0.0f;
+		for (int i = 0; i < kernelSize; ++i)
+			sum += kernel[i] * src[x + i * stride];
+		out[x] = sum;
+	}
+}
+
+#if defined(SIMD_SSE2)
+// Four texels at once in the same order as the scalar kernels, the remainder goes to the scalar one
+static void compute_weights_simd(float* weights, int count, int x, float centerX, float dy2, float invRadius, BrushFalloff falloff)
+{
+	__m128 zero = _mm_setzero_ps();
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 two = _mm_set1_ps(2.0f);
+	__m128 three = _mm_set1_ps(3.0f);
+	__m128 cx = _mm_set1_ps(centerX);
+	__m128 dy = _mm_set1_ps(dy2);
+	__m128 inv = _mm_set1_ps(invRadius);
+	__m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 fx = _mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32(x + i), lanes));
+		__m128 dx = _mm_sub_ps(fx, cx);
+		__m128 d = _mm_mul_ps(_mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), dy)), inv);
+		__m128 t = _mm_max_ps(_mm_sub_ps(one, d), zero);
+		__m128 w;
+		switch (falloff)
+		{
+		case BrushFalloff::Constant:
+			w = _mm_and_ps(_mm_cmplt_ps(d, one), one);
+			break;
+		case BrushFalloff::Linear:
+			w = t;
+			break;
+		case BrushFalloff::Smooth:
+			w = _mm_mul_ps(_mm_mul_ps(t, t), _mm_sub_ps(three, _mm_mul_ps(two, t)));
+			break;
+		default:
+			w = _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(one, _mm_mul_ps(d, d)), zero));
+			break;
+		}
+		_mm_storeu_ps(weights + i, w);
+	}
+	compute_weights_scalar(weights + i, count - i, x + i, centerX, dy2, invRadius, falloff);
+}
+
+static void add_row_simd(float* heights, const float* weights, const float* offsets, float offset, int count)
+{
+	__m128 zero = _mm_setzero_ps();
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 constant = _mm_set1_ps(offset);
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 o = offsets ? _mm_loadu_ps(offsets + i) : constant;
+		__m128 h = _mm_add_ps(_mm_loadu_ps(heights + i), _mm_mul_ps(_mm_loadu_ps(weights + i), o));
+		_mm_storeu_ps(heights + i, _mm_min_ps(_mm_max_ps(h, zero), one));
+	}
+	add_row_scalar(heights + i, weights + i, offsets ? offsets + i : nullptr, offset, count - i);
+}
+
+static void blend_row_simd(float* heights, const float* weights, const float* targets, float target, float strength, int count)
+{
+	__m128 zero = _mm_setzero_ps();
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 constant = _mm_set1_ps(target);
+	__m128 s = _mm_set1_ps(strength);
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 t = targets ? _mm_loadu_ps(targets + i) : constant;
+		__m128 h = _mm_loadu_ps(heights + i);
+		h = _mm_add_ps(h, _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(weights + i), s), _mm_sub_ps(t, h)));
+		_mm_storeu_ps(heights + i, _mm_min_ps(_mm_max_ps(h, zero), one));
+	}
+	blend_row_scalar(heights + i, weights + i, targets ? targets + i : nullptr, target, strength, count - i);
+}
+
+static void convolve_simd(const float* src, int stride, const float* kernel, int kernelSize, float* out, int count)
+{
+	int x = 0;
+	for (; x + 4 <= count; x += 4)
+	{
+		__m128 sum = _mm_setzero_ps();
+		for (int i = 0; i < kernelSize; ++i)
+			sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(kernel[i]), _mm_loadu_ps(src + x + i * stride)));
+		_mm_storeu_ps(out + x, sum);
+	}
+	convolve_scalar(src + x, stride, kernel, kernelSize, out + x, count - x);
+}
+#endif
+
+// Smoothstep interpolated hash of the integer lattice, in [-1, 1]
+static float get_lattice_value(uint32_t seed, int x, int y)
+{
+	uint64_t hash = hash_combine(hash_combine(seed, uint32_t(x)), uint32_t(y));
+	return float(hash >> 40) * (2.0f / 16777216.0f) - 1.0f;
+}
+
+static float get_value_noise(uint32_t seed, float x, float y)
+{
+	float fx = std::floor(x);
+	float fy = std::floor(y);
+	int ix = static_cast<int>(fx);
+	int iy = static_cast<int>(fy);
+	float tx = x - fx;
+	float ty = y - fy;
+	tx = tx * tx * (3.0f - 2.0f * tx);
+	ty = ty * ty * (3.0f - 2.0f * ty);
+
+	float a = get_lattice_value(seed, ix, iy);
+	float b = get_lattice_value(seed, ix + 1, iy);
+	float c = get_lattice_value(seed, ix, iy + 1);
+	float d = get_lattice_value(seed, ix + 1, iy + 1);
+	return glm::mix(glm::mix(a, b, tx), glm::mix(c, d, tx), ty);
+}
+
+static void write_varint(std::vector<uint8_t>& out, uint32_t value)
+{
+	while (value >= 0x80)
+	{
+		out.push_back(uint8_t(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back(uint8_t(value));
+}
+
+static uint32_t read_varint(const uint8_t*& data)
+{
+	uint32_t value = 0;
+	int shift = 0;
+	while (*data & 0x80)
+	{
+		value |= uint32_t(*data++ & 0x7F) << shift;
+		shift += 7;
+	}
+	value |= uint32_t(*data++) << shift;
+	return value;
+}
+
+// The xor of two close heights has its sign, exponent and high mantissa bits at zero, and the texels
+// the stroke didn't change are zero. The words are split in byte planes, most significant first, coded
+// as a run of zero followed by a run of literal bytes
+static void compress_delta(const uint32_t* words, uint32_t count, std::vector<uint8_t>& out)
+{
+	std::vector<uint8_t> planes(count * 4);
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		for (uint32_t p = 0; p < 4; ++p)
+			planes[p * count + i] = uint8_t(words[i] >> (24 - 8 * p));
+	}
+
+	out.clear();
+	size_t size = planes.size();
+	size_t i = 0;
+	while (i < size)
+	{
+		size_t zeroStart = i;
+		while (i < size && planes[i] == 0)
+			++i;
+		// A literal run ends on three zeros, shorter runs of zero cost less inside of it than a new run
+		size_t literalStart = i;
+		while (i < size && (planes[i] != 0 || (i + 2 < size && (planes[i + 1] != 0 || planes[i + 2] != 0))))
+			++i;
+		write_varint(out, uint32_t(literalStart - zeroStart));
+		write_varint(out, uint32_t(i - literalStart));
+		out.insert(out.end(), planes.begin() + literalStart, planes.begin() + i);
+	}
+}
+
+static void decompress_delta(const uint8_t* data, uint32_t count, uint32_t* words)
+{
+	std::vector<uint8_t> planes(count * 4);
+	size_t i = 0;
+	while (i < planes.size())
+	{
+		uint32_t zeroCount = read_varint(data);
+		memset(planes.data() + i, 0, zeroCount);
+		i += zeroCount;
+		uint32_t literalCount = read_varint(data);
+		ASSERT(i + literalCount <= planes.size());
+		memcpy(planes.data() + i, data, literalCount);
+		data += literalCount;
+		i += literalCount;
+	}
+
+	for (uint32_t w = 0; w < count; ++w)
+		words[w] = (uint32_t(planes[w]) << 24) | (uint32_t(planes[count + w]) << 16) | (uint32_t(planes[2 * count + w]) << 8) | planes[3 * count + w];
+}
+
+TerrainBrush::TerrainBrush(Ref<TerrainStream> stream, uint32_t workerCount, bool reference) : m_stream(stream), m_reference(reference)
+{
+	m_jobSystem = CreateRef<JobSystem>(workerCount);
+}
+
+uint32_t TerrainBrush::get_worker_count() const
+{
+	return m_jobSystem->get_worker_count();
+}
+
+void TerrainBrush::get_tile_rect(int tileX, int tileY, glm::ivec2& min, glm::ivec2& max) const
+{
+	min = glm::ivec2(tileX, tileY) * TILE_SIZE;
+	max = glm::min(min + TILE_SIZE - 1, glm::ivec2(m_stream->get_width() - 1, m_stream->get_height() - 1));
+}
+
+void TerrainBrush::compute_tile(Tile& tile, const glm::vec2& center, const BrushSettings& settings) const
+{
+	int width = tile.max.x - tile.min.x + 1;
+	int height = tile.max.y - tile.min.y + 1;
+	int kernelSize = static_cast<int>(m_gaussian.size());
+	int border = settings.type == BrushType::Smooth ? kernelSize / 2 : 0;
+	int sourceWidth = width + 2 * border;
+	int sourceHeight = height + 2 * border;
+
+	// The gaussian reads around the tile, texels outside of the stream repeat its border
+	tile.source.resize(sourceWidth * sourceHeight);
+	if (border == 0)
+		m_stream->read_rect(tile.min, tile.max, tile.source.data());
+	else
+	{
+		glm::ivec2 readMin = glm::max(tile.min - border, glm::ivec2(0));
+		glm::ivec2 readMax = glm::min(tile.max + border, glm::ivec2(m_stream->get_width() - 1, m_stream->get_height() - 1));
+		int readWidth = readMax.x - readMin.x + 1;
+		tile.blurred.resize(readWidth * (readMax.y - readMin.y + 1));
+		m_stream->read_rect(readMin, readMax, tile.blurred.data());
+		for (int sy = 0; sy < sourceHeight; ++sy)
+		{
+			int y = glm::clamp(tile.min.y - border + sy, readMin.y, readMax.y) - readMin.y;
+			for (int sx = 0; sx < sourceWidth; ++sx)
+			{
+				int x = glm::clamp(tile.min.x - border + sx, readMin.x, readMax.x) - readMin.x;
+				tile.source[sy * sourceWidth + sx] = tile.blurred[y * readWidth + x];
+			}
+		}
+	}
+
+	tile.heights.resize(width * height);
+	for (int y = 0; y < height; ++y)
+		memcpy(tile.heights.data() + y * width, tile.source.data() + (y + border) * sourceWidth + border, width * sizeof(float));
+
+	auto convolve = convolve_scalar;
+	auto compute_weights = compute_weights_scalar;
+	auto add_row = add_row_scalar;
+	auto blend_row = blend_row_scalar;
+#if defined(SIMD_SSE2)
+	if (!m_reference)
+	{
+		convolve = convolve_simd;
+		compute_weights = compute_weights_simd;
+		add_row = add_row_simd;
+		blend_row = blend_row_simd;
+	}
+#endif
+
+	tile.target.resize(width * height);
+	if (settings.type == BrushType::Smooth)
+	{
+		// Separable, the rows of the source then the columns of the result
+		tile.blurred.resize(sourceHeight * width);
+		for (int y = 0; y < sourceHeight; ++y)
+			convolve(tile.source.data() + y * sourceWidth, 1, m_gaussian.data(), kernelSize, tile.blurred.data() + y * width, width);
+		for (int y = 0; y < height; ++y)
+			convolve(tile.blurred.data() + y * width, width, m_gaussian.data(), kernelSize, tile.target.data() + y * width, width);
+	}
+	else if (settings.type == BrushType::Noise)
+	{
+		for (int y = 0; y < height; ++y)
+		{
+			float ny = float(tile.min.y + y) * settings.noiseFrequency;
+			for (int x = 0; x < width; ++x)
+			{
+				float nx = float(tile.min.x + x) * settings.noiseFrequency;
+				tile.target[y * width + x] = settings.strength * get_value_noise(settings.noiseSeed, nx, ny);
+			}
+		}
+	}
+
+	float invRadius = 1.0f / std::max(settings.radius, 1.0f);
+	tile.weights.resize(width);
+	for (int y = 0; y < height; ++y)
+	{
+		float dy = float(tile.min.y + y) - center.y;
+		compute_weights(tile.weights.data(), width, tile.min.x, center.x, dy * dy, invRadius, settings.falloff);
+
+		float* row = tile.heights.data() + y * width;
+		const float* target = tile.target.data() + y * width;
+		switch (settings.type)
+		{
+		case BrushType::Raise:
+			add_row(row, tile.weights.data(), nullptr, settings.strength, width);
+			break;
+		case BrushType::Lower:
+			add_row(row, tile.weights.data(), nullptr, -settings.strength, width);
+			break;
+		case BrushType::Noise:
+			add_row(row, tile.weights.data(), target, 0.0f, width);
+			break;
+		case BrushType::Smooth:
+			blend_row(row, tile.weights.data(), target, 0.0f, settings.strength, width);
+			break;
+		case BrushType::Flatten:
+			blend_row(row, tile.weights.data(), nullptr, settings.flattenHeight, settings.strength, width);
+			break;
+		}
+	}
+}
+
+void TerrainBrush::begin_stroke()
+{
+	end_stroke();
+	m_inStroke = true;
+}
+
+void TerrainBrush::apply(const glm::vec2& center, const BrushSettings& settings)
+{
+	using Clock = std::chrono::high_resolution_clock;
+	auto start = Clock::now();
+
+	bool singleStroke = !m_inStroke;
+	if (singleStroke)
+		begin_stroke();
+
+	float radius = std::max(settings.radius, 1.0f);
+	glm::ivec2 size = glm::ivec2(m_stream->get_width(), m_stream->get_height());
+	glm::ivec2 min = glm::max(glm::ivec2(glm::floor(center - radius)), glm::ivec2(0));
+	glm::ivec2 max = glm::min(glm::ivec2(glm::ceil(center + radius)), size - 1);
+	m_stats.tileCount = 0;
+	m_stats.texelCount = 0;
+	if (min.x <= max.x && min.y <= max.y)
+	{
+		if (settings.type == BrushType::Smooth)
+		{
+			float sigma = std::max(settings.smoothSigma, 0.1f);
+			int kernelRadius = std::min(static_cast<int>(std::ceil(3.0f * sigma)), MAX_GAUSSIAN_RADIUS);
+			m_gaussian.resize(2 * kernelRadius + 1);
+			float sum = 0.0f;
+			for (int i = -kernelRadius; i <= kernelRadius; ++i)
+			{
+				m_gaussian[i + kernelRadius] = std::exp(-float(i * i) / (2.0f * sigma * sigma));
+				sum += m_gaussian[i + kernelRadius];
+			}
+			for (float& weight : m_gaussian)
+				weight /= sum;
+		}
+
+		glm::ivec2 firstTile = min / TILE_SIZE;
+		glm::ivec2 lastTile = max / TILE_SIZE;
+		uint32_t tileCount = uint32_t(lastTile.x - firstTile.x + 1) * uint32_t(lastTile.y - firstTile.y + 1);
+		if (m_tiles.size() < tileCount)
+			m_tiles.resize(tileCount);
+
+		uint32_t index = 0;
+		for (int ty = firstTile.y; ty <= lastTile.y; ++ty)
+		{
+			for (int tx = firstTile.x; tx <= lastTile.x; ++tx)
+			{
+				Tile& tile = m_tiles[index++];
+				get_tile_rect(tx, ty, tile.min, tile.max);
+
+				// Heights before the stroke, saved the first time the stroke touches the tile
+				uint64_t key = (uint64_t(ty) << 32) | uint32_t(tx);
+				if (m_strokeTiles.find(key) == m_strokeTiles.end())
+				{
+					glm::ivec2 extent = tile.max - tile.min + 1;
+					std::vector<float>& original = m_strokeTiles[key];
+					original.resize(extent.x * extent.y);
+					m_stream->read_rect(tile.min, tile.max, original.data());
+				}
+
+				tile.min = glm::max(tile.min, min);
+				tile.max = glm::min(tile.max, max);
+			}
+		}
+
+		// The tiles only read the stream, it is written once every tile is done
+		for (uint32_t i = 0; i < tileCount; ++i)
+		{
+			m_jobSystem->execute([this, i, center, settings]() {
+				compute_tile(m_tiles[i], center, settings);
+			});
+		}
+		m_jobSystem->wait();
+
+		for (uint32_t i = 0; i < tileCount; ++i)
+		{
+			Tile& tile = m_tiles[i];
+			m_stream->write_rect(tile.min, tile.max, tile.heights.data());
+			m_stats.texelCount += tile.heights.size();
+		}
+		m_stats.tileCount = tileCount;
+	}
+
+	if (singleStroke)
+		end_stroke();
+	m_stats.time = std::chrono::duration<float, std::milli>(Clock::now() - start).count();
+}
+
+void TerrainBrush::end_stroke()
+{
+	if (!m_inStroke)
+		return;
+	m_inStroke = false;
+
+	Stroke stroke;
+	std::vector<float> current;
+	std::vector<uint32_t> delta;
+	m_stats.strokeRawSize = 0;
+	for (auto& pair : m_strokeTiles)
+	{
+		const std::vector<float>& original = pair.second;
+		TileDelta tile;
+		get_tile_rect(int(uint32_t(pair.first)), int(pair.first >> 32), tile.min, tile.max);
+		current.resize(original.size());
+		m_stream->read_rect(tile.min, tile.max, current.data());
+		m_stats.strokeRawSize += original.size() * sizeof(float);
+
+		uint32_t count = static_cast<uint32_t>(original.size());
+		delta.resize(count);
+		uint32_t changed = 0;
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			uint32_t before, after;
+			memcpy(&before, &original[i], sizeof(uint32_t));
+			memcpy(&after, &current[i], sizeof(uint32_t));
+			delta[i] = before ^ after;
+			changed |= delta[i];
+		}
+		if (changed == 0)
+			continue;
+
+		compress_delta(delta.data(), count, tile.data);
+		stroke.size += tile.data.size() + sizeof(TileDelta);
+		stroke.tiles.push_back(std::move(tile));
+	}
+	m_strokeTiles.clear();
+	m_stats.strokeCompressedSize = stroke.size;
+	if (stroke.tiles.empty())
+		return;
+
+	// The strokes undone before this one can't be redone anymore
+	for (const Stroke& redo : m_redoStack)
+		m_historySize -= redo.size;
+	m_redoStack.clear();
+
+	m_historySize += stroke.size;
+	m_undoStack.push_back(std::move(stroke));
+	enforce_budget();
+}
+
+void TerrainBrush::apply_delta(const Stroke& stroke)
+{
+	std::vector<float> heights;
+	std::vector<uint32_t> delta;
+	for (const TileDelta& tile : stroke.tiles)
+	{
+		glm::ivec2 extent = tile.max - tile.min + 1;
+		uint32_t count = uint32_t(extent.x * extent.y);
+		heights.resize(count);
+		delta.resize(count);
+		m_stream->read_rect(tile.min, tile.max, heights.data());
+		decompress_delta(tile.data.data(), count, delta.data());
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			uint32_t bits;
+			memcpy(&bits, &heights[i], sizeof(uint32_t));
+			bits ^= delta[i];
+			memcpy(&heights[i], &bits, sizeof(uint32_t));
+		}
+		m_stream->write_rect(tile.min, tile.max, heights.data());
+	}
+}
+
+void TerrainBrush::undo()
+{
+	end_stroke();
+	if (m_undoStack.empty())
+		return;
+
+	Stroke stroke = std::move(m_undoStack.back());
+	m_undoStack.pop_back();
+	apply_delta(stroke);
+	m_redoStack.push_back(std::move(stroke));
+}
+
+void TerrainBrush::redo()
+{
+	end_stroke();
+	if (m_redoStack.empty())
+		return;
+
+	Stroke stroke = std::move(m_redoStack.back());
+	m_redoStack.pop_back();
+	apply_delta(stroke);
+	m_undoStack.push_back(std::move(stroke));
+}
+
+void TerrainBrush::clear_history()
+{
+	m_undoStack.clear();
+	m_redoStack.clear();
+	m_historySize = 0;
+}
+
+void TerrainBrush::set_history_budget(uint64_t budget)
+{
+	m_historyBudget = budget;
+	enforce_budget();
+}
+
+void TerrainBrush::enforce_budget()
+{
+	// Oldest first, the last stroke is always kept
+	while (m_historySize > m_historyBudget && m_undoStack.size() > 1)
+	{
+		m_historySize -= m_undoStack.front().size;
+		m_undoStack.pop_front();
+	}
+}
+
+void TerrainBrush::destroy()
+{
+	m_jobSystem->destroy();
+	clear_history();
+	m_strokeTiles.clear();
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include "core/base.h"
+#include "core/math.h"
+#include <vector>
+#include <deque>
+#include <unordered_map>
+
+class TerrainStream;
+class JobSystem;
+
+enum class BrushType
+{
+	Raise,
+	Lower,
+	// Blend toward the heights blurred by a separable gaussian
+	Smooth,
+	// Blend toward flattenHeight
+	Flatten,
+	// Add value noise
+	Noise
+};
+
+// Weight of the brush from 1 at its center to 0 at its radius
+enum class BrushFalloff
+{
+	Constant,
+	Linear,
+	Smooth,
+	Spherical
+};
+
+struct BrushSettings
+{
+	BrushType type = BrushType::Raise;
+	BrushFalloff falloff = BrushFalloff::Smooth;
+	// In texel
+	float radius = 32.0f;
+	// Height added at the center by raise, lower and noise, blend factor of smooth and flatten
+	float strength = 0.005f;
+	float flattenHeight = 0.5f;
+	// Standard deviation of the gaussian in texel, the kernel is cut at 3 sigma
+	float smoothSigma = 2.0f;
+	// Lattice cells per texel of the noise brush
+	float noiseFrequency = 0.05f;
+	uint32_t noiseSeed = 1;
+};
+
+// Sculpting of the heights of a TerrainStream
+// The footprint of the brush is cut in tiles computed in parallel and written back to the stream,
+// which adds them to its dirty rects. A stroke is undone with the xor of its tiles before and after
+// the stroke, stored compressed, so undo and redo are the same operation
+// The history assumes every edit of the stream goes through the brush
+class TerrainBrush
+{
+public:
+	// workerCount is the number of thread computing the tiles, 0 runs on the calling thread
+	// reference picks the scalar kernels, the SIMD ones are bit exact with them
+	TerrainBrush(Ref<TerrainStream> stream, uint32_t workerCount, bool reference = false);
+
+	// Every apply between begin_stroke and end_stroke is undone at once
+	void begin_stroke();
+	// center is in texel, an apply outside of a stroke is a stroke on its own
+	void apply(const glm::vec2& center, const BrushSettings& settings);
+	void end_stroke();
+	bool is_in_stroke() const { return m_inStroke; }
+
+	bool can_undo() const { return !m_undoStack.empty(); }
+	bool can_redo() const { return !m_redoStack.empty(); }
+	void undo();
+	void redo();
+	void clear_history();
+
+	// Compressed size of the undo and redo strokes, the oldest strokes are dropped over the budget
+	uint64_t get_history_size() const { return m_historySize; }
+	uint64_t get_history_budget() const { return m_historyBudget; }
+	void set_history_budget(uint64_t budget);
+	uint32_t get_undo_count() const { return static_cast<uint32_t>(m_undoStack.size()); }
+	uint32_t get_redo_count() const { return static_cast<uint32_t>(m_redoStack.size()); }
+
+	struct Stats
+	{
+		// Last apply
+		uint32_t tileCount = 0;
+		uint64_t texelCount = 0;
+		// Milliseconds
+		float time = 0.0f;
+		// Last stroke, byte of the tiles it touched against their compressed delta
+		uint64_t strokeRawSize = 0;
+		uint64_t strokeCompressedSize = 0;
+	};
+	const Stats& get_stats() const { return m_stats; }
+
+	uint32_t get_worker_count() const;
+	void destroy();
+
+	// Tiles are aligned on the texel grid, a tile is the unit of work and of undo
+	static const int TILE_SIZE = 64;
+private:
+	struct TileDelta
+	{
+		glm::ivec2 min;
+		glm::ivec2 max;
+		std::vector<uint8_t> data;
+	};
+
+	struct Stroke
+	{
+		std::vector<TileDelta> tiles;
+		uint64_t size = 0;
+	};
+
+	// Part of a tile covered by an apply, buffers are reused from one apply to the next
+	struct Tile
+	{
+		glm::ivec2 min;
+		glm::ivec2 max;
+		std::vector<float> heights;
+		// Heights around the tile read by the gaussian
+		std::vector<float> source;
+		std::vector<float> blurred;
+		std::vector<float> target;
+		std::vector<float> weights;
+	};
+
+	Ref<TerrainStream> m_stream;
+	Ref<JobSystem> m_jobSystem;
+	bool m_reference;
+	std::vector<Tile> m_tiles;
+	std::vector<float> m_gaussian;
+
+	bool m_inStroke = false;
+	// Heights before the stroke of the tiles it touched, keyed by tile y << 32 | tile x
+	std::unordered_map<uint64_t, std::vector<float>> m_strokeTiles;
+	std::deque<Stroke> m_undoStack;
+	std::vector<Stroke> m_redoStack;
+	uint64_t m_historySize = 0;
+	uint64_t m_historyBudget = 64ull * 1024 * 1024;
+	Stats m_stats;
+
+	// Texel rect of the tile clipped to the stream
+	void get_tile_rect(int tileX, int tileY, glm::ivec2& min, glm::ivec2& max) const;
+	void compute_tile(Tile& tile, const glm::vec2& center, const BrushSettings& settings) const;
+	// Xor the heights with the stroke delta, goes from after to before the stroke and back
+	void apply_delta(const Stroke& stroke);
+	void enforce_budget();
+};
@@ -3,16 +3,64 @@
 #include "renderer/context.h"
 #include "renderer/device.h"
 #include "renderer/buffer.h"
+#include "core/simd.h"
 
-float get_height(Ref<TerrainStream> stream, float x, float y, float maxHeight)
+#include <climits>
+
+// Texel read straight from the stream
+struct StreamTexels
+{
+	const TerrainStream* stream;
+
+	float get(int x, int y) const { return stream->get(x, y); }
+
+	const float* get_row(int y, int x0, int x1) const
+	{
+		if (x0 < 0 || x1 >= int(stream->get_width()))
+			return nullptr;
+		return stream->get_float_row(y);
+	}
+};
+
+// Texel rect decoded once before building a chunk, reads outside of it go to the stream
+struct TexelBlock
 {
+	const TerrainStream* stream;
+	std::vector<float> texels;
+	const float* data = nullptr;
+	glm::ivec2 min = glm::ivec2(0);
+	int width = 0;
+	int height = 0;
+
+	float get(int x, int y) const
+	{
+		uint32_t bx = uint32_t(x - min.x);
+		uint32_t by = uint32_t(y - min.y);
+		if (bx < uint32_t(width) && by < uint32_t(height))
+			return data[by * width + bx];
+		return stream->get(x, y);
+	}
+
+	// Pointer indexed by texel x if [x0, x1] of row y is in the block, nullptr otherwise
+	const float* get_row(int y, int x0, int x1) const
+	{
+		if (data == nullptr || y < min.y || y >= min.y + height || x0 < min.x || x1 >= min.x + width)
+			return nullptr;
+		return data + (y - min.y) * width - min.x;
+	}
+};
+
+template<typename Texels>
+float get_height(const Texels& texels, float x, float y, float maxHeight)
+{
+	const TerrainStream* stream = texels.stream;
 	int ix = static_cast<int>(x);
 	int iy = static_cast<int>(y);
 
-	float a = stream->get(ix, iy);
-	float b = stream->get(ix + 1, iy);
-	float c = stream->get(ix, iy + 1);
-	float d = stream->get(ix + 1, iy + 1);
+	float a = texels.get(ix, iy);
+	float b = texels.get(ix + 1, iy);
+	float c = texels.get(ix, iy + 1);
+	float d = texels.get(ix + 1, iy + 1);
 
 	float fx = x - ix;
 	float fy = y - iy;
@@ -50,58 +98,43 @@ uint32_t compress_normal(const glm::vec3& normal)
 	return result;
 }
 
-void TerrainChunk::create_mesh(Ref<TerrainStream> stream, const ivec3& terrainSize, uint32_t vertexCount, std::vector<VertexP4N1_Float>& vertices)
+// Grid vertices of create_mesh, Texels is where the heights are read from
+// Only the rows [firstRow, lastRow] of the grid are written, -1 and VERTEX_COUNT + 1 are the border
+template<typename Texels>
+static void build_vertices(const Texels& texels, const glm::ivec2& min, const glm::ivec2& max, const ivec3& terrainSize, int VERTEX_COUNT, int firstRow, int lastRow, std::vector<VertexP4N1_Float>& vertices)
 {
-	// Terrain Width and height
-	int VERTEX_COUNT = vertexCount;
-
-	uint32_t width = stream->get_width();
-	uint32_t height = stream->get_height();
+	uint32_t width = texels.stream->get_width();
+	uint32_t height = texels.stream->get_height();
 
 	float mX = 1.0f / float(terrainSize.x);
 	float mZ = 1.0f / float(terrainSize.z);
 
-	float rangeZ = float(m_max.y - m_min.y);
-	float rangeX = float(m_max.x - m_min.x);
+	float rangeZ = float(max.y - min.y);
+	float rangeX = float(max.x - min.x);
 	float maxHeight = float(terrainSize.y);
 
 	vertices.resize((VERTEX_COUNT + 3) * (VERTEX_COUNT + 3));
-	for (int z = -1; z <= VERTEX_COUNT + 1; ++z)
+	for (int z = firstRow; z <= lastRow; ++z)
 	{
 		float fz = float(z) / float(VERTEX_COUNT);
-		fz = (m_min.y + fz * rangeZ);
+		fz = (min.y + fz * rangeZ);
 		for (int x = -1; x <= VERTEX_COUNT + 1; ++x)
 		{
 			float fx = float(x) / float(VERTEX_COUNT);
-			fx = (m_min.x + fx * rangeX);
+			fx = (min.x + fx * rangeX);
 
 			float uvx = fx * mX * (width - 3) + 1.0f;
 			float uvz = fz * mZ * (height - 3) + 1.0f;
 
-			int ix = static_cast<int>(uvx);
-			int iz = static_cast<int>(uvz);
-
-			float h = get_height(stream, uvx, uvz, maxHeight);
-			float a = get_height(stream, uvx + 1.0f, uvz, maxHeight);
-			float b = get_height(stream, uvx - 1.0f, uvz, maxHeight);
-			float c = get_height(stream, uvx, uvz + 1.0f, maxHeight);
-			float d = get_height(stream, uvx, uvz - 1.0f, maxHeight);
-			
-			float nextHeight = h;
-			if (m_lodLevel > 0)
-			{
-				int scale = static_cast<int>(std::pow(2.0f, m_lodLevel));
-				glm::vec2 modPos = glm::vec2{ glm::mod(float(ix / scale), 2.0f), glm::mod(float(iz / scale), 2.0f) };
-				if (glm::length(glm::vec2(modPos)) > 0.5f)
-				{
-					float h1 = get_height(stream, ix + modPos.x, iz + modPos.y, maxHeight);
-					float h2 = get_height(stream, ix - modPos.x, iz - modPos.y, maxHeight);
-					nextHeight = (h1 + h2) * 0.5f;
-				}
-			}
+			float h = get_height(texels, uvx, uvz, maxHeight);
+			float a = get_height(texels, uvx + 1.0f, uvz, maxHeight);
+			float b = get_height(texels, uvx - 1.0f, uvz, maxHeight);
+			float c = get_height(texels, uvx, uvz + 1.0f, maxHeight);
+			float d = get_height(texels, uvx, uvz - 1.0f, maxHeight);
+
 
 			VertexP4N1_Float vertex;
-			vertex.position = glm::vec4(fx, h, fz, nextHeight);
+			vertex.position = glm::vec4(fx, h, fz, h);
 			vertex.normal = compress_normal(glm::normalize(glm::vec3(a - b, 1.0f, d - c)));
 
 			int index = (z + 1) * (VERTEX_COUNT + 3) + (x + 1);
@@ -109,45 +142,487 @@ void TerrainChunk::create_mesh(Ref<TerrainStream> stream, const ivec3& terrainSi
 		}
 	}
 
-	// Displace the skirt
-	if (m_lodLevel > 0)
+}
+
+#if defined(SIMD_SSE2)
+// Constants of get_height in every lane
+struct HeightConstants
+{
+	__m128 zero;
+	__m128 half;
+	__m128 one;
+	__m128 two;
+	__m128 three;
+	__m128 halfWidth;
+	__m128 halfHeight;
+	__m128 radius;
+	__m128 transitionRegion;
+	__m128 maxHeight;
+	__m128 negMaxHeight;
+};
+
+// Bilinear filtering and edge falloff of get_height for four samples
+// The operations are done in the same order as the scalar version so that both are bit exact
+static inline __m128 filter_height(const HeightConstants& k, __m128 a, __m128 b, __m128 c, __m128 d, __m128 fx, __m128 fy, __m128 distance2)
+{
+	__m128 h0 = _mm_add_ps(_mm_mul_ps(a, _mm_sub_ps(k.one, fx)), _mm_mul_ps(b, fx));
+	__m128 h1 = _mm_add_ps(_mm_mul_ps(c, _mm_sub_ps(k.one, fx)), _mm_mul_ps(d, fx));
+	__m128 h = _mm_add_ps(_mm_mul_ps(h0, _mm_sub_ps(k.one, fy)), _mm_mul_ps(h1, fy));
+	h = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(h, k.two), k.one), k.maxHeight);
+
+	__m128 distance = _mm_sub_ps(_mm_sqrt_ps(distance2), k.radius);
+	__m128 factor = _mm_div_ps(_mm_max_ps(distance, k.zero), k.transitionRegion);
+	factor = _mm_min_ps(_mm_max_ps(factor, k.zero), k.one);
+	factor = _mm_mul_ps(_mm_mul_ps(factor, factor), _mm_sub_ps(k.three, _mm_mul_ps(k.two, factor)));
+	__m128 faded = _mm_add_ps(_mm_mul_ps(h, _mm_sub_ps(k.one, factor)), _mm_mul_ps(k.negMaxHeight, factor));
+
+	__m128 inside = _mm_cmplt_ps(distance, k.zero);
+	return _mm_or_ps(_mm_and_ps(inside, h), _mm_andnot_ps(inside, faded));
+}
+
+// Row oriented build_vertices computing four vertices at once
+// Sample positions only depend on the column or on the row, they are computed once per chunk for the columns and once per row
+// The texels of a row of samples are read through a row pointer when they are in the decoded block
+template<typename Texels>
+static void build_vertices_simd(const Texels& texels, const glm::ivec2& min, const glm::ivec2& max, const ivec3& terrainSize, int VERTEX_COUNT, int firstRow, int lastRow, std::vector<VertexP4N1_Float>& vertices)
+{
+	uint32_t width = texels.stream->get_width();
+	uint32_t height = texels.stream->get_height();
+
+	float mX = 1.0f / float(terrainSize.x);
+	float mZ = 1.0f / float(terrainSize.z);
+
+	float rangeZ = float(max.y - min.y);
+	float rangeX = float(max.x - min.x);
+	float maxHeight = float(terrainSize.y);
+
+	const float transitionRegion = 200.0f;
+	float hW = float(width) * 0.5f;
+	float hH = float(height) * 0.5f;
+	float radius = glm::max(hW, hH) - transitionRegion;
+
+	HeightConstants k;
+	k.zero = _mm_setzero_ps();
+	k.half = _mm_set1_ps(0.5f);
+	k.one = _mm_set1_ps(1.0f);
+	k.two = _mm_set1_ps(2.0f);
+	k.three = _mm_set1_ps(3.0f);
+	k.halfWidth = _mm_set1_ps(hW);
+	k.halfHeight = _mm_set1_ps(hH);
+	k.radius = _mm_set1_ps(radius);
+	k.transitionRegion = _mm_set1_ps(transitionRegion);
+	k.maxHeight = _mm_set1_ps(maxHeight);
+	k.negMaxHeight = _mm_set1_ps(-maxHeight);
+
+	// Sample offsets, the vertex itself then its neighbours used for the normal
+	const float offsets[3] = { 0.0f, 1.0f, -1.0f };
+
+	// Padding lanes repeat the last column and are not written
+	int rowSize = VERTEX_COUNT + 3;
+	int columnCount = (rowSize + 3) & ~3;
+	std::vector<float> worldX(columnCount);
+	std::vector<int> columnIndex(3 * columnCount);
+	std::vector<float> columnFraction(3 * columnCount);
+	std::vector<float> columnDistance(3 * columnCount);
+	int columnMin = INT_MAX;
+	int columnMax = INT_MIN;
+	for (int c = 0; c < columnCount; ++c)
 	{
-		int z = 0;
-		const float skirtHeight = 0.0f;
-		for (int x = -1; x <= VERTEX_COUNT + 1; ++x)
+		int x = glm::min(c, rowSize - 1) - 1;
+		float fx = float(x) / float(VERTEX_COUNT);
+		fx = (min.x + fx * rangeX);
+		float uvx = fx * mX * (width - 3) + 1.0f;
+
+		worldX[c] = fx;
+		for (int o = 0; o < 3; ++o)
 		{
-			int index = (z + 1) * (VERTEX_COUNT + 3) + (x + 1);
-			VertexP4N1_Float& vertex = vertices[index];
-			vertex.position.y -= skirtHeight;
+			float sx = uvx + offsets[o];
+			int ix = static_cast<int>(sx);
+			float dx = sx - hW;
+			columnIndex[o * columnCount + c] = ix;
+			columnFraction[o * columnCount + c] = sx - ix;
+			columnDistance[o * columnCount + c] = dx * dx;
+			columnMin = glm::min(columnMin, ix);
+			columnMax = glm::max(columnMax, ix + 1);
 		}
+	}
 
-		z = VERTEX_COUNT + 1;
-		for (int x = -1; x <= VERTEX_COUNT + 1; ++x)
+	vertices.resize(rowSize * rowSize);
+	for (int z = firstRow; z <= lastRow; ++z)
+	{
+		float fz = float(z) / float(VERTEX_COUNT);
+		fz = (min.y + fz * rangeZ);
+		float uvz = fz * mZ * (height - 3) + 1.0f;
+
+		int rowIndex[3];
+		__m128 rowFraction[3];
+		__m128 rowDistance[3];
+		const float* rows[3][2];
+		for (int o = 0; o < 3; ++o)
 		{
-			int index = (z + 1) * (VERTEX_COUNT + 3) + (x + 1);
-			VertexP4N1_Float& vertex = vertices[index];
-			vertex.position.y -= skirtHeight;
+			float sz = uvz + offsets[o];
+			int iz = static_cast<int>(sz);
+			float dz = sz - hH;
+			rowIndex[o] = iz;
+			rowFraction[o] = _mm_set1_ps(sz - iz);
+			rowDistance[o] = _mm_set1_ps(dz * dz);
+			rows[o][0] = texels.get_row(iz, columnMin, columnMax);
+			rows[o][1] = texels.get_row(iz + 1, columnMin, columnMax);
 		}
 
-		int x = 0;
-		for (int z = -1; z <= VERTEX_COUNT + 1; ++z)
+		// Samples of column set o on row r, four columns starting at c
+		auto sample = [&](int o, int r, int c) {
+			const int* ix = &columnIndex[o * columnCount + c];
+			alignas(16) float a[4], b[4], cc[4], d[4];
+			const float* row0 = rows[r][0];
+			const float* row1 = rows[r][1];
+			if (row0 != nullptr && row1 != nullptr)
+			{
+				for (int i = 0; i < 4; ++i)
+				{
+					a[i] = row0[ix[i]];
+					b[i] = row0[ix[i] + 1];
+					cc[i] = row1[ix[i]];
+					d[i] = row1[ix[i] + 1];
+				}
+			}
+			else
+			{
+				int iz = rowIndex[r];
+				for (int i = 0; i < 4; ++i)
+				{
+					a[i] = texels.get(ix[i], iz);
+					b[i] = texels.get(ix[i] + 1, iz);
+					cc[i] = texels.get(ix[i], iz + 1);
+					d[i] = texels.get(ix[i] + 1, iz + 1);
+				}
+			}
+			__m128 fx = _mm_loadu_ps(&columnFraction[o * columnCount + c]);
+			__m128 distance2 = _mm_add_ps(_mm_loadu_ps(&columnDistance[o * columnCount + c]), rowDistance[r]);
+			return filter_height(k, _mm_load_ps(a), _mm_load_ps(b), _mm_load_ps(cc), _mm_load_ps(d), fx, rowFraction[r], distance2);
+		};
+
+		VertexP4N1_Float* row = vertices.data() + (z + 1) * rowSize;
+		for (int c = 0; c < columnCount; c += 4)
 		{
-			int index = (z + 1) * (VERTEX_COUNT + 3) + (x + 1);
-			VertexP4N1_Float& vertex = vertices[index];
-			vertex.position.y -= skirtHeight;
+			__m128 h = sample(0, 0, c);
+			__m128 a = sample(1, 0, c);
+			__m128 b = sample(2, 0, c);
+			__m128 cz = sample(0, 1, c);
+			__m128 d = sample(0, 2, c);
+
+			// normalize(vec3(a - b, 1.0f, d - c)) followed by compress_normal
+			__m128 nx = _mm_sub_ps(a, b);
+			__m128 nz = _mm_sub_ps(d, cz);
+			__m128 length2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), k.one), _mm_mul_ps(nz, nz));
+			__m128 invLength = _mm_div_ps(k.one, _mm_sqrt_ps(length2));
+			nx = _mm_mul_ps(nx, invLength);
+			nz = _mm_mul_ps(nz, invLength);
+			__m128 c255 = _mm_set1_ps(255.0f);
+			__m128i ux = _mm_cvttps_epi32(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(nx, k.half), k.half), c255));
+			__m128i uy = _mm_cvttps_epi32(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(invLength, k.half), k.half), c255));
+			__m128i uz = _mm_cvttps_epi32(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(nz, k.half), k.half), c255));
+			__m128i normal = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(ux, 16), _mm_slli_epi32(uy, 8)), uz);
+
+			alignas(16) float heights[4];
+			alignas(16) uint32_t normals[4];
+			_mm_store_ps(heights, h);
+			_mm_store_si128((__m128i*)normals, normal);
+
+			int laneCount = glm::min(4, rowSize - c);
+			for (int i = 0; i < laneCount; ++i)
+			{
+				VertexP4N1_Float& vertex = row[c + i];
+				vertex.position = glm::vec4(worldX[c + i], heights[i], fz, heights[i]);
+				vertex.normal = normals[i];
+			}
 		}
+	}
+}
+#endif
+
+// Morph target in position.w, the height the vertex has once the chunk is merged into its parent
+// Even vertices are on the parent grid and keep their height, odd ones move to the midpoint of their
+// neighbours along the parent edge, the anti diagonal of the index buffer for odd-odd vertices
+// It only depends on the grid so both sides of an edge shared by two chunks of the same lod agree
+// The morph of row z reads the heights of rows z - 1 to z + 1, they must have been built for [firstRow, lastRow]
+template<typename Texels>
+static void build_morph_targets(const Texels& texels, const glm::ivec2& min, const glm::ivec2& max, const ivec3& terrainSize, int VERTEX_COUNT, int firstRow, int lastRow, std::vector<VertexP4N1_Float>& vertices)
+{
+	uint32_t width = texels.stream->get_width();
+	uint32_t height = texels.stream->get_height();
+
+	float mX = 1.0f / float(terrainSize.x);
+	float mZ = 1.0f / float(terrainSize.z);
+
+	float rangeZ = float(max.y - min.y);
+	float rangeX = float(max.x - min.x);
+	float maxHeight = float(terrainSize.y);
 
-		x = VERTEX_COUNT + 1;
-		for (int z = -1; z <= VERTEX_COUNT + 1; ++z)
+	// Heights of [-2, VERTEX_COUNT + 2], the outer ring is only read by the border vertices
+	int gridSize = VERTEX_COUNT + 3;
+	int rowSize = VERTEX_COUNT + 5;
+	std::vector<float> heights(rowSize * rowSize);
+	for (int z = glm::max(firstRow - 1, -2); z <= glm::min(lastRow + 1, VERTEX_COUNT + 2); ++z)
+	{
+		float fz = float(z) / float(VERTEX_COUNT);
+		fz = (min.y + fz * rangeZ);
+		float uvz = fz * mZ * (height - 3) + 1.0f;
+		bool ringRow = z == -2 || z == VERTEX_COUNT + 2;
+		for (int x = -2; x <= VERTEX_COUNT + 2; ++x)
 		{
-			int index = (z + 1) * (VERTEX_COUNT + 3) + (x + 1);
-			VertexP4N1_Float& vertex = vertices[index];
-			vertex.position.y -= skirtHeight;
+			float& h = heights[(z + 2) * rowSize + (x + 2)];
+			if (ringRow || x == -2 || x == VERTEX_COUNT + 2)
+			{
+				float fx = float(x) / float(VERTEX_COUNT);
+				fx = (min.x + fx * rangeX);
+				float uvx = fx * mX * (width - 3) + 1.0f;
+				h = get_height(texels, uvx, uvz, maxHeight);
+			}
+			else
+				h = vertices[(z + 1) * gridSize + (x + 1)].position.y;
 		}
 	}
+
+	for (int z = firstRow; z <= lastRow; ++z)
+	{
+		for (int x = -1; x <= VERTEX_COUNT + 1; ++x)
+		{
+			int ox = x & 1;
+			int oz = z & 1;
+			if ((ox | oz) == 0)
+				continue;
+			if (ox & oz)
+				oz = -1;
+
+			float h1 = heights[(z + oz + 2) * rowSize + (x + ox + 2)];
+			float h2 = heights[(z - oz + 2) * rowSize + (x - ox + 2)];
+			vertices[(z + 1) * gridSize + (x + 1)].position.w = (h1 + h2) * 0.5f;
+		}
+	}
+}
+
+// Grid vertices from the SIMD kernel when available, reference picks the scalar version
+// Rows [firstRow, lastRow] are complete, the rows next to them are built as well for the morph targets
+template<typename Texels>
+static void build_grid(const Texels& texels, const glm::ivec2& min, const glm::ivec2& max, const ivec3& terrainSize, int VERTEX_COUNT, int firstRow, int lastRow, std::vector<VertexP4N1_Float>& vertices, bool reference)
+{
+	int firstVertexRow = glm::max(firstRow - 1, -1);
+	int lastVertexRow = glm::min(lastRow + 1, VERTEX_COUNT + 1);
+#if defined(SIMD_SSE2)
+	if (!reference)
+		build_vertices_simd(texels, min, max, terrainSize, VERTEX_COUNT, firstVertexRow, lastVertexRow, vertices);
+	else
+		build_vertices(texels, min, max, terrainSize, VERTEX_COUNT, firstVertexRow, lastVertexRow, vertices);
+#else
+	build_vertices(texels, min, max, terrainSize, VERTEX_COUNT, firstVertexRow, lastVertexRow, vertices);
+#endif
+	build_morph_targets(texels, min, max, terrainSize, VERTEX_COUNT, firstRow, lastRow, vertices);
+}
+
+static void build_mesh(Ref<TerrainStream> stream, const glm::ivec2& min, const glm::ivec2& max, const ivec3& terrainSize, uint32_t vertexCount, std::vector<VertexP4N1_Float>& vertices, bool reference)
+{
+	// Terrain Width and height
+	int VERTEX_COUNT = vertexCount;
+
+	// Fine lod reads most of the texel of their rect, it is decoded up front in a single pass
+	// Coarse lod only touch a few of them and keep reading the stream
+	TexelBlock block;
+	block.stream = stream.get();
+	glm::ivec2 texelMin, texelMax;
+	TerrainChunk::get_texel_rect(stream, min, max, terrainSize, vertexCount, texelMin, texelMax);
+	glm::ivec2 texelExtent = texelMax - texelMin + 1;
+	if (uint64_t(texelExtent.x) * texelExtent.y <= 4ull * (VERTEX_COUNT + 3) * (VERTEX_COUNT + 3))
+	{
+		block.min = texelMin;
+		block.width = texelExtent.x;
+		block.height = texelExtent.y;
+		block.texels.resize(block.width * block.height);
+		stream->read_rect(texelMin, texelMax, block.texels.data());
+		block.data = block.texels.data();
+		build_grid(block, min, max, terrainSize, VERTEX_COUNT, -1, VERTEX_COUNT + 1, vertices, reference);
+	}
+	else
+		build_grid(StreamTexels{ stream.get() }, min, max, terrainSize, VERTEX_COUNT, -1, VERTEX_COUNT + 1, vertices, reference);
+}
+
+void TerrainChunk::create_mesh(Ref<TerrainStream> stream, const glm::ivec2& min, const glm::ivec2& max, const ivec3& terrainSize, uint32_t vertexCount, std::vector<VertexP4N1_Float>& vertices)
+{
+	build_mesh(stream, min, max, terrainSize, vertexCount, vertices, false);
+}
+
+void TerrainChunk::create_mesh_reference(Ref<TerrainStream> stream, const glm::ivec2& min, const glm::ivec2& max, const ivec3& terrainSize, uint32_t vertexCount, std::vector<VertexP4N1_Float>& vertices)
+{
+	build_mesh(stream, min, max, terrainSize, vertexCount, vertices, true);
+}
+
+void TerrainChunk::create_mesh_rows(Ref<TerrainStream> stream, const glm::ivec2& min, const glm::ivec2& max, const ivec3& terrainSize, uint32_t vertexCount, int firstRow, int lastRow, std::vector<VertexP4N1_Float>& vertices)
+{
+	int VERTEX_COUNT = vertexCount;
+	ASSERT(firstRow >= -1 && firstRow <= lastRow && lastRow <= VERTEX_COUNT + 1);
+
+	// A few rows only touch a small part of the texel rect, they are read straight from the stream
+	build_grid(StreamTexels{ stream.get() }, min, max, terrainSize, VERTEX_COUNT, firstRow, lastRow, vertices, false);
+
+	int rowSize = VERTEX_COUNT + 3;
+	vertices.erase(vertices.begin() + (lastRow + 2) * rowSize, vertices.end());
+	vertices.erase(vertices.begin(), vertices.begin() + (firstRow + 1) * rowSize);
+}
+
+bool TerrainChunk::get_dirty_rows(Ref<TerrainStream> stream, const glm::ivec2& min, const glm::ivec2& max, const ivec3& terrainSize, uint32_t vertexCount, const glm::ivec2& texelMin, const glm::ivec2& texelMax, int& firstRow, int& lastRow)
+{
+	glm::ivec2 chunkTexelMin, chunkTexelMax;
+	get_texel_rect(stream, min, max, terrainSize, vertexCount, chunkTexelMin, chunkTexelMax);
+	if (glm::any(glm::greaterThan(texelMin, chunkTexelMax)) || glm::any(glm::lessThan(texelMax, chunkTexelMin)))
+		return false;
+
+	// Same mapping as build_vertices
+	int VERTEX_COUNT = vertexCount;
+	float mZ = 1.0f / float(terrainSize.z);
+	float rangeZ = float(max.y - min.y);
+	float height = float(stream->get_height());
+	auto get_uvz = [&](int z) {
+		float fz = float(z) / float(VERTEX_COUNT);
+		fz = (min.y + fz * rangeZ);
+		return fz * mZ * (height - 3) + 1.0f;
+	};
+
+	// Row z is filtered from the texel rows around z - 1 to z + 1 through its normal and its morph target
+	firstRow = INT_MAX;
+	lastRow = INT_MIN;
+	for (int z = -1; z <= VERTEX_COUNT + 1; ++z)
+	{
+		int rowMin = int(glm::floor(get_uvz(z - 1) - 1.0f));
+		int rowMax = int(glm::floor(get_uvz(z + 1) + 1.0f)) + 1;
+		if (rowMin > texelMax.y || rowMax < texelMin.y)
+			continue;
+		firstRow = glm::min(firstRow, z);
+		lastRow = glm::max(lastRow, z);
+	}
+	return firstRow <= lastRow;
+}
+
+static void get_uv_rect(Ref<TerrainStream> stream, const glm::ivec2& min, const glm::ivec2& max, const ivec3& terrainSize, uint32_t vertexCount, glm::vec2& uvMin, glm::vec2& uvMax)
+{
+	float width = float(stream->get_width());
+	float height = float(stream->get_height());
+
+	// Same mapping as create_mesh, the mesh has one extra vertex on each side and its morph targets one more
+	glm::vec2 spacing = glm::vec2(max - min) / float(vertexCount);
+	glm::vec2 worldMin = glm::vec2(min) - 2.0f * spacing;
+	glm::vec2 worldMax = glm::vec2(max) + 2.0f * spacing;
+	glm::vec2 scale = glm::vec2((width - 3) / float(terrainSize.x), (height - 3) / float(terrainSize.z));
+	uvMin = worldMin * scale + 1.0f;
+	uvMax = worldMax * scale + 1.0f;
+}
+
+void TerrainChunk::get_texel_rect(Ref<TerrainStream> stream, const glm::ivec2& min, const glm::ivec2& max, const ivec3& terrainSize, uint32_t vertexCount, glm::ivec2& texelMin, glm::ivec2& texelMax)
+{
+	glm::vec2 uvMin, uvMax;
+	get_uv_rect(stream, min, max, terrainSize, vertexCount, uvMin, uvMax);
+
+	// Bilinear filtering reads the next texel and the morph target its neighbours
+	texelMin = glm::ivec2(glm::floor(uvMin)) - 2;
+	texelMax = glm::ivec2(glm::floor(uvMax)) + 2;
+}
+
+glm::vec2 TerrainChunk::get_height_bounds(Ref<TerrainStream> stream, const glm::ivec2& min, const glm::ivec2& max, const ivec3& terrainSize, uint32_t vertexCount)
+{
+	float width = float(stream->get_width());
+	float height = float(stream->get_height());
+	float maxHeight = float(terrainSize.y);
+
+	glm::vec2 uvMin, uvMax;
+	get_uv_rect(stream, min, max, terrainSize, vertexCount, uvMin, uvMax);
+
+	glm::ivec2 texelMin, texelMax;
+	get_texel_rect(stream, min, max, terrainSize, vertexCount, texelMin, texelMax);
+	glm::vec2 range = stream->get_height_range(texelMin, texelMax);
+	range = (range * 2.0f - 1.0f) * maxHeight;
+
+	// Outside of the radius the height fades to -maxHeight, see get_height
+	const float transitionRegion = 200.0f;
+	glm::vec2 center = glm::vec2(width, height) * 0.5f;
+	float radius = glm::max(center.x, center.y) - transitionRegion;
+	glm::vec2 farthest = glm::max(glm::abs(uvMin - center), glm::abs(uvMax - center));
+	if (glm::length(farthest) > radius)
+		range.x = -maxHeight;
+	return range;
+}
+
+float TerrainChunk::sample_surface(Ref<TerrainStream> stream, const glm::vec2& position, const ivec3& terrainSize, glm::vec3* normal)
+{
+	StreamTexels texels = { stream.get() };
+	float maxHeight = float(terrainSize.y);
+	float mX = 1.0f / float(terrainSize.x);
+	float mZ = 1.0f / float(terrainSize.z);
+
+	// Same mapping as create_mesh
+	float uvx = position.x * mX * (stream->get_width() - 3) + 1.0f;
+	float uvz = position.y * mZ * (stream->get_height() - 3) + 1.0f;
+	if (normal != nullptr)
+	{
+		float a = get_height(texels, uvx + 1.0f, uvz, maxHeight);
+		float b = get_height(texels, uvx - 1.0f, uvz, maxHeight);
+		float c = get_height(texels, uvx, uvz + 1.0f, maxHeight);
+		float d = get_height(texels, uvx, uvz - 1.0f, maxHeight);
+		*normal = glm::normalize(glm::vec3(a - b, 1.0f, d - c));
+	}
+	return get_height(texels, uvx, uvz, maxHeight);
+}
+
+uint16_t TerrainChunk::encode_octahedral(const glm::vec3& normal)
+{
+	// Project on the octahedron, the lower half is folded over the upper one
+	glm::vec3 n = normal / (glm::abs(normal.x) + glm::abs(normal.y) + glm::abs(normal.z));
+	glm::vec2 e = glm::vec2(n.x, n.z);
+	if (n.y < 0.0f)
+	{
+		glm::vec2 s = glm::vec2(e.x >= 0.0f ? 1.0f : -1.0f, e.y >= 0.0f ? 1.0f : -1.0f);
+		e = (1.0f - glm::abs(glm::vec2(e.y, e.x))) * s;
+	}
+	glm::uvec2 q = glm::uvec2(glm::round(glm::clamp(e * 0.5f + 0.5f, 0.0f, 1.0f) * 255.0f));
+	return uint16_t(q.x | (q.y << 8));
+}
+
+glm::vec3 TerrainChunk::decode_octahedral(uint16_t normal)
+{
+	glm::vec2 e = glm::vec2(float(normal & 0xFF), float(normal >> 8)) / 255.0f * 2.0f - 1.0f;
+	glm::vec3 n = glm::vec3(e.x, 1.0f - glm::abs(e.x) - glm::abs(e.y), e.y);
+	float t = glm::max(-n.y, 0.0f);
+	n.x += n.x >= 0.0f ? -t : t;
+	n.z += n.z >= 0.0f ? -t : t;
+	return glm::normalize(n);
+}
+
+void TerrainChunk::compress_mesh(const std::vector<VertexP4N1_Float>& vertices, float maxHeight, std::vector<TerrainVertex>& compressed, glm::vec2& heightRange)
+{
+	heightRange = glm::vec2(FLT_MAX, -FLT_MAX);
+	for (auto& vertex : vertices)
+	{
+		heightRange.x = glm::min(heightRange.x, glm::min(vertex.position.y, vertex.position.w));
+		heightRange.y = glm::max(heightRange.y, glm::max(vertex.position.y, vertex.position.w));
+	}
+
+	// Every chunk uses the same steps, a vertex shared by two chunks decodes to the same height
+	float scale = 65535.0f / (2.0f * maxHeight);
+
+	compressed.resize(vertices.size());
+	for (size_t i = 0; i < vertices.size(); ++i)
+	{
+		const VertexP4N1_Float& vertex = vertices[i];
+		TerrainVertex& result = compressed[i];
+		result.height = uint16_t(glm::clamp((vertex.position.y + maxHeight) * scale + 0.5f, 0.0f, 65535.0f));
+		result.morphHeight = uint16_t(glm::clamp((vertex.position.w + maxHeight) * scale + 0.5f, 0.0f, 65535.0f));
+
+		// create_mesh normal is packed as 8 bits per axis
+		glm::vec3 normal = glm::vec3((vertex.normal >> 16) & 0xFF, (vertex.normal >> 8) & 0xFF, vertex.normal & 0xFF);
+		normal = normal / 255.0f * 2.0f - 1.0f;
+		result.normal = encode_octahedral(glm::normalize(normal));
+	}
 }
 
-TerrainChunk::TerrainChunk(Ref<VertexBufferView> vb) : vb(vb)
+TerrainChunk::TerrainChunk(uint32_t poolIndex) : m_poolIndex(poolIndex)
 {
 	//m_mesh = new Mesh();
 	m_id = UINT32_MAX;
@@ -162,14 +637,37 @@ void TerrainChunk::initialize(const glm::ivec2& min, const glm::ivec2& max, uint
 	m_loaded = false;
 	m_id = id;
 	m_lastFrameIndex = lastFrameIndex;
+	m_buildId.fetch_add(1, std::memory_order_release);
+}
+
+void TerrainChunk::upload(Context* context, ShaderStorageBuffer* vertexBuffer, std::vector<TerrainVertex>& vertices, const glm::vec2& heightRange)
+{
+	uint32_t size = static_cast<uint32_t>(vertices.size() * sizeof(TerrainVertex));
+	context->copy(vertexBuffer, vertices.data(), m_poolIndex * size, size);
+	set_loaded(heightRange);
 }
 
-void TerrainChunk::build(Context* context, Ref<TerrainStream> stream, const glm::ivec3& terrainSize, uint32_t vertexCount)
+void TerrainChunk::upload_rows(Context* context, ShaderStorageBuffer* vertexBuffer, std::vector<TerrainVertex>& vertices, uint32_t chunkVertexCount, uint32_t firstVertex, const glm::vec2& heightRange)
 {
-	std::vector<VertexP4N1_Float> vertices;
-	create_mesh(stream, terrainSize, vertexCount, vertices);
-	//m_mesh->finalize(context);
-	ASSERT(vertices.size() * sizeof(VertexP4N1_Float) == vb->size);
-	context->copy(vb->buffer, vertices.data(), vb->offset, vb->size);
+	ASSERT(firstVertex + vertices.size() <= chunkVertexCount);
+	uint32_t offset = (m_poolIndex * chunkVertexCount + firstVertex) * sizeof(TerrainVertex);
+	context->copy(vertexBuffer, vertices.data(), offset, static_cast<uint32_t>(vertices.size() * sizeof(TerrainVertex)));
+
+	// The rows left as they are keep their heights, the range can only grow until the chunk is built again
+	set_loaded(glm::vec2(glm::min(m_minHeight, heightRange.x), glm::max(m_maxHeight, heightRange.y)));
+}
+
+void TerrainChunk::set_loaded(const glm::vec2& heightRange)
+{
+	m_minHeight = heightRange.x;
+	m_maxHeight = heightRange.y;
 	m_loaded = true;
 }
+
+TerrainChunkGpuData TerrainChunk::get_gpu_data(float maxHeight) const
+{
+	TerrainChunkGpuData data;
+	data.rect = glm::vec4(float(m_min.x), float(m_min.y), float(m_max.x - m_min.x), float(m_max.y - m_min.y));
+	data.heightRange = glm::vec4(-maxHeight, 2.0f * maxHeight / 65535.0f, float(m_lodLevel), 0.0f);
+	return data;
+}
@@ -4,13 +4,12 @@
 #include "core/math.h"
 
 #include <vector>
+#include <atomic>
 
 class TerrainStream;
 class Mesh;
 class Context;
-
-struct VertexBufferView;
-class IndexBuffer;
+class ShaderStorageBuffer;
 
 struct VertexP4N1_Float
 {
@@ -18,35 +17,118 @@ struct VertexP4N1_Float
 	uint32_t normal;
 };
 
+// Unit normal packed in 8 bits per axis, x in the bits 16 to 23, the normal of VertexP4N1_Float
+uint32_t compress_normal(const glm::vec3& normal);
+
+// Vertex stored on the gpu, x and z are rebuilt from the vertex index in the chunk grid
+// see terrain_vertex.h for the decoding
+struct TerrainVertex
+{
+	// Quantized over the height range of the terrain
+	uint16_t height;
+	uint16_t morphHeight;
+	// Octahedral encoding, 8 bits per axis
+	uint16_t normal;
+};
+
+// Per chunk data of the shader, matches TerrainChunkData in terrain_vertex.h
+struct TerrainChunkGpuData
+{
+	// xy min, zw size
+	glm::vec4 rect;
+	// x height of a quantized 0, y height of a quantization step, z lod level
+	glm::vec4 heightRange;
+};
+
+// Where the terrain vertex shader gets the chunk vertices from
+enum class TerrainMeshMode
+{
+	// Built by create_mesh on the worker and uploaded as TerrainVertex
+	CpuMesh,
+	// Computed in the vertex shader from the heightmap uploaded once as a texture
+	VertexTextureFetch
+};
+
 class TerrainChunk
 {
 public:
-	TerrainChunk(Ref<VertexBufferView> vb);
+	TerrainChunk(uint32_t poolIndex);
+
+	// Only depends on its argument so it can be called from worker thread
+	static void create_mesh(Ref<TerrainStream> stream, const glm::ivec2& min, const glm::ivec2& max, const ivec3& terrainSize, uint32_t vertexCount, std::vector<VertexP4N1_Float>& vertices);
+	// Scalar version of create_mesh, the SIMD one is bit exact with it
+	static void create_mesh_reference(Ref<TerrainStream> stream, const glm::ivec2& min, const glm::ivec2& max, const ivec3& terrainSize, uint32_t vertexCount, std::vector<VertexP4N1_Float>& vertices);
+
+	// Rows [firstRow, lastRow] of the vertex grid of create_mesh, the border rows are -1 and vertexCount + 1
+	// vertices only holds these rows, bit exact with the same rows of create_mesh
+	static void create_mesh_rows(Ref<TerrainStream> stream, const glm::ivec2& min, const glm::ivec2& max, const ivec3& terrainSize, uint32_t vertexCount, int firstRow, int lastRow, std::vector<VertexP4N1_Float>& vertices);
+	// Rows of the vertex grid of create_mesh reading a texel of [texelMin, texelMax], false if none of them does
+	static bool get_dirty_rows(Ref<TerrainStream> stream, const glm::ivec2& min, const glm::ivec2& max, const ivec3& terrainSize, uint32_t vertexCount, const glm::ivec2& texelMin, const glm::ivec2& texelMax, int& firstRow, int& lastRow);
+
+	// Texel rect [texelMin, texelMax] read by create_mesh for this area
+	static void get_texel_rect(Ref<TerrainStream> stream, const glm::ivec2& min, const glm::ivec2& max, const ivec3& terrainSize, uint32_t vertexCount, glm::ivec2& texelMin, glm::ivec2& texelMax);
+
+	// Quantize the vertices of create_mesh in TerrainVertex over [-maxHeight, maxHeight], heightRange is the range of the mesh
+	static void compress_mesh(const std::vector<VertexP4N1_Float>& vertices, float maxHeight, std::vector<TerrainVertex>& compressed, glm::vec2& heightRange);
+	static uint16_t encode_octahedral(const glm::vec3& normal);
+	static glm::vec3 decode_octahedral(uint16_t normal);
+
+	// Conservative world space height range of the mesh create_mesh would build for this area
+	static glm::vec2 get_height_bounds(Ref<TerrainStream> stream, const glm::ivec2& min, const glm::ivec2& max, const ivec3& terrainSize, uint32_t vertexCount);
+
+	// World space height of the surface built by create_mesh at any position, and its normal if requested
+	static float sample_surface(Ref<TerrainStream> stream, const glm::vec2& position, const ivec3& terrainSize, glm::vec3* normal = nullptr);
 
 	// reinitialize current chunk
 	void initialize(const glm::ivec2& min, const glm::ivec2& max, uint32_t lod_level, uint32_t id, uint64_t lastFrameIndex);
-	void build(Context* context, Ref<TerrainStream> stream, const glm::ivec3& terrainSize, uint32_t vertexCount);
+	// Upload the vertices generated by compress_mesh in the slot of the chunk, called from the render thread
+	void upload(Context* context, ShaderStorageBuffer* vertexBuffer, std::vector<TerrainVertex>& vertices, const glm::vec2& heightRange);
+	// Overwrite part of the slot from firstVertex, heightRange is the range of the new vertices
+	void upload_rows(Context* context, ShaderStorageBuffer* vertexBuffer, std::vector<TerrainVertex>& vertices, uint32_t chunkVertexCount, uint32_t firstVertex, const glm::vec2& heightRange);
+	// Mark the chunk as ready to draw without vertices, used when the heights are fetched from a texture
+	void set_loaded(const glm::vec2& heightRange);
+	// Data read by the shader to decode the uploaded vertices
+	TerrainChunkGpuData get_gpu_data(float maxHeight) const;
 	bool is_loaded() const { return m_loaded; }
+	// The content of the slot has been lost, the chunk has to be built again
+	void unload() { m_loaded = false; }
+
+	// A pinned chunk is never evicted from the pool, held while its mesh is being built
+	// Can be released from worker thread
+	void pin() { m_pinCount.fetch_add(1, std::memory_order_relaxed); }
+	void unpin() { m_pinCount.fetch_sub(1, std::memory_order_release); }
+	bool is_pinned() const { return m_pinCount.load(std::memory_order_acquire) > 0; }
+
+	// Incremented everytime the chunk is reinitialized, used to discard stale mesh build
+	uint32_t get_build_id() const { return m_buildId.load(std::memory_order_acquire); }
+	// The heights have changed under a build in flight, its result is discarded like after a reinitialization
+	void invalidate_build() { m_buildId.fetch_add(1, std::memory_order_release); }
 
 	uint32_t get_id() const { return m_id; }
+	// Slot of the chunk in the shared vertex and chunk buffer
+	uint32_t get_pool_index() const { return m_poolIndex; }
 	uint64_t get_last_frame_index() const { return m_lastFrameIndex; }
 	void set_last_frame_index(uint64_t index) { m_lastFrameIndex = index; }
 
 	glm::ivec2 get_min() const { return m_min; }
 	glm::ivec2 get_max() const { return m_max; }
-	uint32_t get_lod_level() { return m_lodLevel; }
+	uint32_t get_lod_level() const { return m_lodLevel; }
 	glm::ivec2 get_center() const { return (m_min + m_max) / 2; }
+	// Height range of the uploaded mesh, including the morph target
+	float get_min_height() const { return m_minHeight; }
+	float get_max_height() const { return m_maxHeight; }
 
-	Ref<VertexBufferView> vb;
 private:
 	uint64_t m_lastFrameIndex;
+	uint32_t m_poolIndex;
 	uint32_t m_id;
 	glm::ivec2 m_min;
 	glm::ivec2 m_max;
 	uint32_t m_lodLevel;
+	float m_minHeight = 0.0f;
+	float m_maxHeight = 0.0f;
 
 	bool m_loaded = false;
-
-	void create_mesh(Ref<TerrainStream> stream, const ivec3& terrainSize, uint32_t vertexCount, std::vector<VertexP4N1_Float>& vertices);
-
+	std::atomic<uint32_t> m_buildId = 0;
+	std::atomic<uint32_t> m_pinCount = 0;
 };
\ No newline at end of file
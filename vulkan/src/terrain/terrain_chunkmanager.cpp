@@ -6,97 +6,588 @@
 #include "renderer/context.h"
 #include "renderer/device.h"
 #include "renderer/buffer.h"
+#include "renderer/shaderbinding.h"
+#include "renderer/texture.h"
+#include "core/job_system.h"
+#include "core/hash.h"
 #include <algorithm>
+#include <chrono>
 
-TerrainChunk* TerrainChunkManager::get_free_chunk()
+void TerrainChunkManager::lru_remove(uint32_t index)
+{
+	LruLink& link = m_lruLinks[index];
+	if (link.prev != UINT32_MAX)
+		m_lruLinks[link.prev].next = link.next;
+	else
+		m_lruHead = link.next;
+	if (link.next != UINT32_MAX)
+		m_lruLinks[link.next].prev = link.prev;
+	else
+		m_lruTail = link.prev;
+	link = LruLink{};
+}
+
+void TerrainChunkManager::lru_push_front(uint32_t index)
+{
+	LruLink& link = m_lruLinks[index];
+	link.prev = UINT32_MAX;
+	link.next = m_lruHead;
+	if (m_lruHead != UINT32_MAX)
+		m_lruLinks[m_lruHead].prev = index;
+	else
+		m_lruTail = index;
+	m_lruHead = index;
+}
+
+TerrainChunk* TerrainChunkManager::get_free_chunk(uint64_t frameIndex)
 {
 	if (m_availableList.size() > 0)
 	{
 		uint32_t availableIndex = m_availableList.top();
 		m_availableList.pop();
+		lru_push_front(availableIndex);
 		return m_chunkPool[availableIndex];
 	}
-	else
+
+	// The chunks used during the frame are all in front of the other ones, once the tail has been used
+	// the only ones left are pinned. They are moved to the front so that a pass skips each of them once
+	uint32_t skipCount = 0;
+	while (m_lruTail != UINT32_MAX && skipCount < m_poolSize)
 	{
-		auto found = std::min_element(m_chunkPool.begin(), m_chunkPool.end(), [](const TerrainChunk* lhs, const TerrainChunk* rhs) {
-			return lhs->get_last_frame_index() < rhs->get_last_frame_index();
-			});
-		ASSERT(found != m_chunkPool.end());
-		return *found;
+		uint32_t index = m_lruTail;
+		TerrainChunk* chunk = m_chunkPool[index];
+		if (chunk->get_last_frame_index() == frameIndex)
+			break;
+
+		lru_remove(index);
+		lru_push_front(index);
+		if (!chunk->is_pinned())
+		{
+			m_frameStats.evicted++;
+			return chunk;
+		}
+		m_frameStats.pinnedSkipped++;
+		skipCount++;
 	}
+
+	m_frameStats.exhausted++;
+	return nullptr;
+}
+
+void TerrainChunkManager::touch(TerrainChunk* chunk, uint64_t frameIndex)
+{
+	chunk->set_last_frame_index(frameIndex);
+	uint32_t index = chunk->get_pool_index();
+	if (m_lruHead == index)
+		return;
+	lru_remove(index);
+	lru_push_front(index);
 }
 
-void populate_index_buffer(Context* context, IndexBuffer* ib, uint32_t vertexCount, uint32_t& indexCount)
+// Index of the chunk grid without its border for a set of edges stitched to a coarser neighbour
+// The odd vertices of a stitched edge are collapsed on an even neighbour, the edge then matches the one
+// of the neighbour without T-junction and the triangles that become degenerate are dropped
+// The direction alternates around the chunk so that two stitched edges never leave a flat triangle in a corner
+static void build_chunk_indices(uint32_t vertexCount, uint32_t stitchMask, std::vector<uint16_t>& indices)
 {
-	// Skirt on each side
-	std::vector<unsigned int> indices;
-	for (uint32_t z = 0; z < vertexCount + 2; ++z)
+	uint32_t rowSize = vertexCount + 3;
+	auto get_index = [&](uint32_t x, uint32_t z) {
+		if ((stitchMask & TerrainChunkManager::STITCH_NORTH) && z == 0 && (x & 1))
+			x--;
+		else if ((stitchMask & TerrainChunkManager::STITCH_SOUTH) && z == vertexCount && (x & 1))
+			x++;
+		else if ((stitchMask & TerrainChunkManager::STITCH_EAST) && x == vertexCount && (z & 1))
+			z++;
+		else if ((stitchMask & TerrainChunkManager::STITCH_WEST) && x == 0 && (z & 1))
+			z--;
+		// Skip the border of the vertex grid
+		return uint16_t((z + 1) * rowSize + (x + 1));
+	};
+
+	auto add_triangle = [&](uint16_t a, uint16_t b, uint16_t c) {
+		if (a == b || b == c || a == c)
+			return;
+		indices.push_back(a);
+		indices.push_back(b);
+		indices.push_back(c);
+	};
+
+	for (uint32_t z = 0; z < vertexCount; ++z)
 	{
-		for (uint32_t x = 0; x < vertexCount + 2; ++x)
+		for (uint32_t x = 0; x < vertexCount; ++x)
 		{
-			uint32_t i0 = z * (vertexCount + 3) + x;
-			uint32_t i1 = i0 + 1;
-			uint32_t i2 = i0 + (vertexCount + 3);
-			uint32_t i3 = i2 + 1;
-
-			indices.push_back(i2);
-			indices.push_back(i1);
-			indices.push_back(i0);
-
-			indices.push_back(i2);
-			indices.push_back(i3);
-			indices.push_back(i1);
+			uint16_t i0 = get_index(x, z);
+			uint16_t i1 = get_index(x + 1, z);
+			uint16_t i2 = get_index(x, z + 1);
+			uint16_t i3 = get_index(x + 1, z + 1);
+
+			add_triangle(i2, i1, i0);
+			add_triangle(i2, i3, i1);
 		}
 	}
-	context->copy(ib, indices.data(), 0, static_cast<uint32_t>(indices.size()) * sizeof(uint32_t));
-	indexCount = static_cast<uint32_t>(indices.size());
 }
 
-TerrainChunkManager::TerrainChunkManager(Context* context, uint32_t poolSize)  : POOL_SIZE(poolSize)
+void populate_index_buffer(Context* context, IndexBuffer* ib, uint32_t vertexCount, uint32_t* firstIndex, uint32_t* indexCount)
+{
+	std::vector<uint16_t> indices;
+	for (uint32_t mask = 0; mask < TerrainChunkManager::STITCH_VARIANT_COUNT; ++mask)
+	{
+		firstIndex[mask] = static_cast<uint32_t>(indices.size());
+		build_chunk_indices(vertexCount, mask, indices);
+		indexCount[mask] = static_cast<uint32_t>(indices.size()) - firstIndex[mask];
+	}
+	context->copy(ib, indices.data(), 0, static_cast<uint32_t>(indices.size()) * sizeof(uint16_t));
+}
+
+// Grid and terrain parameters before the chunk data, see TerrainChunkBuffer in terrain_vertex.h
+static const uint32_t CHUNK_BUFFER_HEADER_SIZE = 3 * sizeof(glm::vec4);
+// Around 600 chunks of 128 vertices on a side, four times the pool
+static const uint64_t MESH_CACHE_MEMORY_BUDGET = 64ull * 1024 * 1024;
+
+static Texture* create_heightmap_texture(Context* context, uint32_t width, uint32_t height, float* texels)
+{
+	TextureDescription desc = TextureDescription::Initialize(width, height);
+	desc.format = Format::R32Float;
+	desc.flags = TextureFlag::Sampler | TextureFlag::TransferDst;
+	// Read with texelFetch and filtered in the shader like create_mesh
+	SamplerDescription sampler = SamplerDescription::Initialize();
+	sampler.minFilter = sampler.magFilter = TextureFilter::Nearest;
+	desc.sampler = &sampler;
+	Texture* texture = Device::create_texture(desc);
+	context->copy(texture, texels, width * height * sizeof(float));
+	return texture;
+}
+
+TerrainChunkManager::TerrainChunkManager(Context* context, uint32_t poolSize, uint32_t workerCount, float timeBudget, TerrainMeshMode mode, Ref<TerrainStream> stream, glm::ivec3 terrainSize) : m_poolSize(poolSize), m_mode(mode), m_timeBudget(timeBudget)
 {
-	m_chunkPool.resize(POOL_SIZE);
+	m_jobSystem = CreateRef<JobSystem>(workerCount);
+
+	// Enough to keep every worker busy while the queue is refilled
+	m_maxPendingBuilds = std::max(2u, m_jobSystem->get_worker_count() * 2);
+
+	m_terrainParams[0] = glm::vec4(float(terrainSize.x), float(terrainSize.z), float(terrainSize.y), 0.0f);
+	m_terrainParams[1] = glm::vec4(0.0f);
 
-	uint32_t chunkVBSize = (m_vertexCount + 3) * (m_vertexCount + 3) * sizeof(VertexP4N1_Float);
-	this->vb = Device::create_vertexbuffer(BufferUsageHint::StaticDraw, chunkVBSize * POOL_SIZE);
+	if (m_mode == TerrainMeshMode::VertexTextureFetch)
+	{
+		ASSERT_MSG(!stream->is_tiled(), "Vertex texture fetch needs the whole heightmap in memory");
+		uint32_t width = stream->get_width();
+		uint32_t height = stream->get_height();
+		std::vector<float> texels(uint64_t(width) * height);
+		stream->read_rect(glm::ivec2(0), glm::ivec2(width - 1, height - 1), texels.data());
+		heightmap = create_heightmap_texture(context, width, height, texels.data());
+		m_heightmapMemory = texels.size() * sizeof(float);
+	}
+	else
+	{
+		float texel = 0.0f;
+		heightmap = create_heightmap_texture(context, 1, 1, &texel);
+		m_heightmapMemory = sizeof(float);
 
-	uint32_t chunkIndexSize = (m_vertexCount + 2) * (m_vertexCount + 2) * 6 * sizeof(uint32_t);
-	ib = Device::create_indexbuffer(BufferUsageHint::StaticDraw, IndexType::UnsignedInt, chunkIndexSize);
-	populate_index_buffer(context, ib, m_vertexCount, indexCount);
+		// Everything the mesh depends on beside the key
+		uint64_t layoutHash = hash_combine(m_vertexCount, (uint64_t(uint32_t(terrainSize.x)) << 32) | uint32_t(terrainSize.z));
+		layoutHash = hash_combine(layoutHash, uint32_t(terrainSize.y));
+		m_meshCache = CreateRef<TerrainMeshCache>(get_chunk_vertex_count(), layoutHash, MESH_CACHE_MEMORY_BUDGET);
+	}
+
+	m_bindings = Device::create_shader_bindings();
+	m_bindings->set_texture_sampler(heightmap, 8);
+	create_pool_buffers(context);
+
+	// Every variant is at most the full grid, vertices of a chunk are indexed with 16 bits
+	ASSERT_MSG(get_chunk_vertex_count() <= 65536, "Chunk vertices are indexed with 16 bits");
+	uint32_t chunkIndexSize = m_vertexCount * m_vertexCount * 6 * sizeof(uint16_t) * STITCH_VARIANT_COUNT;
+	ib = Device::create_indexbuffer(BufferUsageHint::StaticDraw, IndexType::UnsignedShort, chunkIndexSize);
+	populate_index_buffer(context, ib, m_vertexCount, m_firstIndex, m_indexCount);
+	m_totalIndexCount = m_firstIndex[STITCH_VARIANT_COUNT - 1] + m_indexCount[STITCH_VARIANT_COUNT - 1];
 	
-	for (uint32_t i = 0; i < POOL_SIZE; ++i)
+	m_chunkPool.resize(m_poolSize);
+	m_dispatchedBuildId.resize(m_poolSize, UINT32_MAX);
+	m_lruLinks.resize(m_poolSize);
+	for (uint32_t i = 0; i < m_poolSize; ++i)
+	{
+		m_chunkPool[i] = new TerrainChunk(i);
+		m_availableList.push(i);
+	}
+}
+
+void TerrainChunkManager::create_pool_buffers(Context* context)
+{
+	// Vertices are pulled from a storage buffer in the vertex shader, it is read as uint
+	// Texture fetch mode never reads it but the shader still needs a buffer bound
+	uint32_t vertexBufferSize = get_chunk_vertex_count() * sizeof(TerrainVertex) * m_poolSize;
+	if (m_mode == TerrainMeshMode::VertexTextureFetch)
+		vertexBufferSize = sizeof(uint32_t);
+	vertexBuffer = Device::create_shader_storage_buffer(BufferUsageHint::StaticDraw, (vertexBufferSize + 3) & ~3u);
+
+	// Chunk data is written when the chunk is uploaded
+	chunkBuffer = Device::create_shader_storage_buffer(BufferUsageHint::StaticDraw, CHUNK_BUFFER_HEADER_SIZE + m_poolSize * sizeof(TerrainChunkGpuData));
+	glm::uvec4 grid = glm::uvec4(m_vertexCount, m_vertexCount + 3, get_chunk_vertex_count(), m_mode == TerrainMeshMode::VertexTextureFetch ? 1 : 0);
+	context->copy(chunkBuffer, &grid, 0, sizeof(glm::uvec4));
+	context->copy(chunkBuffer, m_terrainParams, sizeof(glm::uvec4), sizeof(m_terrainParams));
+
+	m_bindings->set_buffer(chunkBuffer, 6);
+	m_bindings->set_buffer(vertexBuffer, 7);
+}
+
+void TerrainChunkManager::resize_pool(Context* context, Ref<TerrainStream> stream, uint32_t poolSize)
+{
+	ASSERT_MSG(poolSize >= m_poolSize, "The chunk pool can only grow");
+	if (poolSize == m_poolSize)
+		return;
+
+	// Frames in flight still read the chunk buffers
+	Device::wait_idle();
+	Device::destroy_buffer(vertexBuffer);
+	Device::destroy_buffer(chunkBuffer);
+
+	uint32_t previousSize = m_poolSize;
+	m_poolSize = poolSize;
+	create_pool_buffers(context);
+
+	m_chunkPool.resize(m_poolSize);
+	m_dispatchedBuildId.resize(m_poolSize, UINT32_MAX);
+	m_lruLinks.resize(m_poolSize);
+	for (uint32_t i = previousSize; i < m_poolSize; ++i)
 	{
-		Ref<VertexBufferView> vb = CreateRef<VertexBufferView>();
-		vb->buffer = this->vb;
-		vb->offset = i * chunkVBSize;
-		vb->size = chunkVBSize;
-		m_chunkPool[i] = new TerrainChunk(vb);
+		m_chunkPool[i] = new TerrainChunk(i);
 		m_availableList.push(i);
 	}
+
+	// The slots are at the same place in the new buffers, the builds in flight are uploaded as usual
+	for (uint32_t i = 0; i < previousSize; ++i)
+	{
+		TerrainChunk* chunk = m_chunkPool[i];
+		if (!chunk->is_loaded())
+			continue;
+
+		if (m_mode == TerrainMeshMode::CpuMesh)
+		{
+			glm::vec2 heightRange;
+			std::vector<TerrainVertex>* cached = m_meshCache->find(get_mesh_key(chunk, stream), heightRange);
+			if (cached == nullptr)
+			{
+				chunk->unload();
+				m_dispatchedBuildId[i] = UINT32_MAX;
+				continue;
+			}
+			chunk->upload(context, vertexBuffer, *cached, heightRange);
+		}
+		upload_gpu_data(context, chunk);
+	}
+}
+
+TerrainMeshKey TerrainChunkManager::get_mesh_key(TerrainChunk* chunk, Ref<TerrainStream> stream) const
+{
+	return { chunk->get_min(), chunk->get_max(), chunk->get_lod_level(), 0, stream->get_content_hash() };
+}
+
+bool TerrainChunkManager::is_edited(Ref<TerrainStream> stream, const TerrainMeshKey& key, glm::ivec3 terrainSize) const
+{
+	if (m_editedRects.empty())
+		return false;
+
+	glm::ivec2 texelMin, texelMax;
+	TerrainChunk::get_texel_rect(stream, key.min, key.max, terrainSize, m_vertexCount, texelMin, texelMax);
+	for (const TerrainStream::DirtyRect& rect : m_editedRects)
+	{
+		if (rect.min.x <= texelMax.x && rect.max.x >= texelMin.x && rect.min.y <= texelMax.y && rect.max.y >= texelMin.y)
+			return true;
+	}
+	return false;
+}
+
+// Beyond that the edited rects are merged in their bounds, some meshes are kept out of the disk cache for nothing
+static const size_t MAX_EDITED_RECT_COUNT = 256;
+
+void TerrainChunkManager::invalidate_texels(Context* context, Ref<TerrainStream> stream, const glm::ivec2& min, const glm::ivec2& max, glm::ivec3 terrainSize)
+{
+	m_frameEditStats.dirtyRects++;
+	if (m_editedRects.size() == MAX_EDITED_RECT_COUNT)
+	{
+		TerrainStream::DirtyRect bounds = m_editedRects[0];
+		for (const TerrainStream::DirtyRect& rect : m_editedRects)
+		{
+			bounds.min = glm::min(bounds.min, rect.min);
+			bounds.max = glm::max(bounds.max, rect.max);
+		}
+		m_editedRects.clear();
+		m_editedRects.push_back(bounds);
+	}
+	m_editedRects.push_back({ min, max });
+
+	if (m_meshCache)
+	{
+		uint32_t vertexCount = m_vertexCount;
+		m_frameEditStats.invalidatedMeshes += m_meshCache->invalidate([&](const TerrainMeshKey& key) {
+			glm::ivec2 texelMin, texelMax;
+			TerrainChunk::get_texel_rect(stream, key.min, key.max, terrainSize, vertexCount, texelMin, texelMax);
+			return min.x <= texelMax.x && max.x >= texelMin.x && min.y <= texelMax.y && max.y >= texelMin.y;
+		});
+	}
+
+	if (m_mode == TerrainMeshMode::VertexTextureFetch)
+	{
+		// Only the rect is uploaded, the rest of the texture is kept
+		glm::ivec2 rectMin = glm::max(min, glm::ivec2(0));
+		glm::ivec2 rectMax = glm::min(max, glm::ivec2(stream->get_width() - 1, stream->get_height() - 1));
+		if (rectMin.x > rectMax.x || rectMin.y > rectMax.y)
+			return;
+		glm::ivec2 extent = rectMax - rectMin + 1;
+		std::vector<float> texels(uint64_t(extent.x) * extent.y);
+		stream->read_rect(rectMin, rectMax, texels.data());
+		uint32_t size = static_cast<uint32_t>(texels.size() * sizeof(float));
+		context->copy(heightmap, texels.data(), size, rectMin.x, rectMin.y, extent.x, extent.y);
+	}
 }
 
-void TerrainChunkManager::add_to_cache(TerrainChunk* chunk)
+void TerrainChunkManager::refresh_chunk(Context* context, Ref<TerrainStream> stream, TerrainChunk* chunk, const glm::ivec2& min, const glm::ivec2& max, glm::ivec3 terrainSize)
 {
+	auto rebuild = [&]() {
+		// The build in flight, if any, read the heights before the edit
+		chunk->unload();
+		chunk->invalidate_build();
+		m_frameEditStats.rebuiltChunks++;
+	};
+
 	if (!chunk->is_loaded())
-		m_chunkToBeLoaded.push(chunk);
+	{
+		rebuild();
+		return;
+	}
+
+	if (m_mode == TerrainMeshMode::VertexTextureFetch)
+	{
+		// The heights are read from the texture, only the bounds change
+		chunk->set_loaded(TerrainChunk::get_height_bounds(stream, chunk->get_min(), chunk->get_max(), terrainSize, m_vertexCount));
+		upload_gpu_data(context, chunk);
+		return;
+	}
+
+	int firstRow, lastRow;
+	if (!TerrainChunk::get_dirty_rows(stream, chunk->get_min(), chunk->get_max(), terrainSize, m_vertexCount, min, max, firstRow, lastRow))
+		return;
+
+	// Rebuilt on the calling thread, the tiles of a chunk that is not drawn anymore may have been paged out
+	glm::ivec2 texelMin, texelMax;
+	TerrainChunk::get_texel_rect(stream, chunk->get_min(), chunk->get_max(), terrainSize, m_vertexCount, texelMin, texelMax);
+	if (!stream->acquire(texelMin, texelMax))
+	{
+		rebuild();
+		return;
+	}
+
+	glm::vec2 heightRange;
+	TerrainChunk::create_mesh_rows(stream, chunk->get_min(), chunk->get_max(), terrainSize, m_vertexCount, firstRow, lastRow, m_editVertices);
+	TerrainChunk::compress_mesh(m_editVertices, float(terrainSize.y), m_editCompressed, heightRange);
+	stream->release(texelMin, texelMax);
+
+	uint32_t rowSize = m_vertexCount + 3;
+	chunk->upload_rows(context, vertexBuffer, m_editCompressed, get_chunk_vertex_count(), uint32_t(firstRow + 1) * rowSize, heightRange);
+	upload_gpu_data(context, chunk);
+	m_frameEditStats.patchedChunks++;
+	m_frameEditStats.patchedRows += uint32_t(lastRow - firstRow + 1);
+	m_frameEditStats.patchedBytes += m_editCompressed.size() * sizeof(TerrainVertex) + sizeof(TerrainChunkGpuData);
+}
+
+void TerrainChunkManager::request_build(TerrainChunk* chunk, float priority)
+{
+	// Already built or being built for its current assignment
+	if (chunk->is_loaded() || m_dispatchedBuildId[chunk->get_pool_index()] == chunk->get_build_id())
+		return;
+	m_buildRequests.push_back({ chunk, chunk->get_build_id(), priority });
+	std::push_heap(m_buildRequests.begin(), m_buildRequests.end());
+}
+
+uint64_t TerrainChunkManager::get_vertex_memory() const
+{
+	if (m_mode == TerrainMeshMode::VertexTextureFetch)
+		return 0;
+	return uint64_t(get_chunk_vertex_count()) * sizeof(TerrainVertex) * m_poolSize;
+}
+
+uint64_t TerrainChunkManager::get_float_vertex_memory() const
+{
+	return uint64_t(get_chunk_vertex_count()) * sizeof(VertexP4N1_Float) * m_poolSize;
+}
+
+uint32_t TerrainChunkManager::get_worker_count() const
+{
+	return m_jobSystem->get_worker_count();
+}
+
+void TerrainChunkManager::upload_gpu_data(Context* context, TerrainChunk* chunk)
+{
+	TerrainChunkGpuData gpuData = chunk->get_gpu_data(m_terrainParams[0].z);
+	context->copy(chunkBuffer, &gpuData, CHUNK_BUFFER_HEADER_SIZE + chunk->get_pool_index() * sizeof(TerrainChunkGpuData), sizeof(TerrainChunkGpuData));
+}
+
+void TerrainChunkManager::set_lod_parameters(Context* context, const glm::vec2& camera, float lodDistance)
+{
+	m_terrainParams[0].w = lodDistance;
+	m_terrainParams[1] = glm::vec4(camera, 0.0f, 0.0f);
+	context->copy(chunkBuffer, m_terrainParams, sizeof(glm::uvec4), sizeof(m_terrainParams));
 }
 
 void TerrainChunkManager::update(Context* context, Ref<TerrainStream> stream, glm::ivec3 terrainSize)
 {
-	while (m_chunkToBeLoaded.size() > 0)
+	using Clock = std::chrono::high_resolution_clock;
+	auto start = Clock::now();
+	auto get_elapsed = [&start]() {
+		return std::chrono::duration<float, std::micro>(Clock::now() - start).count();
+	};
+
+	m_poolStats = m_frameStats;
+	m_frameStats = PoolStats{};
+	m_editStats = m_frameEditStats;
+	m_frameEditStats = EditStats{};
+
+	m_buildStats = BuildStats{};
+	m_buildStats.requested = static_cast<uint32_t>(m_buildRequests.size());
+	m_buildStats.budget = m_timeBudget;
+	m_buildStats.cancelled = m_cancelledBuilds.exchange(0);
+
+	// Pop the highest priority request, the ones whose chunk has been reassigned since they were made are cancelled
+	auto pop_request = [&](BuildRequest& request) {
+		while (!m_buildRequests.empty())
+		{
+			std::pop_heap(m_buildRequests.begin(), m_buildRequests.end());
+			request = m_buildRequests.back();
+			m_buildRequests.pop_back();
+			if (request.chunk->get_build_id() == request.buildId)
+				return true;
+			m_buildStats.cancelled++;
+		}
+		return false;
+	};
+
+	if (m_mode == TerrainMeshMode::VertexTextureFetch)
 	{
-		TerrainChunk* chunk = m_chunkToBeLoaded.front();
-		m_chunkToBeLoaded.pop();
-		chunk->build(context, stream, terrainSize, m_vertexCount);
-		break;
+		// Nothing to build, the chunk only needs its bounds for the culling
+		BuildRequest request;
+		while ((m_buildStats.uploaded == 0 || get_elapsed() < m_timeBudget) && pop_request(request))
+		{
+			TerrainChunk* chunk = request.chunk;
+			chunk->set_loaded(TerrainChunk::get_height_bounds(stream, chunk->get_min(), chunk->get_max(), terrainSize, m_vertexCount));
+			upload_gpu_data(context, chunk);
+			m_buildStats.uploadedBytes += sizeof(TerrainChunkGpuData);
+			m_buildStats.uploaded++;
+		}
+		m_buildStats.deferred = static_cast<uint32_t>(m_buildRequests.size());
+		m_buildRequests.clear();
+		m_buildStats.usedTime = get_elapsed();
+		return;
 	}
+
+	// Upload the finished mesh first, at least one every frame so that the terrain always makes progress
+	while (m_buildStats.uploaded == 0 || get_elapsed() < m_timeBudget)
+	{
+		Ref<BuildResult> result = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(m_buildMutex);
+			if (m_builtChunks.size() == 0)
+				break;
+			result = m_builtChunks.front();
+			m_builtChunks.pop();
+		}
+
+		result->chunk->unpin();
+		if (result->chunk->get_build_id() != result->buildId)
+		{
+			m_buildStats.cancelled++;
+			continue;
+		}
+
+		TerrainChunk* chunk = result->chunk;
+		chunk->upload(context, vertexBuffer, result->vertices, result->heightRange);
+		m_meshCache->insert(result->key, result->vertices, result->heightRange, !is_edited(stream, result->key, terrainSize));
+		upload_gpu_data(context, chunk);
+		m_buildStats.uploadedBytes += result->vertices.size() * sizeof(TerrainVertex) + sizeof(TerrainChunkGpuData);
+		m_buildStats.uploaded++;
+	}
+
+	// Dispatch the requests from the highest priority with the remaining budget
+	// The one whose heightmap is not resident yet are skipped so that a build never waits on disk
+	BuildRequest request;
+	while (get_elapsed() < m_timeBudget && m_pendingBuilds.load() < m_maxPendingBuilds && pop_request(request))
+	{
+		// Copy everything the worker needs, the chunk can be reinitialized while the mesh is being built
+		TerrainChunk* chunk = request.chunk;
+		uint32_t buildId = request.buildId;
+		glm::ivec2 min = chunk->get_min();
+		glm::ivec2 max = chunk->get_max();
+		uint32_t vertexCount = m_vertexCount;
+		TerrainMeshKey key = get_mesh_key(chunk, stream);
+
+		// Built before its eviction from the pool, uploaded right away
+		glm::vec2 heightRange;
+		std::vector<TerrainVertex>* cached = m_meshCache->find(key, heightRange);
+		if (cached)
+		{
+			chunk->upload(context, vertexBuffer, *cached, heightRange);
+			upload_gpu_data(context, chunk);
+			m_buildStats.uploadedBytes += cached->size() * sizeof(TerrainVertex) + sizeof(TerrainChunkGpuData);
+			m_buildStats.uploaded++;
+			m_buildStats.cached++;
+			continue;
+		}
+
+		glm::ivec2 texelMin, texelMax;
+		TerrainChunk::get_texel_rect(stream, min, max, terrainSize, vertexCount, texelMin, texelMax);
+		if (!stream->acquire(texelMin, texelMax))
+		{
+			m_buildStats.waitingForStream++;
+			continue;
+		}
+
+		m_dispatchedBuildId[chunk->get_pool_index()] = buildId;
+		chunk->pin();
+		m_buildStats.dispatched++;
+		m_pendingBuilds++;
+		m_jobSystem->execute([this, chunk, buildId, key, min, max, stream, terrainSize, vertexCount, texelMin, texelMax]() {
+			// Skip the chunk that has already been reassigned
+			if (chunk->get_build_id() == buildId)
+			{
+				Ref<BuildResult> result = CreateRef<BuildResult>();
+				result->chunk = chunk;
+				result->buildId = buildId;
+				result->key = key;
+				std::vector<VertexP4N1_Float> vertices;
+				TerrainChunk::create_mesh(stream, min, max, terrainSize, vertexCount, vertices);
+				TerrainChunk::compress_mesh(vertices, float(terrainSize.y), result->vertices, result->heightRange);
+
+				std::lock_guard<std::mutex> lock(m_buildMutex);
+				m_builtChunks.push(result);
+			}
+			else
+			{
+				m_cancelledBuilds++;
+				chunk->unpin();
+			}
+			stream->release(texelMin, texelMax);
+			m_pendingBuilds--;
+		});
+	}
+
+	// The quadtree requests the chunks it still needs every frame with their new priority
+	m_buildStats.deferred = static_cast<uint32_t>(m_buildRequests.size());
+	m_buildRequests.clear();
+	m_buildStats.usedTime = get_elapsed();
 }
 
 void TerrainChunkManager::destroy()
 {
+	m_jobSystem->destroy();
+	if (m_meshCache)
+		m_meshCache->destroy();
+
 	for (auto& pool : m_chunkPool)
 		delete pool;
 
-	Device::destroy_buffer(vb);
+	Device::destroy_buffer(vertexBuffer);
+	Device::destroy_buffer(chunkBuffer);
+	Device::destroy_texture(heightmap);
 	Device::destroy_buffer(ib);
+	Device::destroy_shader_bindings(m_bindings);
 	m_chunkPool.clear();
 }
@@ -6,33 +6,217 @@
 #include <vector>
 #include <stack>
 #include <queue>
+#include <mutex>
+#include <atomic>
+
+#include "terrain_mesh_cache.h"
+#include "terrain_stream.h"
 
 class TerrainChunk;
 class Context;
+class JobSystem;
+struct VertexP4N1_Float;
+struct TerrainVertex;
 class TerrainStream;
 
-class VertexBuffer;
 class IndexBuffer;
+class ShaderStorageBuffer;
+class ShaderBindings;
+class Texture;
+enum class TerrainMeshMode;
 
 class TerrainChunkManager
 {
 public:
-	TerrainChunkManager(Context* context, uint32_t poolSize);
-	TerrainChunk* get_free_chunk();
-	void add_to_cache(TerrainChunk* chunk);
+	// workerCount is the number of thread generating chunk mesh in background, 0 builds on the calling thread
+	// timeBudget is the time in microseconds update can spend dispatching builds and uploading them every frame
+	// VertexTextureFetch mode uploads the whole stream as a texture, it must be resident in memory
+	TerrainChunkManager(Context* context, uint32_t poolSize, uint32_t workerCount, float timeBudget, TerrainMeshMode mode, Ref<TerrainStream> stream, glm::ivec3 terrainSize);
+	// Least recently used chunk, the ones used during frameIndex or pinned by a build are never returned
+	// Returns nullptr when the pool is exhausted, the chunk is marked as used during frameIndex
+	TerrainChunk* get_free_chunk(uint64_t frameIndex);
+	// Mark a chunk as used during frameIndex
+	void touch(TerrainChunk* chunk, uint64_t frameIndex);
+	// Grow the pool to poolSize chunk, waits for the gpu to be idle as the chunk buffers are recreated
+	// The loaded chunks are uploaded again from the mesh cache, the other ones are built again
+	void resize_pool(Context* context, Ref<TerrainStream> stream, uint32_t poolSize);
+	// Ask for the mesh of a chunk that is not loaded, must be called every frame the chunk is still needed
+	// Requests are served from the highest priority and the ones not served are dropped at the end of update
+	void request_build(TerrainChunk* chunk, float priority);
 
 	void update(Context* context, Ref<TerrainStream> stream, glm::ivec3 terrainSize);
+	// The heights of the texel rect [min, max] have been written, drops the cached meshes reading them and
+	// updates the heightmap texture, called before refresh_chunk on the chunks overlapping the rect
+	void invalidate_texels(Context* context, Ref<TerrainStream> stream, const glm::ivec2& min, const glm::ivec2& max, glm::ivec3 terrainSize);
+	// Bring a chunk reading the edited texel rect [min, max] up to date, the vertex rows of a loaded chunk that
+	// read the rect are built again and uploaded in place, a chunk without mesh yet is built again from the queue
+	void refresh_chunk(Context* context, Ref<TerrainStream> stream, TerrainChunk* chunk, const glm::ivec2& min, const glm::ivec2& max, glm::ivec3 terrainSize);
+	// Camera the chunks have been selected from and split distance of QuadTree, read by the vertex morph
+	void set_lod_parameters(Context* context, const glm::vec2& camera, float lodDistance);
 	void destroy();
 
+	uint32_t get_pool_size() const { return m_poolSize; }
+	uint32_t get_vertex_count() const { return m_vertexCount; }
+	uint32_t get_worker_count() const;
+
+	float get_time_budget() const { return m_timeBudget; }
+	void set_time_budget(float budget) { m_timeBudget = budget; }
+
+	// Build queue activity of the last update
+	struct BuildStats
+	{
+		uint32_t requested = 0;
+		uint32_t dispatched = 0;
+		// Served by the mesh cache without building them
+		uint32_t cached = 0;
+		// Left in the queue by the time budget or because enough builds are already running
+		uint32_t deferred = 0;
+		// Requests and builds of chunks reassigned before their mesh was uploaded
+		uint32_t cancelled = 0;
+		// Requests waiting for their heightmap tiles to be paged in
+		uint32_t waitingForStream = 0;
+		uint32_t uploaded = 0;
+		uint64_t uploadedBytes = 0;
+		// Microseconds spent in update against the budget
+		float usedTime = 0.0f;
+		float budget = 0.0f;
+	};
+	const BuildStats& get_build_stats() const { return m_buildStats; }
+
+	// Chunk pool activity of the last frame
+	struct PoolStats
+	{
+		uint32_t evicted = 0;
+		// Pinned chunks passed over while looking for a chunk to evict
+		uint32_t pinnedSkipped = 0;
+		// get_free_chunk calls that failed because every chunk was in use
+		uint32_t exhausted = 0;
+	};
+	const PoolStats& get_pool_stats() const { return m_poolStats; }
+
+	// Edits of the heights applied last frame
+	struct EditStats
+	{
+		uint32_t dirtyRects = 0;
+		// Loaded chunks whose rows have been rebuilt in place
+		uint32_t patchedChunks = 0;
+		uint32_t patchedRows = 0;
+		uint64_t patchedBytes = 0;
+		// Chunks sent back to the build queue, their build was in flight or their tiles not resident
+		uint32_t rebuiltChunks = 0;
+		// Mesh cache entries and disk slots reading the edited texels
+		uint32_t invalidatedMeshes = 0;
+	};
+	const EditStats& get_edit_stats() const { return m_editStats; }
+	// Meshes of the chunks evicted from the pool, null in vertex texture fetch mode
+	Ref<TerrainMeshCache> get_mesh_cache() { return m_meshCache; }
+	uint32_t get_pending_build_count() const { return m_pendingBuilds.load(); }
+
+	// Vertex per chunk including the border
+	uint32_t get_chunk_vertex_count() const { return (m_vertexCount + 3) * (m_vertexCount + 3); }
+	// Byte of the vertex pool and what it would take with VertexP4N1_Float
+	uint64_t get_vertex_memory() const;
+	uint64_t get_float_vertex_memory() const;
+	// Byte of the heightmap texture, a single texel when the vertices are built on the cpu
+	uint64_t get_heightmap_memory() const { return m_heightmapMemory; }
+	TerrainMeshMode get_mesh_mode() const { return m_mode; }
+
+	// Edges of a chunk stitched to a coarser neighbour, in the order of QuadTree::Direction
+	static const uint32_t STITCH_NORTH = 1;
+	static const uint32_t STITCH_SOUTH = 2;
+	static const uint32_t STITCH_EAST = 4;
+	static const uint32_t STITCH_WEST = 8;
+	static const uint32_t STITCH_VARIANT_COUNT = 16;
+	// Index range of the chunk grid with the edges of stitchMask matching a neighbour of the next lod
+	uint32_t get_first_index(uint32_t stitchMask) const { return m_firstIndex[stitchMask]; }
+	uint32_t get_index_count(uint32_t stitchMask) const { return m_indexCount[stitchMask]; }
+	uint32_t get_total_index_count() const { return m_totalIndexCount; }
+
+	// Chunk and vertex storage buffer and heightmap texture read by the terrain vertex shaders, see terrain_vertex.h
+	ShaderBindings* get_bindings() { return m_bindings; }
+
+	// Stitching variants of the chunk grid one after the other, see get_first_index
 	IndexBuffer* ib;
-	VertexBuffer* vb;
-	uint32_t indexCount = 0;
+	// Every chunk owns a slot of get_chunk_vertex_count() TerrainVertex
+	ShaderStorageBuffer* vertexBuffer;
+	// Grid header followed by a TerrainChunkGpuData per slot
+	ShaderStorageBuffer* chunkBuffer;
+	Texture* heightmap;
 private:
-	uint32_t POOL_SIZE = 100;
+	uint32_t m_firstIndex[STITCH_VARIANT_COUNT] = {};
+	uint32_t m_indexCount[STITCH_VARIANT_COUNT] = {};
+	uint32_t m_totalIndexCount = 0;
+	uint32_t m_poolSize = 100;
 	uint32_t m_vertexCount = 128;
+	TerrainMeshMode m_mode;
+	uint64_t m_heightmapMemory = 0;
+	// u_TerrainParams and u_TerrainCamera of the chunk buffer header
+	glm::vec4 m_terrainParams[2];
 	// Chunk Cache
 	std::vector<TerrainChunk*> m_chunkPool;
 	std::stack<uint32_t> m_availableList;
-	std::queue<TerrainChunk*> m_chunkToBeLoaded;
+	// Intrusive lru of the assigned chunks indexed by pool index, most recently used at the head
+	struct LruLink
+	{
+		uint32_t prev = UINT32_MAX;
+		uint32_t next = UINT32_MAX;
+	};
+	std::vector<LruLink> m_lruLinks;
+	uint32_t m_lruHead = UINT32_MAX;
+	uint32_t m_lruTail = UINT32_MAX;
+	PoolStats m_poolStats;
+	PoolStats m_frameStats;
+	EditStats m_editStats;
+	EditStats m_frameEditStats;
+	// Texel rects edited since the creation, the meshes reading them are kept out of the disk cache
+	std::vector<TerrainStream::DirtyRect> m_editedRects;
+	// Reused by refresh_chunk
+	std::vector<VertexP4N1_Float> m_editVertices;
+	std::vector<TerrainVertex> m_editCompressed;
+
+	struct BuildRequest
+	{
+		TerrainChunk* chunk;
+		uint32_t buildId;
+		float priority;
+
+		bool operator<(const BuildRequest& rhs) const { return priority < rhs.priority; }
+	};
+	// Max heap of the requests of the frame, rebuilt every frame so that the priorities follow the camera
+	std::vector<BuildRequest> m_buildRequests;
+	// Build id dispatched for each pool slot, a chunk is not requested again while its build is running
+	std::vector<uint32_t> m_dispatchedBuildId;
+
+	// Background mesh generation
+	struct BuildResult
+	{
+		TerrainChunk* chunk;
+		uint32_t buildId;
+		TerrainMeshKey key;
+		std::vector<TerrainVertex> vertices;
+		glm::vec2 heightRange;
+	};
+
+	Ref<JobSystem> m_jobSystem;
+	std::mutex m_buildMutex;
+	std::queue<Ref<BuildResult>> m_builtChunks;
+	std::atomic<uint32_t> m_pendingBuilds = 0;
+	// Builds skipped by the workers because their chunk has been reassigned
+	std::atomic<uint32_t> m_cancelledBuilds = 0;
+	// Builds handed to the workers at once, the rest waits in the queue where its priority can still change
+	uint32_t m_maxPendingBuilds;
+	float m_timeBudget;
+	BuildStats m_buildStats;
+	Ref<TerrainMeshCache> m_meshCache;
+
+	ShaderBindings* m_bindings;
 
+	void upload_gpu_data(Context* context, TerrainChunk* chunk);
+	// Vertex and chunk buffer sized for the pool, bound in m_bindings
+	void create_pool_buffers(Context* context);
+	TerrainMeshKey get_mesh_key(TerrainChunk* chunk, Ref<TerrainStream> stream) const;
+	// True if the mesh of key reads a texel of m_editedRects
+	bool is_edited(Ref<TerrainStream> stream, const TerrainMeshKey& key, glm::ivec3 terrainSize) const;
+	void lru_remove(uint32_t index);
+	void lru_push_front(uint32_t index);
 };
\ No newline at end of file
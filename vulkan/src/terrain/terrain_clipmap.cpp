@@ -0,0 +1,418 @@
+#include "terrain_clipmap.h"
+#include "terrain_chunk.h"
+#include "terrain_stream.h"
+#include "scene/camera.h"
+#include "renderer/context.h"
+#include "renderer/device.h"
+#include "renderer/buffer.h"
+#include "renderer/shaderbinding.h"
+#include "renderer/texture.h"
+
+#include <chrono>
+#include <cstring>
+#include <imgui/imgui.h>
+
+// Same header as the chunk buffer, see TerrainChunkBuffer in terrain_vertex.h
+static const uint32_t LEVEL_BUFFER_HEADER_SIZE = 3 * sizeof(glm::vec4);
+// Mode flag of the header read by get_terrain_vertex
+static const uint32_t CLIPMAP_MODE = 2;
+
+static int floor_div(int a, int b)
+{
+	return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+// Heights of every level are quantized in the full range of the terrain
+static uint16_t quantize_height(float height, float maxHeight)
+{
+	float scale = 65535.0f / (2.0f * maxHeight);
+	return uint16_t(glm::clamp((height + maxHeight) * scale + 0.5f, 0.0f, 65535.0f));
+}
+
+TerrainClipmap::TerrainClipmap(Context* context, Ref<TerrainStream> stream, uint32_t terrainSize, int maxHeight, float spacing, uint32_t levelSize) :
+	m_stream(stream), m_terrainSize(terrainSize, maxHeight, terrainSize), m_levelSize(levelSize), m_rowSize(levelSize + 1)
+{
+	ASSERT_MSG(levelSize % 8 == 0, "Clipmap level size must be a multiple of 8");
+	ASSERT_MSG(m_rowSize * m_rowSize <= 65536, "Clipmap level vertices are indexed with 16 bits");
+
+	// The coarsest level covers the terrain wherever the camera is
+	uint32_t levelCount = 1;
+	while (float(levelSize) * spacing * float(1 << (levelCount - 1)) < 2.0f * float(terrainSize))
+		levelCount++;
+	m_levels.resize(levelCount);
+	for (uint32_t i = 0; i < levelCount; ++i)
+		m_levels[i].spacing = spacing * float(1 << i);
+	m_finestActiveLevel = levelCount;
+
+	uint32_t levelVertexCount = m_rowSize * m_rowSize;
+	m_updateBudget = levelVertexCount;
+	m_vertices.resize(levelVertexCount);
+
+	uint32_t vertexBufferSize = levelCount * levelVertexCount * sizeof(TerrainVertex);
+	m_vertexBuffer = Device::create_shader_storage_buffer(BufferUsageHint::StaticDraw, (vertexBufferSize + 3) & ~3u);
+
+	// Morph region in cell before the outer border of a level
+	float transitionWidth = float(levelSize) / 10.0f;
+	m_levelBuffer = Device::create_shader_storage_buffer(BufferUsageHint::StaticDraw, LEVEL_BUFFER_HEADER_SIZE + levelCount * sizeof(TerrainChunkGpuData));
+	glm::uvec4 grid = glm::uvec4(m_levelSize, m_rowSize, levelVertexCount, CLIPMAP_MODE);
+	glm::vec4 params = glm::vec4(float(terrainSize), float(terrainSize), float(maxHeight), transitionWidth);
+	context->copy(m_levelBuffer, &grid, 0, sizeof(glm::uvec4));
+	context->copy(m_levelBuffer, &params, sizeof(glm::uvec4), sizeof(glm::vec4));
+
+	TextureDescription desc = TextureDescription::Initialize(1, 1);
+	desc.format = Format::R32Float;
+	desc.flags = TextureFlag::Sampler | TextureFlag::TransferDst;
+	SamplerDescription sampler = SamplerDescription::Initialize();
+	sampler.minFilter = sampler.magFilter = TextureFilter::Nearest;
+	desc.sampler = &sampler;
+	m_heightmap = Device::create_texture(desc);
+	float texel = 0.0f;
+	context->copy(m_heightmap, &texel, sizeof(float));
+
+	m_bindings = Device::create_shader_bindings();
+	m_bindings->set_buffer(m_levelBuffer, 6);
+	m_bindings->set_buffer(m_vertexBuffer, 7);
+	m_bindings->set_texture_sampler(m_heightmap, 8);
+
+	create_index_buffer(context);
+
+	m_drawCommands.reserve(levelCount);
+	m_drawBuffer = Device::create_indirect_buffer(BufferUsageHint::DynamicDraw, levelCount * sizeof(DrawIndexedIndirectData));
+}
+
+void TerrainClipmap::create_index_buffer(Context* context)
+{
+	// The finer level covers half of the level, one cell off the center depending on how both are snapped
+	int n = static_cast<int>(m_levelSize);
+	auto add_grid = [&](std::vector<uint16_t>& indices, bool hole, int holeX, int holeZ)
+	{
+		for (int z = 0; z < n; ++z)
+		{
+			for (int x = 0; x < n; ++x)
+			{
+				if (hole && x >= holeX && x < holeX + n / 2 && z >= holeZ && z < holeZ + n / 2)
+					continue;
+
+				// Same triangulation as the quadtree chunks, the morph of build_vertex relies on its diagonal
+				uint16_t i0 = uint16_t(z * m_rowSize + x);
+				uint16_t i1 = i0 + 1;
+				uint16_t i2 = uint16_t(i0 + m_rowSize);
+				uint16_t i3 = i2 + 1;
+
+				indices.push_back(i2);
+				indices.push_back(i1);
+				indices.push_back(i0);
+
+				indices.push_back(i2);
+				indices.push_back(i3);
+				indices.push_back(i1);
+			}
+		}
+	};
+
+	std::vector<uint16_t> indices;
+	add_grid(indices, false, 0, 0);
+	m_fullIndexCount = static_cast<uint32_t>(indices.size());
+	for (int i = 0; i < 4; ++i)
+		add_grid(indices, true, n / 4 + (i & 1), n / 4 + (i >> 1));
+	m_ringIndexCount = (static_cast<uint32_t>(indices.size()) - m_fullIndexCount) / 4;
+
+	uint32_t size = static_cast<uint32_t>(indices.size() * sizeof(uint16_t));
+	m_ib = Device::create_indexbuffer(BufferUsageHint::StaticDraw, IndexType::UnsignedShort, size);
+	context->copy(m_ib, indices.data(), 0, size);
+}
+
+glm::ivec2 TerrainClipmap::get_origin(const glm::ivec2& center, uint32_t level) const
+{
+	// Integer division of the finest position keeps the levels consistent with each other,
+	// the finer level then always starts levelSize / 4 or levelSize / 4 + 1 cells in this one
+	int scale = 1 << level;
+	int halfSize = static_cast<int>(m_levelSize / 2);
+	glm::ivec2 position = glm::ivec2(floor_div(center.x, scale), floor_div(center.y, scale));
+	return glm::ivec2(floor_div(position.x - halfSize, 2), floor_div(position.y - halfSize, 2)) * 2;
+}
+
+uint32_t TerrainClipmap::get_update_cost(const Level& level, const glm::ivec2& origin) const
+{
+	glm::ivec2 delta = glm::abs(origin - level.origin);
+	int rowSize = static_cast<int>(m_rowSize);
+	if (!level.valid || delta.x >= rowSize || delta.y >= rowSize)
+		return m_rowSize * m_rowSize;
+	return uint32_t(delta.y * rowSize + delta.x * (rowSize - delta.y));
+}
+
+void TerrainClipmap::update(Context* context, Ref<Camera> camera)
+{
+	using Clock = std::chrono::high_resolution_clock;
+	auto start = Clock::now();
+
+	m_updatedVertexLastFrame = 0;
+	m_uploadedBytesLastFrame = 0;
+	m_copyLastFrame = 0;
+
+	// Edited before the levels move, the rows and columns they expose read the edited heights
+	apply_edits(context);
+
+	glm::vec3 cameraPosition = camera->get_position();
+	m_center = glm::vec2(cameraPosition.x, cameraPosition.z);
+	glm::ivec2 center = glm::ivec2(glm::floor(m_center / m_levels[0].spacing));
+
+	// Coarse to fine so that the drawn levels are always a nested set
+	uint32_t levelCount = static_cast<uint32_t>(m_levels.size());
+	uint32_t budget = m_updateBudget;
+	m_finestActiveLevel = levelCount;
+	for (int i = int(levelCount) - 1; i >= 0; --i)
+	{
+		glm::ivec2 origin = get_origin(center, i);
+		uint32_t cost = get_update_cost(m_levels[i], origin);
+		if (i != int(levelCount) - 1 && cost > budget)
+			break;
+		budget -= glm::min(cost, budget);
+		update_level(context, i, origin);
+		m_finestActiveLevel = i;
+	}
+
+	// The morph center follows the camera every frame, see u_TerrainCamera
+	glm::vec4 morphCenter = glm::vec4(m_center, 0.0f, 0.0f);
+	context->copy(m_levelBuffer, &morphCenter, 2 * sizeof(glm::vec4), sizeof(glm::vec4));
+
+	float maxHeight = float(m_terrainSize.y);
+	std::vector<TerrainChunkGpuData> levelData(levelCount);
+	for (uint32_t i = 0; i < levelCount; ++i)
+	{
+		const Level& level = m_levels[i];
+		glm::vec2 min = glm::vec2(level.origin) * level.spacing;
+		// w is the toroidal slot of the min corner, see get_terrain_vertex
+		float slot = float(get_slot(level.origin.x) + get_slot(level.origin.y) * m_rowSize);
+		levelData[i].rect = glm::vec4(min, float(m_levelSize) * level.spacing, slot);
+		levelData[i].heightRange = glm::vec4(-maxHeight, 2.0f * maxHeight / 65535.0f, 0.0f, 0.0f);
+	}
+	context->copy(m_levelBuffer, levelData.data(), LEVEL_BUFFER_HEADER_SIZE, levelCount * sizeof(TerrainChunkGpuData));
+
+	build_draws(context);
+	m_updateTimeLastFrame = std::chrono::duration<float, std::milli>(Clock::now() - start).count();
+
+	if (ImGui::CollapsingHeader("Terrain Clipmap"))
+	{
+		const float megaByte = 1.0f / (1024.0f * 1024.0f);
+		uint64_t vertexMemory = uint64_t(levelCount) * m_rowSize * m_rowSize * sizeof(TerrainVertex);
+		uint64_t indexMemory = uint64_t(m_fullIndexCount + 4 * m_ringIndexCount) * sizeof(uint16_t);
+		ImGui::Text("levels: %d / %d, finest spacing: %.2f", levelCount - m_finestActiveLevel, levelCount, m_levels[0].spacing);
+		ImGui::Text("vertex updated last frame: %d (%.1fKB in %d copies)", m_updatedVertexLastFrame, float(m_uploadedBytesLastFrame) / 1024.0f, m_copyLastFrame);
+		ImGui::Text("update: %.3fms", m_updateTimeLastFrame);
+		ImGui::Text("vertex: %.2fMB, index: %.2fMB", float(vertexMemory) * megaByte, float(indexMemory) * megaByte);
+
+		int updateBudget = static_cast<int>(m_updateBudget);
+		if (ImGui::SliderInt("vertex per frame", &updateBudget, 1024, int(m_rowSize * m_rowSize) * 4))
+			m_updateBudget = static_cast<uint32_t>(updateBudget);
+	}
+}
+
+void TerrainClipmap::update_level(Context* context, uint32_t index, const glm::ivec2& origin)
+{
+	Level& level = m_levels[index];
+	int n = static_cast<int>(m_levelSize);
+	glm::ivec2 delta = origin - level.origin;
+	if (get_update_cost(level, origin) == m_rowSize * m_rowSize)
+		write_rows(context, index, origin.y, origin.y + n, origin.x);
+	else
+	{
+		// Rows entering the level, then the part of the entering columns on the rows that are kept
+		if (delta.y > 0)
+			write_rows(context, index, origin.y + n - delta.y + 1, origin.y + n, origin.x);
+		else if (delta.y < 0)
+			write_rows(context, index, origin.y, origin.y - delta.y - 1, origin.x);
+
+		int zMin = glm::max(origin.y, level.origin.y);
+		int zMax = glm::min(origin.y, level.origin.y) + n;
+		if (delta.x > 0)
+			write_columns(context, index, zMin, zMax, origin.x + n - delta.x + 1, origin.x + n);
+		else if (delta.x < 0)
+			write_columns(context, index, zMin, zMax, origin.x, origin.x - delta.x - 1);
+	}
+	level.origin = origin;
+	level.valid = true;
+}
+
+void TerrainClipmap::apply_edits(Context* context)
+{
+	if (!m_stream->has_dirty_rects())
+		return;
+
+	m_stream->take_dirty_rects(m_dirtyRects);
+	int n = static_cast<int>(m_levelSize);
+	// World distance of a texel, see sample_surface
+	glm::vec2 texelSize = glm::vec2(float(m_terrainSize.x), float(m_terrainSize.z)) / (glm::vec2(float(m_stream->get_width()), float(m_stream->get_height())) - 3.0f);
+	for (uint32_t i = 0; i < m_levels.size(); ++i)
+	{
+		const Level& level = m_levels[i];
+		if (!level.valid)
+			continue;
+
+		for (const TerrainStream::DirtyRect& rect : m_dirtyRects)
+		{
+			// A vertex reads the texels from the one before its previous morph neighbour to the two after the next one,
+			// through the bilinear taps of the normal, see build_vertex and TerrainChunk::get_dirty_rows
+			glm::ivec2 min = glm::ivec2(glm::floor((glm::vec2(rect.min) - 3.0f) * texelSize / level.spacing)) - 1;
+			glm::ivec2 max = glm::ivec2(glm::floor((glm::vec2(rect.max) + 1.0f) * texelSize / level.spacing)) + 1;
+			min = glm::max(min, level.origin);
+			max = glm::min(max, level.origin + n);
+			if (min.x > max.x || min.y > max.y)
+				continue;
+
+			if (min.x == level.origin.x && max.x == level.origin.x + n)
+				write_rows(context, i, min.y, max.y, level.origin.x);
+			else
+				write_columns(context, i, min.y, max.y, min.x, max.x);
+		}
+	}
+}
+
+void TerrainClipmap::write_rows(Context* context, uint32_t index, int zMin, int zMax, int xMin)
+{
+	const Level& level = m_levels[index];
+	for (int z = zMin; z <= zMax; ++z)
+	{
+		TerrainVertex* row = &m_vertices[get_slot(z) * m_rowSize];
+		for (int x = xMin; x <= xMin + int(m_levelSize); ++x)
+			row[get_slot(x)] = build_vertex(level, glm::ivec2(x, z));
+	}
+
+	// A whole row is contiguous, the rows only wrap once
+	uint32_t firstRow = get_slot(zMin);
+	uint32_t rowCount = uint32_t(zMax - zMin + 1);
+	uint32_t count = glm::min(rowCount, m_rowSize - firstRow);
+	upload_vertices(context, index, firstRow * m_rowSize, count * m_rowSize);
+	if (rowCount > count)
+		upload_vertices(context, index, 0, (rowCount - count) * m_rowSize);
+}
+
+void TerrainClipmap::write_columns(Context* context, uint32_t index, int zMin, int zMax, int xMin, int xMax)
+{
+	const Level& level = m_levels[index];
+	uint32_t firstColumn = get_slot(xMin);
+	uint32_t columnCount = uint32_t(xMax - xMin + 1);
+	uint32_t count = glm::min(columnCount, m_rowSize - firstColumn);
+	for (int z = zMin; z <= zMax; ++z)
+	{
+		uint32_t row = get_slot(z) * m_rowSize;
+		for (int x = xMin; x <= xMax; ++x)
+			m_vertices[row + get_slot(x)] = build_vertex(level, glm::ivec2(x, z));
+
+		upload_vertices(context, index, row + firstColumn, count);
+		if (columnCount > count)
+			upload_vertices(context, index, row, columnCount - count);
+	}
+}
+
+TerrainVertex TerrainClipmap::build_vertex(const Level& level, const glm::ivec2& position)
+{
+	glm::vec3 normal;
+	float height = TerrainChunk::sample_surface(m_stream, glm::vec2(position) * level.spacing, m_terrainSize, &normal);
+
+	// Odd vertices morph to the edge of the next level, the odd one on both axis
+	// to the diagonal of the triangulation
+	float morphHeight = height;
+	glm::ivec2 parity = position & 1;
+	if (parity.x != 0 || parity.y != 0)
+	{
+		glm::ivec2 offset = (parity.x != 0 && parity.y != 0) ? glm::ivec2(1, -1) : parity;
+		float h1 = TerrainChunk::sample_surface(m_stream, glm::vec2(position + offset) * level.spacing, m_terrainSize);
+		float h2 = TerrainChunk::sample_surface(m_stream, glm::vec2(position - offset) * level.spacing, m_terrainSize);
+		morphHeight = (h1 + h2) * 0.5f;
+	}
+
+	float maxHeight = float(m_terrainSize.y);
+	TerrainVertex vertex;
+	vertex.height = quantize_height(height, maxHeight);
+	vertex.morphHeight = quantize_height(morphHeight, maxHeight);
+	vertex.normal = TerrainChunk::encode_octahedral(normal);
+	return vertex;
+}
+
+uint32_t TerrainClipmap::get_slot(int position) const
+{
+	int rowSize = static_cast<int>(m_rowSize);
+	return uint32_t(((position % rowSize) + rowSize) % rowSize);
+}
+
+void TerrainClipmap::upload_vertices(Context* context, uint32_t index, uint32_t firstSlot, uint32_t count)
+{
+	uint32_t offset = (index * m_rowSize * m_rowSize + firstSlot) * sizeof(TerrainVertex);
+	uint32_t size = count * sizeof(TerrainVertex);
+	context->copy(m_vertexBuffer, &m_vertices[firstSlot], offset, size);
+	m_updatedVertexLastFrame += count;
+	m_uploadedBytesLastFrame += size;
+	m_copyLastFrame++;
+}
+
+void TerrainClipmap::build_draws(Context* context)
+{
+	uint32_t levelCount = static_cast<uint32_t>(m_levels.size());
+	int quarter = static_cast<int>(m_levelSize / 4);
+
+	m_drawCommands.clear();
+	for (uint32_t i = m_finestActiveLevel; i < levelCount; ++i)
+	{
+		DrawIndexedIndirectData drawData = {};
+		drawData.instanceCount = 1;
+		drawData.vertexOffset = static_cast<int32_t>(i * m_rowSize * m_rowSize);
+		if (i == m_finestActiveLevel)
+			drawData.indexCount = m_fullIndexCount;
+		else
+		{
+			// Pick the ring whose hole is where the finer level is, see get_origin
+			glm::ivec2 hole = m_levels[i - 1].origin / 2 - m_levels[i].origin - quarter;
+			ASSERT(hole.x >= 0 && hole.x <= 1 && hole.y >= 0 && hole.y <= 1);
+			drawData.indexCount = m_ringIndexCount;
+			drawData.firstIndex = m_fullIndexCount + uint32_t(hole.x + hole.y * 2) * m_ringIndexCount;
+		}
+		m_drawCommands.push_back(drawData);
+	}
+
+	uint32_t size = static_cast<uint32_t>(m_drawCommands.size() * sizeof(DrawIndexedIndirectData));
+	bool changed = m_drawCommands.size() != m_uploadedDrawCommands.size() ||
+		std::memcmp(m_drawCommands.data(), m_uploadedDrawCommands.data(), size) != 0;
+	if (changed && size > 0)
+	{
+		context->copy(m_drawBuffer, m_drawCommands.data(), 0, size);
+		m_uploadedDrawCommands = m_drawCommands;
+	}
+}
+
+uint32_t TerrainClipmap::get_draw_count(float distance) const
+{
+	uint32_t drawCount = 0;
+	for (uint32_t i = m_finestActiveLevel; i < m_levels.size(); ++i)
+	{
+		if (float(m_levelSize) * m_levels[i].spacing * 0.5f > distance)
+			break;
+		drawCount++;
+	}
+	return drawCount;
+}
+
+void TerrainClipmap::render(Context* context)
+{
+	draw(context, 0, static_cast<uint32_t>(m_drawCommands.size()));
+}
+
+void TerrainClipmap::draw(Context* context, uint32_t firstDraw, uint32_t drawCount)
+{
+	if (drawCount == 0)
+		return;
+
+	context->set_buffer(m_ib, 0);
+	uint32_t stride = sizeof(DrawIndexedIndirectData);
+	context->draw_indexed_indirect(m_drawBuffer, firstDraw * stride, drawCount, stride);
+}
+
+void TerrainClipmap::destroy()
+{
+	Device::destroy_buffer(m_vertexBuffer);
+	Device::destroy_buffer(m_levelBuffer);
+	Device::destroy_buffer(m_ib);
+	Device::destroy_buffer(m_drawBuffer);
+	Device::destroy_texture(m_heightmap);
+	Device::destroy_shader_bindings(m_bindings);
+}
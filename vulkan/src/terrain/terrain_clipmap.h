@@ -0,0 +1,101 @@
+#pragma once
+
+#include "core/base.h"
+#include "core/math.h"
+#include <stdint.h>
+#include <vector>
+
+#include "renderer/buffer.h"
+#include "terrain_stream.h"
+
+class Context;
+class Camera;
+class ShaderBindings;
+class Texture;
+struct TerrainVertex;
+
+// Geometry clipmap: nested square grids centered on the camera, each level doubling the vertex spacing
+// Levels are stored toroidally in a shared vertex buffer, moving the camera only rewrites the rows
+// and columns it exposes. It reads the same stream and builds the same surface as the quadtree
+class TerrainClipmap
+{
+public:
+	// spacing is the distance between two vertices of the finest level
+	// levelSize is the number of cell on a side of a level, a multiple of 8 so that the levels nest
+	TerrainClipmap(Context* context, Ref<TerrainStream> stream, uint32_t terrainSize, int maxHeight, float spacing, uint32_t levelSize = 248);
+
+	void update(Context* context, Ref<Camera> camera);
+	// Draw every active level, the finest is drawn first
+	void render(Context* context);
+	// Submit drawCount draws of the active levels starting from the finest one
+	void draw(Context* context, uint32_t firstDraw, uint32_t drawCount);
+	void destroy();
+
+	// Number of draws, starting from the finest, of the levels within distance of the camera
+	uint32_t get_draw_count(float distance) const;
+
+	// Level and vertex storage buffers read by the terrain vertex shaders, see terrain_vertex.h
+	ShaderBindings* get_bindings() { return m_bindings; }
+	// (levelSize + 1)^2 vertices per level, each one at its toroidal slot
+	ShaderStorageBuffer* get_vertex_buffer() { return m_vertexBuffer; }
+
+private:
+	struct Level
+	{
+		// Min corner in vertex of the level, always even so that it lies on the next level grid
+		glm::ivec2 origin = glm::ivec2(0);
+		float spacing = 1.0f;
+		bool valid = false;
+	};
+
+	Ref<TerrainStream> m_stream;
+	glm::ivec3 m_terrainSize;
+	uint32_t m_levelSize;
+	uint32_t m_rowSize;
+	std::vector<Level> m_levels;
+	// Levels from this one to the coarsest are up to date and drawn
+	uint32_t m_finestActiveLevel;
+	glm::vec2 m_center = glm::vec2(0.0f);
+
+	// Vertex written per frame, the coarsest level is always updated and finer levels
+	// that don't fit stay hidden until a later frame
+	uint32_t m_updateBudget;
+
+	ShaderStorageBuffer* m_vertexBuffer;
+	// Header then a TerrainChunkGpuData per level
+	ShaderStorageBuffer* m_levelBuffer;
+	// Only bound for the layout shared with the other terrain modes
+	Texture* m_heightmap;
+	ShaderBindings* m_bindings;
+
+	// Full grid of a level followed by the four rings around a finer level
+	IndexBuffer* m_ib;
+	uint32_t m_fullIndexCount = 0;
+	uint32_t m_ringIndexCount = 0;
+
+	IndirectBuffer* m_drawBuffer;
+	std::vector<DrawIndexedIndirectData> m_drawCommands;
+	std::vector<DrawIndexedIndirectData> m_uploadedDrawCommands;
+
+	std::vector<TerrainVertex> m_vertices;
+	std::vector<TerrainStream::DirtyRect> m_dirtyRects;
+
+	uint32_t m_updatedVertexLastFrame = 0;
+	uint64_t m_uploadedBytesLastFrame = 0;
+	uint32_t m_copyLastFrame = 0;
+	float m_updateTimeLastFrame = 0.0f;
+
+	void create_index_buffer(Context* context);
+	glm::ivec2 get_origin(const glm::ivec2& center, uint32_t level) const;
+	uint32_t get_update_cost(const Level& level, const glm::ivec2& origin) const;
+	void update_level(Context* context, uint32_t index, const glm::ivec2& origin);
+	// Rewrite the vertices of the valid levels that read the texels edited since the last frame
+	void apply_edits(Context* context);
+	// Rows [zMin, zMax] and columns [xMin, xMax] of a level in vertex, written at their toroidal position
+	void write_rows(Context* context, uint32_t index, int zMin, int zMax, int xMin);
+	void write_columns(Context* context, uint32_t index, int zMin, int zMax, int xMin, int xMax);
+	TerrainVertex build_vertex(const Level& level, const glm::ivec2& position);
+	uint32_t get_slot(int position) const;
+	void upload_vertices(Context* context, uint32_t index, uint32_t firstSlot, uint32_t count);
+	void build_draws(Context* context);
+};
@@ -0,0 +1,118 @@
+#include "terrain_culling.h"
+
+#include "common/common.h"
+#include "core/frustum.h"
+#include "renderer/pipeline.h"
+#include "renderer/context.h"
+#include "renderer/device.h"
+#include "renderer/buffer.h"
+#include "renderer/shaderbinding.h"
+
+static const uint32_t CULL_LOCAL_SIZE = 64;
+
+TerrainCulling::TerrainCulling(uint32_t maxChunkCount) : m_maxChunkCount(maxChunkCount)
+{
+	std::string code = load_file("spirv/terrain_cull.comp.spv");
+	ASSERT(code.size() % 4 == 0);
+	PipelineDescription desc = {};
+	ShaderDescription shader = { ShaderStage::Compute, code, static_cast<uint32_t>(code.size()) };
+	desc.shaderStageCount = 1;
+	desc.shaderStages = &shader;
+	m_pipeline = Device::create_pipeline(desc);
+
+	m_chunkBuffer = Device::create_shader_storage_buffer(BufferUsageHint::DynamicDraw, maxChunkCount * sizeof(ChunkCullData));
+	// Only written by the gpu
+	m_drawBuffer = Device::create_indirect_buffer(BufferUsageHint::StaticDraw, maxChunkCount * sizeof(DrawIndexedIndirectData));
+	m_countBuffer = Device::create_indirect_buffer(BufferUsageHint::StaticDraw, sizeof(uint32_t));
+
+	m_bindings = Device::create_shader_bindings();
+	m_bindings->set_buffer(m_chunkBuffer, 0);
+	m_bindings->set_buffer(m_drawBuffer, 1);
+	m_bindings->set_buffer(m_countBuffer, 2);
+}
+
+std::array<glm::vec4, 6> TerrainCulling::get_planes(const Frustum& frustum)
+{
+	std::array<glm::vec4, 6> planes;
+	const std::array<Plane, 6>& frustumPlanes = frustum.get_planes();
+	for (int i = 0; i < 6; ++i)
+		planes[i] = glm::vec4(frustumPlanes[i].normal, frustumPlanes[i].distance);
+	return planes;
+}
+
+bool TerrainCulling::is_visible(const std::array<glm::vec4, 6>& planes, const ChunkCullData& chunk)
+{
+	// Box is outside if its corner furthest along the normal is behind one of the plane
+	for (int i = 0; i < 6; ++i)
+	{
+		glm::vec3 normal = glm::vec3(planes[i]);
+		glm::vec3 p = glm::vec3(
+			normal.x >= 0.0f ? chunk.boundsMax.x : chunk.boundsMin.x,
+			normal.y >= 0.0f ? chunk.boundsMax.y : chunk.boundsMin.y,
+			normal.z >= 0.0f ? chunk.boundsMax.z : chunk.boundsMin.z);
+
+		if (glm::dot(normal, p) + planes[i].w < 0.0f)
+			return false;
+	}
+	return true;
+}
+
+void TerrainCulling::cull(const std::array<glm::vec4, 6>& planes, const std::vector<ChunkCullData>& chunks, std::vector<DrawIndexedIndirectData>& draws)
+{
+	for (auto& chunk : chunks)
+	{
+		if (!is_visible(planes, chunk))
+			continue;
+
+		DrawIndexedIndirectData drawData = {};
+		drawData.indexCount = chunk.indexCount;
+		drawData.instanceCount = 1;
+		drawData.firstIndex = chunk.firstIndex;
+		drawData.vertexOffset = chunk.vertexOffset;
+		drawData.firstInstance = 0;
+		draws.push_back(drawData);
+	}
+}
+
+void TerrainCulling::dispatch(Context* context, const std::array<glm::vec4, 6>& planes, const std::vector<ChunkCullData>& chunks)
+{
+	ASSERT(chunks.size() <= m_maxChunkCount);
+	m_chunkCount = static_cast<uint32_t>(chunks.size());
+
+	// The staged copy is submitted before the frame command buffer
+	uint32_t drawCount = 0;
+	context->copy(m_countBuffer, &drawCount, 0, sizeof(uint32_t));
+	if (m_chunkCount == 0)
+		return;
+
+	context->copy(m_chunkBuffer, (void*)chunks.data(), 0, m_chunkCount * sizeof(ChunkCullData));
+	context->update_pipeline(m_pipeline, &m_bindings, 1);
+	context->set_pipeline(m_pipeline);
+
+	struct PushConstants
+	{
+		glm::vec4 planes[6];
+		uint32_t chunkCount;
+	} pushConstants;
+	for (int i = 0; i < 6; ++i)
+		pushConstants.planes[i] = planes[i];
+	pushConstants.chunkCount = m_chunkCount;
+	context->set_uniform(ShaderStage::Compute, 0, sizeof(PushConstants), &pushConstants);
+	context->dispatch_compute((m_chunkCount + CULL_LOCAL_SIZE - 1) / CULL_LOCAL_SIZE, 1, 1);
+}
+
+void TerrainCulling::draw(Context* context)
+{
+	if (m_chunkCount == 0)
+		return;
+	context->draw_indexed_indirect_count(m_drawBuffer, 0, m_countBuffer, 0, m_chunkCount, sizeof(DrawIndexedIndirectData));
+}
+
+void TerrainCulling::destroy()
+{
+	Device::destroy_pipeline(m_pipeline);
+	Device::destroy_shader_bindings(m_bindings);
+	Device::destroy_buffer(m_chunkBuffer);
+	Device::destroy_buffer(m_drawBuffer);
+	Device::destroy_buffer(m_countBuffer);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "core/math.h"
+#include <stdint.h>
+#include <vector>
+#include <array>
+
+class Context;
+class Pipeline;
+class ShaderBindings;
+class ShaderStorageBuffer;
+class IndirectBuffer;
+class Frustum;
+struct DrawIndexedIndirectData;
+
+// Input of the culling kernel for a single chunk, matches the std430 layout of terrain_cull.comp
+struct ChunkCullData
+{
+	glm::vec4 boundsMin;
+	glm::vec4 boundsMax;
+	uint32_t indexCount;
+	int32_t vertexOffset;
+	// Stitching variant of the chunk in the shared index buffer
+	uint32_t firstIndex;
+	uint32_t padding;
+};
+
+// Frustum culling of the terrain chunks on the gpu, the visible chunks
+// are written as a compacted list of indirect draw
+class TerrainCulling
+{
+public:
+	TerrainCulling(uint32_t maxChunkCount);
+
+	// Plane as (normal, distance) with normal facing inside the frustum
+	static std::array<glm::vec4, 6> get_planes(const Frustum& frustum);
+
+	// Cpu reference of terrain_cull.comp, used when the gpu path is not available
+	static bool is_visible(const std::array<glm::vec4, 6>& planes, const ChunkCullData& chunk);
+	static void cull(const std::array<glm::vec4, 6>& planes, const std::vector<ChunkCullData>& chunks, std::vector<DrawIndexedIndirectData>& draws);
+
+	// Upload the chunks and record the culling dispatch, must be recorded outside of a renderpass
+	void dispatch(Context* context, const std::array<glm::vec4, 6>& planes, const std::vector<ChunkCullData>& chunks);
+	// Draw count is read from the gpu, the vertex and index buffer must already be bound
+	void draw(Context* context);
+
+	void destroy();
+private:
+	Pipeline* m_pipeline;
+	ShaderBindings* m_bindings;
+
+	ShaderStorageBuffer* m_chunkBuffer;
+	IndirectBuffer* m_drawBuffer;
+	IndirectBuffer* m_countBuffer;
+
+	uint32_t m_maxChunkCount;
+	uint32_t m_chunkCount = 0;
+};
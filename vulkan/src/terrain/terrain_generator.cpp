@@ -0,0 +1,325 @@
+#include "terrain_generator.h"
+#include "core/job_system.h"
+#include "core/hash.h"
+#include "core/simd.h"
+
+#include <algorithm>
+#include <random>
+#include <cmath>
+#include <cstring>
+
+// Gradient of the hash as gx * x + gy * y, the z = 0 slice of the 16 gradients of the improved noise
+static const float GRADIENT_X[16] = { 1.0f, -1.0f, 1.0f, -1.0f, 1.0f, -1.0f, 1.0f, -1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, -1.0f, 0.0f };
+static const float GRADIENT_Y[16] = { 1.0f, 1.0f, -1.0f, -1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, -1.0f, 1.0f, -1.0f, 1.0f, -1.0f, 1.0f, -1.0f };
+
+static inline float fade(float t)
+{
+	return t * t * t * (t * (t * 6.0f - 15.0f) + 10.0f);
+}
+
+static inline float lerp(float t, float a, float b)
+{
+	return a + t * (b - a);
+}
+
+static inline float gradient(uint8_t hash, float x, float y)
+{
+	return GRADIENT_X[hash & 15] * x + GRADIENT_Y[hash & 15] * y;
+}
+
+#if defined(SIMD_SSE2)
+// SSE2 has no floor, truncate and step down the negative values
+static inline __m128 floor_simd(__m128 v)
+{
+	__m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(v));
+	return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, v), _mm_set1_ps(1.0f)));
+}
+
+static inline __m128 fade_simd(__m128 t)
+{
+	__m128 a = _mm_mul_ps(_mm_mul_ps(t, t), t);
+	__m128 b = _mm_add_ps(_mm_mul_ps(t, _mm_sub_ps(_mm_mul_ps(t, _mm_set1_ps(6.0f)), _mm_set1_ps(15.0f))), _mm_set1_ps(10.0f));
+	return _mm_mul_ps(a, b);
+}
+
+static inline __m128 lerp_simd(__m128 t, __m128 a, __m128 b)
+{
+	return _mm_add_ps(a, _mm_mul_ps(t, _mm_sub_ps(b, a)));
+}
+
+// Four noise at once in the same order as TerrainGenerator::noise, the hashes are looked up per lane
+static __m128 noise_simd(const uint8_t* p, __m128 x, __m128 y)
+{
+	__m128 fx = floor_simd(x);
+	__m128 fy = floor_simd(y);
+	alignas(16) int32_t ix[4];
+	alignas(16) int32_t iy[4];
+	_mm_store_si128(reinterpret_cast<__m128i*>(ix), _mm_cvttps_epi32(fx));
+	_mm_store_si128(reinterpret_cast<__m128i*>(iy), _mm_cvttps_epi32(fy));
+
+	// Corners (0, 0), (1, 0), (0, 1), (1, 1)
+	alignas(16) float gx[4][4];
+	alignas(16) float gy[4][4];
+	for (int lane = 0; lane < 4; ++lane)
+	{
+		int X = ix[lane] & 255;
+		int Y = iy[lane] & 255;
+		int A = p[X] + Y;
+		int B = p[X + 1] + Y;
+		uint8_t hashes[4] = { p[p[A]], p[p[B]], p[p[A + 1]], p[p[B + 1]] };
+		for (int corner = 0; corner < 4; ++corner)
+		{
+			gx[corner][lane] = GRADIENT_X[hashes[corner] & 15];
+			gy[corner][lane] = GRADIENT_Y[hashes[corner] & 15];
+		}
+	}
+
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 x0 = _mm_sub_ps(x, fx);
+	__m128 y0 = _mm_sub_ps(y, fy);
+	__m128 x1 = _mm_sub_ps(x0, one);
+	__m128 y1 = _mm_sub_ps(y0, one);
+	__m128 u = fade_simd(x0);
+	__m128 v = fade_simd(y0);
+
+	__m128 g00 = _mm_add_ps(_mm_mul_ps(_mm_load_ps(gx[0]), x0), _mm_mul_ps(_mm_load_ps(gy[0]), y0));
+	__m128 g10 = _mm_add_ps(_mm_mul_ps(_mm_load_ps(gx[1]), x1), _mm_mul_ps(_mm_load_ps(gy[1]), y0));
+	__m128 g01 = _mm_add_ps(_mm_mul_ps(_mm_load_ps(gx[2]), x0), _mm_mul_ps(_mm_load_ps(gy[2]), y1));
+	__m128 g11 = _mm_add_ps(_mm_mul_ps(_mm_load_ps(gx[3]), x1), _mm_mul_ps(_mm_load_ps(gy[3]), y1));
+	return lerp_simd(v, lerp_simd(u, g00, g10), lerp_simd(u, g01, g11));
+}
+#endif
+
+TerrainGenerator::TerrainGenerator(const PerlinGenerator& generator, bool reference) : m_generator(generator), m_reference(reference)
+{
+	ASSERT(generator.octaves > 0);
+
+	// Same shuffle as siv::PerlinNoise::reseed
+	for (uint32_t i = 0; i < 256; ++i)
+		m_permutation[i] = static_cast<uint8_t>(i);
+	std::shuffle(m_permutation, m_permutation + 256, std::default_random_engine(generator.seed));
+	for (uint32_t i = 0; i < 256; ++i)
+		m_permutation[256 + i] = m_permutation[i];
+
+	float amplitude = generator.amplitude;
+	float frequency = generator.frequency;
+	m_normalization = 0.0f;
+	for (uint32_t i = 0; i < generator.octaves; ++i)
+	{
+		m_amplitudes.push_back(amplitude);
+		m_frequencies.push_back(frequency);
+		m_normalization += amplitude;
+		amplitude *= generator.gain;
+		frequency *= generator.lacunarity;
+	}
+}
+
+float TerrainGenerator::noise(float x, float y) const
+{
+	const uint8_t* p = m_permutation;
+	float fx = std::floor(x);
+	float fy = std::floor(y);
+	int X = static_cast<int>(fx) & 255;
+	int Y = static_cast<int>(fy) & 255;
+	x -= fx;
+	y -= fy;
+
+	float u = fade(x);
+	float v = fade(y);
+	int A = p[X] + Y;
+	int B = p[X + 1] + Y;
+	float g00 = gradient(p[p[A]], x, y);
+	float g10 = gradient(p[p[B]], x - 1.0f, y);
+	float g01 = gradient(p[p[A + 1]], x, y - 1.0f);
+	float g11 = gradient(p[p[B + 1]], x - 1.0f, y - 1.0f);
+	return lerp(v, lerp(u, g00, g10), lerp(u, g01, g11));
+}
+
+void TerrainGenerator::generate_row_scalar(int x, int y, int count, float* out) const
+{
+	uint32_t octaveCount = static_cast<uint32_t>(m_frequencies.size());
+	for (int i = 0; i < count; ++i)
+	{
+		float total = 0.0f;
+		float previous = 1.0f;
+		for (uint32_t o = 0; o < octaveCount; ++o)
+		{
+			float frequency = m_frequencies[o];
+			float n = noise(float(x + i) * frequency, float(y) * frequency);
+			switch (m_generator.type)
+			{
+			case NoiseType::Fbm:
+				total += m_amplitudes[o] * (n * 0.5f + 0.5f);
+				break;
+			case NoiseType::Ridged:
+				n = m_generator.ridgeOffset - std::abs(n);
+				n = n * n;
+				total += n * m_amplitudes[o] * previous;
+				previous = n;
+				break;
+			case NoiseType::Billow:
+				total += m_amplitudes[o] * std::abs(n);
+				break;
+			}
+		}
+		out[i] = total / m_normalization * 2.0f - 1.0f;
+	}
+}
+
+void TerrainGenerator::generate_row_simd(int x, int y, int count, float* out) const
+{
+	int i = 0;
+#if defined(SIMD_SSE2)
+	__m128 zero = _mm_setzero_ps();
+	__m128 half = _mm_set1_ps(0.5f);
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 two = _mm_set1_ps(2.0f);
+	__m128 offset = _mm_set1_ps(m_generator.ridgeOffset);
+	__m128 normalization = _mm_set1_ps(m_normalization);
+	__m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	__m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+	__m128 fy = _mm_set1_ps(float(y));
+	uint32_t octaveCount = static_cast<uint32_t>(m_frequencies.size());
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 fx = _mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32(x + i), lanes));
+		__m128 total = zero;
+		__m128 previous = one;
+		for (uint32_t o = 0; o < octaveCount; ++o)
+		{
+			__m128 frequency = _mm_set1_ps(m_frequencies[o]);
+			__m128 amplitude = _mm_set1_ps(m_amplitudes[o]);
+			__m128 n = noise_simd(m_permutation, _mm_mul_ps(fx, frequency), _mm_mul_ps(fy, frequency));
+			switch (m_generator.type)
+			{
+			case NoiseType::Fbm:
+				total = _mm_add_ps(total, _mm_mul_ps(amplitude, _mm_add_ps(_mm_mul_ps(n, half), half)));
+				break;
+			case NoiseType::Ridged:
+				n = _mm_sub_ps(offset, _mm_and_ps(n, absMask));
+				n = _mm_mul_ps(n, n);
+				total = _mm_add_ps(total, _mm_mul_ps(_mm_mul_ps(n, amplitude), previous));
+				previous = n;
+				break;
+			case NoiseType::Billow:
+				total = _mm_add_ps(total, _mm_mul_ps(amplitude, _mm_and_ps(n, absMask)));
+				break;
+			}
+		}
+		_mm_storeu_ps(out + i, _mm_sub_ps(_mm_mul_ps(_mm_div_ps(total, normalization), two), one));
+	}
+#endif
+	generate_row_scalar(x + i, y, count - i, out + i);
+}
+
+void TerrainGenerator::generate_row(int x, int y, int count, float* out) const
+{
+	if (m_reference)
+		generate_row_scalar(x, y, count, out);
+	else
+		generate_row_simd(x, y, count, out);
+
+	if (m_generator.exponent != 1.0f)
+	{
+		for (int i = 0; i < count; ++i)
+			out[i] = std::pow(out[i], m_generator.exponent);
+	}
+}
+
+void TerrainGenerator::generate_rect(const glm::ivec2& min, const glm::ivec2& max, float* out) const
+{
+	int width = max.x - min.x + 1;
+	for (int y = min.y; y <= max.y; ++y)
+		generate_row(min.x, y, width, out + (y - min.y) * width);
+}
+
+void TerrainGenerator::generate(float* out, JobSystem* jobSystem) const
+{
+	int width = static_cast<int>(m_generator.width);
+	int height = static_cast<int>(m_generator.height);
+	for (int band = 0; band < height; band += BAND_SIZE)
+	{
+		jobSystem->execute([this, out, band, width, height]() {
+			int last = std::min(band + BAND_SIZE, height);
+			for (int y = band; y < last; ++y)
+				generate_row(0, y, width, out + uint64_t(y) * width);
+		});
+	}
+	jobSystem->wait();
+}
+
+glm::vec2 TerrainGenerator::get_height_bound() const
+{
+	// |noise| <= 1 so every octave term is at least zero, the largest weighted sum depends on the type
+	float total = m_normalization;
+	if (m_generator.type == NoiseType::Ridged)
+	{
+		float offset = m_generator.ridgeOffset;
+		float peak = std::max(offset * offset, (offset - 1.0f) * (offset - 1.0f));
+		float previous = 1.0f;
+		total = 0.0f;
+		for (float amplitude : m_amplitudes)
+		{
+			total += peak * amplitude * previous;
+			previous = peak;
+		}
+	}
+
+	// The margin covers the rounding of the kernels
+	const float margin = 1e-4f;
+	glm::vec2 bound = glm::vec2(-1.0f, total / m_normalization * 2.0f - 1.0f);
+	if (m_generator.exponent != 1.0f)
+		bound.y = std::max(std::pow(std::max(bound.y, 0.0f), m_generator.exponent), 1.0f);
+	return bound + glm::vec2(-margin, margin);
+}
+
+uint64_t TerrainGenerator::get_settings_hash() const
+{
+	auto hash_float = [](uint64_t hash, float v) {
+		uint32_t bits;
+		memcpy(&bits, &v, sizeof(uint32_t));
+		return hash_combine(hash, bits);
+	};
+
+	uint64_t hash = hash_combine(uint64_t(m_generator.width), uint64_t(m_generator.height));
+	hash = hash_combine(hash, m_generator.seed);
+	hash = hash_combine(hash, m_generator.octaves);
+	hash = hash_combine(hash, uint64_t(m_generator.type));
+	hash = hash_float(hash, m_generator.amplitude);
+	hash = hash_float(hash, m_generator.exponent);
+	hash = hash_float(hash, m_generator.frequency);
+	hash = hash_float(hash, m_generator.lacunarity);
+	hash = hash_float(hash, m_generator.gain);
+	return hash_float(hash, m_generator.ridgeOffset);
+}
+
+TerrainProceduralSource::TerrainProceduralSource(const PerlinGenerator& generator, uint32_t tileSize) : m_generator(generator), m_tileSize(tileSize)
+{
+	ASSERT_MSG(tileSize >= 2 && (tileSize & (tileSize - 1)) == 0, "Tile size must be a power of two");
+	m_heightBound = m_generator.get_height_bound();
+	m_contentHash = hash_combine(m_generator.get_settings_hash(), tileSize);
+}
+
+void TerrainProceduralSource::load_tile(uint32_t tileIndex, uint8_t* out) const
+{
+	int tileSize = static_cast<int>(m_tileSize);
+	int minX = int(tileIndex % get_tile_count_x()) * tileSize;
+	int minY = int(tileIndex / get_tile_count_x()) * tileSize;
+	int width = std::min(tileSize, int(get_width()) - minX);
+	int height = std::min(tileSize, int(get_height()) - minY);
+
+	float* heights = reinterpret_cast<float*>(out);
+	for (int y = 0; y < tileSize; ++y)
+	{
+		float* row = heights + y * tileSize;
+		int validCount = y < height ? width : 0;
+		if (validCount > 0)
+			m_generator.generate_rect(glm::ivec2(minX, minY + y), glm::ivec2(minX + validCount - 1, minY + y), row);
+		std::fill(row + validCount, row + tileSize, 0.0f);
+	}
+}
+
+void TerrainProceduralSource::read_row(int x, int y, int count, float* out) const
+{
+	m_generator.generate_rect(glm::ivec2(x, y), glm::ivec2(x + count - 1, y), out);
+}
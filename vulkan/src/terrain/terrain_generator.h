@@ -0,0 +1,109 @@
+#pragma once
+
+#include "core/base.h"
+#include "core/math.h"
+#include <vector>
+
+#include "terrain_tile_source.h"
+
+class JobSystem;
+
+enum class NoiseType
+{
+	// Sum of octaves of perlin noise
+	Fbm,
+	// Octaves of (offset - |noise|)^2 weighted by the previous octave, sharp crests
+	Ridged,
+	// Octaves of |noise|, round hills and sharp valleys
+	Billow
+};
+
+struct PerlinGenerator
+{
+	float amplitude = 1.0f;
+	float exponent = 1.0f;
+	float frequency = 0.1f;
+	float lacunarity = 2.0f;
+	float gain = 0.5f;
+	uint32_t octaves = 5;
+	uint32_t width = 512;
+	uint32_t height = 512;
+	uint32_t seed = 532;
+	NoiseType type = NoiseType::Fbm;
+	float ridgeOffset = 1.0f;
+};
+
+// Float perlin noise with the permutation siv::PerlinNoise uses for the same seed
+// A texel only depends on its coordinate so the output doesn't depend on the worker count or on
+// the rects it is generated in
+class TerrainGenerator
+{
+public:
+	// reference picks the scalar kernel, the SIMD one is bit exact with it
+	TerrainGenerator(const PerlinGenerator& generator, bool reference = false);
+
+	// Noise in [-1, 1] at (x, y), the z = 0 slice of the improved perlin noise
+	float noise(float x, float y) const;
+
+	// Heights of the texel rect [min, max] (inclusive), row by row
+	void generate_rect(const glm::ivec2& min, const glm::ivec2& max, float* out) const;
+	// Heights of the whole width x height map, bands of rows are generated in parallel on jobSystem
+	void generate(float* out, JobSystem* jobSystem) const;
+
+	// Bound of every height the settings can generate, from the range of the noise and the octave weights
+	glm::vec2 get_height_bound() const;
+	// Hash of the settings, identify the generated heights
+	uint64_t get_settings_hash() const;
+	const PerlinGenerator& get_settings() const { return m_generator; }
+
+	// Tables of the kernels, uploaded as is by TerrainGpuGenerator
+	const uint8_t* get_permutation() const { return m_permutation; }
+	const std::vector<float>& get_amplitudes() const { return m_amplitudes; }
+	const std::vector<float>& get_frequencies() const { return m_frequencies; }
+	float get_normalization() const { return m_normalization; }
+
+	// Rows per job of generate
+	static const int BAND_SIZE = 32;
+private:
+	PerlinGenerator m_generator;
+	bool m_reference;
+	uint8_t m_permutation[512];
+	// Per octave, computed once so that both kernels read the same values
+	std::vector<float> m_amplitudes;
+	std::vector<float> m_frequencies;
+	float m_normalization = 1.0f;
+
+	void generate_row(int x, int y, int count, float* out) const;
+	void generate_row_scalar(int x, int y, int count, float* out) const;
+	void generate_row_simd(int x, int y, int count, float* out) const;
+};
+
+// Tiles of a TerrainGenerator generated on first access, nothing is stored so the map can be far
+// larger than the memory, the TerrainTileCache holds the generated tiles within its budget
+class TerrainProceduralSource : public TerrainTileSource
+{
+public:
+	// Map of generator.width x generator.height texel, tileSize is a power of two
+	TerrainProceduralSource(const PerlinGenerator& generator, uint32_t tileSize);
+
+	uint32_t get_width() const override { return m_generator.get_settings().width; }
+	uint32_t get_height() const override { return m_generator.get_settings().height; }
+	uint32_t get_tile_size() const override { return m_tileSize; }
+	HeightFormat get_format() const override { return HeightFormat::Float; }
+
+	// Every tile has the bound of the generator until it is generated
+	glm::vec2 get_tile_range(uint32_t /*tileIndex*/) const override { return m_heightBound; }
+	bool has_exact_tile_ranges() const override { return false; }
+	uint64_t get_content_hash() const override { return m_contentHash; }
+
+	// The texel of the tile past the edge of the map are zero
+	void load_tile(uint32_t tileIndex, uint8_t* out) const override;
+	void read_row(int x, int y, int count, float* out) const override;
+
+	void destroy() override {}
+private:
+	TerrainGenerator m_generator;
+	uint32_t m_tileSize;
+	glm::vec2 m_heightBound;
+	uint64_t m_contentHash;
+};
@@ -0,0 +1,297 @@
+#include "terrain_gpu_generator.h"
+#include "terrain_generator.h"
+#include "terrain_chunk.h"
+
+#include "common/common.h"
+#include "renderer/pipeline.h"
+#include "renderer/context.h"
+#include "renderer/device.h"
+#include "renderer/buffer.h"
+#include "renderer/shaderbinding.h"
+
+#include <algorithm>
+#include <cfloat>
+
+// Must match GENERATOR_LOCAL_SIZE of terrain_generator.h
+static const uint32_t GENERATOR_LOCAL_SIZE = 16;
+
+TerrainGpuGenerator::TerrainGpuGenerator(Context* context, const PerlinGenerator& generator, uint32_t tileSize, float maxHeight, uint32_t maxTileCount) :
+	m_tileSize(tileSize), m_maxTileCount(maxTileCount)
+{
+	ASSERT_MSG(tileSize >= GENERATOR_LOCAL_SIZE && (tileSize & (tileSize - 1)) == 0, "Tile size must be a power of two of at least 16");
+	ASSERT_MSG(generator.octaves <= MAX_OCTAVES, "Too many octaves for the gpu generator");
+	ASSERT(uint64_t(tileSize + 2) * (tileSize + 2) * maxTileCount * sizeof(float) <= UINT32_MAX);
+
+	m_heightPipeline = create_pipeline("spirv/terrain_generate_heights.comp.spv");
+	m_normalPipeline = create_pipeline("spirv/terrain_generate_normals.comp.spv");
+	m_minMaxPipeline = create_pipeline("spirv/terrain_generate_minmax.comp.spv");
+
+	// The tables are the one of the cpu kernels so that both generate the same noise
+	TerrainGenerator reference(generator);
+	SettingsData settings = {};
+	for (uint32_t i = 0; i < 512; ++i)
+		settings.permutation[i] = reference.get_permutation()[i];
+	for (uint32_t i = 0; i < generator.octaves; ++i)
+	{
+		settings.amplitudes[i] = reference.get_amplitudes()[i];
+		settings.frequencies[i] = reference.get_frequencies()[i];
+	}
+	m_settingsBuffer = Device::create_shader_storage_buffer(BufferUsageHint::StaticDraw, sizeof(SettingsData));
+	context->copy(m_settingsBuffer, &settings, 0, sizeof(SettingsData));
+
+	uint32_t texelCount = tileSize * tileSize;
+	m_tileBuffer = Device::create_shader_storage_buffer(BufferUsageHint::DynamicDraw, maxTileCount * sizeof(uint32_t));
+	m_apronBuffer = Device::create_shader_storage_buffer(BufferUsageHint::StaticDraw, (tileSize + 2) * (tileSize + 2) * maxTileCount * sizeof(float));
+	// Only written by the gpu, read back for validation
+	m_heightBuffer = Device::create_shader_storage_buffer(BufferUsageHint::StaticRead, texelCount * maxTileCount * sizeof(float));
+	m_normalBuffer = Device::create_shader_storage_buffer(BufferUsageHint::StaticRead, texelCount * maxTileCount * sizeof(uint32_t));
+	m_rangeBuffer = Device::create_shader_storage_buffer(BufferUsageHint::StaticRead, get_range_count(tileSize) * maxTileCount * sizeof(glm::vec2));
+
+	m_heightBindings = Device::create_shader_bindings();
+	m_heightBindings->set_buffer(m_settingsBuffer, 0);
+	m_heightBindings->set_buffer(m_tileBuffer, 1);
+	m_heightBindings->set_buffer(m_apronBuffer, 2);
+
+	m_normalBindings = Device::create_shader_bindings();
+	m_normalBindings->set_buffer(m_tileBuffer, 0);
+	m_normalBindings->set_buffer(m_apronBuffer, 1);
+	m_normalBindings->set_buffer(m_heightBuffer, 2);
+	m_normalBindings->set_buffer(m_normalBuffer, 3);
+
+	m_minMaxBindings = Device::create_shader_bindings();
+	m_minMaxBindings->set_buffer(m_tileBuffer, 0);
+	m_minMaxBindings->set_buffer(m_heightBuffer, 1);
+	m_minMaxBindings->set_buffer(m_rangeBuffer, 2);
+
+	uint32_t tileCountX = (generator.width + tileSize - 1) / tileSize;
+	m_pushConstants.grid = glm::uvec4(generator.width, generator.height, tileSize, tileCountX);
+	m_pushConstants.noise = glm::uvec4(generator.octaves, static_cast<uint32_t>(generator.type), 0, 0);
+	m_pushConstants.params = glm::vec4(generator.ridgeOffset, reference.get_normalization(), generator.exponent, maxHeight);
+}
+
+Pipeline* TerrainGpuGenerator::create_pipeline(const char* filename)
+{
+	std::string code = load_file(filename);
+	ASSERT(code.size() % 4 == 0);
+	PipelineDescription desc = {};
+	ShaderDescription shader = { ShaderStage::Compute, code, static_cast<uint32_t>(code.size()) };
+	desc.shaderStageCount = 1;
+	desc.shaderStages = &shader;
+	return Device::create_pipeline(desc);
+}
+
+uint32_t TerrainGpuGenerator::get_level_count(uint32_t tileSize)
+{
+	uint32_t levelCount = 0;
+	while ((2u << levelCount) <= tileSize)
+		levelCount++;
+	return levelCount;
+}
+
+uint32_t TerrainGpuGenerator::get_level_offset(uint32_t tileSize, uint32_t level)
+{
+	uint32_t offset = 0;
+	for (uint32_t i = 0; i < level; ++i)
+	{
+		uint32_t side = tileSize >> (i + 1);
+		offset += side * side;
+	}
+	return offset;
+}
+
+void TerrainGpuGenerator::dispatch(Context* context, const std::vector<uint32_t>& tileIndices)
+{
+	ASSERT(tileIndices.size() <= m_maxTileCount);
+	m_tileCount = static_cast<uint32_t>(tileIndices.size());
+	m_tileIndices = tileIndices;
+	if (m_tileCount == 0)
+		return;
+
+	context->copy(m_tileBuffer, (void*)tileIndices.data(), 0, m_tileCount * sizeof(uint32_t));
+
+	// Heights of the tiles and their border
+	uint32_t apronGroupCount = (m_tileSize + 2 + GENERATOR_LOCAL_SIZE - 1) / GENERATOR_LOCAL_SIZE;
+	m_pushConstants.noise.z = 0;
+	context->update_pipeline(m_heightPipeline, &m_heightBindings, 1);
+	context->set_pipeline(m_heightPipeline);
+	context->set_uniform(ShaderStage::Compute, 0, sizeof(PushConstants), &m_pushConstants);
+	context->dispatch_compute(apronGroupCount, apronGroupCount, m_tileCount);
+
+	uint32_t groupCount = m_tileSize / GENERATOR_LOCAL_SIZE;
+	context->update_pipeline(m_normalPipeline, &m_normalBindings, 1);
+	context->set_pipeline(m_normalPipeline);
+	context->set_uniform(ShaderStage::Compute, 0, sizeof(PushConstants), &m_pushConstants);
+	context->dispatch_compute(groupCount, groupCount, m_tileCount);
+
+	// One dispatch per level, each one reads the level written by the previous one
+	context->update_pipeline(m_minMaxPipeline, &m_minMaxBindings, 1);
+	context->set_pipeline(m_minMaxPipeline);
+	uint32_t levelCount = get_level_count(m_tileSize);
+	for (uint32_t level = 0; level < levelCount; ++level)
+	{
+		uint32_t side = m_tileSize >> (level + 1);
+		groupCount = (side + GENERATOR_LOCAL_SIZE - 1) / GENERATOR_LOCAL_SIZE;
+		m_pushConstants.noise.z = level;
+		context->set_uniform(ShaderStage::Compute, 0, sizeof(PushConstants), &m_pushConstants);
+		context->dispatch_compute(groupCount, groupCount, m_tileCount);
+	}
+}
+
+void TerrainGpuGenerator::read_tile(Context* context, uint32_t slot, float* heights, uint32_t* normals, glm::vec2* ranges)
+{
+	ASSERT(slot < m_tileCount);
+	uint32_t texelCount = m_tileSize * m_tileSize;
+	if (heights)
+		context->read(m_heightBuffer, heights, slot * texelCount * sizeof(float), texelCount * sizeof(float));
+	if (normals)
+		context->read(m_normalBuffer, normals, slot * texelCount * sizeof(uint32_t), texelCount * sizeof(uint32_t));
+	if (ranges)
+	{
+		uint32_t rangeCount = get_range_count(m_tileSize);
+		context->read(m_rangeBuffer, ranges, slot * rangeCount * sizeof(glm::vec2), rangeCount * sizeof(glm::vec2));
+	}
+}
+
+TerrainGpuGenerator::CheckResult TerrainGpuGenerator::check(Context* context, const TerrainGenerator& generator, float tolerance)
+{
+	CheckResult result;
+	result.tileCount = m_tileCount;
+	float maxHeight = m_pushConstants.params.w;
+	uint32_t texelCount = m_tileSize * m_tileSize;
+	uint32_t rangeCount = get_range_count(m_tileSize);
+	std::vector<float> heights(texelCount), referenceHeights(texelCount);
+	std::vector<uint32_t> normals(texelCount), referenceNormals(texelCount);
+	std::vector<glm::vec2> ranges(rangeCount), referenceRanges(rangeCount);
+	for (uint32_t slot = 0; slot < m_tileCount; ++slot)
+	{
+		generate_tile(generator, m_tileIndices[slot], m_tileSize, maxHeight, referenceHeights.data(), referenceNormals.data(), referenceRanges.data());
+		read_tile(context, slot, heights.data(), normals.data(), ranges.data());
+		for (uint32_t i = 0; i < texelCount; ++i)
+		{
+			float error = std::abs(heights[i] - referenceHeights[i]);
+			result.maxHeightError = std::max(result.maxHeightError, error);
+			if (error > tolerance)
+				result.heightMismatchCount++;
+
+			for (int shift = 0; shift < 24; shift += 8)
+			{
+				int a = int((normals[i] >> shift) & 0xff);
+				int b = int((referenceNormals[i] >> shift) & 0xff);
+				if (std::abs(a - b) > 1)
+				{
+					result.normalMismatchCount++;
+					break;
+				}
+			}
+		}
+		for (uint32_t i = 0; i < rangeCount; ++i)
+		{
+			if (std::abs(ranges[i].x - referenceRanges[i].x) > tolerance || std::abs(ranges[i].y - referenceRanges[i].y) > tolerance)
+				result.rangeMismatchCount++;
+		}
+	}
+	return result;
+}
+
+void TerrainGpuGenerator::generate_tile(const TerrainGenerator& generator, uint32_t tileIndex, uint32_t tileSize, float maxHeight,
+	float* heights, uint32_t* normals, glm::vec2* ranges)
+{
+	int width = static_cast<int>(generator.get_settings().width);
+	int height = static_cast<int>(generator.get_settings().height);
+	int size = static_cast<int>(tileSize);
+	int tileCountX = (width + size - 1) / size;
+	glm::ivec2 origin = glm::ivec2(int(tileIndex) % tileCountX, int(tileIndex) / tileCountX) * size;
+
+	// terrain_generate_heights.comp, the border is clamped to the map
+	int apronSize = size + 2;
+	std::vector<float> apron(apronSize * apronSize);
+	std::vector<float> row(apronSize);
+	int firstX = std::max(origin.x - 1, 0);
+	int lastX = std::min(origin.x + size, width - 1);
+	for (int y = 0; y < apronSize; ++y)
+	{
+		int texelY = std::min(std::max(origin.y + y - 1, 0), height - 1);
+		generator.generate_rect(glm::ivec2(firstX, texelY), glm::ivec2(lastX, texelY), row.data());
+		for (int x = 0; x < apronSize; ++x)
+		{
+			int texelX = std::min(std::max(origin.x + x - 1, 0), width - 1);
+			apron[y * apronSize + x] = row[texelX - firstX];
+		}
+	}
+
+	// terrain_generate_normals.comp
+	auto get_apron = [&](int x, int y) {
+		return (apron[y * apronSize + x] * 2.0f - 1.0f) * maxHeight;
+	};
+	for (int y = 0; y < size; ++y)
+	{
+		for (int x = 0; x < size; ++x)
+		{
+			int index = y * size + x;
+			if (origin.x + x >= width || origin.y + y >= height)
+			{
+				heights[index] = 0.0f;
+				normals[index] = 0;
+				continue;
+			}
+
+			float a = get_apron(x + 2, y + 1);
+			float b = get_apron(x, y + 1);
+			float c = get_apron(x + 1, y + 2);
+			float d = get_apron(x + 1, y);
+			heights[index] = apron[(y + 1) * apronSize + x + 1];
+			normals[index] = compress_normal(glm::normalize(glm::vec3(a - b, 1.0f, d - c)));
+		}
+	}
+
+	// terrain_generate_minmax.comp
+	uint32_t levelCount = get_level_count(tileSize);
+	for (uint32_t level = 0; level < levelCount; ++level)
+	{
+		int side = size >> (level + 1);
+		glm::vec2* levelRanges = ranges + get_level_offset(tileSize, level);
+		const glm::vec2* childRanges = level > 0 ? ranges + get_level_offset(tileSize, level - 1) : nullptr;
+		for (int y = 0; y < side; ++y)
+		{
+			for (int x = 0; x < side; ++x)
+			{
+				glm::vec2 range = glm::vec2(FLT_MAX, -FLT_MAX);
+				for (int j = 0; j < 2; ++j)
+				{
+					for (int i = 0; i < 2; ++i)
+					{
+						int cx = x * 2 + i;
+						int cy = y * 2 + j;
+						if (childRanges)
+						{
+							glm::vec2 childRange = childRanges[cy * side * 2 + cx];
+							range = glm::vec2(std::min(range.x, childRange.x), std::max(range.y, childRange.y));
+						}
+						else if (origin.x + cx < width && origin.y + cy < height)
+						{
+							float h = heights[cy * size + cx];
+							range = glm::vec2(std::min(range.x, h), std::max(range.y, h));
+						}
+					}
+				}
+				levelRanges[y * side + x] = range;
+			}
+		}
+	}
+}
+
+void TerrainGpuGenerator::destroy()
+{
+	Device::destroy_pipeline(m_heightPipeline);
+	Device::destroy_pipeline(m_normalPipeline);
+	Device::destroy_pipeline(m_minMaxPipeline);
+	Device::destroy_shader_bindings(m_heightBindings);
+	Device::destroy_shader_bindings(m_normalBindings);
+	Device::destroy_shader_bindings(m_minMaxBindings);
+	Device::destroy_buffer(m_settingsBuffer);
+	Device::destroy_buffer(m_tileBuffer);
+	Device::destroy_buffer(m_apronBuffer);
+	Device::destroy_buffer(m_heightBuffer);
+	Device::destroy_buffer(m_normalBuffer);
+	Device::destroy_buffer(m_rangeBuffer);
+}
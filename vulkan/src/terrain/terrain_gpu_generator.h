@@ -0,0 +1,103 @@
+#pragma once
+
+#include "core/math.h"
+#include <stdint.h>
+#include <vector>
+
+class Context;
+class Pipeline;
+class ShaderBindings;
+class ShaderStorageBuffer;
+class TerrainGenerator;
+struct PerlinGenerator;
+
+// Heights, normals and min/max mips of TerrainGenerator tiles computed on the gpu by the
+// terrain_generate_*.comp passes. A batch of tiles is written to storage buffers, slot i
+// holds the i-th tile of the batch until the next dispatch
+class TerrainGpuGenerator
+{
+public:
+	// tileSize is a power of two of at least 16, maxHeight scales the heights for the normals like create_mesh
+	TerrainGpuGenerator(Context* context, const PerlinGenerator& generator, uint32_t tileSize, float maxHeight, uint32_t maxTileCount);
+
+	// Record the passes for the tiles of the map, must be recorded outside of a renderpass
+	void dispatch(Context* context, const std::vector<uint32_t>& tileIndices);
+	// Blocking readback of a slot of the last dispatch, every output can be null
+	void read_tile(Context* context, uint32_t slot, float* heights, uint32_t* normals, glm::vec2* ranges);
+
+	// Tiles of the last dispatch read back and compared with generate_tile
+	struct CheckResult
+	{
+		uint32_t tileCount = 0;
+		float maxHeightError = 0.0f;
+		// Heights and min/max cells further than the tolerance, normals with an axis more than one step apart
+		uint32_t heightMismatchCount = 0;
+		uint32_t normalMismatchCount = 0;
+		uint32_t rangeMismatchCount = 0;
+	};
+	// Blocking, generator must have the settings the gpu generator has been created with
+	CheckResult check(Context* context, const TerrainGenerator& generator, float tolerance);
+
+	// tileSize x tileSize float per slot, zero past the edge of the map
+	ShaderStorageBuffer* get_height_buffer() { return m_heightBuffer; }
+	// tileSize x tileSize packed normal per slot, see compress_normal
+	ShaderStorageBuffer* get_normal_buffer() { return m_normalBuffer; }
+	// get_range_count(tileSize) (min, max) per slot
+	ShaderStorageBuffer* get_range_buffer() { return m_rangeBuffer; }
+
+	uint32_t get_tile_size() const { return m_tileSize; }
+	uint32_t get_max_tile_count() const { return m_maxTileCount; }
+
+	// Min/max levels of a tile from the finest, level i has (tileSize >> (i + 1))^2 cells of
+	// 2^(i + 1) texel like the TerrainStream pyramid, the last level is the range of the tile
+	static uint32_t get_level_count(uint32_t tileSize);
+	static uint32_t get_level_offset(uint32_t tileSize, uint32_t level);
+	static uint32_t get_range_count(uint32_t tileSize) { return get_level_offset(tileSize, get_level_count(tileSize)); }
+
+	// Cpu reference of the three passes for a tile
+	// Add, multiply and floor round like the gpu, division, normalize and pow differ by a few ulp
+	static void generate_tile(const TerrainGenerator& generator, uint32_t tileIndex, uint32_t tileSize, float maxHeight,
+		float* heights, uint32_t* normals, glm::vec2* ranges);
+
+	void destroy();
+private:
+	// Must match the settings buffer of terrain_generate_heights.comp
+	static const uint32_t MAX_OCTAVES = 16;
+	struct SettingsData
+	{
+		uint32_t permutation[512];
+		float amplitudes[MAX_OCTAVES];
+		float frequencies[MAX_OCTAVES];
+	};
+
+	// Must match the push constants of terrain_generator.h
+	struct PushConstants
+	{
+		glm::uvec4 grid;
+		glm::uvec4 noise;
+		glm::vec4 params;
+	} m_pushConstants;
+
+	uint32_t m_tileSize;
+	uint32_t m_maxTileCount;
+	uint32_t m_tileCount = 0;
+	// Tiles of the last dispatch, slot i holds m_tileIndices[i]
+	std::vector<uint32_t> m_tileIndices;
+
+	Pipeline* m_heightPipeline;
+	Pipeline* m_normalPipeline;
+	Pipeline* m_minMaxPipeline;
+	ShaderBindings* m_heightBindings;
+	ShaderBindings* m_normalBindings;
+	ShaderBindings* m_minMaxBindings;
+
+	ShaderStorageBuffer* m_settingsBuffer;
+	ShaderStorageBuffer* m_tileBuffer;
+	// Heights with a border of one texel, only read by the normal pass
+	ShaderStorageBuffer* m_apronBuffer;
+	ShaderStorageBuffer* m_heightBuffer;
+	ShaderStorageBuffer* m_normalBuffer;
+	ShaderStorageBuffer* m_rangeBuffer;
+
+	static Pipeline* create_pipeline(const char* filename);
+};
@@ -0,0 +1,38 @@
+#include "terrain_height_format.h"
+#include "core/simd.h"
+
+void decode_heights_scalar(const uint16_t* src, uint32_t count, float* dst)
+{
+	for (uint32_t i = 0; i < count; ++i)
+		dst[i] = decode_height(src[i]);
+}
+
+void decode_heights(const uint16_t* src, uint32_t count, float* dst)
+{
+	uint32_t i = 0;
+	// Integer to float conversion is exact below 2^24 so every path gives the same result
+#if defined(SIMD_AVX2)
+	const __m256 scale8 = _mm256_set1_ps(HEIGHT_UINT16_SCALE);
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+		__m256 f = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(v));
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(f, scale8));
+	}
+#endif
+
+#if defined(SIMD_SSE2)
+	const __m128 scale4 = _mm_set1_ps(HEIGHT_UINT16_SCALE);
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+		__m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+		__m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero));
+		_mm_storeu_ps(dst + i, _mm_mul_ps(lo, scale4));
+		_mm_storeu_ps(dst + i + 4, _mm_mul_ps(hi, scale4));
+	}
+#endif
+
+	decode_heights_scalar(src + i, count - i, dst + i);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+
+enum class HeightFormat : uint32_t
+{
+	Float,
+	// Normalized by 65536 like the 16 bit png have always been loaded
+	UInt16
+};
+
+constexpr float HEIGHT_UINT16_SCALE = 1.0f / 65536.0f;
+
+inline float decode_height(uint16_t v)
+{
+	return float(v) * HEIGHT_UINT16_SCALE;
+}
+
+inline uint16_t encode_height(float v)
+{
+	float scaled = v * 65536.0f + 0.5f;
+	if (scaled <= 0.0f)
+		return 0;
+	if (scaled >= 65535.0f)
+		return 65535;
+	return static_cast<uint16_t>(scaled);
+}
+
+inline uint32_t get_height_format_size(HeightFormat format)
+{
+	return format == HeightFormat::UInt16 ? sizeof(uint16_t) : sizeof(float);
+}
+
+// Decode count heights with the widest instruction set available, bit exact with decode_height
+void decode_heights(const uint16_t* src, uint32_t count, float* dst);
+void decode_heights_scalar(const uint16_t* src, uint32_t count, float* dst);
@@ -0,0 +1,290 @@
+#include "terrain_mesh_cache.h"
+#include "core/mapped_file.h"
+#include "core/hash.h"
+#include <algorithm>
+#include <cstring>
+
+static const uint32_t MESH_CACHE_MAGIC = 0x4843534d; // MSCH
+static const uint32_t MESH_CACHE_VERSION = 1;
+static const uint64_t MESH_CACHE_ALIGNMENT = 4096;
+
+static uint64_t align_to(uint64_t value, uint64_t alignment)
+{
+	return (value + alignment - 1) & ~(alignment - 1);
+}
+
+uint64_t TerrainMeshKey::get_hash() const
+{
+	uint64_t hash = hash_combine(heightmapHash, (uint64_t(uint32_t(min.x)) << 32) | uint32_t(min.y));
+	hash = hash_combine(hash, (uint64_t(uint32_t(max.x)) << 32) | uint32_t(max.y));
+	return hash_combine(hash, lod);
+}
+
+TerrainMeshCache::TerrainMeshCache(uint32_t vertexCount, uint64_t layoutHash, uint64_t memoryBudget) :
+	m_vertexCount(vertexCount),
+	m_layoutHash(hash_combine(layoutHash, sizeof(TerrainVertex))),
+	m_memoryBudget(memoryBudget)
+{
+}
+
+std::vector<TerrainVertex>* TerrainMeshCache::find(const TerrainMeshKey& key, glm::vec2& heightRange)
+{
+	uint64_t hash = key.get_hash();
+	auto found = m_entries.find(hash);
+	if (found != m_entries.end() && found->second.key == key)
+	{
+		Entry& entry = found->second;
+		m_lru.splice(m_lru.begin(), m_lru, entry.lruIterator);
+		heightRange = entry.heightRange;
+		m_stats.memoryHits++;
+		return &entry.vertices;
+	}
+
+	uint32_t slot = find_disk_slot(key, hash);
+	if (slot == UINT32_MAX)
+	{
+		m_stats.misses++;
+		return nullptr;
+	}
+
+	touch_disk_slot(slot);
+	Entry& entry = allocate_entry(key, hash);
+	entry.heightRange = m_diskSlots[slot].heightRange;
+	memcpy(entry.vertices.data(), get_slot_data(slot), get_blob_size());
+	heightRange = entry.heightRange;
+	m_stats.diskHits++;
+	return &entry.vertices;
+}
+
+void TerrainMeshCache::insert(const TerrainMeshKey& key, const std::vector<TerrainVertex>& vertices, const glm::vec2& heightRange, bool persistent)
+{
+	ASSERT(vertices.size() == m_vertexCount);
+	uint64_t hash = key.get_hash();
+	Entry& entry = allocate_entry(key, hash);
+	entry.heightRange = heightRange;
+	memcpy(entry.vertices.data(), vertices.data(), get_blob_size());
+	m_stats.insertions++;
+
+	if (m_diskFile && persistent)
+		write_disk_slot(key, hash, vertices, heightRange);
+}
+
+uint32_t TerrainMeshCache::invalidate(const std::function<bool(const TerrainMeshKey&)>& predicate)
+{
+	uint32_t count = 0;
+	for (auto it = m_entries.begin(); it != m_entries.end();)
+	{
+		if (predicate(it->second.key))
+		{
+			m_lru.erase(it->second.lruIterator);
+			it = m_entries.erase(it);
+			count++;
+		}
+		else
+			++it;
+	}
+
+	// The slot goes to the back of the lru where it is reused first
+	for (auto it = m_diskIndex.begin(); it != m_diskIndex.end();)
+	{
+		uint32_t slot = it->second;
+		if (predicate(m_diskSlots[slot].key))
+		{
+			m_diskSlots[slot].valid = 0;
+			m_diskLru.splice(m_diskLru.end(), m_diskLru, m_diskLruIterators[slot]);
+			it = m_diskIndex.erase(it);
+			count++;
+		}
+		else
+			++it;
+	}
+
+	m_stats.invalidated += count;
+	return count;
+}
+
+TerrainMeshCache::Entry& TerrainMeshCache::allocate_entry(const TerrainMeshKey& key, uint64_t hash)
+{
+	auto found = m_entries.find(hash);
+	if (found == m_entries.end())
+	{
+		// Make room first so that the new entry is never the one evicted
+		evict_over_budget(m_memoryBudget > get_blob_size() ? m_memoryBudget - get_blob_size() : 0);
+		found = m_entries.emplace(hash, Entry{}).first;
+		m_lru.push_front(hash);
+		found->second.lruIterator = m_lru.begin();
+		found->second.vertices.resize(m_vertexCount);
+	}
+	else
+		m_lru.splice(m_lru.begin(), m_lru, found->second.lruIterator);
+
+	found->second.key = key;
+	return found->second;
+}
+
+void TerrainMeshCache::evict_over_budget(uint64_t budget)
+{
+	while (!m_lru.empty() && get_memory_size() > budget)
+	{
+		m_entries.erase(m_lru.back());
+		m_lru.pop_back();
+		m_stats.evictions++;
+	}
+}
+
+void TerrainMeshCache::set_memory_budget(uint64_t budget)
+{
+	m_memoryBudget = budget;
+	evict_over_budget(m_memoryBudget);
+}
+
+uint64_t TerrainMeshCache::get_slot_stride() const
+{
+	return align_to(get_blob_size(), MESH_CACHE_ALIGNMENT);
+}
+
+bool TerrainMeshCache::open_disk_cache(const char* filename, uint32_t slotCount)
+{
+	close_disk_cache();
+	ASSERT(slotCount > 0);
+
+	uint64_t slotDataOffset = align_to(sizeof(DiskHeader) + uint64_t(slotCount) * sizeof(DiskSlot), MESH_CACHE_ALIGNMENT);
+	uint64_t fileSize = slotDataOffset + uint64_t(slotCount) * get_slot_stride();
+	Ref<MappedFile> file = CreateRef<MappedFile>(filename, fileSize);
+	if (!file->is_valid())
+	{
+		Debug_Error("Failed to map terrain mesh cache %s", filename);
+		file->destroy();
+		return false;
+	}
+
+	uint8_t* data = file->get_writable_data();
+	DiskHeader* header = reinterpret_cast<DiskHeader*>(data);
+	m_diskSlots = reinterpret_cast<DiskSlot*>(data + sizeof(DiskHeader));
+	m_diskData = data + slotDataOffset;
+
+	// Written by another version or with other mesh parameters, start from an empty cache
+	if (header->magic != MESH_CACHE_MAGIC || header->version != MESH_CACHE_VERSION || header->slotCount != slotCount ||
+		header->vertexCount != m_vertexCount || header->layoutHash != m_layoutHash || header->slotDataOffset != slotDataOffset)
+	{
+		header->magic = 0;
+		memset(m_diskSlots, 0, uint64_t(slotCount) * sizeof(DiskSlot));
+		header->version = MESH_CACHE_VERSION;
+		header->slotCount = slotCount;
+		header->vertexCount = m_vertexCount;
+		header->layoutHash = m_layoutHash;
+		header->slotDataOffset = slotDataOffset;
+		header->magic = MESH_CACHE_MAGIC;
+	}
+
+	// Rebuild the index and the lru from the slot table, the page of a slot is only read on hit
+	std::vector<uint32_t> order(slotCount);
+	for (uint32_t i = 0; i < slotCount; ++i)
+	{
+		order[i] = i;
+		const DiskSlot& slot = m_diskSlots[i];
+		if (slot.valid)
+		{
+			m_diskIndex[slot.key.get_hash()] = i;
+			m_diskUseCounter = std::max(m_diskUseCounter, slot.lastUse);
+		}
+	}
+	std::sort(order.begin(), order.end(), [this](uint32_t lhs, uint32_t rhs) {
+		const DiskSlot& a = m_diskSlots[lhs];
+		const DiskSlot& b = m_diskSlots[rhs];
+		if (a.valid != b.valid)
+			return a.valid > b.valid;
+		return a.lastUse > b.lastUse;
+	});
+
+	m_diskLruIterators.resize(slotCount);
+	for (uint32_t slot : order)
+	{
+		m_diskLru.push_back(slot);
+		m_diskLruIterators[slot] = std::prev(m_diskLru.end());
+	}
+
+	m_diskFile = file;
+	return true;
+}
+
+void TerrainMeshCache::close_disk_cache()
+{
+	if (m_diskFile == nullptr)
+		return;
+
+	m_diskFile->destroy();
+	m_diskFile = nullptr;
+	m_diskSlots = nullptr;
+	m_diskData = nullptr;
+	m_diskUseCounter = 0;
+	m_diskIndex.clear();
+	m_diskLru.clear();
+	m_diskLruIterators.clear();
+}
+
+uint32_t TerrainMeshCache::find_disk_slot(const TerrainMeshKey& key, uint64_t hash)
+{
+	if (m_diskFile == nullptr)
+		return UINT32_MAX;
+
+	auto found = m_diskIndex.find(hash);
+	if (found == m_diskIndex.end())
+		return UINT32_MAX;
+
+	uint32_t slot = found->second;
+	DiskSlot& diskSlot = m_diskSlots[slot];
+	if (!(diskSlot.key == key))
+		return UINT32_MAX;
+
+	if (hash_bytes(get_slot_data(slot), get_blob_size()) != diskSlot.checksum)
+	{
+		diskSlot.valid = 0;
+		m_diskIndex.erase(found);
+		m_diskLru.splice(m_diskLru.end(), m_diskLru, m_diskLruIterators[slot]);
+		m_stats.corruptedSlots++;
+		return UINT32_MAX;
+	}
+	return slot;
+}
+
+void TerrainMeshCache::write_disk_slot(const TerrainMeshKey& key, uint64_t hash, const std::vector<TerrainVertex>& vertices, const glm::vec2& heightRange)
+{
+	uint32_t slot;
+	auto found = m_diskIndex.find(hash);
+	if (found != m_diskIndex.end())
+		slot = found->second;
+	else
+	{
+		// Least recently used or free slot
+		slot = m_diskLru.back();
+		if (m_diskSlots[slot].valid)
+			m_diskIndex.erase(m_diskSlots[slot].key.get_hash());
+		m_diskIndex[hash] = slot;
+	}
+
+	// Invalidated during the write, an interrupted write is then caught by the checksum
+	DiskSlot& diskSlot = m_diskSlots[slot];
+	diskSlot.valid = 0;
+	memcpy(get_slot_data(slot), vertices.data(), get_blob_size());
+	diskSlot.key = key;
+	diskSlot.key.padding = 0;
+	diskSlot.heightRange = heightRange;
+	diskSlot.checksum = hash_bytes(vertices.data(), get_blob_size());
+	diskSlot.valid = 1;
+	touch_disk_slot(slot);
+	m_stats.diskWrites++;
+}
+
+void TerrainMeshCache::touch_disk_slot(uint32_t slot)
+{
+	m_diskSlots[slot].lastUse = ++m_diskUseCounter;
+	m_diskLru.splice(m_diskLru.begin(), m_diskLru, m_diskLruIterators[slot]);
+}
+
+void TerrainMeshCache::destroy()
+{
+	close_disk_cache();
+	m_entries.clear();
+	m_lru.clear();
+}
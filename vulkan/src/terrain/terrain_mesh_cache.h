@@ -0,0 +1,149 @@
+#pragma once
+
+#include "core/base.h"
+#include "core/math.h"
+#include <unordered_map>
+#include <vector>
+#include <list>
+#include <functional>
+
+#include "terrain_chunk.h"
+
+class MappedFile;
+
+// Identify a mesh built by TerrainChunk::create_mesh, heightmapHash is the content hash of the stream
+struct TerrainMeshKey
+{
+	glm::ivec2 min;
+	glm::ivec2 max;
+	uint32_t lod;
+	uint32_t padding;
+	uint64_t heightmapHash;
+
+	bool operator==(const TerrainMeshKey& rhs) const
+	{
+		return min == rhs.min && max == rhs.max && lod == rhs.lod && heightmapHash == rhs.heightmapHash;
+	}
+	uint64_t get_hash() const;
+};
+
+// Second level cache of the chunk meshes evicted from the pool
+// The compressed vertices are kept in a least recently used cache in memory, optionally backed by
+// a memory mapped file so that they survive eviction from memory and the application restart
+// Every blob has the same size, the file is a fixed number of slot replaced in lru order
+// Only used from the main thread
+class TerrainMeshCache
+{
+public:
+	// vertexCount is the number of TerrainVertex of a mesh, layoutHash identify the parameters
+	// of the mesh build that are not part of the key like the grid size or the height range
+	TerrainMeshCache(uint32_t vertexCount, uint64_t layoutHash, uint64_t memoryBudget);
+
+	// Resident vertices of the mesh, valid until the next insert or find
+	// Meshes read from the disk cache are copied in memory first
+	std::vector<TerrainVertex>* find(const TerrainMeshKey& key, glm::vec2& heightRange);
+	// A mesh that is not persistent is kept out of the disk cache, used for the meshes of edited heights
+	// which are not part of the key and would be wrong once the heightmap is loaded again
+	void insert(const TerrainMeshKey& key, const std::vector<TerrainVertex>& vertices, const glm::vec2& heightRange, bool persistent = true);
+	// Drop the meshes for which predicate returns true from memory and from the disk cache
+	// Returns the number of memory entries and disk slots dropped
+	uint32_t invalidate(const std::function<bool(const TerrainMeshKey&)>& predicate);
+
+	// Map filename with slotCount mesh, the slots written by a previous run with the same layout are reused
+	bool open_disk_cache(const char* filename, uint32_t slotCount);
+	void close_disk_cache();
+	bool has_disk_cache() const { return m_diskFile != nullptr; }
+
+	uint64_t get_memory_budget() const { return m_memoryBudget; }
+	void set_memory_budget(uint64_t budget);
+	uint64_t get_memory_size() const { return m_entries.size() * get_blob_size(); }
+	uint32_t get_entry_count() const { return static_cast<uint32_t>(m_entries.size()); }
+	uint32_t get_disk_entry_count() const { return static_cast<uint32_t>(m_diskIndex.size()); }
+	uint32_t get_disk_slot_count() const { return static_cast<uint32_t>(m_diskLruIterators.size()); }
+	uint64_t get_blob_size() const { return uint64_t(m_vertexCount) * sizeof(TerrainVertex); }
+
+	// Counted since the creation of the cache or the last reset_stats
+	struct Stats
+	{
+		uint64_t memoryHits = 0;
+		uint64_t diskHits = 0;
+		uint64_t misses = 0;
+		uint64_t insertions = 0;
+		uint64_t evictions = 0;
+		uint64_t diskWrites = 0;
+		// Disk slots whose content doesn't match its checksum, left by an interrupted write
+		uint64_t corruptedSlots = 0;
+		// Dropped by invalidate after an edit of the heights
+		uint64_t invalidated = 0;
+
+		float get_hit_rate() const
+		{
+			uint64_t lookups = memoryHits + diskHits + misses;
+			return lookups > 0 ? float(memoryHits + diskHits) / float(lookups) : 0.0f;
+		}
+	};
+	const Stats& get_stats() const { return m_stats; }
+	void reset_stats() { m_stats = Stats{}; }
+
+	void destroy();
+private:
+	struct Entry
+	{
+		TerrainMeshKey key;
+		glm::vec2 heightRange;
+		std::vector<TerrainVertex> vertices;
+		std::list<uint64_t>::iterator lruIterator;
+	};
+
+	// Layout of the disk cache
+	// [header][slot table][padding to page][slot 0][slot 1]...
+	struct DiskHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t slotCount;
+		uint32_t vertexCount;
+		uint64_t layoutHash;
+		uint64_t slotDataOffset;
+	};
+
+	struct DiskSlot
+	{
+		TerrainMeshKey key;
+		glm::vec2 heightRange;
+		uint64_t checksum;
+		// Bumped every time the slot is used, orders the lru when the file is opened again
+		uint64_t lastUse;
+		uint32_t valid;
+		uint32_t padding;
+	};
+
+	uint32_t m_vertexCount;
+	uint64_t m_layoutHash;
+	uint64_t m_memoryBudget;
+
+	// Keyed by TerrainMeshKey::get_hash, a collision is handled as a miss
+	std::unordered_map<uint64_t, Entry> m_entries;
+	// Most recently used first
+	std::list<uint64_t> m_lru;
+
+	Ref<MappedFile> m_diskFile;
+	DiskSlot* m_diskSlots = nullptr;
+	uint8_t* m_diskData = nullptr;
+	uint64_t m_diskUseCounter = 0;
+	std::unordered_map<uint64_t, uint32_t> m_diskIndex;
+	// Most recently used first, the free slots are at the back
+	std::list<uint32_t> m_diskLru;
+	std::vector<std::list<uint32_t>::iterator> m_diskLruIterators;
+
+	Stats m_stats;
+
+	Entry& allocate_entry(const TerrainMeshKey& key, uint64_t hash);
+	void evict_over_budget(uint64_t budget);
+	// Slot holding the mesh or UINT32_MAX, the slot is checked against its checksum
+	uint32_t find_disk_slot(const TerrainMeshKey& key, uint64_t hash);
+	void write_disk_slot(const TerrainMeshKey& key, uint64_t hash, const std::vector<TerrainVertex>& vertices, const glm::vec2& heightRange);
+	void touch_disk_slot(uint32_t slot);
+	uint8_t* get_slot_data(uint32_t slot) const { return m_diskData + uint64_t(slot) * get_slot_stride(); }
+	uint64_t get_slot_stride() const;
+};
@@ -6,65 +6,297 @@
 #include "renderer/context.h"
 #include "renderer/buffer.h"
 #include "renderer/device.h"
+#include "core/job_system.h"
+#include "terrain_culling.h"
+#include "terrain_stream.h"
 
-QuadTree::QuadTree(Context* context, Ref<TerrainStream> stream, uint32_t depth, uint32_t maxSize, int maxHeight) : m_depth(depth), m_size(maxSize), m_maxHeight(maxHeight), m_stream(stream)
+#include <algorithm>
+#include <chrono>
+
+// Written next to the executable when enabled from the terrain panel, around 200MB
+static const char* MESH_DISK_CACHE_FILENAME = "terrain_mesh_cache.bin";
+static const uint32_t MESH_DISK_CACHE_SLOT_COUNT = 2048;
+
+QuadTree::QuadTree(Context* context, Ref<TerrainStream> stream, uint32_t depth, uint32_t maxSize, int maxHeight, TerrainMeshMode meshMode, uint32_t poolSize) : m_depth(depth), m_size(maxSize), m_maxHeight(maxHeight), m_stream(stream)
 {
 	// given a depth d, no of node is given by
 	// n = (4 ^ (d + 1) / 3)
 
 	int n = static_cast<int>(std::pow(4, depth + 1)) / 3;
 	m_nodes.resize(n);
-	manager = CreateRef<TerrainChunkManager>(context, 150);
+	m_splitNodes.resize(depth + 1);
+	manager = CreateRef<TerrainChunkManager>(context, poolSize, JobSystem::get_default_worker_count(), 1000.0f, meshMode, stream, glm::ivec3(maxSize, maxHeight, maxSize));
+	create_draw_buffers();
+	m_gpuCulling = context->is_draw_indirect_count_supported();
+}
+
+void QuadTree::create_draw_buffers()
+{
+	// Selected chunks are unique so a view never needs more draw than the pool size, space is reserved
+	// for the cpu culled main view, the grass subset added by add_draws and two other views
+	uint32_t poolSize = manager->get_pool_size();
+	m_maxDrawCount = poolSize * 4;
+	m_drawCommands.reserve(m_maxDrawCount);
+	m_drawBuffer = Device::create_indirect_buffer(BufferUsageHint::DynamicDraw, m_maxDrawCount * sizeof(DrawIndexedIndirectData));
+
+	m_culling = CreateRef<TerrainCulling>(poolSize);
+}
+
+void QuadTree::resize_pool(Context* context, uint32_t poolSize)
+{
+	if (poolSize <= manager->get_pool_size())
+		return;
+
+	manager->resize_pool(context, m_stream, poolSize);
+	// The gpu is idle after the resize of the pool
+	Device::destroy_buffer(m_drawBuffer);
+	m_culling->destroy();
+	create_draw_buffers();
+	m_drawListDirty = true;
 }
 
 #include <imgui/imgui.h>
 void QuadTree::update(Context* context, Ref<Camera> camera)
 {
+	// The chunks that could not be assigned last frame are assigned once the pool has grown
+	uint32_t poolSize = manager->get_pool_size();
+	if (m_growPool && manager->get_pool_stats().exhausted > 0 && poolSize < m_maxPoolSize)
+		resize_pool(context, std::min(poolSize * 3 / 2, m_maxPoolSize));
+
 	m_frameIndex++;
 	// @TODO temp
 	if (ImGui::CollapsingHeader("Terrain"))
 	{
-		ImGui::Text("poolSize: %d", 150);
-		ImGui::Text("chunk rendered last frame: %d", m_visibleList.size());
+		const TerrainChunkManager::PoolStats& poolStats = manager->get_pool_stats();
+		ImGui::Text("poolSize: %d", manager->get_pool_size());
+		ImGui::Text("chunk evicted: %d, pinned skipped: %d, pool exhausted: %d", poolStats.evicted, poolStats.pinnedSkipped, poolStats.exhausted);
+		ImGui::Checkbox("grow pool when exhausted", &m_growPool);
+		ImGui::SameLine();
+		if (ImGui::Button("grow pool"))
+			resize_pool(context, manager->get_pool_size() * 3 / 2);
+		ImGui::Text("chunk rendered last frame: %d (%d triangles)", int(m_visibleList.size()), m_drawnTriangleLastFrame);
+		// Below 2 * sqrt(2) the morph of a chunk doesn't end before a coarser neighbour
+		ImGui::SliderFloat("lod distance", &m_lodDistance, 3.0f, 8.0f);
+		ImGui::Text("forced split: %d, split waiting for children: %d", m_forcedSplitLastFrame, m_collapsedLastFrame);
+		ImGui::Text("stitched chunk: %d", m_stitchedChunkLastFrame);
+		// Nodes rejected while selecting the lod, with the pyramid bounds and with the full height bounds
+		ImGui::Text("node culled: %d / %d (full height: %d)", m_cullStats.culled, m_cullStats.tested, m_cullStats.culledFullHeight);
+		if (context->is_draw_indirect_count_supported())
+			ImGui::Checkbox("gpu culling", &m_gpuCulling);
+		if (!m_gpuCulled)
+			ImGui::Text("chunk visible after culling: %d", m_culledDrawCount);
+		ImGui::Text("build workers: %d", manager->get_worker_count());
+		ImGui::Text("pending builds: %d", manager->get_pending_build_count());
+		const TerrainChunkManager::BuildStats& buildStats = manager->get_build_stats();
+		ImGui::Text("build requests: %d, dispatched: %d, deferred: %d, cancelled: %d", buildStats.requested, buildStats.dispatched, buildStats.deferred, buildStats.cancelled);
+		ImGui::Text("served from mesh cache: %d", buildStats.cached);
+		const TerrainChunkManager::EditStats& editStats = manager->get_edit_stats();
+		ImGui::Text("edited rects: %d, nodes invalidated: %d, time: %.0fus", editStats.dirtyRects, m_invalidatedNodeLastFrame, m_editTimeLastFrame);
+		ImGui::Text("chunk patched: %d (%d rows, %.1fKB), rebuilt: %d, cached meshes dropped: %d", editStats.patchedChunks, editStats.patchedRows,
+			float(editStats.patchedBytes) / 1024.0f, editStats.rebuiltChunks, editStats.invalidatedMeshes);
+		ImGui::Text("chunk uploaded last frame: %d (%.1fKB)", buildStats.uploaded, float(buildStats.uploadedBytes) / 1024.0f);
+		ImGui::Text("build time: %.0fus / %.0fus", buildStats.usedTime, buildStats.budget);
+		float timeBudget = manager->get_time_budget();
+		if (ImGui::SliderFloat("build budget (us)", &timeBudget, 100.0f, 8000.0f))
+			manager->set_time_budget(timeBudget);
+
+		Ref<TerrainMeshCache> meshCache = manager->get_mesh_cache();
+		if (meshCache)
+		{
+			const float megaByte = 1.0f / (1024.0f * 1024.0f);
+			const TerrainMeshCache::Stats& cacheStats = meshCache->get_stats();
+			ImGui::Text("mesh cache: %d meshes (%.1fMB), hit rate: %.1f%%", meshCache->get_entry_count(), float(meshCache->get_memory_size()) * megaByte, cacheStats.get_hit_rate() * 100.0f);
+			ImGui::Text("memory hits: %llu, disk hits: %llu, misses: %llu", cacheStats.memoryHits, cacheStats.diskHits, cacheStats.misses);
+			if (meshCache->has_disk_cache())
+				ImGui::Text("disk cache: %d / %d slots, writes: %llu, corrupted: %llu", meshCache->get_disk_entry_count(), meshCache->get_disk_slot_count(), cacheStats.diskWrites, cacheStats.corruptedSlots);
+
+			int cacheBudget = static_cast<int>(float(meshCache->get_memory_budget()) * megaByte);
+			if (ImGui::SliderInt("mesh cache budget (MB)", &cacheBudget, 0, 1024))
+				meshCache->set_memory_budget(uint64_t(cacheBudget) * 1024 * 1024);
+			bool diskCache = meshCache->has_disk_cache();
+			if (ImGui::Checkbox("disk mesh cache", &diskCache))
+			{
+				if (diskCache)
+					meshCache->open_disk_cache(MESH_DISK_CACHE_FILENAME, MESH_DISK_CACHE_SLOT_COUNT);
+				else
+					meshCache->close_disk_cache();
+			}
+			ImGui::SameLine();
+			if (ImGui::Button("reset stats"))
+				meshCache->reset_stats();
+		}
+
+		// Vertex pool against the float layout it replaces, the index buffer is shared by every chunk
+		const float vramMegaByte = 1.0f / (1024.0f * 1024.0f);
+		uint64_t indexMemory = uint64_t(manager->get_total_index_count()) * sizeof(uint16_t);
+		bool textureFetch = manager->get_mesh_mode() == TerrainMeshMode::VertexTextureFetch;
+		ImGui::Text("mesh mode: %s", textureFetch ? "vertex texture fetch" : "cpu mesh");
+		ImGui::Text("vertex pool: %.2fMB (float layout: %.2fMB), index: %.2fMB", float(manager->get_vertex_memory()) * vramMegaByte,
+			float(manager->get_float_vertex_memory()) * vramMegaByte, float(indexMemory) * vramMegaByte);
+		ImGui::Text("heightmap texture: %.2fMB", float(manager->get_heightmap_memory()) * vramMegaByte);
+
+		if (m_stream->is_tiled())
+		{
+			Ref<TerrainTileCache> tileCache = m_stream->get_tile_cache();
+			const float megaByte = 1.0f / (1024.0f * 1024.0f);
+			ImGui::Text("resident tiles: %d (%.1fMB)", tileCache->get_resident_tile_count(), float(tileCache->get_resident_size()) * megaByte);
+			ImGui::Text("tile loads pending: %d, loaded: %d, evicted: %d", tileCache->get_pending_load_count(), tileCache->get_loaded_last_frame(), tileCache->get_evicted_last_frame());
+			ImGui::Text("direct reads last frame: %llu", tileCache->get_direct_reads_last_frame());
+			ImGui::Text("chunk waiting for tiles: %d", buildStats.waitingForStream);
+
+			int budget = static_cast<int>(float(tileCache->get_memory_budget()) * megaByte);
+			if (ImGui::SliderInt("tile budget (MB)", &budget, 16, 4096))
+				tileCache->set_memory_budget(uint64_t(budget) * 1024 * 1024);
+			ImGui::SliderFloat("prefetch distance", &m_prefetchDistance, 1.0f, 4.0f);
+		}
 	}
 	m_visibleList.clear();
+	m_drawListDirty = true;
+
+	apply_edits(context);
+	m_nodeTested = m_nodeCulled = m_nodeCulledFullHeight = 0;
+	for (auto& nodes : m_splitNodes)
+		nodes.clear();
 	_update(context, camera, glm::ivec2(m_size / 2), 0, 0);
+	balance(camera);
+	glm::vec3 camPos = camera->get_position();
+	manager->set_lod_parameters(context, glm::vec2(camPos.x, camPos.z), m_lodDistance);
+	m_cullStats.tested = m_nodeTested;
+	m_cullStats.culled = m_nodeCulled;
+	m_cullStats.culledFullHeight = m_nodeCulledFullHeight;
 	manager->update(context, m_stream, glm::ivec3(m_size, m_maxHeight, m_size));
+	m_stream->update();
+}
+
+void QuadTree::apply_edits(Context* context)
+{
+	m_invalidatedNodeLastFrame = 0;
+	m_editTimeLastFrame = 0.0f;
+	if (!m_stream->has_dirty_rects())
+		return;
+
+	using Clock = std::chrono::high_resolution_clock;
+	auto start = Clock::now();
+	m_stream->take_dirty_rects(m_dirtyRects);
+	glm::ivec3 terrainSize = glm::ivec3(m_size, m_maxHeight, m_size);
+	for (const TerrainStream::DirtyRect& rect : m_dirtyRects)
+	{
+		manager->invalidate_texels(context, m_stream, rect.min, rect.max, terrainSize);
+		invalidate_nodes(context, 0, 0, glm::ivec2(0), m_size, rect.min, rect.max);
+	}
+	m_editTimeLastFrame = std::chrono::duration<float, std::micro>(Clock::now() - start).count();
+}
+
+void QuadTree::invalidate_nodes(Context* context, uint32_t id, uint32_t depth, const glm::ivec2& min, uint32_t size, const glm::ivec2& texelMin, const glm::ivec2& texelMax)
+{
+	glm::ivec2 max = min + glm::ivec2(size);
+	glm::ivec3 terrainSize = glm::ivec3(m_size, m_maxHeight, m_size);
+	glm::ivec2 nodeTexelMin, nodeTexelMax;
+	TerrainChunk::get_texel_rect(m_stream, min, max, terrainSize, manager->get_vertex_count(), nodeTexelMin, nodeTexelMax);
+	if (glm::any(glm::greaterThan(texelMin, nodeTexelMax)) || glm::any(glm::lessThan(texelMax, nodeTexelMin)))
+		return;
+
+	Node& node = m_nodes[id];
+	node.heightRangeValid = false;
+	if (node.chunk)
+		manager->refresh_chunk(context, m_stream, node.chunk, texelMin, texelMax, terrainSize);
+	m_invalidatedNodeLastFrame++;
+
+	if (depth == m_depth)
+		return;
+	uint32_t childSize = size / 2;
+	uint32_t firstChild = id * 4 + 1;
+	for (uint32_t i = 0; i < 4; ++i)
+	{
+		glm::ivec2 childMin = min + glm::ivec2(i & 1, i >> 1) * int(childSize);
+		invalidate_nodes(context, firstChild + i, depth + 1, childMin, childSize, texelMin, texelMax);
+	}
+}
+
+glm::vec2 QuadTree::get_height_range(uint32_t id, const glm::ivec2& min, const glm::ivec2& max)
+{
+	Node& node = m_nodes[id];
+	if (!node.heightRangeValid)
+	{
+		node.heightRange = TerrainChunk::get_height_bounds(m_stream, min, max, glm::ivec3(m_size, m_maxHeight, m_size), manager->get_vertex_count());
+		node.heightRangeValid = true;
+	}
+	return node.heightRange;
 }
 
-bool QuadTree::split(const glm::ivec2& position, const glm::ivec2& size, Ref<Camera> camera)
+float QuadTree::get_distance(const glm::ivec2& center, const glm::ivec2& size, Ref<Camera> camera) const
 {
 	glm::vec3 camPos = camera->get_position();
-	camPos.y = 0.0f;
+	glm::vec2 offset = glm::abs(glm::vec2(camPos.x, camPos.z) - glm::vec2(center)) - glm::vec2(size);
+	return glm::length(glm::max(offset, glm::vec2(0.0f)));
+}
 
+bool QuadTree::split(const glm::ivec2& position, const glm::ivec2& size, uint32_t id, Ref<Camera> camera)
+{
 	glm::ivec2 min = position - size;
 	glm::ivec2 max = position + size;
-	BoundingBox box = { glm::vec3(min.x, -m_maxHeight, min.y), glm::vec3(max.x, m_maxHeight, max.y) };
+	glm::vec2 heightRange = get_height_range(id, min, max);
+	BoundingBox box = { glm::vec3(min.x, heightRange.x, min.y), glm::vec3(max.x, heightRange.y, max.y) };
 
-	if (camera->get_frustum()->intersect_box(box))
-	{
-		float distance = glm::length(glm::vec3(position.x, 0.0f, position.y) - camPos);
-		if (distance < size.x * 4.0f)
-			return true;
-		return false;
-	}
+	Ref<Frustum> frustum = camera->get_frustum();
+	m_nodeTested++;
+	BoundingBox fullHeightBox = { glm::vec3(min.x, -m_maxHeight, min.y), glm::vec3(max.x, m_maxHeight, max.y) };
+	if (!frustum->intersect_box(fullHeightBox))
+		m_nodeCulledFullHeight++;
+
+	if (frustum->intersect_box(box))
+		return get_distance(position, size, camera) < float(size.x) * m_lodDistance;
+	m_nodeCulled++;
 	return false;
 }
 
-void QuadTree::assign_chunk(const glm::ivec2& min, const glm::ivec2& max, uint32_t lod, uint32_t id)
+void QuadTree::prefetch(const glm::ivec2& center, const glm::ivec2& size, Ref<Camera> camera)
+{
+	if (!m_stream->is_tiled())
+		return;
+
+	// Same distance metric as split, closest to the split distance are loaded first
+	float distance = get_distance(center, size, camera) / (float(size.x) * m_lodDistance);
+	if (distance > m_prefetchDistance)
+		return;
+
+	glm::ivec2 texelMin, texelMax;
+	TerrainChunk::get_texel_rect(m_stream, center - size, center + size, glm::ivec3(m_size, m_maxHeight, m_size), manager->get_vertex_count(), texelMin, texelMax);
+	m_stream->prefetch(texelMin, texelMax, distance);
+}
+
+float QuadTree::get_build_priority(const glm::ivec2& min, const glm::ivec2& max, Ref<Camera> camera) const
+{
+	glm::ivec2 size = (max - min) / 2;
+	float spacing = float(max.x - min.x) / float(manager->get_vertex_count());
+	float distance = std::max(get_distance(min + size, size, camera), 1.0f);
+	float priority = spacing / (distance * 2.0f * std::tan(camera->get_fov() * 0.5f));
+
+	BoundingBox fullHeightBox = { glm::vec3(min.x, -m_maxHeight, min.y), glm::vec3(max.x, m_maxHeight, max.y) };
+	if (!camera->get_frustum()->intersect_box(fullHeightBox))
+		priority *= 0.25f;
+	return priority;
+}
+
+void QuadTree::assign_chunk(const glm::ivec2& min, const glm::ivec2& max, uint32_t lod, uint32_t id, Ref<Camera> camera)
 {
 	TerrainChunk* chunk = m_nodes[id].chunk;
 	if (chunk == nullptr)
 	{
-		chunk = manager->get_free_chunk();
+		chunk = manager->get_free_chunk(m_frameIndex);
+		// Every chunk is used by this frame, the node is drawn with its parent
+		if (chunk == nullptr)
+			return;
 		if (chunk->get_id() != UINT_MAX)
 			m_nodes[chunk->get_id()].chunk = nullptr;
 		chunk->initialize(min, max, lod, id, m_frameIndex);
-		manager->add_to_cache(chunk);
 		m_nodes[id].chunk = chunk;
 	}
 	else
-		chunk->set_last_frame_index(m_frameIndex);
+		manager->touch(chunk, m_frameIndex);
+
+	if (!chunk->is_loaded())
+		manager->request_build(chunk, get_build_priority(min, max, camera));
 }
 
 void QuadTree::_update(Context* context, Ref<Camera> camera, const glm::ivec2& center, uint32_t parent, uint32_t depth)
@@ -75,9 +307,12 @@ void QuadTree::_update(Context* context, Ref<Camera> camera, const glm::ivec2& c
 
 	glm::ivec2 halfDim = glm::ivec2(m_size / static_cast<int>(std::pow(2, depth + 1)));
 
-	assign_chunk(center - halfDim, center + halfDim, m_depth - depth, parent);
-	if (split(center, halfDim, camera) || depth == 0)
+	assign_chunk(center - halfDim, center + halfDim, m_depth - depth, parent, camera);
+	if (split(center, halfDim, parent, camera) || depth == 0)
 	{
+		if (depth < m_depth)
+			mark_split(parent, depth);
+
 		glm::ivec2 halfDimForChild = halfDim / 2;
 		// Create Child
 		glm::ivec2 childs[4] =
@@ -92,6 +327,8 @@ void QuadTree::_update(Context* context, Ref<Camera> camera, const glm::ivec2& c
 		for (int i = 0; i < 4; ++i)
 			_update(context, camera, childs[i], firstChild + i, depth + 1);
 	}
+	else if (depth < m_depth)
+		prefetch(center, halfDim, camera);
 }
 
 void draw_quad(const glm::ivec2& min_size, const glm::ivec2& max_size)
@@ -108,112 +345,331 @@ void draw_quad(const glm::ivec2& min_size, const glm::ivec2& max_size)
 }
 
 
+void QuadTree::prepass(Context* context, Ref<Camera> camera)
+{
+	if (m_drawListDirty)
+		build_draw_list(context, camera, true);
+}
+
 void QuadTree::render(Context* context, Ref<Camera> camera)
+{
+	if (m_drawListDirty)
+		build_draw_list(context, camera, false);
+
+	if (camera.get() != m_cullCamera)
+	{
+		// Other view (reflection, shadow...) are culled on the cpu against their own frustum
+		uint32_t firstDraw = static_cast<uint32_t>(m_drawCommands.size());
+		TerrainCulling::cull(TerrainCulling::get_planes(*camera->get_frustum()), m_cullData, m_drawCommands);
+		uint32_t drawCount = static_cast<uint32_t>(m_drawCommands.size()) - firstDraw;
+		upload_draws(context, firstDraw, drawCount);
+		draw(context, firstDraw, drawCount);
+	}
+	else if (m_gpuCulled)
+	{
+		context->set_buffer(manager->ib, 0);
+		m_culling->draw(context);
+	}
+	else
+		draw(context, m_culledFirstDraw, m_culledDrawCount);
+}
+
+void QuadTree::build_draw_list(Context* context, Ref<Camera> camera, bool allowDispatch)
 {
 	m_totalChunkRendered = 0;
 	glm::vec3 camPos = camera->get_position();
 
 	if (m_visibleList.size() == 0)
 	{
-		_get_visible_list(camera, glm::ivec2(m_size / 2), 0, 0, m_visibleList);
-		// Sort from front to back
-
-		std::sort(m_visibleList.begin(), m_visibleList.end(), [&](const TerrainChunk* lhs, const TerrainChunk* rhs)
-			{
-				glm::ivec2 c1 = lhs->get_center();
-				glm::ivec2 c2 = rhs->get_center();
-				return glm::distance2(glm::vec3(c1.x, 0.0f, c1.y), camPos) < glm::distance2(glm::vec3(c2.x, 0.0f, c2.y), camPos);
-			});
+		// Chunks loaded since the selection can be drawn, they come out front to back
+		select_drawn_nodes();
+		_get_visible_list(0, 0, m_depth, glm::ivec2(m_size / 2), glm::vec2(camPos.x, camPos.z), m_visibleList);
+		update_stitch_masks();
 	}
 
-	uint32_t indexCount = manager->indexCount;
-	context->set_buffer(manager->ib, 0);
-	
+	m_drawCommands.clear();
+	m_cullData.clear();
 	for (auto chunk : m_visibleList)
+		m_cullData.push_back(get_cull_data(chunk));
+
+	m_cullCamera = camera.get();
+	m_cullPlanes = TerrainCulling::get_planes(*camera->get_frustum());
+	m_gpuCulled = allowDispatch && m_gpuCulling && context->is_draw_indirect_count_supported();
+	if (m_gpuCulled)
+	{
+		m_culling->dispatch(context, m_cullPlanes, m_cullData);
+		m_culledFirstDraw = m_culledDrawCount = 0;
+	}
+	else
 	{
-		glm::ivec2 center = chunk->get_center();
-		glm::ivec2 size = chunk->get_max() - chunk->get_min();
+		m_culledFirstDraw = static_cast<uint32_t>(m_drawCommands.size());
+		TerrainCulling::cull(m_cullPlanes, m_cullData, m_drawCommands);
+		m_culledDrawCount = static_cast<uint32_t>(m_drawCommands.size()) - m_culledFirstDraw;
+		upload_draws(context, m_culledFirstDraw, m_culledDrawCount);
+	}
+	m_drawListDirty = false;
+}
 
+ChunkCullData QuadTree::get_cull_data(TerrainChunk* chunk)
+{
+	glm::ivec2 min = chunk->get_min();
+	glm::ivec2 max = chunk->get_max();
 
-		float morphFactor = 1.0f;
-		/*
-		if (chunk->get_lod_level() > 0)
-		{
-			float transitionRegionWidth = 0.2f * size.x;
-			float dist = glm::distance(camPos, glm::vec3(center.x, 0.0f, center.y)) - size.x;
-			dist = glm::min(dist, transitionRegionWidth * 2.0f) - transitionRegionWidth;
-			dist /= transitionRegionWidth;
-			morphFactor = 1.0f - glm::clamp(dist * 0.5f + 0.5f, 0.0f, 1.0f);
-		}
-		*/
-		//context->set_uniform(ShaderStage::Vertex, sizeof(glm::mat4) + sizeof(glm::vec4), sizeof(float), &morphFactor);
+	ChunkCullData cullData = {};
+	cullData.boundsMin = glm::vec4(float(min.x), chunk->get_min_height(), float(min.y), 0.0f);
+	cullData.boundsMax = glm::vec4(float(max.x), chunk->get_max_height(), float(max.y), 0.0f);
+	uint32_t stitchMask = m_nodes[chunk->get_id()].stitchMask;
+	cullData.indexCount = manager->get_index_count(stitchMask);
+	cullData.firstIndex = manager->get_first_index(stitchMask);
+	// Every chunk lives in the shared vertex buffer, its offset is baked in the draw
+	// and the shader finds the chunk from the vertex index
+	cullData.vertexOffset = static_cast<int32_t>(chunk->get_pool_index() * manager->get_chunk_vertex_count());
+	return cullData;
+}
+
+bool QuadTree::is_visible(TerrainChunk* chunk)
+{
+	return TerrainCulling::is_visible(m_cullPlanes, get_cull_data(chunk));
+}
 
-		Ref<VertexBufferView> vb = chunk->vb;
-		context->set_buffer(vb->buffer, vb->offset);
-		context->draw_indexed(indexCount);
+uint32_t QuadTree::add_draws(Context* context, const std::vector<TerrainChunk*>& chunks)
+{
+	uint32_t firstDraw = static_cast<uint32_t>(m_drawCommands.size());
+	for (auto chunk : chunks)
+	{
+		ChunkCullData cullData = get_cull_data(chunk);
+		DrawIndexedIndirectData drawData = {};
+		drawData.indexCount = cullData.indexCount;
+		drawData.instanceCount = 1;
+		drawData.firstIndex = cullData.firstIndex;
+		drawData.vertexOffset = cullData.vertexOffset;
+		drawData.firstInstance = 0;
+		m_drawCommands.push_back(drawData);
 	}
+
+	upload_draws(context, firstDraw, static_cast<uint32_t>(chunks.size()));
+	return firstDraw;
+}
+
+void QuadTree::upload_draws(Context* context, uint32_t firstDraw, uint32_t drawCount)
+{
+	if (drawCount == 0)
+		return;
+
+	ASSERT_MSG(firstDraw + drawCount <= m_maxDrawCount, "Insufficient space in the terrain indirect buffer");
+	uint32_t stride = sizeof(DrawIndexedIndirectData);
+	context->copy(m_drawBuffer, &m_drawCommands[firstDraw], firstDraw * stride, drawCount * stride);
+}
+
+void QuadTree::draw(Context* context, uint32_t firstDraw, uint32_t drawCount)
+{
+	if (drawCount == 0)
+		return;
+
+	context->set_buffer(manager->ib, 0);
+	uint32_t stride = sizeof(DrawIndexedIndirectData);
+	context->draw_indexed_indirect(m_drawBuffer, firstDraw * stride, drawCount, stride);
 }
 
 void QuadTree::destroy()
 {
+	Device::destroy_buffer(m_drawBuffer);
+	m_culling->destroy();
 	manager->destroy();
 }
 
-// Direction is N(0), S(1), E(2), W(3)
-uint32_t QuadTree::find_neighbour(uint32_t currentNode, Direction direction)
+// Children of a node are ordered x first, the index of a node in its depth is the morton code of its position
+static uint32_t interleave_bits(uint32_t x)
 {
-	//uint32_t parentNode = (currentNode >> 2);
-	ASSERT(0);
-	return 0u;
+	x &= 0xFFFF;
+	x = (x | (x << 8)) & 0x00FF00FF;
+	x = (x | (x << 4)) & 0x0F0F0F0F;
+	x = (x | (x << 2)) & 0x33333333;
+	x = (x | (x << 1)) & 0x55555555;
+	return x;
 }
 
-void QuadTree::_get_visible_list(Ref<Camera> camera, const glm::ivec2& center, uint32_t parent, uint32_t depth, std::vector<TerrainChunk*>& chunks)
+static uint32_t compact_bits(uint32_t x)
 {
-	glm::ivec2 halfDim = glm::ivec2(m_size / static_cast<int>(std::pow(2, depth + 1)));
+	x &= 0x55555555;
+	x = (x | (x >> 1)) & 0x33333333;
+	x = (x | (x >> 2)) & 0x0F0F0F0F;
+	x = (x | (x >> 4)) & 0x00FF00FF;
+	x = (x | (x >> 8)) & 0x0000FFFF;
+	return x;
+}
 
-	if (depth == m_depth)
+// (4 ^ depth - 1) / 3 nodes above the depth
+static uint32_t get_first_node(uint32_t depth)
+{
+	return ((1u << (2 * depth)) - 1) / 3;
+}
+
+uint32_t QuadTree::get_node_depth(uint32_t id)
+{
+	uint32_t depth = 0;
+	while (id >= get_first_node(depth + 1))
+		depth++;
+	return depth;
+}
+
+glm::uvec2 QuadTree::get_node_position(uint32_t id, uint32_t depth)
+{
+	uint32_t code = id - get_first_node(depth);
+	return glm::uvec2(compact_bits(code), compact_bits(code >> 1));
+}
+
+uint32_t QuadTree::get_node_index(const glm::uvec2& position, uint32_t depth)
+{
+	return get_first_node(depth) + (interleave_bits(position.x) | (interleave_bits(position.y) << 1));
+}
+
+uint32_t QuadTree::find_neighbour(uint32_t currentNode, Direction direction) const
+{
+	uint32_t depth = get_node_depth(currentNode);
+	glm::ivec2 position = glm::ivec2(get_node_position(currentNode, depth));
+	switch (direction)
 	{
-		chunks.push_back(m_nodes[parent].chunk);
-		m_totalChunkRendered++;
-		return;
+	case Direction::N: position.y--; break;
+	case Direction::S: position.y++; break;
+	case Direction::E: position.x++; break;
+	case Direction::W: position.x--; break;
 	}
 
-	uint32_t firstChild = parent * 4 + 1;
-	bool childLoaded = true;
-	for (int i = 0; i < 4; ++i)
+	int nodePerSide = 1 << depth;
+	if (position.x < 0 || position.y < 0 || position.x >= nodePerSide || position.y >= nodePerSide)
+		return UINT32_MAX;
+	return get_node_index(glm::uvec2(position), depth);
+}
+
+void QuadTree::mark_split(uint32_t id, uint32_t depth)
+{
+	m_nodes[id].splitFrame = m_frameIndex;
+	m_splitNodes[depth].push_back(id);
+}
+
+void QuadTree::balance(Ref<Camera> camera)
+{
+	m_forcedSplitLastFrame = 0;
+	// Neighbours of the nodes of depth 1 are children of the root which is always split
+	for (uint32_t depth = m_depth - 1; depth >= 2 && depth < m_depth; --depth)
 	{
-		TerrainChunk* child = m_nodes[firstChild + i].chunk;
-		if (child == nullptr || !child->is_loaded())
+		for (uint32_t id : m_splitNodes[depth])
 		{
-			childLoaded = false;
-			break;
+			for (int i = 0; i < 4; ++i)
+			{
+				uint32_t neighbour = find_neighbour(id, Direction(i));
+				if (neighbour == UINT32_MAX)
+					continue;
+
+				uint32_t parent = get_parent(neighbour);
+				if (is_split(parent))
+					continue;
+
+				mark_split(parent, depth - 1);
+				uint32_t childSize = m_size >> depth;
+				for (uint32_t child = parent * 4 + 1; child < parent * 4 + 5; ++child)
+				{
+					glm::ivec2 min = glm::ivec2(get_node_position(child, depth)) * int(childSize);
+					assign_chunk(min, min + int(childSize), m_depth - depth, child, camera);
+				}
+				m_forcedSplitLastFrame++;
+			}
 		}
 	}
+}
 
-	if ((split(center, halfDim, camera) && childLoaded) || depth == 0)
+void QuadTree::select_drawn_nodes()
+{
+	m_collapsedLastFrame = 0;
+	// The root is always split even if its children are still loading
+	m_nodes[0].drawnSplitFrame = m_frameIndex;
+	for (uint32_t depth = 1; depth < m_depth; ++depth)
 	{
-		glm::ivec2 halfDimForChild = halfDim / 2;
-		// Create Child
-		glm::ivec2 childs[4] =
+		for (uint32_t id : m_splitNodes[depth])
 		{
-			center + glm::ivec2(-halfDimForChild.x, -halfDimForChild.y),
-			center + glm::ivec2(halfDimForChild.x, -halfDimForChild.y),
-			center + glm::ivec2(-halfDimForChild.x,  halfDimForChild.y),
-			center + glm::ivec2(halfDimForChild.x,  halfDimForChild.y),
-		};
+			if (!is_drawn_split(get_parent(id)))
+				continue;
 
-		for (int i = 0; i < 4; ++i)
-			_get_visible_list(camera, childs[i], parent * 4 + 1 + i, depth + 1, chunks);
+			bool drawn = true;
+			for (uint32_t child = id * 4 + 1; child < id * 4 + 5; ++child)
+			{
+				TerrainChunk* chunk = m_nodes[child].chunk;
+				drawn = drawn && chunk != nullptr && chunk->is_loaded();
+			}
+
+			// Every neighbour must be a leaf or split, parents are final as the levels are walked top down
+			for (int i = 0; i < 4 && drawn; ++i)
+			{
+				uint32_t neighbour = find_neighbour(id, Direction(i));
+				drawn = neighbour == UINT32_MAX || is_drawn_split(get_parent(neighbour));
+			}
+
+			if (drawn)
+				m_nodes[id].drawnSplitFrame = m_frameIndex;
+			else
+				m_collapsedLastFrame++;
+		}
 	}
-	else
+}
+
+uint32_t QuadTree::get_stitch_mask(uint32_t id) const
+{
+	uint32_t stitchMask = 0;
+	for (int i = 0; i < 4; ++i)
 	{
-		TerrainChunk* chunk = m_nodes[parent].chunk;
-		if (chunk != nullptr && chunk->is_loaded())
+		uint32_t neighbour = find_neighbour(id, Direction(i));
+		if (neighbour != UINT32_MAX && !is_drawn_split(get_parent(neighbour)))
+			stitchMask |= 1u << i;
+	}
+	return stitchMask;
+}
+
+uint32_t QuadTree::get_stitch_mask(const TerrainChunk* chunk) const
+{
+	return m_nodes[chunk->get_id()].stitchMask;
+}
+
+void QuadTree::get_visible_list(uint32_t maxDepth, const glm::vec2& viewPosition, std::vector<TerrainChunk*>& chunks)
+{
+	_get_visible_list(0, 0, std::min(maxDepth, m_depth), glm::ivec2(m_size / 2), viewPosition, chunks);
+}
+
+void QuadTree::_get_visible_list(uint32_t parent, uint32_t depth, uint32_t maxDepth, const glm::ivec2& center, const glm::vec2& camera, std::vector<TerrainChunk*>& chunks)
+{
+	if (depth < maxDepth && is_drawn_split(parent))
+	{
+		// Child on the side of the camera first, then the two sharing an edge with it and the opposite one
+		int halfDimForChild = int(m_size >> (depth + 2));
+		uint32_t nearest = (camera.x >= float(center.x) ? 1 : 0) | (camera.y >= float(center.y) ? 2 : 0);
+		uint32_t firstChild = parent * 4 + 1;
+		for (uint32_t i = 0; i < 4; ++i)
 		{
-			// Leaf node
-			chunks.push_back(chunk);
-			m_totalChunkRendered++;
+			uint32_t child = nearest ^ i;
+			glm::ivec2 childCenter = center + glm::ivec2((child & 1) ? halfDimForChild : -halfDimForChild, (child & 2) ? halfDimForChild : -halfDimForChild);
+			_get_visible_list(firstChild + child, depth + 1, maxDepth, childCenter, camera, chunks);
 		}
+		return;
 	}
+
+	// Leaf node
+	TerrainChunk* chunk = m_nodes[parent].chunk;
+	if (chunk != nullptr && chunk->is_loaded())
+		chunks.push_back(chunk);
 }
 
+void QuadTree::update_stitch_masks()
+{
+	m_stitchedChunkLastFrame = m_drawnTriangleLastFrame = 0;
+	for (TerrainChunk* chunk : m_visibleList)
+	{
+		uint32_t id = chunk->get_id();
+		Node& node = m_nodes[id];
+		node.stitchMask = get_stitch_mask(id);
+		if (node.stitchMask != 0)
+			m_stitchedChunkLastFrame++;
+
+		m_totalChunkRendered++;
+		m_drawnTriangleLastFrame += manager->get_index_count(node.stitchMask) / 3;
+	}
+}
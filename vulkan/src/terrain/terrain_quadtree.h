@@ -6,32 +6,95 @@
 #include <vector>
 
 #include "terrain_chunkmanager.h"
+#include "renderer/buffer.h"
+#include "terrain_culling.h"
 
 class TerrainChunk;
 class TerrainChunkManager;
 class Context;
 class Camera;
 class TerrainStream;
+class ShaderBindings;
 struct IndexBufferView;
 
 struct Node
 {
 	TerrainChunk* chunk;
+	// World space height range of the node area, computed from the stream height pyramid
+	glm::vec2 heightRange;
+	bool heightRangeValid = false;
+	// Frame the node has been split in by the lod selection, and in the drawn tree that only
+	// keeps the splits whose children are loaded
+	uint64_t splitFrame = 0;
+	uint64_t drawnSplitFrame = 0;
+	// Edges drawn against a coarser neighbour, see TerrainChunkManager::STITCH_NORTH
+	uint32_t stitchMask = 0;
 };
 
 class QuadTree
 {
 public:
-	QuadTree(Context* context, Ref<TerrainStream> stream, uint32_t depth, uint32_t size, int m_maxHeight);
+	// poolSize is the initial number of chunk, the pool grows when a frame needs more
+	QuadTree(Context* context, Ref<TerrainStream> stream, uint32_t depth, uint32_t size, int m_maxHeight, TerrainMeshMode meshMode, uint32_t poolSize);
 
 	void update(Context* context, Ref<Camera> camera);
+	// Build the draws of the frame and dispatch the gpu culling, must be called outside of a renderpass
+	void prepass(Context* context, Ref<Camera> camera);
+	// Every pass of the frame reuses the chunks selected by prepass or by the first call,
+	// they are culled against the frustum of the camera used for the pass
 	void render(Context* context, Ref<Camera> camera);
 	void destroy();
 
+	// Grow the chunk pool and the draw buffers sized after it, waits for the gpu to be idle
+	void resize_pool(Context* context, uint32_t poolSize);
+
+	// Cpu test against the frustum used to build the draws of the frame
+	bool is_visible(TerrainChunk* chunk);
+
+	// Append a draw for each chunk after the terrain draws, returns the index of the first one
+	uint32_t add_draws(Context* context, const std::vector<TerrainChunk*>& chunks);
+	// Bind the shared index buffer and submit drawCount draws from the indirect buffer
+	// the pipeline must be updated with get_chunk_bindings to read the vertices
+	void draw(Context* context, uint32_t firstDraw, uint32_t drawCount);
+
 	IndexBuffer* get_ib() { return manager->ib; }
-	uint32_t get_indices_count() { return manager->indexCount; }
+	ShaderBindings* get_chunk_bindings() { return manager->get_bindings(); }
+	IndirectBuffer* get_indirect_buffer() { return m_drawBuffer; }
+	uint32_t get_vertex_count() { return manager->get_vertex_count(); }
+	TerrainChunkManager* get_chunk_manager() { return manager.get(); }
 
 	std::vector<TerrainChunk*>& get_visible_list() { return m_visibleList; }
+	// Leaves of the drawn tree of the last prepass down to maxDepth, front to back from viewPosition
+	void get_visible_list(uint32_t maxDepth, const glm::vec2& viewPosition, std::vector<TerrainChunk*>& chunks);
+
+	// N is toward -z and E toward +x
+	enum class Direction
+	{
+		N, S, E, W
+	};
+
+	// Node of the same depth sharing an edge with currentNode, UINT32_MAX at the border of the terrain
+	uint32_t find_neighbour(uint32_t currentNode, Direction direction) const;
+	// Depth of the node and its position in node of that depth
+	static uint32_t get_node_depth(uint32_t id);
+	static glm::uvec2 get_node_position(uint32_t id, uint32_t depth);
+	static uint32_t get_node_index(const glm::uvec2& position, uint32_t depth);
+	static uint32_t get_parent(uint32_t id) { return (id - 1) / 4; }
+	// Edges of a chunk of the visible list drawn against a coarser neighbour, bit i is Direction(i)
+	uint32_t get_stitch_mask(const TerrainChunk* chunk) const;
+	// Split nodes of the frame per depth, the balancing passes walk them level by level
+	const std::vector<uint32_t>& get_split_nodes(uint32_t depth) const { return m_splitNodes[depth]; }
+	bool is_split(uint32_t id) const { return m_nodes[id].splitFrame == m_frameIndex; }
+
+	// Nodes of the last lod selection tested against the frustum, rejected with the pyramid bounds
+	// and with the full [-maxHeight, maxHeight] bounds
+	struct CullStats
+	{
+		uint32_t tested = 0;
+		uint32_t culled = 0;
+		uint32_t culledFullHeight = 0;
+	};
+	const CullStats& get_cull_stats() const { return m_cullStats; }
 private:
 	std::vector<Node> m_nodes;
 	uint32_t m_depth;
@@ -41,22 +104,86 @@ private:
 
 	Ref<TerrainChunkManager> manager;
 	Ref<TerrainStream> m_stream;
+	// The pool is grown by half when a frame runs out of chunk
+	bool m_growPool = true;
+	uint32_t m_maxPoolSize = 1024;
 
 
 	std::vector<TerrainChunk*> m_visibleList;
 
-	void _update(Context* context, Ref<Camera> camera, const glm::ivec2& center, uint32_t parent, uint32_t depth);
-	void _get_visible_list(Ref<Camera> camera, const glm::ivec2& center, uint32_t parent, uint32_t depth, std::vector<TerrainChunk*>& chunks);
-	void assign_chunk(const glm::ivec2& min, const glm::ivec2& max, uint32_t lod, uint32_t id);
+	// Draw of the visible chunks followed by the one added with add_draws
+	IndirectBuffer* m_drawBuffer;
+	std::vector<DrawIndexedIndirectData> m_drawCommands;
+	uint32_t m_maxDrawCount;
+	bool m_drawListDirty = true;
+	void create_draw_buffers();
+
+	Ref<TerrainCulling> m_culling;
+	std::vector<ChunkCullData> m_cullData;
+	std::array<glm::vec4, 6> m_cullPlanes = {};
+	// Camera used to build the draws, its view is culled on the gpu when supported
+	Camera* m_cullCamera = nullptr;
+	bool m_gpuCulling = false;
+	// True if the culled draws of this frame have been generated on the gpu
+	bool m_gpuCulled = false;
+	uint32_t m_culledFirstDraw = 0;
+	uint32_t m_culledDrawCount = 0;
+
+	void build_draw_list(Context* context, Ref<Camera> camera, bool allowDispatch);
+	void upload_draws(Context* context, uint32_t firstDraw, uint32_t drawCount);
+	ChunkCullData get_cull_data(TerrainChunk* chunk);
 
-	bool split(const glm::ivec2& center, const glm::ivec2& size, Ref<Camera> camera);
+	void _update(Context* context, Ref<Camera> camera, const glm::ivec2& center, uint32_t parent, uint32_t depth);
+	// Apply the dirty rects of the stream before the lod selection reads the height ranges
+	void apply_edits(Context* context);
+	// Nodes of every depth whose texel rect overlaps the edited rect [texelMin, texelMax] get their height range
+	// computed again and their chunk refreshed, the children of a node are within its texel rect
+	void invalidate_nodes(Context* context, uint32_t id, uint32_t depth, const glm::ivec2& min, uint32_t size, const glm::ivec2& texelMin, const glm::ivec2& texelMax);
+	std::vector<TerrainStream::DirtyRect> m_dirtyRects;
+	uint32_t m_invalidatedNodeLastFrame = 0;
+	float m_editTimeLastFrame = 0.0f;
+	// Leaves of the drawn tree down to maxDepth, the children closest to the camera are visited first
+	// so that the chunks come out front to back without sorting
+	void _get_visible_list(uint32_t parent, uint32_t depth, uint32_t maxDepth, const glm::ivec2& center, const glm::vec2& camera, std::vector<TerrainChunk*>& chunks);
+	void update_stitch_masks();
+
+	std::vector<std::vector<uint32_t>> m_splitNodes;
+	bool is_drawn_split(uint32_t id) const { return m_nodes[id].drawnSplitFrame == m_frameIndex; }
+	void mark_split(uint32_t id, uint32_t depth);
+	// Split the parent of every missing neighbour of a split node so that two leaves sharing an edge
+	// are at most one lod apart, deepest level first so that forced splits are balanced in turn
+	void balance(Ref<Camera> camera);
+	// Drawn tree: splits whose children are not loaded yet are dropped, as well as the splits
+	// that would then be next to a leaf more than one lod coarser
+	void select_drawn_nodes();
+	uint32_t get_stitch_mask(uint32_t id) const;
+	// Reuse the chunk of the node or take one from the pool, a chunk that is not loaded is requested again every frame
+	void assign_chunk(const glm::ivec2& min, const glm::ivec2& max, uint32_t lod, uint32_t id, Ref<Camera> camera);
+	// Screen space size of a vertex spacing of the node, the chunks outside of the frustum come after the visible ones
+	float get_build_priority(const glm::ivec2& min, const glm::ivec2& max, Ref<Camera> camera) const;
+
+	bool split(const glm::ivec2& center, const glm::ivec2& size, uint32_t id, Ref<Camera> camera);
+	// A node is split when the camera is closer to its rect than m_lodDistance times its half size,
+	// the vertex shader morphs each chunk toward its parent before that distance, see get_chunk_morph
+	float m_lodDistance = 4.0f;
+	// Distance on the ground plane from the camera to the rect of a node
+	float get_distance(const glm::ivec2& center, const glm::ivec2& size, Ref<Camera> camera) const;
+	// Page in the heightmap of a node that is close to be split
+	void prefetch(const glm::ivec2& center, const glm::ivec2& size, Ref<Camera> camera);
+	// Prefetch distance relative to the split distance
+	float m_prefetchDistance = 1.5f;
+	glm::vec2 get_height_range(uint32_t id, const glm::ivec2& min, const glm::ivec2& max);
 
-	enum class Direction
-	{
-		N, S, E, W
-	};
+	uint32_t m_totalChunkRendered = 0;
 
-	uint32_t find_neighbour(uint32_t currentNode, Direction direction);
+	uint32_t m_nodeTested = 0;
+	uint32_t m_nodeCulled = 0;
+	uint32_t m_nodeCulledFullHeight = 0;
+	CullStats m_cullStats;
 
-	uint32_t m_totalChunkRendered = 0;
+	// Balancing of the frame, nodes split for a finer neighbour and splits dropped from the drawn tree
+	uint32_t m_forcedSplitLastFrame = 0;
+	uint32_t m_collapsedLastFrame = 0;
+	uint32_t m_stitchedChunkLastFrame = 0;
+	uint32_t m_drawnTriangleLastFrame = 0;
 };
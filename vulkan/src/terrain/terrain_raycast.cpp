@@ -0,0 +1,226 @@
+#include "terrain_raycast.h"
+#include "terrain_stream.h"
+#include "core/job_system.h"
+#include <algorithm>
+
+// Number of ray cast by a single job of the batched ray cast
+static const uint32_t RAY_BATCH_SIZE = 256;
+// Deepest pyramid is 32 levels and every level pushes at most 4 nodes
+static const int MAX_TRAVERSAL_STACK = 4 * 33;
+
+TerrainRayCaster::TerrainRayCaster(Ref<TerrainStream> stream, float maxHeight, uint32_t workerCount) : m_stream(stream), m_maxHeight(maxHeight)
+{
+	m_jobSystem = CreateRef<JobSystem>(workerCount);
+}
+
+uint32_t TerrainRayCaster::get_worker_count() const
+{
+	return m_jobSystem->get_worker_count();
+}
+
+glm::vec2 TerrainRayCaster::get_node_range(int level, int x, int y) const
+{
+	glm::vec2 range;
+	if (level < 0)
+	{
+		// Single patch, range of its four corners
+		float a = m_stream->get(x, y);
+		float b = m_stream->get(x + 1, y);
+		float c = m_stream->get(x, y + 1);
+		float d = m_stream->get(x + 1, y + 1);
+		range = glm::vec2(std::min(std::min(a, b), std::min(c, d)), std::max(std::max(a, b), std::max(c, d)));
+	}
+	else
+	{
+		// Patches on the last row and column of the cell also read the first texel of the next cells
+		range = m_stream->get_height_pyramid_cell(level, x, y);
+		for (int i = 1; i < 4; ++i)
+		{
+			glm::vec2 neighbour = m_stream->get_height_pyramid_cell(level, x + (i & 1), y + (i >> 1));
+			range.x = std::min(range.x, neighbour.x);
+			range.y = std::max(range.y, neighbour.y);
+		}
+	}
+	return (range * 2.0f - 1.0f) * m_maxHeight;
+}
+
+bool TerrainRayCaster::intersect_patch(const Ray& ray, int x, int y, float tEnter, float tExit, float& t) const
+{
+	float a = (m_stream->get(x, y) * 2.0f - 1.0f) * m_maxHeight;
+	float b = (m_stream->get(x + 1, y) * 2.0f - 1.0f) * m_maxHeight;
+	float c = (m_stream->get(x, y + 1) * 2.0f - 1.0f) * m_maxHeight;
+	float d = (m_stream->get(x + 1, y + 1) * 2.0f - 1.0f) * m_maxHeight;
+
+	// Parameterized from the entry point to keep the coefficients small
+	// h(u, v) = a + B * u + C * v + D * u * v with u, v local to the patch
+	glm::vec3 p = ray.origin + ray.direction * tEnter;
+	float u0 = p.x - float(x);
+	float v0 = p.z - float(y);
+	float B = b - a;
+	float C = c - a;
+	float D = a - b - c + d;
+	glm::vec3 dir = ray.direction;
+
+	// f(s) = ray height - surface height = A2 * s^2 + A1 * s + A0
+	float A2 = -D * dir.x * dir.z;
+	float A1 = dir.y - (B * dir.x + C * dir.z + D * (u0 * dir.z + v0 * dir.x));
+	float A0 = p.y - (a + B * u0 + C * v0 + D * u0 * v0);
+
+	float length = tExit - tEnter;
+	if (A0 <= 0.0f)
+	{
+		t = tEnter;
+		return true;
+	}
+
+	float s = FLT_MAX;
+	if (std::abs(A2) < 1e-6f)
+	{
+		if (A1 < 0.0f)
+			s = -A0 / A1;
+	}
+	else
+	{
+		float discriminant = A1 * A1 - 4.0f * A2 * A0;
+		if (discriminant < 0.0f)
+			return false;
+
+		// Numerically stable roots
+		float q = -0.5f * (A1 + std::copysign(std::sqrt(discriminant), A1));
+		float r0 = q / A2;
+		float r1 = q != 0.0f ? A0 / q : r0;
+		if (r0 > r1)
+			std::swap(r0, r1);
+		s = r0 >= 0.0f ? r0 : r1;
+	}
+
+	if (s < 0.0f || s > length)
+		return false;
+	t = tEnter + s;
+	return true;
+}
+
+bool TerrainRayCaster::ray_cast(const Ray& ray, float maxDistance, TerrainRayHit& hit) const
+{
+	hit.hit = false;
+	hit.t = maxDistance;
+	hit.position = ray.origin + ray.direction * maxDistance;
+
+	int width = m_stream->get_width();
+	int height = m_stream->get_height();
+	int levelCount = m_stream->get_height_pyramid_level_count();
+	if (width < 2 || height < 2 || levelCount == 0)
+		return false;
+
+	// Avoid 0 * inf in the slab test of axis aligned ray
+	glm::vec3 dir = ray.direction;
+	const float epsilon = 1e-8f;
+	glm::vec3 invDir = 1.0f / glm::vec3(
+		std::abs(dir.x) < epsilon ? std::copysign(epsilon, dir.x) : dir.x,
+		dir.y,
+		std::abs(dir.z) < epsilon ? std::copysign(epsilon, dir.z) : dir.z);
+
+	// Clip the ray to the patches covered by a node, world xz is the texel coordinate
+	auto clip = [&](int level, int x, int y, float tEnter, float tExit, Node& node) {
+		int size = level < 0 ? 1 : 2 << level;
+		float minX = float(x * size);
+		float minZ = float(y * size);
+		float maxX = float(std::min((x + 1) * size, width - 1));
+		float maxZ = float(std::min((y + 1) * size, height - 1));
+		if (minX >= maxX || minZ >= maxZ)
+			return false;
+
+		float tx0 = (minX - ray.origin.x) * invDir.x;
+		float tx1 = (maxX - ray.origin.x) * invDir.x;
+		float tz0 = (minZ - ray.origin.z) * invDir.z;
+		float tz1 = (maxZ - ray.origin.z) * invDir.z;
+		node.level = level;
+		node.x = x;
+		node.y = y;
+		node.tEnter = std::max(tEnter, std::max(std::min(tx0, tx1), std::min(tz0, tz1)));
+		node.tExit = std::min(tExit, std::min(std::max(tx0, tx1), std::max(tz0, tz1)));
+		return node.tEnter <= node.tExit;
+	};
+
+	// Ray starting under the surface hit immediately, the traversal below only looks for the first crossing from above
+	glm::vec3 origin = ray.origin;
+	if (origin.x >= 0.0f && origin.z >= 0.0f && origin.x <= float(width - 1) && origin.z <= float(height - 1))
+	{
+		int x = std::min(static_cast<int>(origin.x), width - 2);
+		int y = std::min(static_cast<int>(origin.z), height - 2);
+		float t = 0.0f;
+		if (intersect_patch(ray, x, y, 0.0f, 0.0f, t))
+		{
+			hit.hit = true;
+			hit.t = 0.0f;
+			hit.position = origin;
+			return true;
+		}
+	}
+
+	Node stack[MAX_TRAVERSAL_STACK];
+	int stackSize = 0;
+	if (!clip(levelCount - 1, 0, 0, 0.0f, maxDistance, stack[0]))
+		return false;
+	stackSize = 1;
+
+	while (stackSize > 0)
+	{
+		Node node = stack[--stackSize];
+
+		// Skip the node if the ray segment is entirely above or below its height range
+		glm::vec2 range = get_node_range(node.level, node.x, node.y);
+		float y0 = ray.origin.y + dir.y * node.tEnter;
+		float y1 = ray.origin.y + dir.y * node.tExit;
+		if (std::min(y0, y1) > range.y || std::max(y0, y1) < range.x)
+			continue;
+
+		if (node.level < 0)
+		{
+			float t = 0.0f;
+			if (intersect_patch(ray, node.x, node.y, node.tEnter, node.tExit, t))
+			{
+				hit.hit = true;
+				hit.t = t;
+				hit.position = ray.origin + ray.direction * t;
+				return true;
+			}
+			continue;
+		}
+
+		Node children[4];
+		int childCount = 0;
+		for (int i = 0; i < 4; ++i)
+		{
+			if (clip(node.level - 1, node.x * 2 + (i & 1), node.y * 2 + (i >> 1), node.tEnter, node.tExit, children[childCount]))
+				childCount++;
+		}
+
+		// Closest child is pushed last so that the traversal is front to back
+		std::sort(children, children + childCount, [](const Node& lhs, const Node& rhs) {
+			return lhs.tEnter > rhs.tEnter;
+		});
+		ASSERT(stackSize + childCount <= MAX_TRAVERSAL_STACK);
+		for (int i = 0; i < childCount; ++i)
+			stack[stackSize++] = children[i];
+	}
+	return false;
+}
+
+void TerrainRayCaster::ray_cast(const Ray* rays, uint32_t count, float maxDistance, TerrainRayHit* hits)
+{
+	for (uint32_t first = 0; first < count; first += RAY_BATCH_SIZE)
+	{
+		uint32_t last = std::min(first + RAY_BATCH_SIZE, count);
+		m_jobSystem->execute([this, rays, hits, first, last, maxDistance]() {
+			for (uint32_t i = first; i < last; ++i)
+				ray_cast(rays[i], maxDistance, hits[i]);
+		});
+	}
+	m_jobSystem->wait();
+}
+
+void TerrainRayCaster::destroy()
+{
+	m_jobSystem->destroy();
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "core/base.h"
+#include "core/math.h"
+#include "core/ray.h"
+#include <stdint.h>
+
+class TerrainStream;
+class JobSystem;
+
+struct TerrainRayHit
+{
+	glm::vec3 position;
+	float t;
+	bool hit;
+};
+
+// Ray cast against the bilinear heightfield sampled by Terrain::get_height
+// The stream min/max pyramid is traversed front to back and only the patches whose
+// height range overlap the ray are intersected exactly
+class TerrainRayCaster
+{
+public:
+	// workerCount is the number of thread used by the batched ray cast, 0 runs on the calling thread
+	TerrainRayCaster(Ref<TerrainStream> stream, float maxHeight, uint32_t workerCount);
+
+	// Closest intersection with t in [0, maxDistance], direction must be normalized
+	bool ray_cast(const Ray& ray, float maxDistance, TerrainRayHit& hit) const;
+	// Cast every ray and block until all of them are done
+	void ray_cast(const Ray* rays, uint32_t count, float maxDistance, TerrainRayHit* hits);
+
+	uint32_t get_worker_count() const;
+	void destroy();
+private:
+	Ref<TerrainStream> m_stream;
+	Ref<JobSystem> m_jobSystem;
+	float m_maxHeight;
+
+	struct Node
+	{
+		int level;
+		int x;
+		int y;
+		float tEnter;
+		float tExit;
+	};
+
+	// World space height range of the patches covered by a node
+	glm::vec2 get_node_range(int level, int x, int y) const;
+	bool intersect_patch(const Ray& ray, int x, int y, float tEnter, float tExit, float& t) const;
+};
@@ -1,107 +1,531 @@
 #include "terrain_stream.h"
-#include "perlin_noise.h"
+#include "terrain_tile_file.h"
+#include "core/job_system.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb/stb_image.h>
 #include <fstream>
+#include <algorithm>
+#include <cstring>
 
 TerrainStream::TerrainStream(const char* filename)
 {
 	int nChannel = 0;
 	unsigned short* buffer = stbi_load_16(filename, &m_xsize, &m_ysize, &nChannel, 0);
 	ASSERT(buffer != nullptr);
-	m_buffer = new float[m_xsize * m_ysize];
+	// Expanding to float would double the memory for no precision gain, decoded on read
+	m_buffer16 = new uint16_t[m_xsize * m_ysize];
+	memcpy(m_buffer16, buffer, m_xsize * m_ysize * sizeof(uint16_t));
+	stbi_image_free(buffer);
+	build_height_pyramid();
+	compute_content_hash();
+}
 
-	float m = 1.0f / 65536.0f;
-	const float frequency = 10.0f;
-	for (int y = 0; y < m_ysize; ++y)
+TerrainStream::TerrainStream(const PerlinGenerator& generator) : m_xsize(generator.width), m_ysize(generator.height)
+{
+	m_buffer = new float[uint64_t(m_xsize) * m_ysize];
+	JobSystem jobSystem(JobSystem::get_default_worker_count());
+	TerrainGenerator(generator).generate(m_buffer, &jobSystem);
+	jobSystem.destroy();
+	build_height_pyramid();
+	compute_content_hash();
+}
+
+TerrainStream::TerrainStream(float* data, uint32_t xsize, uint32_t ysize)
+{
+	m_xsize = xsize;
+	m_ysize = ysize;
+	m_buffer = data;
+	build_height_pyramid();
+	compute_content_hash();
+}
+
+TerrainStream::TerrainStream(uint16_t* data, uint32_t xsize, uint32_t ysize)
+{
+	m_xsize = xsize;
+	m_ysize = ysize;
+	m_buffer16 = data;
+	build_height_pyramid();
+	compute_content_hash();
+}
+
+TerrainStream::TerrainStream(Ref<TerrainTileSource> source, uint64_t memoryBudget, uint32_t loaderCount)
+{
+	m_xsize = source->get_width();
+	m_ysize = source->get_height();
+	m_tileCache = CreateRef<TerrainTileCache>(source, memoryBudget, loaderCount);
+	build_height_pyramid();
+	compute_content_hash();
+}
+
+float TerrainStream::sample(float x, float y) const
+{
+	int ix = static_cast<int>(x);
+	int iy = static_cast<int>(y);
+
+	float a, b, c, d;
+	if (ix >= 0 && iy >= 0 && ix + 1 < m_xsize && iy + 1 < m_ysize && !m_tileCache)
 	{
-		for (int x = 0; x < m_xsize; ++x)
+		// Whole footprint inside of the data, no per texel bounds check
+		uint32_t index = iy * m_xsize + ix;
+		if (m_buffer16)
 		{
-			uint32_t index = y * m_xsize + x;
-			m_buffer[index] = float(buffer[index]) * m;
+			a = decode_height(m_buffer16[index]);
+			b = decode_height(m_buffer16[index + 1]);
+			c = decode_height(m_buffer16[index + m_xsize]);
+			d = decode_height(m_buffer16[index + m_xsize + 1]);
+		}
+		else
+		{
+			a = m_buffer[index];
+			b = m_buffer[index + 1];
+			c = m_buffer[index + m_xsize];
+			d = m_buffer[index + m_xsize + 1];
 		}
 	}
-	stbi_image_free(buffer);
+	else
+	{
+		a = get(ix, iy);
+		b = get(ix + 1, iy);
+		c = get(ix, iy + 1);
+		d = get(ix + 1, iy + 1);
+	}
+
+	float fx = x - ix;
+	float fy = y - iy;
+
+	float h0 = glm::mix(a, b, fx);
+	float h1 = glm::mix(c, d, fx);
+	return glm::mix(h0, h1, fy);
 }
 
-/*
-float ridge(float h, float offset) 
+void TerrainStream::read_rect(const glm::ivec2& min, const glm::ivec2& max, float* out) const
 {
-	h = abs(h);
-	h = offset - h;
-	h = h * h;
-	return h;
+	int width = max.x - min.x + 1;
+	int validMinX = std::max(min.x, 0);
+	int validMaxX = std::min(max.x, m_xsize - 1);
+	for (int y = min.y; y <= max.y; ++y)
+	{
+		float* row = out + (y - min.y) * width;
+		if (y < 0 || y >= m_ysize || validMinX > validMaxX)
+		{
+			std::fill(row, row + width, 0.0f);
+			continue;
+		}
+
+		std::fill(row, row + (validMinX - min.x), 0.0f);
+		std::fill(row + (validMaxX - min.x + 1), row + width, 0.0f);
+
+		int count = validMaxX - validMinX + 1;
+		float* dst = row + (validMinX - min.x);
+		uint32_t index = y * m_xsize + validMinX;
+		if (m_buffer)
+			memcpy(dst, m_buffer + index, count * sizeof(float));
+		else if (m_buffer16)
+			decode_heights(m_buffer16 + index, count, dst);
+		else
+			m_tileCache->read_row(validMinX, y, count, dst);
+	}
 }
 
-float ridgedmf(vec3 p, int noctaves, float lac, float g, float off) {
-	float sum = 0;
-	float freq = 0.5, amp = .75;
-	float prev = 0.25;
-	for (int i = 0; i < noctaves; i++) {
-		float n = ridge(inoise(p * freq), off);
-		sum += n * amp * prev;
-		prev = n;
-		freq *= lac;
-		amp *= g;
+void TerrainStream::write_rect(const glm::ivec2& min, const glm::ivec2& max, const float* data)
+{
+	int width = max.x - min.x + 1;
+	glm::ivec2 validMin = glm::max(min, glm::ivec2(0));
+	glm::ivec2 validMax = glm::min(max, glm::ivec2(m_xsize - 1, m_ysize - 1));
+	if (validMin.x > validMax.x || validMin.y > validMax.y)
+		return;
+
+	// The chunk builds still in flight read the heights they have been dispatched with
+	wait_for_readers(validMin, validMax);
+
+	// Range of the stored values, the 16 bit encoding rounds them
+	glm::vec2 range = glm::vec2(FLT_MAX, -FLT_MAX);
+	int count = validMax.x - validMin.x + 1;
+	for (int y = validMin.y; y <= validMax.y; ++y)
+	{
+		const float* src = data + (y - min.y) * width + (validMin.x - min.x);
+		uint64_t index = uint64_t(y) * m_xsize + validMin.x;
+		if (m_buffer)
+			memcpy(m_buffer + index, src, count * sizeof(float));
+
+		for (int x = 0; x < count; ++x)
+		{
+			float v = src[x];
+			if (m_buffer16)
+			{
+				m_buffer16[index + x] = encode_height(v);
+				v = decode_height(m_buffer16[index + x]);
+			}
+			else if (m_tileCache)
+				v = m_tileCache->set(validMin.x + x, y, v);
+			range.x = std::min(range.x, v);
+			range.y = std::max(range.y, v);
+		}
 	}
-	return (sum - 0.5) * heightScale;
+	expand_height_pyramid(validMin, validMax, range);
+	mark_dirty(validMin, validMax);
+}
+
+HeightFormat TerrainStream::get_format() const
+{
+	if (m_tileCache)
+		return m_tileCache->get_format();
+	return m_buffer16 ? HeightFormat::UInt16 : HeightFormat::Float;
+}
+
+uint64_t TerrainStream::get_memory_footprint() const
+{
+	uint64_t size = 0;
+	if (m_tileCache)
+		size = m_tileCache->get_resident_size();
+	else
+		size = uint64_t(m_xsize) * m_ysize * get_height_format_size(get_format());
+
+	for (auto& level : m_heightPyramid)
+		size += level.ranges.size() * sizeof(glm::vec2);
+	return size;
+}
+
+void TerrainStream::prefetch(const glm::ivec2& min, const glm::ivec2& max, float priority)
+{
+	if (m_tileCache)
+		m_tileCache->prefetch(min, max, priority);
+}
+
+bool TerrainStream::acquire(const glm::ivec2& min, const glm::ivec2& max)
+{
+	if (m_tileCache && !m_tileCache->acquire(min, max))
+		return false;
+
+	std::lock_guard<std::mutex> lock(m_acquireMutex);
+	m_acquiredRects.push_back({ min, max });
+	return true;
 }
-*/
 
-float fbm(siv::PerlinNoise* noise, int x, int y, const PerlinGenerator& generator)
+void TerrainStream::release(const glm::ivec2& min, const glm::ivec2& max)
 {
-	double total = 0.0;
-	double normalization = 0.0;
+	if (m_tileCache)
+		m_tileCache->release(min, max);
 
-	float a = generator.amplitude;
-	float f = generator.frequency;
-	for (uint32_t i = 0; i < generator.octaves; ++i)
 	{
-		total += a * noise->noise2D_0_1(double(x * f), double(y * f));
-		normalization += a;
+		std::lock_guard<std::mutex> lock(m_acquireMutex);
+		auto it = std::find_if(m_acquiredRects.begin(), m_acquiredRects.end(), [&](const DirtyRect& rect) {
+			return rect.min == min && rect.max == max;
+		});
+		ASSERT(it != m_acquiredRects.end());
+		if (it != m_acquiredRects.end())
+		{
+			*it = m_acquiredRects.back();
+			m_acquiredRects.pop_back();
+		}
+	}
+	m_releaseCondition.notify_all();
+}
+
+void TerrainStream::wait_for_readers(const glm::ivec2& min, const glm::ivec2& max)
+{
+	std::unique_lock<std::mutex> lock(m_acquireMutex);
+	m_releaseCondition.wait(lock, [&]() {
+		for (const DirtyRect& rect : m_acquiredRects)
+		{
+			if (rect.min.x <= max.x && rect.max.x >= min.x && rect.min.y <= max.y && rect.max.y >= min.y)
+				return false;
+		}
+		return true;
+	});
+}
 
-		a *= generator.gain;
-		f *= generator.lacunarity;
+void TerrainStream::update()
+{
+	if (m_tileCache == nullptr)
+		return;
+
+	m_tileCache->update();
+	if (!m_tileCache->has_exact_tile_ranges())
+	{
+		m_tileCache->take_installed_tiles(m_installedTiles);
+		for (uint32_t tileIndex : m_installedTiles)
+			refine_height_pyramid(tileIndex);
 	}
-	total /= normalization;
-	total = total * 2.0f - 1.0f;
+}
 
-	return static_cast<float>(std::pow(total, generator.exponent));
+void TerrainStream::compute_content_hash()
+{
+	uint64_t seed = hash_combine(uint64_t(m_xsize), uint64_t(m_ysize));
+	uint64_t texelCount = uint64_t(m_xsize) * m_ysize;
+	if (m_buffer)
+		m_contentHash = hash_bytes(m_buffer, texelCount * sizeof(float), hash_combine(seed, uint64_t(HeightFormat::Float)));
+	else if (m_buffer16)
+		m_contentHash = hash_bytes(m_buffer16, texelCount * sizeof(uint16_t), hash_combine(seed, uint64_t(HeightFormat::UInt16)));
+	else
+		m_contentHash = hash_combine(seed, m_tileCache->get_content_hash());
 }
 
-TerrainStream::TerrainStream(const PerlinGenerator& generator) : m_xsize(generator.width), m_ysize(generator.height)
+void TerrainStream::build_height_pyramid()
 {
-	m_buffer = new float[(generator.width + 1) * (generator.height + 1)];
-	siv::PerlinNoise* noise = new siv::PerlinNoise(generator.seed);
+	m_heightPyramid.clear();
+	m_heightPyramidBaseLevel = 0;
 
-	for (uint32_t y = 0; y < generator.height; ++y)
+	int width = m_xsize;
+	int height = m_ysize;
+	if (m_tileCache)
 	{
-		for (uint32_t x = 0; x < generator.height; ++x)
+		// The first level is the tile range table, the tiles themselves are never read
+		PyramidLevel level;
+		level.width = m_tileCache->get_tile_count_x();
+		level.height = m_tileCache->get_tile_count_y();
+		level.ranges.resize(level.width * level.height);
+		for (int i = 0; i < level.width * level.height; ++i)
+			level.ranges[i] = m_tileCache->get_tile_range(i);
+
+		uint32_t tileSize = m_tileCache->get_tile_size();
+		while ((2u << m_heightPyramidBaseLevel) < tileSize)
+			m_heightPyramidBaseLevel++;
+
+		width = level.width;
+		height = level.height;
+		m_heightPyramid.push_back(std::move(level));
+	}
+
+	while (width > 1 || height > 1)
+	{
+		PyramidLevel level;
+		level.width = (width + 1) / 2;
+		level.height = (height + 1) / 2;
+		level.ranges.resize(level.width * level.height);
+
+		for (int y = 0; y < level.height; ++y)
 		{
-			m_buffer[y * generator.width + x] = fbm(noise, x, y, generator);
+			for (int x = 0; x < level.width; ++x)
+			{
+				if (!m_heightPyramid.empty())
+				{
+					level.ranges[y * level.width + x] = merge_height_pyramid_cells(m_heightPyramid.back(), x, y);
+					continue;
+				}
+
+				glm::vec2 range = glm::vec2(FLT_MAX, -FLT_MAX);
+				// The last row and column are clamped for odd dimension
+				for (int j = 0; j < 2; ++j)
+				{
+					for (int i = 0; i < 2; ++i)
+					{
+						float h = get(std::min(x * 2 + i, width - 1), std::min(y * 2 + j, height - 1));
+						range.x = std::min(range.x, h);
+						range.y = std::max(range.y, h);
+					}
+				}
+				level.ranges[y * level.width + x] = range;
+			}
 		}
+
+		width = level.width;
+		height = level.height;
+		m_heightPyramid.push_back(std::move(level));
 	}
 }
 
-TerrainStream::TerrainStream(float* data, uint32_t xsize, uint32_t ysize)
+glm::vec2 TerrainStream::merge_height_pyramid_cells(const PyramidLevel& level, int x, int y) const
 {
-	m_xsize = xsize;
-	m_ysize = ysize;
-	m_buffer = data;
+	// Cells of the finer level covered by cell (x, y), clamped for odd dimension
+	glm::vec2 range = glm::vec2(FLT_MAX, -FLT_MAX);
+	for (int j = 0; j < 2; ++j)
+	{
+		for (int i = 0; i < 2; ++i)
+		{
+			int sx = std::min(x * 2 + i, level.width - 1);
+			int sy = std::min(y * 2 + j, level.height - 1);
+			const glm::vec2& cell = level.ranges[sy * level.width + sx];
+			range.x = std::min(range.x, cell.x);
+			range.y = std::max(range.y, cell.y);
+		}
+	}
+	return range;
+}
+
+void TerrainStream::refine_height_pyramid(uint32_t tileIndex)
+{
+	// The tile is resident, its texel already hold the edits made since it was installed
+	PyramidLevel& tileLevel = m_heightPyramid[0];
+	int x = int(tileIndex) % tileLevel.width;
+	int y = int(tileIndex) / tileLevel.width;
+	int tileSize = static_cast<int>(m_tileCache->get_tile_size());
+	glm::ivec2 min = glm::ivec2(x, y) * tileSize;
+	glm::ivec2 max = glm::min(min + tileSize - 1, glm::ivec2(m_xsize - 1, m_ysize - 1));
+	std::vector<float> heights(uint64_t(max.x - min.x + 1) * (max.y - min.y + 1));
+	read_rect(min, max, heights.data());
+
+	glm::vec2 range = glm::vec2(FLT_MAX, -FLT_MAX);
+	for (float h : heights)
+	{
+		range.x = std::min(range.x, h);
+		range.y = std::max(range.y, h);
+	}
+	tileLevel.ranges[tileIndex] = range;
+
+	for (size_t i = 1; i < m_heightPyramid.size(); ++i)
+	{
+		x /= 2;
+		y /= 2;
+		PyramidLevel& level = m_heightPyramid[i];
+		level.ranges[y * level.width + x] = merge_height_pyramid_cells(m_heightPyramid[i - 1], x, y);
+	}
+}
+
+void TerrainStream::expand_height_pyramid(int x, int y, float v)
+{
+	x >>= m_heightPyramidBaseLevel;
+	y >>= m_heightPyramidBaseLevel;
+	for (auto& level : m_heightPyramid)
+	{
+		x /= 2;
+		y /= 2;
+		if (x >= level.width || y >= level.height)
+			return;
+
+		glm::vec2& range = level.ranges[y * level.width + x];
+		range.x = std::min(range.x, v);
+		range.y = std::max(range.y, v);
+	}
+}
+
+void TerrainStream::expand_height_pyramid(const glm::ivec2& min, const glm::ivec2& max, const glm::vec2& range)
+{
+	int shift = m_heightPyramidBaseLevel;
+	for (auto& level : m_heightPyramid)
+	{
+		shift++;
+		int maxX = std::min(max.x >> shift, level.width - 1);
+		int maxY = std::min(max.y >> shift, level.height - 1);
+		for (int y = min.y >> shift; y <= maxY; ++y)
+		{
+			for (int x = min.x >> shift; x <= maxX; ++x)
+			{
+				glm::vec2& cell = level.ranges[y * level.width + x];
+				cell.x = std::min(cell.x, range.x);
+				cell.y = std::max(cell.y, range.y);
+			}
+		}
+	}
+}
+
+// Enough for a few separate strokes in a frame, beyond that every rect is merged in their bounds
+static const size_t MAX_DIRTY_RECT_COUNT = 32;
+
+void TerrainStream::mark_dirty(const glm::ivec2& min, const glm::ivec2& max)
+{
+	// Most recent first, consecutive writes of a brush are next to each other
+	for (auto it = m_dirtyRects.rbegin(); it != m_dirtyRects.rend(); ++it)
+	{
+		if (min.x <= it->max.x + 1 && max.x >= it->min.x - 1 && min.y <= it->max.y + 1 && max.y >= it->min.y - 1)
+		{
+			it->min = glm::min(it->min, min);
+			it->max = glm::max(it->max, max);
+			return;
+		}
+	}
+
+	if (m_dirtyRects.size() < MAX_DIRTY_RECT_COUNT)
+	{
+		m_dirtyRects.push_back({ min, max });
+		return;
+	}
+
+	DirtyRect bounds = { min, max };
+	for (const DirtyRect& rect : m_dirtyRects)
+	{
+		bounds.min = glm::min(bounds.min, rect.min);
+		bounds.max = glm::max(bounds.max, rect.max);
+	}
+	m_dirtyRects.clear();
+	m_dirtyRects.push_back(bounds);
+}
+
+void TerrainStream::take_dirty_rects(std::vector<DirtyRect>& rects)
+{
+	rects.clear();
+	rects.swap(m_dirtyRects);
+}
+
+glm::vec2 TerrainStream::get_height_range(const glm::ivec2& min, const glm::ivec2& max)
+{
+	glm::ivec2 rectMin = glm::clamp(min, glm::ivec2(0), glm::ivec2(m_xsize - 1, m_ysize - 1));
+	glm::ivec2 rectMax = glm::clamp(max, glm::ivec2(0), glm::ivec2(m_xsize - 1, m_ysize - 1));
+
+	// get() returns zero outside of the data
+	glm::vec2 range = glm::vec2(FLT_MAX, -FLT_MAX);
+	if (min != rectMin || max != rectMax)
+		range = glm::vec2(0.0f);
+
+	if (rectMin.x > rectMax.x || rectMin.y > rectMax.y)
+		return range;
+
+	// Pick the level where the rectangle covers at most a few cell on each side
+	int extent = std::max(rectMax.x - rectMin.x, rectMax.y - rectMin.y) + 1;
+	int levelIndex = -1;
+	while (levelIndex + 1 < get_height_pyramid_level_count() && (extent >> (levelIndex + 2)) >= 4)
+		levelIndex++;
+	if (m_tileCache)
+		levelIndex = std::max(levelIndex, m_heightPyramidBaseLevel);
+
+	if (levelIndex < 0)
+	{
+		for (int y = rectMin.y; y <= rectMax.y; ++y)
+		{
+			for (int x = rectMin.x; x <= rectMax.x; ++x)
+			{
+				float h = get(x, y);
+				range.x = std::min(range.x, h);
+				range.y = std::max(range.y, h);
+			}
+		}
+		return range;
+	}
+
+	const PyramidLevel& level = m_heightPyramid[levelIndex - m_heightPyramidBaseLevel];
+	int shift = levelIndex + 1;
+	for (int y = rectMin.y >> shift; y <= (rectMax.y >> shift); ++y)
+	{
+		for (int x = rectMin.x >> shift; x <= (rectMax.x >> shift); ++x)
+		{
+			glm::vec2 cell = level.ranges[y * level.width + x];
+			range.x = std::min(range.x, cell.x);
+			range.y = std::max(range.y, cell.y);
+		}
+	}
+	return range;
 }
 
 void TerrainStream::serialize(const char* filename)
 {
+	ASSERT_MSG(m_tileCache == nullptr, "Tiled stream can't be serialized as a single buffer");
 	std::ofstream outfile(filename, std::ios::binary);
 	int size[] = { m_xsize, m_ysize };
 	outfile.write(reinterpret_cast<char*>(size), sizeof(int) * 2);
-	outfile.write(reinterpret_cast<char*>(m_buffer), m_xsize * m_ysize * sizeof(float));
+
+	// The raw format is always float
+	std::vector<float> row(m_xsize);
+	for (int y = 0; y < m_ysize; ++y)
+	{
+		read_rect(glm::ivec2(0, y), glm::ivec2(m_xsize - 1, y), row.data());
+		outfile.write(reinterpret_cast<char*>(row.data()), m_xsize * sizeof(float));
+	}
+}
+
+bool TerrainStream::serialize_tiled(const char* filename, uint32_t tileSize, HeightFormat format)
+{
+	return TerrainTileFile::write(filename, m_xsize, m_ysize, tileSize, format, [this](int x, int y) {
+		return get(x, y);
+	});
 }
 
 void TerrainStream::destroy()
 {
-	if(m_buffer)
-		delete m_buffer;
-		
+	if (m_tileCache)
+		m_tileCache->destroy();
+	delete[] m_buffer;
+	delete[] m_buffer16;
+	m_buffer = nullptr;
+	m_buffer16 = nullptr;
 }
@@ -1,52 +1,182 @@
 #pragma once
 
 #include "core/base.h"
+#include "core/math.h"
+#include "core/hash.h"
+#include <vector>
+#include <mutex>
+#include <condition_variable>
 
-struct PerlinGenerator
-{
-	float amplitude = 1.0f;
-	float exponent = 1.0f;
-	float frequency = 0.1f;
-	float lacunarity = 2.0f;
-	float gain = 0.5f;
-	uint32_t octaves = 5;
-	uint32_t width = 512;
-	uint32_t height = 512;
-	uint32_t seed = 532;
-};
+#include "terrain_tile_cache.h"
+#include "terrain_height_format.h"
+#include "terrain_generator.h"
 
 class TerrainStream
 {
 public:
-	// Load from heightmap
+	// Load from heightmap, 16 bit samples are kept as they are
 	TerrainStream(const char* filename);
+	// Generated in parallel with TerrainGenerator
 	TerrainStream(const PerlinGenerator& generator);
 	TerrainStream(float* data, uint32_t xsize, uint32_t ysize);
+	TerrainStream(uint16_t* data, uint32_t xsize, uint32_t ysize);
+	// Out of core heightmap, the tiles are paged in around the camera within memoryBudget byte
+	// loaderCount threads load the tiles, more than one is only useful for a generated source
+	TerrainStream(Ref<TerrainTileSource> source, uint64_t memoryBudget, uint32_t loaderCount = 1);
 
-	float get(int x, int y)
+	float get(int x, int y) const
 	{
 		if (x < 0.0f || x >= m_xsize || y < 0.0f || y >= m_ysize)
 			return 0.0f;
 		//ASSERT(x >= 0 && x <= m_xsize);
 		//ASSERT(y >= 0 && y <= m_ysize);
-		return m_buffer[y * m_xsize + x];
+		if (m_buffer)
+			return m_buffer[y * m_xsize + x];
+		if (m_buffer16)
+			return decode_height(m_buffer16[y * m_xsize + x]);
+		return m_tileCache->get(x, y);
+	}
+
+	// Row y of a float heightmap held in memory, nullptr for the other storage
+	const float* get_float_row(int y) const
+	{
+		if (m_buffer == nullptr || y < 0 || y >= int(m_ysize))
+			return nullptr;
+		return m_buffer + uint64_t(y) * m_xsize;
 	}
 
+	// Bilinear filtered value at texel coordinate (x, y)
+	float sample(float x, float y) const;
+
+	// Decode the texel rect [min, max] (inclusive) in out, row by row, texel outside of the data are zero
+	void read_rect(const glm::ivec2& min, const glm::ivec2& max, float* out) const;
+
+	// Write a texel, the texel is added to the dirty rects so that the meshes reading it are rebuilt
+	// Waits for the readers of the texel like write_rect
 	void set(int x, int y, float v)
 	{
-		if (x < 0.0f || x > m_xsize || y < 0.0f || y > m_ysize)
+		if (x < 0 || x >= m_xsize || y < 0 || y >= m_ysize)
 			return;
 
-		m_buffer[y * m_xsize + y] = v;
+		wait_for_readers(glm::ivec2(x, y), glm::ivec2(x, y));
+
+		uint64_t index = uint64_t(y) * m_xsize + x;
+		if (m_buffer)
+			m_buffer[index] = v;
+		else if (m_buffer16)
+		{
+			m_buffer16[index] = encode_height(v);
+			v = decode_height(m_buffer16[index]);
+		}
+		else
+			v = m_tileCache->set(x, y, v);
+		expand_height_pyramid(x, y, v);
+		mark_dirty(glm::ivec2(x, y), glm::ivec2(x, y));
 	}
 
-	int get_width() { return m_xsize; }
-	int get_height() { return m_ysize; }
+	// Write the texel rect [min, max] (inclusive) from data, row by row, texels outside of the data are skipped
+	// Same as a set per texel with a single dirty rect and pyramid update
+	// Waits for the worker threads reading an acquired rect overlapping it to release it
+	void write_rect(const glm::ivec2& min, const glm::ivec2& max, const float* data);
+
+	// Texel rect [min, max] (inclusive) written since the last take_dirty_rects
+	struct DirtyRect
+	{
+		glm::ivec2 min;
+		glm::ivec2 max;
+	};
+	// Rects touching or overlapping an existing one are merged into it, a long run of set
+	// over a brush ends up as a single rect
+	void mark_dirty(const glm::ivec2& min, const glm::ivec2& max);
+	bool has_dirty_rects() const { return !m_dirtyRects.empty(); }
+	// Move the dirty rects in rects and clear them, called once per frame by the terrain backend
+	void take_dirty_rects(std::vector<DirtyRect>& rects);
+
+	// Identify the heights the stream has been created with, used to key the cached meshes
+	// Edits are not part of it, the meshes overlapping a dirty rect are dropped from the cache instead
+	uint64_t get_content_hash() const { return m_contentHash; }
+
+	HeightFormat get_format() const;
+	// Memory used by the heights and the height pyramid, only the resident tiles are counted for the tiled stream
+	uint64_t get_memory_footprint() const;
+
+	// Paging of the tiled stream, everything is resident for the other ones
+	bool is_tiled() const { return m_tileCache != nullptr; }
+	Ref<TerrainTileCache> get_tile_cache() { return m_tileCache; }
+	// Hint that the texel rect [min, max] will be needed soon, lowest priority are loaded first
+	void prefetch(const glm::ivec2& min, const glm::ivec2& max, float priority);
+	// Keep the texel rect resident until release, returns false if it is not loaded yet
+	// Worker thread can only read the texel of an acquired rect, write_rect does not touch it until then
+	bool acquire(const glm::ivec2& min, const glm::ivec2& max);
+	// Can be called from any thread
+	void release(const glm::ivec2& min, const glm::ivec2& max);
+	// Page the requested tiles in and out, called once per frame from the main thread
+	// The pyramid cells of the tiles installed by a source without exact ranges are tightened here
+	void update();
+
+	// Conservative range of the value stored in [min, max] (inclusive), the returned range
+	// can be larger than the real one but always contains it
+	glm::vec2 get_height_range(const glm::ivec2& min, const glm::ivec2& max);
+
+	// Level i has cells of 2^(i + 1) x 2^(i + 1) texel, the last level is a single cell
+	int get_height_pyramid_level_count() const { return m_heightPyramidBaseLevel + static_cast<int>(m_heightPyramid.size()); }
+	// Range of a pyramid cell, cell outside of the data are zero like get()
+	// Levels finer than the tiles of a tiled stream return the range of the whole tile
+	glm::vec2 get_height_pyramid_cell(int level, int x, int y) const
+	{
+		if (level < m_heightPyramidBaseLevel)
+		{
+			if (x < 0 || y < 0 || (x << (level + 1)) >= m_xsize || (y << (level + 1)) >= m_ysize)
+				return glm::vec2(0.0f);
+			x >>= m_heightPyramidBaseLevel - level;
+			y >>= m_heightPyramidBaseLevel - level;
+			level = m_heightPyramidBaseLevel;
+		}
+		const PyramidLevel& pyramidLevel = m_heightPyramid[level - m_heightPyramidBaseLevel];
+		if (x < 0 || x >= pyramidLevel.width || y < 0 || y >= pyramidLevel.height)
+			return glm::vec2(0.0f);
+		return pyramidLevel.ranges[y * pyramidLevel.width + x];
+	}
+
+	int get_width() const { return m_xsize; }
+	int get_height() const { return m_ysize; }
 
 	void serialize(const char* filename);
+	// Write the heightmap as a tiled container that can be opened with TerrainTileFile
+	bool serialize_tiled(const char* filename, uint32_t tileSize, HeightFormat format);
 	void destroy();
 private:
 	int m_xsize;
 	int m_ysize;
 	float* m_buffer = nullptr;
+	uint16_t* m_buffer16 = nullptr;
+	Ref<TerrainTileCache> m_tileCache;
+	uint64_t m_contentHash = 0;
+	std::vector<DirtyRect> m_dirtyRects;
+	// Rects acquired by the readers, the same rect appears once per acquire
+	std::vector<DirtyRect> m_acquiredRects;
+	std::mutex m_acquireMutex;
+	std::condition_variable m_releaseCondition;
+
+	// Min/max pyramid, level i covers 2^(i + 1) x 2^(i + 1) texel per cell
+	struct PyramidLevel
+	{
+		int width;
+		int height;
+		std::vector<glm::vec2> ranges;
+	};
+	std::vector<PyramidLevel> m_heightPyramid;
+	// Level of m_heightPyramid[0], the finer ones are not stored for the tiled stream
+	int m_heightPyramidBaseLevel = 0;
+
+	void build_height_pyramid();
+	void compute_content_hash();
+	// Block until no acquired rect overlaps [min, max]
+	void wait_for_readers(const glm::ivec2& min, const glm::ivec2& max);
+	void expand_height_pyramid(int x, int y, float v);
+	void expand_height_pyramid(const glm::ivec2& min, const glm::ivec2& max, const glm::vec2& range);
+	// Replace the range of a tile by the one of its resident texel and recompute the coarser cells over it
+	void refine_height_pyramid(uint32_t tileIndex);
+	glm::vec2 merge_height_pyramid_cells(const PyramidLevel& level, int x, int y) const;
+	std::vector<uint32_t> m_installedTiles;
 };
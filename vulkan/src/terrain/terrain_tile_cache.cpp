@@ -0,0 +1,316 @@
+#include "terrain_tile_cache.h"
+#include <algorithm>
+#include <cstring>
+
+TerrainTileCache::TerrainTileCache(Ref<TerrainTileSource> source, uint64_t memoryBudget, uint32_t loaderCount) : m_source(source), m_memoryBudget(memoryBudget)
+{
+	ASSERT(loaderCount > 0);
+	m_width = source->get_width();
+	m_height = source->get_height();
+	m_tileSize = source->get_tile_size();
+	m_tileMask = m_tileSize - 1;
+	m_tileShift = 0;
+	while ((1u << m_tileShift) < m_tileSize)
+		m_tileShift++;
+	m_tileCountX = source->get_tile_count_x();
+	m_tileCountY = source->get_tile_count_y();
+	m_format = source->get_format();
+	m_tileSizeInByte = source->get_tile_size_in_byte();
+	m_tiles = std::make_unique<Tile[]>(m_tileCountX * m_tileCountY);
+
+	for (uint32_t i = 0; i < loaderCount; ++i)
+		m_ioThreads.emplace_back(&TerrainTileCache::io_loop, this);
+}
+
+bool TerrainTileCache::get_tile_rect(const glm::ivec2& min, const glm::ivec2& max, glm::ivec2& tileMin, glm::ivec2& tileMax) const
+{
+	glm::ivec2 rectMin = glm::max(min, glm::ivec2(0));
+	glm::ivec2 rectMax = glm::min(max, glm::ivec2(m_width - 1, m_height - 1));
+	if (rectMin.x > rectMax.x || rectMin.y > rectMax.y)
+		return false;
+
+	tileMin = rectMin >> int(m_tileShift);
+	tileMax = rectMax >> int(m_tileShift);
+	return true;
+}
+
+void TerrainTileCache::touch(uint32_t tileIndex)
+{
+	Tile& tile = m_tiles[tileIndex];
+	tile.lastUsedFrame = m_frameIndex;
+	m_lru.splice(m_lru.begin(), m_lru, tile.lruIterator);
+}
+
+void TerrainTileCache::read_row(int x, int y, int count, float* out) const
+{
+	uint32_t tileRow = (y >> m_tileShift) * m_tileCountX;
+	uint32_t rowOffset = (y & m_tileMask) * m_tileSize;
+	while (count > 0)
+	{
+		// Span of the row inside of a single tile
+		int tileX = x & m_tileMask;
+		int spanCount = std::min(count, int(m_tileSize) - tileX);
+		uint32_t tileIndex = tileRow + (x >> m_tileShift);
+		const uint8_t* data = m_tiles[tileIndex].data.load(std::memory_order_acquire);
+		if (data == nullptr)
+		{
+			m_directReads.fetch_add(spanCount, std::memory_order_relaxed);
+			m_source->read_row(x, y, spanCount, out);
+		}
+		else if (m_format == HeightFormat::UInt16)
+			decode_heights(reinterpret_cast<const uint16_t*>(data) + rowOffset + tileX, spanCount, out);
+		else
+			memcpy(out, reinterpret_cast<const float*>(data) + rowOffset + tileX, spanCount * sizeof(float));
+
+		x += spanCount;
+		out += spanCount;
+		count -= spanCount;
+	}
+}
+
+float TerrainTileCache::read_direct(int x, int y) const
+{
+	m_directReads.fetch_add(1, std::memory_order_relaxed);
+	float v;
+	m_source->read_row(x, y, 1, &v);
+	return v;
+}
+
+float TerrainTileCache::set(int x, int y, float v)
+{
+	uint32_t tileIndex = (y >> m_tileShift) * m_tileCountX + (x >> m_tileShift);
+	Tile& tile = m_tiles[tileIndex];
+	if (tile.state.load() != Resident)
+	{
+		// A copy delivered later by the io thread is discarded by install
+		install(tileIndex, load_tile(tileIndex));
+	}
+
+	tile.dirty = true;
+	touch(tileIndex);
+	uint8_t* data = tile.data.load(std::memory_order_relaxed);
+	uint32_t offset = (y & m_tileMask) * m_tileSize + (x & m_tileMask);
+	if (m_format == HeightFormat::UInt16)
+	{
+		uint16_t encoded = encode_height(v);
+		reinterpret_cast<uint16_t*>(data)[offset] = encoded;
+		return decode_height(encoded);
+	}
+	reinterpret_cast<float*>(data)[offset] = v;
+	return v;
+}
+
+void TerrainTileCache::prefetch(const glm::ivec2& min, const glm::ivec2& max, float priority)
+{
+	glm::ivec2 tileMin, tileMax;
+	if (!get_tile_rect(min, max, tileMin, tileMax))
+		return;
+
+	for (int y = tileMin.y; y <= tileMax.y; ++y)
+	{
+		for (int x = tileMin.x; x <= tileMax.x; ++x)
+		{
+			uint32_t tileIndex = y * m_tileCountX + x;
+			Tile& tile = m_tiles[tileIndex];
+			if (tile.state.load() == Resident)
+				touch(tileIndex);
+			else if (tile.requestFrame != m_frameIndex)
+			{
+				tile.requestFrame = m_frameIndex;
+				tile.requestIndex = static_cast<uint32_t>(m_frameRequests.size());
+				m_frameRequests.push_back({ priority, tileIndex });
+			}
+			else
+			{
+				float& requestPriority = m_frameRequests[tile.requestIndex].priority;
+				requestPriority = std::min(requestPriority, priority);
+			}
+		}
+	}
+}
+
+bool TerrainTileCache::acquire(const glm::ivec2& min, const glm::ivec2& max)
+{
+	glm::ivec2 tileMin, tileMax;
+	if (!get_tile_rect(min, max, tileMin, tileMax))
+		return true;
+
+	for (int y = tileMin.y; y <= tileMax.y; ++y)
+	{
+		for (int x = tileMin.x; x <= tileMax.x; ++x)
+		{
+			if (m_tiles[y * m_tileCountX + x].state.load() != Resident)
+			{
+				// Needed right now, ahead of every prefetch hint
+				prefetch(min, max, -1.0f);
+				return false;
+			}
+		}
+	}
+
+	for (int y = tileMin.y; y <= tileMax.y; ++y)
+	{
+		for (int x = tileMin.x; x <= tileMax.x; ++x)
+		{
+			uint32_t tileIndex = y * m_tileCountX + x;
+			m_tiles[tileIndex].pinCount++;
+			touch(tileIndex);
+		}
+	}
+	return true;
+}
+
+void TerrainTileCache::release(const glm::ivec2& min, const glm::ivec2& max)
+{
+	glm::ivec2 tileMin, tileMax;
+	if (!get_tile_rect(min, max, tileMin, tileMax))
+		return;
+
+	for (int y = tileMin.y; y <= tileMax.y; ++y)
+	{
+		for (int x = tileMin.x; x <= tileMax.x; ++x)
+		{
+			Tile& tile = m_tiles[y * m_tileCountX + x];
+			ASSERT(tile.pinCount.load() > 0);
+			tile.pinCount--;
+		}
+	}
+}
+
+uint8_t* TerrainTileCache::load_tile(uint32_t tileIndex) const
+{
+	uint8_t* data = new uint8_t[m_tileSizeInByte];
+	m_source->load_tile(tileIndex, data);
+	return data;
+}
+
+void TerrainTileCache::install(uint32_t tileIndex, uint8_t* data)
+{
+	Tile& tile = m_tiles[tileIndex];
+	if (tile.state.load() == Resident)
+	{
+		delete[] data;
+		return;
+	}
+
+	tile.data.store(data, std::memory_order_release);
+	tile.state.store(Resident);
+	tile.lastUsedFrame = m_frameIndex;
+	m_lru.push_front(tileIndex);
+	tile.lruIterator = m_lru.begin();
+	m_residentSize += m_tileSizeInByte;
+	if (!m_source->has_exact_tile_ranges())
+		m_installedTiles.push_back(tileIndex);
+}
+
+void TerrainTileCache::take_installed_tiles(std::vector<uint32_t>& tiles)
+{
+	tiles.clear();
+	tiles.swap(m_installedTiles);
+}
+
+void TerrainTileCache::evict(uint32_t tileIndex)
+{
+	Tile& tile = m_tiles[tileIndex];
+	uint8_t* data = tile.data.exchange(nullptr);
+	tile.state.store(Unloaded);
+	m_lru.erase(tile.lruIterator);
+	m_residentSize -= m_tileSizeInByte;
+	delete[] data;
+}
+
+void TerrainTileCache::update()
+{
+	std::vector<LoadedTile> loadedTiles;
+	{
+		std::lock_guard<std::mutex> lock(m_ioMutex);
+		loadedTiles.swap(m_loadedTiles);
+	}
+
+	m_loadedLastFrame = static_cast<uint32_t>(loadedTiles.size());
+	for (auto& loadedTile : loadedTiles)
+		install(loadedTile.tileIndex, loadedTile.data);
+
+	// Tiles used this frame, pinned by a build or edited are never evicted so the budget is a soft limit
+	m_evictedLastFrame = 0;
+	auto it = m_lru.end();
+	while (m_residentSize > m_memoryBudget && it != m_lru.begin())
+	{
+		--it;
+		uint32_t tileIndex = *it;
+		Tile& tile = m_tiles[tileIndex];
+		if (tile.lastUsedFrame == m_frameIndex)
+			break;
+		if (tile.pinCount.load() > 0 || tile.dirty)
+			continue;
+
+		it = std::next(it);
+		evict(tileIndex);
+		m_evictedLastFrame++;
+	}
+
+	// Requests of the previous frame that are still queued are no longer wanted
+	std::sort(m_frameRequests.begin(), m_frameRequests.end(), [](const Request& lhs, const Request& rhs) {
+		return lhs.priority > rhs.priority;
+	});
+	{
+		std::lock_guard<std::mutex> lock(m_ioMutex);
+		m_ioQueue.clear();
+		for (auto& request : m_frameRequests)
+			m_ioQueue.push_back(request.tileIndex);
+		m_pendingLoads = static_cast<uint32_t>(m_ioQueue.size());
+	}
+	if (!m_frameRequests.empty())
+		m_ioAvailable.notify_all();
+	m_frameRequests.clear();
+
+	m_directReadsLastFrame = m_directReads.exchange(0);
+	m_frameIndex++;
+}
+
+void TerrainTileCache::io_loop()
+{
+	while (true)
+	{
+		uint32_t tileIndex = 0;
+		{
+			std::unique_lock<std::mutex> lock(m_ioMutex);
+			m_ioAvailable.wait(lock, [this]() { return !m_running || !m_ioQueue.empty(); });
+			if (!m_running)
+				return;
+
+			tileIndex = m_ioQueue.back();
+			m_ioQueue.pop_back();
+			m_pendingLoads = static_cast<uint32_t>(m_ioQueue.size());
+		}
+
+		uint32_t expected = Unloaded;
+		if (!m_tiles[tileIndex].state.compare_exchange_strong(expected, Loading))
+			continue;
+
+		// Page faults of the mapping or the generation happen here instead of in the mesh builds
+		uint8_t* data = load_tile(tileIndex);
+		std::lock_guard<std::mutex> lock(m_ioMutex);
+		m_loadedTiles.push_back({ tileIndex, data });
+	}
+}
+
+void TerrainTileCache::destroy()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_ioMutex);
+		m_running = false;
+	}
+	m_ioAvailable.notify_all();
+	for (auto& thread : m_ioThreads)
+		thread.join();
+	m_ioThreads.clear();
+
+	for (auto& loadedTile : m_loadedTiles)
+		delete[] loadedTile.data;
+	m_loadedTiles.clear();
+
+	while (!m_lru.empty())
+		evict(m_lru.front());
+	m_source->destroy();
+}
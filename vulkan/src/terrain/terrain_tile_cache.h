@@ -0,0 +1,151 @@
+#pragma once
+
+#include "core/base.h"
+#include "core/math.h"
+#include <vector>
+#include <list>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+#include "terrain_tile_source.h"
+
+// Pages the tiles of a TerrainTileSource in and out of memory
+// Tiles are requested with prefetch hints, loaded on background loader threads and installed
+// on the main thread by update() which also evicts the least recently used ones over budget
+class TerrainTileCache
+{
+public:
+	// One loader is enough to keep the disk busy, a generated source wants one per core
+	TerrainTileCache(Ref<TerrainTileSource> source, uint64_t memoryBudget, uint32_t loaderCount = 1);
+
+	// Resident tiles are read from memory, the other ones straight from the source which may block on disk
+	// or generate the texel
+	// From worker thread the tile must be pinned with acquire
+	float get(int x, int y) const
+	{
+		uint32_t tileIndex = (y >> m_tileShift) * m_tileCountX + (x >> m_tileShift);
+		const uint8_t* data = m_tiles[tileIndex].data.load(std::memory_order_acquire);
+		if (data == nullptr)
+			return read_direct(x, y);
+		uint32_t offset = (y & m_tileMask) * m_tileSize + (x & m_tileMask);
+		if (m_format == HeightFormat::UInt16)
+			return decode_height(reinterpret_cast<const uint16_t*>(data)[offset]);
+		return reinterpret_cast<const float*>(data)[offset];
+	}
+
+	// Decode count texel of row y starting at x, the span must be inside of the heightmap
+	void read_row(int x, int y, int count, float* out) const;
+
+	// Edited tiles stay resident as the file is never written back
+	// Returns the value actually stored after quantization
+	float set(int x, int y, float v);
+
+	// Request the tiles overlapping the texel rect [min, max], lowest priority are loaded first
+	void prefetch(const glm::ivec2& min, const glm::ivec2& max, float priority);
+	// Pin the tiles of the rect if they are all resident, otherwise request them and returns false
+	bool acquire(const glm::ivec2& min, const glm::ivec2& max);
+	// Unpin the tiles pinned by acquire, can be called from any thread
+	void release(const glm::ivec2& min, const glm::ivec2& max);
+
+	// Install the loaded tiles, evict over budget and submit the requests of the frame
+	void update();
+
+	glm::vec2 get_tile_range(uint32_t tileIndex) const { return m_source->get_tile_range(tileIndex); }
+	bool has_exact_tile_ranges() const { return m_source->has_exact_tile_ranges(); }
+	// Tiles installed since the last call, only recorded when the source ranges are bounds
+	void take_installed_tiles(std::vector<uint32_t>& tiles);
+	uint32_t get_tile_size() const { return m_tileSize; }
+	HeightFormat get_format() const { return m_format; }
+	uint32_t get_tile_count_x() const { return m_tileCountX; }
+	uint32_t get_tile_count_y() const { return m_tileCountY; }
+	uint64_t get_content_hash() const { return m_source->get_content_hash(); }
+
+	uint64_t get_memory_budget() const { return m_memoryBudget; }
+	void set_memory_budget(uint64_t budget) { m_memoryBudget = budget; }
+	uint64_t get_resident_size() const { return m_residentSize; }
+	uint32_t get_resident_tile_count() const { return static_cast<uint32_t>(m_lru.size()); }
+	uint32_t get_pending_load_count() const { return m_pendingLoads.load(); }
+	uint32_t get_loaded_last_frame() const { return m_loadedLastFrame; }
+	uint32_t get_evicted_last_frame() const { return m_evictedLastFrame; }
+	// Texel read from a tile that was not resident, each of them can stall on disk or is generated
+	uint64_t get_direct_reads_last_frame() const { return m_directReadsLastFrame; }
+
+	void destroy();
+private:
+	enum TileState : uint32_t
+	{
+		Unloaded,
+		Loading,
+		Resident
+	};
+
+	struct Tile
+	{
+		std::atomic<uint8_t*> data = nullptr;
+		std::atomic<uint32_t> state = Unloaded;
+		std::atomic<uint32_t> pinCount = 0;
+		bool dirty = false;
+		uint64_t lastUsedFrame = 0;
+		std::list<uint32_t>::iterator lruIterator;
+
+		// Index in m_frameRequests when requested during requestFrame
+		uint64_t requestFrame = UINT64_MAX;
+		uint32_t requestIndex = 0;
+	};
+
+	struct Request
+	{
+		float priority;
+		uint32_t tileIndex;
+	};
+
+	struct LoadedTile
+	{
+		uint32_t tileIndex;
+		uint8_t* data;
+	};
+
+	Ref<TerrainTileSource> m_source;
+	uint32_t m_width;
+	uint32_t m_height;
+	uint32_t m_tileSize;
+	uint32_t m_tileShift;
+	uint32_t m_tileMask;
+	uint32_t m_tileCountX;
+	uint32_t m_tileCountY;
+	HeightFormat m_format;
+	uint32_t m_tileSizeInByte;
+	std::unique_ptr<Tile[]> m_tiles;
+
+	uint64_t m_frameIndex = 0;
+	uint64_t m_memoryBudget;
+	uint64_t m_residentSize = 0;
+	// Most recently used first
+	std::list<uint32_t> m_lru;
+	std::vector<Request> m_frameRequests;
+	std::vector<uint32_t> m_installedTiles;
+
+	// Background loading, the io queue is sorted so that the most urgent tile is at the back
+	std::vector<std::thread> m_ioThreads;
+	std::mutex m_ioMutex;
+	std::condition_variable m_ioAvailable;
+	std::vector<uint32_t> m_ioQueue;
+	std::vector<LoadedTile> m_loadedTiles;
+	std::atomic<uint32_t> m_pendingLoads = 0;
+	bool m_running = true;
+
+	mutable std::atomic<uint64_t> m_directReads = 0;
+	uint64_t m_directReadsLastFrame = 0;
+	uint32_t m_loadedLastFrame = 0;
+	uint32_t m_evictedLastFrame = 0;
+
+	bool get_tile_rect(const glm::ivec2& min, const glm::ivec2& max, glm::ivec2& tileMin, glm::ivec2& tileMax) const;
+	void touch(uint32_t tileIndex);
+	void install(uint32_t tileIndex, uint8_t* data);
+	void evict(uint32_t tileIndex);
+	uint8_t* load_tile(uint32_t tileIndex) const;
+	float read_direct(int x, int y) const;
+	void io_loop();
+};
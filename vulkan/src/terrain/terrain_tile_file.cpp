@@ -0,0 +1,141 @@
+#include "terrain_tile_file.h"
+#include "core/mapped_file.h"
+#include "core/hash.h"
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+static const uint32_t TILE_FILE_MAGIC = 0x4e525454; // TTRN
+static const uint32_t TILE_FILE_VERSION = 1;
+static const uint64_t TILE_FILE_ALIGNMENT = 4096;
+
+TerrainTileFile::TerrainTileFile(const char* filename)
+{
+	m_file = CreateRef<MappedFile>(filename);
+	if (!m_file->is_valid() || m_file->get_size() < sizeof(TerrainTileFileHeader))
+	{
+		Debug_Error("Failed to map terrain tile file %s", filename);
+		return;
+	}
+
+	const uint8_t* data = m_file->get_data();
+	const TerrainTileFileHeader* header = reinterpret_cast<const TerrainTileFileHeader*>(data);
+	if (header->magic != TILE_FILE_MAGIC || header->version != TILE_FILE_VERSION)
+	{
+		Debug_Error("Invalid terrain tile file %s", filename);
+		return;
+	}
+
+	uint64_t tileCount = uint64_t(header->tileCountX) * header->tileCountY;
+	uint64_t expectedSize = header->tileDataOffset + tileCount * header->tileSize * header->tileSize * get_height_format_size(header->format);
+	ASSERT_MSG(m_file->get_size() >= expectedSize, "Truncated terrain tile file");
+
+	m_header = header;
+	m_ranges = reinterpret_cast<const glm::vec2*>(data + sizeof(TerrainTileFileHeader));
+	m_tiles = data + header->tileDataOffset;
+	m_contentHash = hash_bytes(data, sizeof(TerrainTileFileHeader) + tileCount * sizeof(glm::vec2));
+}
+
+bool TerrainTileFile::write(const char* filename, uint32_t width, uint32_t height, uint32_t tileSize, HeightFormat format, const std::function<float(int, int)>& sampler)
+{
+	ASSERT_MSG(tileSize >= 2 && (tileSize & (tileSize - 1)) == 0, "Tile size must be a power of two");
+
+	std::ofstream outfile(filename, std::ios::binary);
+	if (!outfile)
+		return false;
+
+	TerrainTileFileHeader header = {};
+	header.magic = TILE_FILE_MAGIC;
+	header.version = TILE_FILE_VERSION;
+	header.width = width;
+	header.height = height;
+	header.tileSize = tileSize;
+	header.format = format;
+	header.tileCountX = (width + tileSize - 1) / tileSize;
+	header.tileCountY = (height + tileSize - 1) / tileSize;
+
+	uint32_t tileCount = header.tileCountX * header.tileCountY;
+	uint64_t tableEnd = sizeof(TerrainTileFileHeader) + tileCount * sizeof(glm::vec2);
+	header.tileDataOffset = (tableEnd + TILE_FILE_ALIGNMENT - 1) & ~(TILE_FILE_ALIGNMENT - 1);
+
+	// The range table is written once all the tiles are known
+	std::vector<glm::vec2> ranges(tileCount);
+	std::vector<float> tile(tileSize * tileSize);
+	std::vector<uint16_t> encodedTile(format == HeightFormat::UInt16 ? tileSize * tileSize : 0);
+	outfile.seekp(header.tileDataOffset);
+	for (uint32_t tileY = 0; tileY < header.tileCountY; ++tileY)
+	{
+		for (uint32_t tileX = 0; tileX < header.tileCountX; ++tileX)
+		{
+			glm::vec2 range = glm::vec2(FLT_MAX, -FLT_MAX);
+			for (uint32_t y = 0; y < tileSize; ++y)
+			{
+				for (uint32_t x = 0; x < tileSize; ++x)
+				{
+					uint32_t texelX = tileX * tileSize + x;
+					uint32_t texelY = tileY * tileSize + y;
+					float h = 0.0f;
+					if (texelX < width && texelY < height)
+					{
+						h = sampler(texelX, texelY);
+						// The range is computed on the stored value
+						if (format == HeightFormat::UInt16)
+							h = decode_height(encode_height(h));
+						range.x = std::min(range.x, h);
+						range.y = std::max(range.y, h);
+					}
+					tile[y * tileSize + x] = h;
+				}
+			}
+			ranges[tileY * header.tileCountX + tileX] = range;
+			if (format == HeightFormat::UInt16)
+			{
+				for (size_t i = 0; i < tile.size(); ++i)
+					encodedTile[i] = encode_height(tile[i]);
+				outfile.write(reinterpret_cast<char*>(encodedTile.data()), encodedTile.size() * sizeof(uint16_t));
+			}
+			else
+				outfile.write(reinterpret_cast<char*>(tile.data()), tile.size() * sizeof(float));
+		}
+	}
+
+	outfile.seekp(0);
+	outfile.write(reinterpret_cast<char*>(&header), sizeof(TerrainTileFileHeader));
+	outfile.write(reinterpret_cast<char*>(ranges.data()), ranges.size() * sizeof(glm::vec2));
+	return outfile.good();
+}
+
+void TerrainTileFile::load_tile(uint32_t tileIndex, uint8_t* out) const
+{
+	memcpy(out, get_tile(tileIndex), get_tile_size_in_byte());
+}
+
+void TerrainTileFile::read_row(int x, int y, int count, float* out) const
+{
+	int tileSize = static_cast<int>(m_header->tileSize);
+	uint32_t tileRow = uint32_t(y / tileSize) * m_header->tileCountX;
+	uint32_t rowOffset = uint32_t(y % tileSize) * tileSize;
+	while (count > 0)
+	{
+		int tileX = x % tileSize;
+		int spanCount = std::min(count, tileSize - tileX);
+		const uint8_t* data = get_tile(tileRow + x / tileSize);
+		if (m_header->format == HeightFormat::UInt16)
+			decode_heights(reinterpret_cast<const uint16_t*>(data) + rowOffset + tileX, spanCount, out);
+		else
+			memcpy(out, reinterpret_cast<const float*>(data) + rowOffset + tileX, spanCount * sizeof(float));
+
+		x += spanCount;
+		out += spanCount;
+		count -= spanCount;
+	}
+}
+
+void TerrainTileFile::destroy()
+{
+	m_file->destroy();
+	m_header = nullptr;
+	m_ranges = nullptr;
+	m_tiles = nullptr;
+}
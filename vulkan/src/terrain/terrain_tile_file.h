@@ -0,0 +1,68 @@
+#pragma once
+
+#include "core/base.h"
+#include "core/math.h"
+#include <functional>
+
+#include "terrain_tile_source.h"
+
+class MappedFile;
+
+// Layout of the tiled terrain container
+// [header][tile range table][padding to page][tile 0][tile 1]...
+// Tiles are stored row by row, each one is tileSize x tileSize height in the file format,
+// the tiles on the right and bottom edge are padded with zero
+struct TerrainTileFileHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t tileSize;
+	uint32_t tileCountX;
+	uint32_t tileCountY;
+	HeightFormat format;
+	uint64_t tileDataOffset;
+};
+
+// Memory mapped tiled heightmap, nothing is read from disk until a tile is accessed
+class TerrainTileFile : public TerrainTileSource
+{
+public:
+	TerrainTileFile(const char* filename);
+
+	bool is_valid() const { return m_header != nullptr; }
+
+	uint32_t get_width() const override { return m_header->width; }
+	uint32_t get_height() const override { return m_header->height; }
+	uint32_t get_tile_size() const override { return m_header->tileSize; }
+	HeightFormat get_format() const override { return m_header->format; }
+
+	// Min/max of the valid texel of a tile, stored in the header so it never touches the tile data
+	glm::vec2 get_tile_range(uint32_t tileIndex) const override { return m_ranges[tileIndex]; }
+	bool has_exact_tile_ranges() const override { return true; }
+	// Hash of the header and the range table, the tile data is never read to compute it
+	uint64_t get_content_hash() const override { return m_contentHash; }
+
+	// Copy of the mapping, page faults happen here
+	void load_tile(uint32_t tileIndex, uint8_t* out) const override;
+	// Straight from the mapping, may block on disk
+	void read_row(int x, int y, int count, float* out) const override;
+
+	const uint8_t* get_tile(uint32_t tileIndex) const
+	{
+		return m_tiles + static_cast<uint64_t>(tileIndex) * get_tile_size_in_byte();
+	}
+
+	// Write a container of width x height texel, sampler is called once per texel tile by tile
+	// so the whole heightmap never needs to be in memory
+	static bool write(const char* filename, uint32_t width, uint32_t height, uint32_t tileSize, HeightFormat format, const std::function<float(int, int)>& sampler);
+
+	void destroy() override;
+private:
+	Ref<MappedFile> m_file;
+	const TerrainTileFileHeader* m_header = nullptr;
+	const glm::vec2* m_ranges = nullptr;
+	const uint8_t* m_tiles = nullptr;
+	uint64_t m_contentHash = 0;
+};
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "core/base.h"
+#include "core/math.h"
+
+#include "terrain_height_format.h"
+
+// Where the tiles paged by TerrainTileCache come from
+// Tiles are tileSize x tileSize texel in the source format, row by row
+class TerrainTileSource
+{
+public:
+	virtual ~TerrainTileSource() = default;
+
+	virtual uint32_t get_width() const = 0;
+	virtual uint32_t get_height() const = 0;
+	virtual uint32_t get_tile_size() const = 0;
+	virtual HeightFormat get_format() const = 0;
+	uint32_t get_tile_count_x() const { return (get_width() + get_tile_size() - 1) / get_tile_size(); }
+	uint32_t get_tile_count_y() const { return (get_height() + get_tile_size() - 1) / get_tile_size(); }
+	uint32_t get_tile_size_in_byte() const { return get_tile_size() * get_tile_size() * get_height_format_size(get_format()); }
+
+	// Range of the valid texel of a tile, known without loading it
+	virtual glm::vec2 get_tile_range(uint32_t tileIndex) const = 0;
+	// False when get_tile_range is only a bound, the range is then computed once the tile is loaded
+	virtual bool has_exact_tile_ranges() const = 0;
+	// Identify the heights of the source without reading the tiles
+	virtual uint64_t get_content_hash() const = 0;
+
+	// Fill out with the tile, called from the loader threads
+	virtual void load_tile(uint32_t tileIndex, uint8_t* out) const = 0;
+	// Decode count texel of row y starting at x without loading their tile, from any thread
+	virtual void read_row(int x, int y, int count, float* out) const = 0;
+
+	virtual void destroy() = 0;
+};
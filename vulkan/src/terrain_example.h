@@ -4,6 +4,7 @@
 #include "light/cascaded_shadow.h"
 #include "terrain/terrain_stream.h"
 #include "terrain/terrain.h"
+#include "core/job_system.h"
 #include "water/water.h"
 
 class TerrainExample : public ExampleBase
@@ -27,6 +28,18 @@ public:
 		uint32_t width = stream->get_width();
 		uint32_t height = stream->get_height();
 		water->set_translation(glm::vec3(width * 0.5f, -180.0f, height * 0.5f));
+#elif 0
+		// Procedural world, the tiles are generated around the camera on first access
+		PerlinGenerator generator;
+		generator.width = 32768;
+		generator.height = 32768;
+		generator.frequency = 0.005f;
+		generator.octaves = 8;
+		Ref<TerrainTileSource> source = CreateRef<TerrainProceduralSource>(generator, 256);
+		Ref<TerrainStream> stream = CreateRef<TerrainStream>(source, 256ull * 1024 * 1024, JobSystem::get_default_worker_count());
+		uint32_t width = stream->get_width();
+		uint32_t height = stream->get_height();
+		water->set_translation(glm::vec3(width * 0.5f, -180.0f, height * 0.5f));
 #else	
 		Ref<TerrainStream> stream = CreateRef<TerrainStream>("assets/heightmap.png");
 		uint32_t width = stream->get_width();
@@ -68,7 +81,12 @@ public:
 
 		glm::vec3 intersection = glm::vec3(0.0f);
 
-		//terrain->ray_cast(camera->generate_ray(mousePos, size), intersection);
+		// The ray cast is only needed under the brush
+		bool isUIActive = ImGui::IsAnyItemActive() || ImGui::IsAnyItemFocused() || ImGui::IsAnyItemHovered();
+		bool sculpting = mouse->is_down(Button::Right) && !isUIActive;
+		if (sculpting)
+			terrain->ray_cast(camera->generate_ray(mousePos, size), intersection);
+		terrain->sculpt(sculpting);
 	}
 
 	void render() override
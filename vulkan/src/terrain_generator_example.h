@@ -0,0 +1,90 @@
+#pragma once
+
+#include "example_base.h"
+#include "terrain/terrain_generator.h"
+#include "terrain/terrain_gpu_generator.h"
+
+#include <chrono>
+
+// Tiles of a 4000 x 4000 map generated by TerrainGpuGenerator and by its cpu reference,
+// the last tile crosses the edge of the map
+class TerrainGeneratorExample : public ExampleBase
+{
+public:
+	TerrainGeneratorExample() : ExampleBase(1280, 720, false)
+	{
+	}
+
+	void update(float dt) override
+	{
+		if (ImGui::Begin("Terrain GPU Generator"))
+		{
+			if (ImGui::Button("Run check"))
+				run_check();
+
+			ImGui::Text("tiles: %d, gpu: %.2fms, cpu reference and readback: %.2fms", m_result.tileCount, m_gpuTime, m_checkTime);
+			ImGui::Text("max height error: %.7f", m_result.maxHeightError);
+			ImGui::Text("mismatch: height %d, normal %d, min/max %d", m_result.heightMismatchCount, m_result.normalMismatchCount, m_result.rangeMismatchCount);
+		}
+		ImGui::End();
+	}
+
+	void render() override
+	{
+		m_context->begin();
+		m_context->set_clear_color(0.2f, 0.2f, 0.2f, 1.0f);
+		m_context->set_clear_depth(1.0f);
+		m_context->begin_renderpass(nullptr, nullptr);
+		m_context->end_renderpass();
+		m_context->end();
+	}
+
+private:
+	TerrainGpuGenerator::CheckResult m_result;
+	// Milliseconds, the gpu time includes the submission and the wait, the check one the cpu reference and the readback
+	float m_gpuTime = 0.0f;
+	float m_checkTime = 0.0f;
+
+	void run_check()
+	{
+		using Clock = std::chrono::high_resolution_clock;
+		auto elapsed = [](Clock::time_point start) {
+			return std::chrono::duration<float, std::milli>(Clock::now() - start).count();
+		};
+
+		PerlinGenerator generator;
+		generator.width = 4000;
+		generator.height = 4000;
+		const uint32_t tileSize = 256;
+		const float maxHeight = 150.0f;
+		const uint32_t tileCountX = (generator.width + tileSize - 1) / tileSize;
+		// Add, multiply and floor round the same on both side, division and normalize don't
+		const float tolerance = 1e-5f;
+
+		// Diagonal of the map, up to the tile on the bottom right corner
+		std::vector<uint32_t> tiles;
+		for (uint32_t i = 0; i < tileCountX; ++i)
+			tiles.push_back(i * tileCountX + i);
+
+		// The check submits its own work, nothing of the previous frames can be in flight
+		Device::wait_idle();
+		uint32_t tileCount = static_cast<uint32_t>(tiles.size());
+		TerrainGpuGenerator gpuGenerator(m_context, generator, tileSize, maxHeight, tileCount);
+		auto start = Clock::now();
+		m_context->begin_compute();
+		gpuGenerator.dispatch(m_context, tiles);
+		m_context->end_compute();
+		m_gpuTime = elapsed(start);
+
+		start = Clock::now();
+		m_result = gpuGenerator.check(m_context, TerrainGenerator(generator), tolerance);
+		m_checkTime = elapsed(start);
+
+		gpuGenerator.destroy();
+	}
+};
+
+ExampleBase* CreateTerrainGeneratorExampleFn()
+{
+	return new TerrainGeneratorExample();
+}
@@ -25,18 +25,23 @@ Inversion::Inversion(Context* context, unsigned int N, Texture* pingpong0, Textu
 		SamplerDescription samplerDesc = SamplerDescription::Initialize();
 		samplerDesc.wrapU = samplerDesc.wrapV = samplerDesc.wrapW = WrapMode::Repeat;
 		desc.sampler = &samplerDesc;
-		m_heightTexture = Device::create_texture(desc);
+		m_heightTextures.resize(context->get_frames_in_flight());
+		for (auto& heightTexture : m_heightTextures)
+			heightTexture = Device::create_texture(desc);
 	}
 
 	m_bindings = Device::create_shader_bindings();
-	m_bindings->set_storage_image(m_heightTexture, 0);
+	m_bindings->set_storage_image(m_heightTextures[0], 0);
 	m_bindings->set_storage_image(pingpong0, 1);
 	m_bindings->set_storage_image(pingpong1, 2);
 }
 
 void Inversion::update(Context* context, unsigned int N, int pingpong)
 {
-	context->transition_layout_for_compute_read(&m_heightTexture, 1);
+	Texture* heightTexture = m_heightTextures[context->get_frame_index()];
+	m_bindings->set_storage_image(heightTexture, 0);
+
+	context->transition_layout_for_compute_read(&heightTexture, 1);
 	context->update_pipeline(m_pipeline, &m_bindings, 1);
 	context->set_pipeline(m_pipeline);
 
@@ -49,6 +54,7 @@ void Inversion::update(Context* context, unsigned int N, int pingpong)
 void Inversion::destroy()
 {
 	Device::destroy_pipeline(m_pipeline);
-	Device::destroy_texture(m_heightTexture);
+	for (auto& heightTexture : m_heightTextures)
+		Device::destroy_texture(heightTexture);
 	Device::destroy_shader_bindings(m_bindings);
 }
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdint.h>
+#include <vector>
+
 class Context;
 class Texture;
 class Pipeline;
@@ -11,10 +14,12 @@ public:
 	Inversion(Context* context, unsigned int N, Texture* pingpong0, Texture* pingpong1);
 	void update(Context* context, unsigned int N, int pingpong);
 
-	Texture* get_height_texture() { return m_heightTexture; }
+	// One output per frame in flight so that the async compute never writes a texture still being rendered
+	Texture* get_height_texture(uint32_t frameIndex) { return m_heightTextures[frameIndex]; }
+	std::vector<Texture*>& get_height_textures() { return m_heightTextures; }
 	void destroy();
 private:
-	Texture* m_heightTexture;
+	std::vector<Texture*> m_heightTextures;
 	Pipeline* m_pipeline;
 
 	ShaderBindings* m_bindings;
@@ -6,7 +6,7 @@
 #include "renderer/shaderbinding.h"
 #include "common/common.h"
 
-NormalMapGenerator::NormalMapGenerator(Context* context, Texture* displacementMap)
+NormalMapGenerator::NormalMapGenerator(Context* context, const std::vector<Texture*>& displacementMaps) : m_displacementMaps(displacementMaps)
 {
 	std::string code = load_file("spirv/normalmap.comp.spv");
 	PipelineDescription desc = {};
@@ -16,8 +16,8 @@ NormalMapGenerator::NormalMapGenerator(Context* context, Texture* displacementMa
 	m_pipeline = Device::create_pipeline(desc);
 
 	{
-		uint32_t width = displacementMap->get_width();
-		uint32_t height = displacementMap->get_height();
+		uint32_t width = displacementMaps[0]->get_width();
+		uint32_t height = displacementMaps[0]->get_height();
 			//Normal map output texture
 		TextureDescription desc = TextureDescription::Initialize(width, height);
 		desc.format = Format::R32G32B32A32Float;
@@ -25,12 +25,14 @@ NormalMapGenerator::NormalMapGenerator(Context* context, Texture* displacementMa
 		SamplerDescription samplerDesc = SamplerDescription::Initialize();
 		samplerDesc.wrapU = samplerDesc.wrapV = samplerDesc.wrapW = WrapMode::Repeat;
 		desc.sampler = &samplerDesc;
-		m_normalTexture = Device::create_texture(desc);
+		m_normalTextures.resize(displacementMaps.size());
+		for (auto& normalTexture : m_normalTextures)
+			normalTexture = Device::create_texture(desc);
 
 
 		m_bindings = Device::create_shader_bindings();
-		m_bindings->set_texture_sampler(displacementMap, 0);
-		m_bindings->set_storage_image(m_normalTexture, 1);
+		m_bindings->set_texture_sampler(displacementMaps[0], 0);
+		m_bindings->set_storage_image(m_normalTextures[0], 1);
 		m_invResolution = 1.0f / glm::vec2(float(width), float(height));
 		m_N = width;
 	}
@@ -42,12 +44,18 @@ void NormalMapGenerator::destroy()
 {
 	Device::destroy_pipeline(m_pipeline);
 	Device::destroy_shader_bindings(m_bindings);
-	Device::destroy_texture(m_normalTexture);
+	for (auto& normalTexture : m_normalTextures)
+		Device::destroy_texture(normalTexture);
 }
 
 void NormalMapGenerator::generate(Context* context)
 {
-	context->transition_layout_for_compute_read(&m_normalTexture, 1);
+	uint32_t frameIndex = context->get_frame_index();
+	Texture* normalTexture = m_normalTextures[frameIndex];
+	m_bindings->set_texture_sampler(m_displacementMaps[frameIndex], 0);
+	m_bindings->set_storage_image(normalTexture, 1);
+
+	context->transition_layout_for_compute_read(&normalTexture, 1);
 	context->update_pipeline(m_pipeline, &m_bindings, 1);
 	context->set_pipeline(m_pipeline);
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "core/math.h"
+#include <vector>
 
 class ShaderBindings;
 class Context;
@@ -10,12 +11,14 @@ class Texture;
 class NormalMapGenerator
 {
 public:
-	NormalMapGenerator(Context* context, Texture* displacementMap);
+	// displacementMaps contains one texture per frame in flight
+	NormalMapGenerator(Context* context, const std::vector<Texture*>& displacementMaps);
 	void generate(Context* context);
-	Texture* get_normal_texture() { return m_normalTexture; }
+	Texture* get_normal_texture(uint32_t frameIndex) { return m_normalTextures[frameIndex]; }
 	void destroy();
 private:
-	Texture* m_normalTexture;
+	std::vector<Texture*> m_displacementMaps;
+	std::vector<Texture*> m_normalTextures;
 	Pipeline* m_pipeline;
 	ShaderBindings* m_bindings;
 	
@@ -174,11 +174,11 @@ Water::Water(Context* context)
 	}
 
 	m_inversion = CreateRef<Inversion>(context, m_properties->dimension, m_spectrumTexture->get_pingpoing_texture0(), m_spectrumTexture->get_pingpoing_texture1());
-	m_normaMapGenerator = CreateRef<NormalMapGenerator>(context, m_inversion->get_height_texture());
+	m_normaMapGenerator = CreateRef<NormalMapGenerator>(context, m_inversion->get_height_textures());
 
 	m_rendererBindings = Device::create_shader_bindings();
-	m_rendererBindings->set_texture_sampler(m_inversion->get_height_texture(), 2);
-	m_rendererBindings->set_texture_sampler(m_normaMapGenerator->get_normal_texture(), 3);
+	m_rendererBindings->set_texture_sampler(m_inversion->get_height_texture(0), 2);
+	m_rendererBindings->set_texture_sampler(m_normaMapGenerator->get_normal_texture(0), 3);
 	m_rendererBindings->set_texture_sampler(m_reflection.fb->get_color_attachment(0), 4);
 	m_rendererBindings->set_texture_sampler(m_refraction.fb->get_color_attachment(0), 5);
 	m_rendererBindings->set_texture_sampler(m_refraction.fb->get_depth_attachment(), 6);
@@ -201,7 +201,9 @@ Water::Water(Context* context)
 void Water::update(Context* context, float dt)
 {
 	m_timeElapsed += dt;
-	context->begin_compute();
+	uint32_t frameIndex = context->get_frame_index();
+	// Graphics work of this frame waits for the result on the GPU, the CPU keeps going
+	context->begin_async_compute();
 	m_spectrumTexture->create_hdt_texture(context, m_timeElapsed, m_properties->horizontalDimension);
 	m_fft->update(context, m_fftBindings, m_properties->dimension);
 	m_inversion->update(context, m_properties->dimension, m_fft->get_texture_index());
@@ -209,14 +211,14 @@ void Water::update(Context* context, float dt)
 	Texture* textures[] = {
 			m_spectrumTexture->get_pingpoing_texture0(),
 			m_spectrumTexture->get_pingpoing_texture1(),
-			m_inversion->get_height_texture(),
+			m_inversion->get_height_texture(frameIndex),
 	};
 	context->transition_layout_for_shader_read(textures, ARRAYSIZE(textures));
 	m_normaMapGenerator->generate(context);
 
-	Texture* normalMap = m_normaMapGenerator->get_normal_texture();
+	Texture* normalMap = m_normaMapGenerator->get_normal_texture(frameIndex);
 	context->transition_layout_for_shader_read(&normalMap, 1);
-	context->end_compute();
+	context->end_async_compute();
 
 }
 
@@ -239,6 +241,9 @@ void Water::render(Context* context, Ref<Camera> camera, ShaderBindings** unifor
 	std::vector<ShaderBindings*> bindings;
 	for (uint32_t i = 0; i < count; ++i)
 		bindings.push_back(uniformBindings[i]);
+	uint32_t frameIndex = context->get_frame_index();
+	m_rendererBindings->set_texture_sampler(m_inversion->get_height_texture(frameIndex), 2);
+	m_rendererBindings->set_texture_sampler(m_normaMapGenerator->get_normal_texture(frameIndex), 3);
 	bindings.push_back(m_rendererBindings);
 
 	m_renderer->render(context, bindings.data(), camera->get_position(), m_translate, static_cast<uint32_t>(bindings.size()));
@@ -251,6 +256,8 @@ void Water::prepass(Context* context, Scene* scene, ShaderBindings** bindings, u
 		updatedBindings.push_back(*bindings + i);
 	updatedBindings.push_back(m_reflection.binding);
 	uint32_t bindingCount = static_cast<uint32_t>(updatedBindings.size());
+	// Terrain vertices are read from the chunk storage buffers
+	ShaderBindings* terrainBindings = scene->get_terrain() ? scene->get_terrain()->get_chunk_bindings() : nullptr;
 
 	Ref<Camera> camera = scene->get_camera();
 	OffscreenUniformData uniformData;
@@ -279,6 +286,8 @@ void Water::prepass(Context* context, Scene* scene, ShaderBindings** bindings, u
 
 		context->update_pipeline(m_reflection.meshPipeline, updatedBindings.data(), bindingCount);
 		context->update_pipeline(m_reflection.terrainPipeline, updatedBindings.data(), bindingCount);
+		if (terrainBindings != nullptr)
+			context->update_pipeline(m_reflection.terrainPipeline, &terrainBindings, 1);
 		generate_offscreen_texture(context, scene, &m_reflection, newCamera, true);
 	}
 
@@ -292,6 +301,8 @@ void Water::prepass(Context* context, Scene* scene, ShaderBindings** bindings, u
 
 		context->update_pipeline(m_refraction.meshPipeline, updatedBindings.data(), bindingCount);
 		context->update_pipeline(m_refraction.terrainPipeline, updatedBindings.data(), bindingCount);
+		if (terrainBindings != nullptr)
+			context->update_pipeline(m_refraction.terrainPipeline, &terrainBindings, 1);
 		generate_offscreen_texture(context, scene, &m_refraction, camera, false);
 		//generate_refraction_texture(context, scene);
 	}
@@ -0,0 +1,128 @@
+#include "test.h"
+#include "terrain_test_util.h"
+
+#include "core/job_system.h"
+#include "terrain/terrain_brush.h"
+
+#include <cstring>
+
+struct BrushStats
+{
+	uint32_t workerCount = 0;
+	// Million of texel per second, indexed by BrushType
+	float referenceRate[5] = {};
+	float rate[5] = {};
+	// Texels that differ between the two copies once every brush is applied
+	uint32_t mismatchCount = 0;
+	// Byte of the tiles touched by the strokes against their compressed undo
+	uint64_t rawSize = 0;
+	uint64_t compressedSize = 0;
+	// Texels that differ from the copy before the strokes once they are all undone
+	uint32_t undoMismatchCount = 0;
+};
+
+// Scalar single thread brush against the SIMD one on the job system, on two size x size copies of the test heights
+// resampled so that the footprint of the brushes is the same whatever the size
+static BrushStats run_brush_strokes(int size, int applyCount, uint32_t workerCount)
+{
+	Ref<TerrainStream> source = create_test_stream();
+	int width = source->get_width();
+	int height = source->get_height();
+	std::vector<float> original(uint64_t(size) * size);
+	for (int y = 0; y < size; ++y)
+	{
+		float sy = float(y) * float(height - 1) / float(size - 1);
+		for (int x = 0; x < size; ++x)
+			original[uint64_t(y) * size + x] = source->sample(float(x) * float(width - 1) / float(size - 1), sy);
+	}
+	source->destroy();
+
+	// The streams own and delete the copies
+	float* referenceHeights = new float[original.size()];
+	float* heights = new float[original.size()];
+	memcpy(referenceHeights, original.data(), original.size() * sizeof(float));
+	memcpy(heights, original.data(), original.size() * sizeof(float));
+	Ref<TerrainStream> referenceStream = CreateRef<TerrainStream>(referenceHeights, size, size);
+	Ref<TerrainStream> stream = CreateRef<TerrainStream>(heights, size, size);
+	TerrainBrush referenceBrush(referenceStream, 0, true);
+	TerrainBrush brush(stream, workerCount);
+
+	BrushStats stats;
+	stats.workerCount = brush.get_worker_count();
+
+	// A stroke of applyCount applies 256 / 4096 of the map wide per brush type, at the same pseudo random centers for both brushes
+	const float scale = float(size) / 4096.0f;
+	uint32_t state = 1234;
+	for (int type = 0; type < 5; ++type)
+	{
+		BrushSettings settings;
+		settings.type = static_cast<BrushType>(type);
+		settings.falloff = static_cast<BrushFalloff>(type % 4);
+		settings.radius = 128.0f * scale;
+		settings.strength = settings.type == BrushType::Smooth || settings.type == BrushType::Flatten ? 0.5f : 0.01f;
+
+		float referenceTime = 0.0f;
+		float time = 0.0f;
+		uint64_t texelCount = 0;
+		referenceBrush.begin_stroke();
+		brush.begin_stroke();
+		for (int i = 0; i < applyCount; ++i)
+		{
+			state = state * 1664525u + 1013904223u;
+			glm::vec2 center = glm::vec2(float(state >> 20), float((state >> 8) & 0xfff)) * scale + 0.5f;
+			referenceBrush.apply(center, settings);
+			referenceTime += referenceBrush.get_stats().time;
+			brush.apply(center, settings);
+			time += brush.get_stats().time;
+			texelCount += brush.get_stats().texelCount;
+		}
+		referenceBrush.end_stroke();
+		brush.end_stroke();
+
+		stats.referenceRate[type] = float(texelCount) / (referenceTime * 1000.0f);
+		stats.rate[type] = float(texelCount) / (time * 1000.0f);
+		stats.rawSize += brush.get_stats().strokeRawSize;
+		stats.compressedSize += brush.get_stats().strokeCompressedSize;
+	}
+
+	for (size_t i = 0; i < original.size(); ++i)
+	{
+		if (memcmp(&referenceHeights[i], &heights[i], sizeof(float)) != 0)
+			stats.mismatchCount++;
+	}
+
+	while (brush.can_undo())
+		brush.undo();
+	for (size_t i = 0; i < original.size(); ++i)
+	{
+		if (memcmp(&original[i], &heights[i], sizeof(float)) != 0)
+			stats.undoMismatchCount++;
+	}
+
+	referenceBrush.destroy();
+	brush.destroy();
+	referenceStream->destroy();
+	stream->destroy();
+	return stats;
+}
+
+TEST(brush_matches_reference_and_undo)
+{
+	BrushStats stats = run_brush_strokes(1024, 8, 4);
+	CHECK_EQUAL(stats.mismatchCount, 0);
+	CHECK_EQUAL(stats.undoMismatchCount, 0);
+	CHECK(stats.rawSize > 0);
+	CHECK(stats.compressedSize > 0);
+}
+
+BENCHMARK(brush)
+{
+	const char* types[] = { "raise", "lower", "smooth", "flatten", "noise" };
+	const float megaByte = 1.0f / (1024.0f * 1024.0f);
+	BrushStats stats = run_brush_strokes(4096, 32, JobSystem::get_default_worker_count());
+	printf("  4096 x 4096, workers: %d\n", stats.workerCount);
+	for (int i = 0; i < 5; ++i)
+		printf("  %s: scalar %.1f Mtexel/s, simd %.1f Mtexel/s\n", types[i], stats.referenceRate[i], stats.rate[i]);
+	printf("  mismatch: %d, undo mismatch: %d\n", stats.mismatchCount, stats.undoMismatchCount);
+	printf("  undo: %.2fMB of tiles in %.2fMB\n", float(stats.rawSize) * megaByte, float(stats.compressedSize) * megaByte);
+}
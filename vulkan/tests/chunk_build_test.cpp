@@ -0,0 +1,112 @@
+#include "test.h"
+#include "headless_device.h"
+#include "terrain_test_util.h"
+
+#include "core/job_system.h"
+#include "renderer/buffer.h"
+#include "terrain/terrain_chunk.h"
+#include "terrain/terrain_chunkmanager.h"
+
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+TEST(parallel_create_mesh_matches_serial)
+{
+	Ref<TerrainStream> stream = create_test_stream();
+	glm::ivec3 terrainSize = glm::ivec3(TERRAIN_SIZE, MAX_HEIGHT, TERRAIN_SIZE);
+	const uint32_t vertexCount = 128;
+	std::vector<ChunkRect> chunks = get_diagonal_chunks();
+
+	std::vector<std::vector<VertexP4N1_Float>> serial(chunks.size());
+	for (size_t i = 0; i < chunks.size(); ++i)
+		TerrainChunk::create_mesh(stream, chunks[i].min, chunks[i].max, terrainSize, vertexCount, serial[i]);
+
+	// More workers than chunks of a lod so that every worker builds some of them
+	JobSystem jobSystem(4);
+	std::vector<std::vector<VertexP4N1_Float>> parallel(chunks.size());
+	for (size_t i = 0; i < chunks.size(); ++i)
+	{
+		jobSystem.execute([&, i]() {
+			TerrainChunk::create_mesh(stream, chunks[i].min, chunks[i].max, terrainSize, vertexCount, parallel[i]);
+		});
+	}
+	jobSystem.wait();
+	jobSystem.destroy();
+
+	for (size_t i = 0; i < chunks.size(); ++i)
+	{
+		CHECK_EQUAL(parallel[i].size(), serial[i].size());
+		CHECK(memcmp(parallel[i].data(), serial[i].data(), serial[i].size() * sizeof(VertexP4N1_Float)) == 0);
+	}
+	stream->destroy();
+}
+
+// Request the chunks until they are all uploaded
+static void build_chunks(HeadlessContext& context, TerrainChunkManager& manager, Ref<TerrainStream> stream, const std::vector<TerrainChunk*>& chunks)
+{
+	glm::ivec3 terrainSize = glm::ivec3(TERRAIN_SIZE, MAX_HEIGHT, TERRAIN_SIZE);
+	for (uint32_t frame = 0; frame < 10000; ++frame)
+	{
+		bool loaded = true;
+		for (size_t i = 0; i < chunks.size(); ++i)
+		{
+			loaded = loaded && chunks[i]->is_loaded();
+			manager.request_build(chunks[i], float(i));
+		}
+		if (loaded)
+			return;
+
+		manager.update(&context, stream, terrainSize);
+		context.next_frame();
+		if (manager.get_pending_build_count() > 0)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	CHECK(!"chunks not loaded after 10000 frames");
+}
+
+TEST(chunk_manager_workers_match_serial)
+{
+	Ref<TerrainStream> stream = create_test_stream();
+	glm::ivec3 terrainSize = glm::ivec3(TERRAIN_SIZE, MAX_HEIGHT, TERRAIN_SIZE);
+	std::vector<ChunkRect> rects = get_diagonal_chunks();
+	uint32_t poolSize = static_cast<uint32_t>(rects.size());
+
+	// Built on the calling thread and by the workers, the uploaded slots must be identical to create_mesh
+	HeadlessContext context;
+	uint32_t workerCounts[] = { 0, 4 };
+	std::vector<std::vector<uint8_t>> vertexBuffers;
+	for (uint32_t workerCount : workerCounts)
+	{
+		TerrainChunkManager manager(&context, poolSize, workerCount, 1000.0f, TerrainMeshMode::CpuMesh, stream, terrainSize);
+		CHECK_EQUAL(manager.get_worker_count(), workerCount);
+
+		std::vector<TerrainChunk*> chunks;
+		for (uint32_t i = 0; i < poolSize; ++i)
+		{
+			TerrainChunk* chunk = manager.get_free_chunk(1);
+			chunk->initialize(rects[i].min, rects[i].max, rects[i].lod, i, 1);
+			chunks.push_back(chunk);
+		}
+		build_chunks(context, manager, stream, chunks);
+
+		uint32_t chunkVertexCount = manager.get_chunk_vertex_count();
+		std::vector<uint8_t>& vertexBuffer = static_cast<HeadlessShaderStorageBuffer*>(manager.vertexBuffer)->data;
+		std::vector<VertexP4N1_Float> vertices;
+		std::vector<TerrainVertex> compressed;
+		glm::vec2 heightRange;
+		for (TerrainChunk* chunk : chunks)
+		{
+			TerrainChunk::create_mesh(stream, chunk->get_min(), chunk->get_max(), terrainSize, manager.get_vertex_count(), vertices);
+			TerrainChunk::compress_mesh(vertices, float(MAX_HEIGHT), compressed, heightRange);
+			CHECK_EQUAL(compressed.size(), chunkVertexCount);
+			uint64_t offset = uint64_t(chunk->get_pool_index()) * chunkVertexCount * sizeof(TerrainVertex);
+			CHECK(memcmp(vertexBuffer.data() + offset, compressed.data(), compressed.size() * sizeof(TerrainVertex)) == 0);
+			CHECK(chunk->get_min_height() == heightRange.x && chunk->get_max_height() == heightRange.y);
+		}
+		vertexBuffers.push_back(vertexBuffer);
+		manager.destroy();
+	}
+	CHECK(vertexBuffers[0] == vertexBuffers[1]);
+	stream->destroy();
+}
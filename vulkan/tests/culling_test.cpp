@@ -0,0 +1,222 @@
+#include "test.h"
+#include "headless_device.h"
+#include "terrain_test_util.h"
+
+#include "core/frustum.h"
+#include "renderer/buffer.h"
+#include "scene/camera.h"
+#include "terrain/terrain_chunk.h"
+#include "terrain/terrain_culling.h"
+#include "terrain/terrain_quadtree.h"
+
+#include <thread>
+
+static uint32_t next_random(uint32_t& state)
+{
+	state = state * 1664525u + 1013904223u;
+	return state >> 8;
+}
+
+static float random_range(uint32_t& state, float min, float max)
+{
+	return min + (max - min) * float(next_random(state)) / float(1 << 24);
+}
+
+// Box outside of the frustum if its eight corners are behind the same plane
+static bool is_box_visible(const std::array<glm::vec4, 6>& planes, const ChunkCullData& chunk)
+{
+	for (const glm::vec4& plane : planes)
+	{
+		bool outside = true;
+		for (int corner = 0; corner < 8 && outside; ++corner)
+		{
+			glm::vec3 p = glm::vec3(
+				(corner & 1) ? chunk.boundsMax.x : chunk.boundsMin.x,
+				(corner & 2) ? chunk.boundsMax.y : chunk.boundsMin.y,
+				(corner & 4) ? chunk.boundsMax.z : chunk.boundsMin.z);
+			outside = glm::dot(glm::vec3(plane), p) + plane.w < 0.0f;
+		}
+		if (outside)
+			return false;
+	}
+	return true;
+}
+
+TEST(cpu_culling_matches_brute_force)
+{
+	uint32_t state = 1234;
+	Ref<Camera> camera = CreateRef<Camera>();
+	camera->set_far_plane(1000.0f);
+
+	uint32_t visibleCount = 0;
+	uint32_t chunkCount = 0;
+	for (int view = 0; view < 64; ++view)
+	{
+		camera->set_position(glm::vec3(random_range(state, 0.0f, 2048.0f), random_range(state, -50.0f, 300.0f), random_range(state, 0.0f, 2048.0f)));
+		camera->set_rotation(glm::vec3(random_range(state, -1.5f, 1.5f), random_range(state, -3.14f, 3.14f), 0.0f));
+		camera->update(0.0f);
+		std::array<glm::vec4, 6> planes = TerrainCulling::get_planes(*camera->get_frustum());
+
+		// Chunks of every size on the map, some of them flat, each one with a distinct draw
+		std::vector<ChunkCullData> chunks(512);
+		for (uint32_t i = 0; i < chunks.size(); ++i)
+		{
+			ChunkCullData& chunk = chunks[i];
+			float size = float(64 << (next_random(state) % 6));
+			glm::vec2 min = glm::vec2(random_range(state, 0.0f, 2048.0f), random_range(state, 0.0f, 2048.0f));
+			float minHeight = random_range(state, -150.0f, 150.0f);
+			float maxHeight = (i % 8 == 0) ? minHeight : random_range(state, minHeight, 150.0f);
+			chunk.boundsMin = glm::vec4(min.x, minHeight, min.y, 0.0f);
+			chunk.boundsMax = glm::vec4(min.x + size, maxHeight, min.y + size, 0.0f);
+			chunk.indexCount = 6 * (i + 1);
+			chunk.vertexOffset = int32_t(i * 131);
+			chunk.firstIndex = i * 7;
+			chunk.padding = 0;
+		}
+
+		std::vector<DrawIndexedIndirectData> draws;
+		TerrainCulling::cull(planes, chunks, draws);
+
+		// The visible chunks keep their order, the draws are compacted at the start of the list
+		size_t drawIndex = 0;
+		for (const ChunkCullData& chunk : chunks)
+		{
+			bool visible = is_box_visible(planes, chunk);
+			CHECK(TerrainCulling::is_visible(planes, chunk) == visible);
+			BoundingBox box = { glm::vec3(chunk.boundsMin), glm::vec3(chunk.boundsMax) };
+			CHECK(camera->get_frustum()->intersect_box(box) == visible);
+			if (!visible)
+				continue;
+
+			CHECK(drawIndex < draws.size());
+			if (drawIndex >= draws.size())
+				break;
+			const DrawIndexedIndirectData& draw = draws[drawIndex++];
+			CHECK_EQUAL(draw.indexCount, chunk.indexCount);
+			CHECK_EQUAL(draw.instanceCount, 1);
+			CHECK_EQUAL(draw.firstIndex, chunk.firstIndex);
+			CHECK_EQUAL(draw.vertexOffset, chunk.vertexOffset);
+			CHECK_EQUAL(draw.firstInstance, 0);
+		}
+		CHECK_EQUAL(draws.size(), drawIndex);
+		visibleCount += static_cast<uint32_t>(drawIndex);
+		chunkCount += static_cast<uint32_t>(chunks.size());
+	}
+
+	// Both outcomes are covered
+	CHECK(visibleCount > 0 && visibleCount < chunkCount);
+}
+
+TEST(cpu_culling_planes_face_inside)
+{
+	Ref<Camera> camera = CreateRef<Camera>();
+	camera->set_position(glm::vec3(100.0f, 20.0f, 100.0f));
+	camera->set_rotation(glm::vec3(0.0f));
+	camera->update(0.0f);
+	std::array<glm::vec4, 6> planes = TerrainCulling::get_planes(*camera->get_frustum());
+
+	// A point in front of the camera is inside every plane, one behind it is outside of the near plane
+	glm::vec3 forward = camera->get_forward();
+	glm::vec3 inside = camera->get_position() - 10.0f * forward;
+	glm::vec3 behind = camera->get_position() + 10.0f * forward;
+	ChunkCullData chunk = {};
+	chunk.boundsMin = chunk.boundsMax = glm::vec4(inside, 0.0f);
+	bool insideVisible = TerrainCulling::is_visible(planes, chunk);
+	chunk.boundsMin = chunk.boundsMax = glm::vec4(behind, 0.0f);
+	bool behindVisible = TerrainCulling::is_visible(planes, chunk);
+	CHECK(insideVisible != behindVisible);
+	for (const glm::vec4& plane : planes)
+		CHECK(std::abs(glm::length(glm::vec3(plane)) - 1.0f) < 1e-4f);
+}
+
+// Camera circling the center of the map, looking along the path and slightly down, the quadtree
+// is updated until its builds are done at each position
+// The generated heights go below 0, the full height box misses that part of the map so it can reject
+// more nodes than the pyramid bounds
+BENCHMARK(culling)
+{
+	Ref<TerrainStream> stream = create_test_stream();
+	HeadlessContext context;
+	uint32_t depth = 0;
+	while ((MIN_CHUNK_SIZE << depth) < TERRAIN_SIZE)
+		depth++;
+	QuadTree quadTree(&context, stream, depth, TERRAIN_SIZE, MAX_HEIGHT, TerrainMeshMode::CpuMesh, 500);
+	TerrainCulling culling(1024);
+	Ref<Camera> camera = CreateRef<Camera>();
+
+	const uint32_t positionCount = 16;
+	const uint32_t iterationCount = 100;
+	uint64_t nodeTested = 0, nodeCulled = 0, nodeCulledFullHeight = 0;
+	uint64_t chunkCount = 0, drawCount = 0;
+	float cpuTime = 0.0f, gpuTime = 0.0f;
+	std::vector<ChunkCullData> chunks;
+	std::vector<DrawIndexedIndirectData> draws;
+	for (uint32_t i = 0; i < positionCount; ++i)
+	{
+		float angle = 6.2831853f * float(i) / float(positionCount);
+		glm::vec3 position = glm::vec3(float(TERRAIN_SIZE) * (0.5f + 0.3f * std::cos(angle)), 0.0f, float(TERRAIN_SIZE) * (0.5f + 0.3f * std::sin(angle)));
+		position.y = sample_world_height(stream, position.x, position.z) + 30.0f;
+		camera->set_position(position);
+		camera->set_rotation(glm::vec3(0.2f, -angle, 0.0f));
+		camera->update(0.0f);
+
+		uint32_t idleFrameCount = 0;
+		for (uint32_t frame = 0; frame < 1000 && idleFrameCount < 10; ++frame)
+		{
+			quadTree.update(&context, camera);
+			quadTree.prepass(&context, camera);
+			context.next_frame();
+			bool pending = quadTree.get_chunk_manager()->get_pending_build_count() > 0;
+			idleFrameCount = pending ? 0 : idleFrameCount + 1;
+			if (pending)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		quadTree.update(&context, camera);
+		quadTree.prepass(&context, camera);
+
+		const QuadTree::CullStats& cullStats = quadTree.get_cull_stats();
+		nodeTested += cullStats.tested;
+		nodeCulled += cullStats.culled;
+		nodeCulledFullHeight += cullStats.culledFullHeight;
+
+		chunks.clear();
+		for (TerrainChunk* chunk : quadTree.get_visible_list())
+		{
+			ChunkCullData cullData = {};
+			cullData.boundsMin = glm::vec4(float(chunk->get_min().x), chunk->get_min_height(), float(chunk->get_min().y), 0.0f);
+			cullData.boundsMax = glm::vec4(float(chunk->get_max().x), chunk->get_max_height(), float(chunk->get_max().y), 0.0f);
+			cullData.indexCount = 6;
+			chunks.push_back(cullData);
+		}
+		std::array<glm::vec4, 6> planes = TerrainCulling::get_planes(*camera->get_frustum());
+		chunkCount += chunks.size();
+
+		// Frame cost on the cpu of both paths, the cpu one culls and uploads the draws and the gpu one uploads
+		// the chunks and records the dispatch, the kernel itself only runs with a device
+		Clock::time_point start = Clock::now();
+		for (uint32_t iteration = 0; iteration < iterationCount; ++iteration)
+		{
+			draws.clear();
+			TerrainCulling::cull(planes, chunks, draws);
+			if (!draws.empty())
+				context.copy(quadTree.get_indirect_buffer(), draws.data(), 0, static_cast<uint32_t>(draws.size() * sizeof(DrawIndexedIndirectData)));
+		}
+		cpuTime += get_elapsed_ms(start);
+		drawCount += draws.size();
+
+		start = Clock::now();
+		for (uint32_t iteration = 0; iteration < iterationCount; ++iteration)
+			culling.dispatch(&context, planes, chunks);
+		gpuTime += get_elapsed_ms(start);
+	}
+
+	printf("  %d camera positions, nodes culled: %.1f / %.1f per frame (full height: %.1f)\n", int(positionCount),
+		float(nodeCulled) / positionCount, float(nodeTested) / positionCount, float(nodeCulledFullHeight) / positionCount);
+	printf("  chunks drawn: %.1f / %.1f per frame\n", float(drawCount) / positionCount, float(chunkCount) / positionCount);
+	float frameCount = float(positionCount * iterationCount);
+	printf("  cpu culling: %.2fus, gpu culling upload and dispatch: %.2fus per frame\n", cpuTime * 1000.0f / frameCount, gpuTime * 1000.0f / frameCount);
+
+	culling.destroy();
+	quadTree.destroy();
+	stream->destroy();
+}
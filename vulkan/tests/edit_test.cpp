@@ -0,0 +1,258 @@
+#include "test.h"
+#include "headless_device.h"
+#include "terrain_test_util.h"
+
+#include "scene/camera.h"
+#include "terrain/terrain_chunk.h"
+#include "terrain/terrain_clipmap.h"
+
+#include <climits>
+#include <cstring>
+#include <thread>
+#include <atomic>
+
+static const uint32_t VERTEX_COUNT = 128;
+
+// Editable float copy of the test stream
+static Ref<TerrainStream> create_editable_stream()
+{
+	Ref<TerrainStream> source = create_test_stream();
+	int width = source->get_width();
+	int height = source->get_height();
+	// The stream owns and deletes the copy
+	float* heights = new float[uint64_t(width) * height];
+	source->read_rect(glm::ivec2(0), glm::ivec2(width - 1, height - 1), heights);
+	source->destroy();
+	return CreateRef<TerrainStream>(heights, width, height);
+}
+
+struct EditChunk
+{
+	glm::ivec2 min;
+	glm::ivec2 max;
+	std::vector<TerrainVertex> vertices;
+};
+
+struct EditStats
+{
+	uint32_t chunkCount = 0;
+	uint32_t dirtyChunkCount = 0;
+	uint32_t rebuiltRowCount = 0;
+	uint32_t totalRowCount = 0;
+	// Vertices of the patched meshes that differ from the full rebuild
+	uint32_t mismatchCount = 0;
+	// Chunks changed by the edit that no dirty row covers
+	uint32_t missedChunkCount = 0;
+	// Rows of create_mesh_rows that differ from the same rows of create_mesh
+	uint32_t rowMismatchCount = 0;
+	// Milliseconds for all the chunks
+	float partialTime = 0.0f;
+	float fullTime = 0.0f;
+};
+
+// Chunks of every lod around editCenter, built before the edit
+static std::vector<EditChunk> create_edit_chunks(const Ref<TerrainStream>& stream, const glm::ivec2& editCenter)
+{
+	glm::ivec3 terrainSize = glm::ivec3(TERRAIN_SIZE, MAX_HEIGHT, TERRAIN_SIZE);
+	std::vector<EditChunk> chunks;
+	std::vector<VertexP4N1_Float> vertices;
+	glm::vec2 heightRange;
+	for (uint32_t lod = 0; (MIN_CHUNK_SIZE << lod) <= TERRAIN_SIZE; ++lod)
+	{
+		int chunkSize = int(MIN_CHUNK_SIZE << lod);
+		glm::ivec2 center = editCenter / chunkSize * chunkSize;
+		for (int z = -2; z < 2; ++z)
+		{
+			for (int x = -2; x < 2; ++x)
+			{
+				EditChunk chunk;
+				chunk.min = center + glm::ivec2(x, z) * chunkSize;
+				chunk.max = chunk.min + glm::ivec2(chunkSize);
+				if (glm::any(glm::lessThan(chunk.min, glm::ivec2(0))) || glm::any(glm::greaterThan(chunk.max, glm::ivec2(TERRAIN_SIZE))))
+					continue;
+				TerrainChunk::create_mesh(stream, chunk.min, chunk.max, terrainSize, VERTEX_COUNT, vertices);
+				TerrainChunk::compress_mesh(vertices, float(MAX_HEIGHT), chunk.vertices, heightRange);
+				chunks.push_back(std::move(chunk));
+			}
+		}
+	}
+	return chunks;
+}
+
+// Raise a square around editCenter, then patch the rows get_dirty_rows reports with create_mesh_rows
+// and compare every chunk against a full rebuild
+static EditStats run_edit(const Ref<TerrainStream>& stream, const glm::ivec2& editCenter, int editRadius)
+{
+	glm::ivec3 terrainSize = glm::ivec3(TERRAIN_SIZE, MAX_HEIGHT, TERRAIN_SIZE);
+	const int rowSize = int(VERTEX_COUNT) + 3;
+	std::vector<EditChunk> chunks = create_edit_chunks(stream, editCenter);
+
+	for (int y = -editRadius; y <= editRadius; ++y)
+	{
+		for (int x = -editRadius; x <= editRadius; ++x)
+			stream->set(editCenter.x + x, editCenter.y + y, stream->get(editCenter.x + x, editCenter.y + y) + 0.05f);
+	}
+	std::vector<TerrainStream::DirtyRect> dirtyRects;
+	stream->take_dirty_rects(dirtyRects);
+
+	EditStats stats;
+	std::vector<VertexP4N1_Float> rows;
+	std::vector<VertexP4N1_Float> vertices;
+	std::vector<TerrainVertex> compressed;
+	glm::vec2 heightRange;
+	for (EditChunk& chunk : chunks)
+	{
+		Clock::time_point start = Clock::now();
+		int firstRow = INT_MAX;
+		int lastRow = INT_MIN;
+		for (const TerrainStream::DirtyRect& rect : dirtyRects)
+		{
+			int rectFirstRow, rectLastRow;
+			if (TerrainChunk::get_dirty_rows(stream, chunk.min, chunk.max, terrainSize, VERTEX_COUNT, rect.min, rect.max, rectFirstRow, rectLastRow))
+			{
+				firstRow = glm::min(firstRow, rectFirstRow);
+				lastRow = glm::max(lastRow, rectLastRow);
+			}
+		}
+		bool dirty = firstRow <= lastRow;
+		if (dirty)
+		{
+			TerrainChunk::create_mesh_rows(stream, chunk.min, chunk.max, terrainSize, VERTEX_COUNT, firstRow, lastRow, rows);
+			TerrainChunk::compress_mesh(rows, float(MAX_HEIGHT), compressed, heightRange);
+			std::copy(compressed.begin(), compressed.end(), chunk.vertices.begin() + (firstRow + 1) * rowSize);
+			stats.dirtyChunkCount++;
+			stats.rebuiltRowCount += lastRow - firstRow + 1;
+		}
+		stats.partialTime += get_elapsed_ms(start);
+		stats.totalRowCount += rowSize;
+		stats.chunkCount++;
+
+		start = Clock::now();
+		TerrainChunk::create_mesh(stream, chunk.min, chunk.max, terrainSize, VERTEX_COUNT, vertices);
+		TerrainChunk::compress_mesh(vertices, float(MAX_HEIGHT), compressed, heightRange);
+		stats.fullTime += get_elapsed_ms(start);
+
+		if (dirty)
+		{
+			const VertexP4N1_Float* fullRows = vertices.data() + (firstRow + 1) * rowSize;
+			if (rows.size() != size_t(lastRow - firstRow + 1) * rowSize || memcmp(rows.data(), fullRows, rows.size() * sizeof(VertexP4N1_Float)) != 0)
+				stats.rowMismatchCount++;
+		}
+
+		uint32_t mismatchCount = 0;
+		for (size_t v = 0; v < compressed.size(); ++v)
+		{
+			if (memcmp(&compressed[v], &chunk.vertices[v], sizeof(TerrainVertex)) != 0)
+				mismatchCount++;
+		}
+		stats.mismatchCount += mismatchCount;
+		if (!dirty && mismatchCount > 0)
+			stats.missedChunkCount++;
+	}
+	return stats;
+}
+
+// Edits on the corner shared by the chunks of every lod and inside a single chunk
+TEST(partial_rebuild_matches_full_rebuild)
+{
+	const glm::ivec2 editCenters[] = { glm::ivec2(TERRAIN_SIZE / 2), glm::ivec2(TERRAIN_SIZE / 2) + glm::ivec2(300, 170) };
+	for (const glm::ivec2& editCenter : editCenters)
+	{
+		Ref<TerrainStream> stream = create_editable_stream();
+		EditStats stats = run_edit(stream, editCenter, 10);
+		CHECK(stats.chunkCount > 0);
+		CHECK(stats.dirtyChunkCount > 0);
+		CHECK(stats.rebuiltRowCount < stats.totalRowCount);
+		CHECK_EQUAL(stats.rowMismatchCount, 0);
+		CHECK_EQUAL(stats.mismatchCount, 0);
+		CHECK_EQUAL(stats.missedChunkCount, 0);
+		stream->destroy();
+	}
+}
+
+// Vertices of every level of a clipmap
+static std::vector<uint8_t> update_clipmap(HeadlessContext& context, TerrainClipmap& clipmap, Ref<Camera> camera)
+{
+	// One level per frame at most, the finer levels are filled over the next frames
+	for (int frame = 0; frame < 16; ++frame)
+	{
+		clipmap.update(&context, camera);
+		context.next_frame();
+	}
+	return static_cast<HeadlessShaderStorageBuffer*>(clipmap.get_vertex_buffer())->data;
+}
+
+// Edits on the finest levels and on a coarse one only, the edited clipmap matches one created after the edits
+TEST(clipmap_edit_matches_rebuild)
+{
+	Ref<TerrainStream> stream = create_editable_stream();
+	HeadlessContext context;
+	Ref<Camera> camera = CreateRef<Camera>();
+	glm::vec3 position = glm::vec3(float(TERRAIN_SIZE) * 0.5f, 0.0f, float(TERRAIN_SIZE) * 0.5f);
+	position.y = sample_world_height(stream, position.x, position.z) + 30.0f;
+	camera->set_position(position);
+	camera->update(0.0f);
+
+	TerrainClipmap clipmap(&context, stream, TERRAIN_SIZE, MAX_HEIGHT, 1.0f);
+	std::vector<uint8_t> vertices = update_clipmap(context, clipmap, camera);
+
+	const glm::ivec2 editCenters[] = { glm::ivec2(TERRAIN_SIZE / 2), glm::ivec2(TERRAIN_SIZE / 2) + glm::ivec2(700, -500) };
+	for (const glm::ivec2& editCenter : editCenters)
+	{
+		for (int y = -10; y <= 10; ++y)
+		{
+			for (int x = -10; x <= 10; ++x)
+				stream->set(editCenter.x + x, editCenter.y + y, stream->get(editCenter.x + x, editCenter.y + y) + 0.05f);
+		}
+	}
+	std::vector<uint8_t> editedVertices = update_clipmap(context, clipmap, camera);
+	CHECK(!stream->has_dirty_rects());
+
+	TerrainClipmap reference(&context, stream, TERRAIN_SIZE, MAX_HEIGHT, 1.0f);
+	std::vector<uint8_t> referenceVertices = update_clipmap(context, reference, camera);
+
+	CHECK_EQUAL(editedVertices.size(), referenceVertices.size());
+	CHECK(editedVertices != vertices);
+	CHECK(editedVertices == referenceVertices);
+
+	clipmap.destroy();
+	reference.destroy();
+	stream->destroy();
+}
+
+// A write over a rect acquired by a chunk build waits for its release, a write next to it does not
+TEST(write_waits_for_acquired_rect)
+{
+	Ref<TerrainStream> stream = create_editable_stream();
+	const glm::ivec2 min = glm::ivec2(100), max = glm::ivec2(163);
+	CHECK(stream->acquire(min, max));
+
+	std::vector<float> heights(16 * 16, 0.25f);
+	stream->write_rect(max + 1, max + 16, heights.data());
+	CHECK_EQUAL(stream->get(max.x + 1, max.y + 1), 0.25f);
+
+	std::atomic<bool> written = false;
+	std::thread writer([&]() {
+		stream->write_rect(max - 8, max + 7, heights.data());
+		written = true;
+	});
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	CHECK(!written.load());
+	CHECK(stream->get(max.x, max.y) != 0.25f);
+
+	stream->release(min, max);
+	writer.join();
+	CHECK(written.load());
+	CHECK_EQUAL(stream->get(max.x, max.y), 0.25f);
+	stream->destroy();
+}
+
+// Partial rebuild of the rows reading the edit against a full rebuild of the chunks
+BENCHMARK(edit_rebuild)
+{
+	Ref<TerrainStream> stream = create_editable_stream();
+	EditStats stats = run_edit(stream, glm::ivec2(TERRAIN_SIZE / 2), 10);
+	printf("  chunks: %d, dirty: %d, rows rebuilt: %d / %d\n", stats.chunkCount, stats.dirtyChunkCount, stats.rebuiltRowCount, stats.totalRowCount);
+	printf("  partial rebuild: %.3fms, full rebuild: %.3fms\n", stats.partialTime, stats.fullTime);
+	stream->destroy();
+}
@@ -0,0 +1,146 @@
+#include "test.h"
+#include "terrain_test_util.h"
+
+#include "core/job_system.h"
+#include "terrain/perlin_noise.h"
+
+#include <cstring>
+#include <thread>
+
+struct GeneratorStats
+{
+	uint32_t workerCount = 0;
+	// Milliseconds
+	float referenceTime = 0.0f;
+	float scalarTime = 0.0f;
+	float simdTime = 0.0f;
+	float parallelTime = 0.0f;
+	// Texels that differ between the scalar and SIMD kernel, and between one thread and every worker
+	uint32_t mismatchCount = 0;
+	uint32_t workerMismatchCount = 0;
+	float maxReferenceError = 0.0f;
+	// Same map from a TerrainProceduralSource, milliseconds to create the stream and to page in
+	// the tiles of the center texels, a quarter of the width of the map
+	float lazyStartupTime = 0.0f;
+	float lazyLoadTime = 0.0f;
+	uint32_t lazyMismatchCount = 0;
+};
+
+// Generated map of size x size, the previous siv::PerlinNoise fbm in double on one thread against
+// the TerrainGenerator kernels
+static GeneratorStats run_generator(uint32_t size, uint32_t workerCount)
+{
+	PerlinGenerator generator;
+	generator.width = size;
+	generator.height = size;
+	uint64_t texelCount = uint64_t(generator.width) * generator.height;
+	std::vector<float> reference(texelCount);
+	std::vector<float> scalar(texelCount);
+	std::vector<float> heights(texelCount);
+
+	GeneratorStats stats;
+
+	// What the generated stream used to run at startup
+	Clock::time_point start = Clock::now();
+	siv::PerlinNoise noise(generator.seed);
+	for (uint32_t y = 0; y < generator.height; ++y)
+	{
+		for (uint32_t x = 0; x < generator.width; ++x)
+		{
+			double total = 0.0;
+			double normalization = 0.0;
+			float a = generator.amplitude;
+			float f = generator.frequency;
+			for (uint32_t i = 0; i < generator.octaves; ++i)
+			{
+				total += a * noise.noise2D_0_1(double(x * f), double(y * f));
+				normalization += a;
+				a *= generator.gain;
+				f *= generator.lacunarity;
+			}
+			total /= normalization;
+			reference[y * generator.width + x] = static_cast<float>(std::pow(total * 2.0 - 1.0, generator.exponent));
+		}
+	}
+	stats.referenceTime = get_elapsed_ms(start);
+
+	JobSystem singleThread(0);
+	JobSystem workers(workerCount);
+	stats.workerCount = workers.get_worker_count();
+
+	start = Clock::now();
+	TerrainGenerator(generator, true).generate(scalar.data(), &singleThread);
+	stats.scalarTime = get_elapsed_ms(start);
+
+	start = Clock::now();
+	TerrainGenerator(generator).generate(heights.data(), &singleThread);
+	stats.simdTime = get_elapsed_ms(start);
+
+	for (uint64_t i = 0; i < texelCount; ++i)
+	{
+		if (memcmp(&scalar[i], &heights[i], sizeof(float)) != 0)
+			stats.mismatchCount++;
+		stats.maxReferenceError = std::max(stats.maxReferenceError, std::abs(scalar[i] - reference[i]));
+	}
+
+	// The reference is not needed anymore
+	start = Clock::now();
+	TerrainGenerator(generator).generate(reference.data(), &workers);
+	stats.parallelTime = get_elapsed_ms(start);
+
+	for (uint64_t i = 0; i < texelCount; ++i)
+	{
+		if (memcmp(&reference[i], &heights[i], sizeof(float)) != 0)
+			stats.workerMismatchCount++;
+	}
+
+	start = Clock::now();
+	Ref<TerrainStream> lazyStream = CreateRef<TerrainStream>(CreateRef<TerrainProceduralSource>(generator, 256), 64ull * 1024 * 1024, std::max(workers.get_worker_count(), 1u));
+	stats.lazyStartupTime = get_elapsed_ms(start);
+
+	start = Clock::now();
+	glm::ivec2 min = glm::ivec2(int(size) * 3 / 8);
+	glm::ivec2 max = glm::ivec2(int(size) * 5 / 8 - 1);
+	lazyStream->prefetch(min, max, 0.0f);
+	while (!lazyStream->acquire(min, max))
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		lazyStream->update();
+	}
+	stats.lazyLoadTime = get_elapsed_ms(start);
+
+	std::vector<float> row(max.x - min.x + 1);
+	for (int y = min.y; y <= max.y; ++y)
+	{
+		lazyStream->read_rect(glm::ivec2(min.x, y), glm::ivec2(max.x, y), row.data());
+		if (memcmp(row.data(), &heights[uint64_t(y) * generator.width + min.x], row.size() * sizeof(float)) != 0)
+			stats.lazyMismatchCount++;
+	}
+	lazyStream->release(min, max);
+	lazyStream->destroy();
+
+	singleThread.destroy();
+	workers.destroy();
+	return stats;
+}
+
+// The kernels are bit exact with each other whatever the worker count or the tiles, and within float
+// rounding of the double siv::PerlinNoise
+TEST(generator_kernels_match)
+{
+	GeneratorStats stats = run_generator(1024, 4);
+	CHECK_EQUAL(stats.mismatchCount, 0);
+	CHECK_EQUAL(stats.workerMismatchCount, 0);
+	CHECK_EQUAL(stats.lazyMismatchCount, 0);
+	CHECK(stats.maxReferenceError < 0.00001f);
+}
+
+BENCHMARK(generator)
+{
+	GeneratorStats stats = run_generator(4096, JobSystem::get_default_worker_count());
+	printf("  4096 x 4096, workers: %d\n", stats.workerCount);
+	printf("  siv double: %.1fms, scalar: %.1fms\n", stats.referenceTime, stats.scalarTime);
+	printf("  simd: %.1fms, simd parallel: %.1fms\n", stats.simdTime, stats.parallelTime);
+	printf("  mismatch: %d, worker mismatch: %d, max error: %.7f\n", stats.mismatchCount, stats.workerMismatchCount, stats.maxReferenceError);
+	printf("  lazy: startup %.1fms, center tiles %.1fms, mismatch: %d\n", stats.lazyStartupTime, stats.lazyLoadTime, stats.lazyMismatchCount);
+}
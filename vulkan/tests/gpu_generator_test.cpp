@@ -0,0 +1,168 @@
+#include "test.h"
+#include "headless_device.h"
+#include "terrain_test_util.h"
+
+#include "terrain/terrain_chunk.h"
+#include "terrain/terrain_gpu_generator.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cstring>
+
+// The cpu reference of the gpu passes against the heights of TerrainGenerator for the whole map: heights bit exact
+// and zero past the edge, normals from the central differences clamped to the map and every min/max cell
+TEST(gpu_generator_reference_matches_generator)
+{
+	const uint32_t tileSize = 64;
+	const float maxHeight = float(MAX_HEIGHT);
+	for (int type = 0; type < 3; ++type)
+	{
+		// Neither side is a multiple of the tile size so that the last tiles cross the edge of the map
+		PerlinGenerator settings;
+		settings.width = 1000;
+		settings.height = 700;
+		settings.type = NoiseType(type);
+		TerrainGenerator generator(settings);
+		int width = int(settings.width);
+		int height = int(settings.height);
+		std::vector<float> map(uint64_t(width) * height);
+		generator.generate_rect(glm::ivec2(0), glm::ivec2(width - 1, height - 1), map.data());
+		auto get_height = [&](int x, int y) {
+			x = std::min(std::max(x, 0), width - 1);
+			y = std::min(std::max(y, 0), height - 1);
+			return (map[y * width + x] * 2.0f - 1.0f) * maxHeight;
+		};
+
+		uint32_t tileCountX = (settings.width + tileSize - 1) / tileSize;
+		uint32_t tileCountY = (settings.height + tileSize - 1) / tileSize;
+		uint32_t levelCount = TerrainGpuGenerator::get_level_count(tileSize);
+		uint32_t rangeCount = TerrainGpuGenerator::get_range_count(tileSize);
+		std::vector<float> heights(tileSize * tileSize);
+		std::vector<uint32_t> normals(tileSize * tileSize);
+		std::vector<glm::vec2> ranges(rangeCount);
+		uint32_t heightMismatchCount = 0;
+		uint32_t normalMismatchCount = 0;
+		uint32_t rangeMismatchCount = 0;
+		for (uint32_t tile = 0; tile < tileCountX * tileCountY; ++tile)
+		{
+			TerrainGpuGenerator::generate_tile(generator, tile, tileSize, maxHeight, heights.data(), normals.data(), ranges.data());
+			glm::ivec2 origin = glm::ivec2(tile % tileCountX, tile / tileCountX) * int(tileSize);
+			for (int y = 0; y < int(tileSize); ++y)
+			{
+				for (int x = 0; x < int(tileSize); ++x)
+				{
+					int texelX = origin.x + x;
+					int texelY = origin.y + y;
+					float expectedHeight = 0.0f;
+					uint32_t expectedNormal = 0;
+					if (texelX < width && texelY < height)
+					{
+						expectedHeight = map[texelY * width + texelX];
+						glm::vec3 normal = glm::vec3(get_height(texelX + 1, texelY) - get_height(texelX - 1, texelY), 1.0f,
+							get_height(texelX, texelY - 1) - get_height(texelX, texelY + 1));
+						expectedNormal = compress_normal(glm::normalize(normal));
+					}
+					uint32_t index = y * tileSize + x;
+					if (memcmp(&expectedHeight, &heights[index], sizeof(float)) != 0)
+						heightMismatchCount++;
+					if (expectedNormal != normals[index])
+						normalMismatchCount++;
+				}
+			}
+
+			// Cells of 2^(level + 1) texel, the texels past the edge of the map are ignored
+			for (uint32_t level = 0; level < levelCount; ++level)
+			{
+				int cellSize = 2 << level;
+				int side = int(tileSize) / cellSize;
+				const glm::vec2* levelRanges = ranges.data() + TerrainGpuGenerator::get_level_offset(tileSize, level);
+				for (int cy = 0; cy < side; ++cy)
+				{
+					for (int cx = 0; cx < side; ++cx)
+					{
+						glm::vec2 expected = glm::vec2(FLT_MAX, -FLT_MAX);
+						for (int y = 0; y < cellSize; ++y)
+						{
+							for (int x = 0; x < cellSize; ++x)
+							{
+								int texelX = origin.x + cx * cellSize + x;
+								int texelY = origin.y + cy * cellSize + y;
+								if (texelX >= width || texelY >= height)
+									continue;
+								float h = map[texelY * width + texelX];
+								expected = glm::vec2(std::min(expected.x, h), std::max(expected.y, h));
+							}
+						}
+						if (levelRanges[cy * side + cx] != expected)
+							rangeMismatchCount++;
+					}
+				}
+			}
+		}
+		CHECK_EQUAL(heightMismatchCount, 0);
+		CHECK_EQUAL(normalMismatchCount, 0);
+		CHECK_EQUAL(rangeMismatchCount, 0);
+	}
+}
+
+// Readback of the slots of a dispatch against the cpu reference, the headless buffers are filled
+// with the reference like the passes would and then moved around the tolerance
+TEST(gpu_generator_check_reads_back_every_slot)
+{
+	PerlinGenerator settings;
+	settings.width = 300;
+	settings.height = 200;
+	const uint32_t tileSize = 64;
+	const float maxHeight = float(MAX_HEIGHT);
+	const float tolerance = 1e-5f;
+	TerrainGenerator generator(settings);
+	HeadlessContext context;
+
+	// Out of order, the last tile crosses both edges of the map
+	const std::vector<uint32_t> tiles = { 9, 0, 6, 14 };
+	TerrainGpuGenerator gpuGenerator(&context, settings, tileSize, maxHeight, static_cast<uint32_t>(tiles.size()));
+	gpuGenerator.dispatch(&context, tiles);
+
+	std::vector<uint8_t>& heights = static_cast<HeadlessShaderStorageBuffer*>(gpuGenerator.get_height_buffer())->data;
+	std::vector<uint8_t>& normals = static_cast<HeadlessShaderStorageBuffer*>(gpuGenerator.get_normal_buffer())->data;
+	std::vector<uint8_t>& ranges = static_cast<HeadlessShaderStorageBuffer*>(gpuGenerator.get_range_buffer())->data;
+	uint32_t texelCount = tileSize * tileSize;
+	uint32_t rangeCount = TerrainGpuGenerator::get_range_count(tileSize);
+	for (uint32_t slot = 0; slot < tiles.size(); ++slot)
+	{
+		TerrainGpuGenerator::generate_tile(generator, tiles[slot], tileSize, maxHeight,
+			reinterpret_cast<float*>(heights.data()) + slot * texelCount,
+			reinterpret_cast<uint32_t*>(normals.data()) + slot * texelCount,
+			reinterpret_cast<glm::vec2*>(ranges.data()) + slot * rangeCount);
+	}
+
+	TerrainGpuGenerator::CheckResult result = gpuGenerator.check(&context, generator, tolerance);
+	CHECK_EQUAL(result.tileCount, tiles.size());
+	CHECK_EQUAL(result.maxHeightError, 0.0f);
+	CHECK_EQUAL(result.heightMismatchCount, 0);
+	CHECK_EQUAL(result.normalMismatchCount, 0);
+	CHECK_EQUAL(result.rangeMismatchCount, 0);
+
+	// Within the tolerance and a step on a normal axis pass, past them they are counted
+	float* slotHeights = reinterpret_cast<float*>(heights.data()) + 3 * texelCount;
+	uint32_t* slotNormals = reinterpret_cast<uint32_t*>(normals.data()) + 2 * texelCount;
+	glm::vec2* slotRanges = reinterpret_cast<glm::vec2*>(ranges.data()) + rangeCount;
+	slotHeights[5] += 0.5f * tolerance;
+	slotHeights[6] += 10.0f * tolerance;
+	auto move_axis = [](uint32_t& normal, int shift, int step) {
+		int axis = int((normal >> shift) & 0xff);
+		axis = axis < 128 ? axis + step : axis - step;
+		normal = (normal & ~(0xffu << shift)) | (uint32_t(axis) << shift);
+	};
+	move_axis(slotNormals[7], 8, 1);
+	move_axis(slotNormals[8], 16, 2);
+	slotRanges[rangeCount - 1].y += 10.0f * tolerance;
+
+	result = gpuGenerator.check(&context, generator, tolerance);
+	CHECK(result.maxHeightError > 5.0f * tolerance);
+	CHECK_EQUAL(result.heightMismatchCount, 1);
+	CHECK_EQUAL(result.normalMismatchCount, 1);
+	CHECK_EQUAL(result.rangeMismatchCount, 1);
+
+	gpuGenerator.destroy();
+}
@@ -0,0 +1,246 @@
+#include "headless_device.h"
+
+#include "core/base.h"
+#include "renderer/device.h"
+#include "renderer/gpu_query.h"
+
+#include <cstring>
+#include <imgui/imgui.h>
+
+std::shared_ptr<GraphicsAPI> Device::graphicsAPI = {};
+uint64_t Device::totalMemoryAllocated = 0;
+
+GraphicsWindow* Device::create_window(int /*width*/, int /*height*/, const char* /*title*/, bool /*fullScreen*/)
+{
+	ASSERT_MSG(0, "No window without gpu");
+	return nullptr;
+}
+
+Pipeline* Device::create_pipeline(const PipelineDescription& /*desc*/)
+{
+	return new HeadlessPipeline();
+}
+
+RenderPass* Device::create_renderpass(const RenderPassDescription& /*desc*/)
+{
+	ASSERT_MSG(0, "No renderpass without gpu");
+	return nullptr;
+}
+
+Framebuffer* Device::create_framebuffer(const FramebufferDescription& /*desc*/, RenderPass* /*rp*/)
+{
+	ASSERT_MSG(0, "No framebuffer without gpu");
+	return nullptr;
+}
+
+void Device::wait_idle()
+{
+}
+
+Context* Device::create_context(GraphicsWindow* /*window*/)
+{
+	return new HeadlessContext();
+}
+
+VertexBuffer* Device::create_vertexbuffer(BufferUsageHint usage, uint32_t sizeInByte)
+{
+	totalMemoryAllocated += sizeInByte;
+	return new HeadlessVertexBuffer(usage, sizeInByte);
+}
+
+IndexBuffer* Device::create_indexbuffer(BufferUsageHint usage, IndexType /*indexType*/, uint32_t sizeInByte)
+{
+	totalMemoryAllocated += sizeInByte;
+	return new HeadlessIndexBuffer(usage, sizeInByte);
+}
+
+UniformBuffer* Device::create_uniformbuffer(BufferUsageHint usage, uint32_t sizeInByte)
+{
+	totalMemoryAllocated += sizeInByte;
+	return new HeadlessUniformBuffer(usage, sizeInByte);
+}
+
+ShaderStorageBuffer* Device::create_shader_storage_buffer(BufferUsageHint usage, uint32_t sizeInByte)
+{
+	totalMemoryAllocated += sizeInByte;
+	return new HeadlessShaderStorageBuffer(usage, sizeInByte);
+}
+
+IndirectBuffer* Device::create_indirect_buffer(BufferUsageHint usage, uint32_t sizeInByte)
+{
+	totalMemoryAllocated += sizeInByte;
+	return new HeadlessIndirectBuffer(usage, sizeInByte);
+}
+
+Texture* Device::create_texture(const TextureDescription& desc)
+{
+	return new HeadlessTexture(desc);
+}
+
+GpuTimestampQuery* Device::create_query(uint32_t /*queryCount*/)
+{
+	return new GpuTimestampQuery();
+}
+
+ShaderBindings* Device::create_shader_bindings()
+{
+	return new HeadlessShaderBindings();
+}
+
+void Device::destroy_window(GraphicsWindow* /*window*/)
+{
+}
+
+void Device::destroy_pipeline(Pipeline* pipeline)
+{
+	delete pipeline;
+}
+
+void Device::destroy_renderpass(RenderPass* /*renderPass*/)
+{
+}
+
+void Device::destroy_framebuffer(Framebuffer* /*framebuffer*/)
+{
+}
+
+void Device::destroy_context(Context* context)
+{
+	delete context;
+}
+
+void Device::destroy_buffer(VertexBuffer* buffer)
+{
+	totalMemoryAllocated -= buffer->get_size();
+	delete buffer;
+}
+
+void Device::destroy_buffer(IndexBuffer* buffer)
+{
+	totalMemoryAllocated -= buffer->get_size();
+	delete buffer;
+}
+
+void Device::destroy_buffer(UniformBuffer* buffer)
+{
+	totalMemoryAllocated -= buffer->get_size();
+	delete buffer;
+}
+
+void Device::destroy_buffer(ShaderStorageBuffer* buffer)
+{
+	totalMemoryAllocated -= buffer->get_size();
+	delete buffer;
+}
+
+void Device::destroy_buffer(IndirectBuffer* buffer)
+{
+	totalMemoryAllocated -= buffer->get_size();
+	delete buffer;
+}
+
+void Device::destroy_texture(Texture* texture)
+{
+	delete texture;
+}
+
+void Device::destroy_shader_bindings(ShaderBindings* bindings)
+{
+	delete bindings;
+}
+
+void Device::destroy_query(GpuTimestampQuery* query)
+{
+	delete query;
+}
+
+HeadlessContext::HeadlessContext()
+{
+	ImGui::CreateContext();
+	ImGuiIO& io = ImGui::GetIO();
+	io.DisplaySize = ImVec2(1280.0f, 720.0f);
+	io.DeltaTime = 1.0f / 60.0f;
+	// Never rendered, NewFrame only needs the atlas to be built
+	unsigned char* pixels;
+	int width, height;
+	io.Fonts->GetTexDataAsRGBA32(&pixels, &width, &height);
+	ImGui::NewFrame();
+}
+
+void HeadlessContext::next_frame()
+{
+	ImGui::EndFrame();
+	ImGui::NewFrame();
+
+	m_uploadStatistics.bytesStagedLastFrame = m_bytesStaged;
+	m_bytesStaged = 0;
+}
+
+void HeadlessContext::copy(std::vector<uint8_t>& buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte)
+{
+	ASSERT(uint64_t(offsetInByte) + sizeInByte <= buffer.size());
+	memcpy(buffer.data() + offsetInByte, data, sizeInByte);
+	m_bytesStaged += sizeInByte;
+}
+
+void HeadlessContext::copy(VertexBuffer* buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte)
+{
+	copy(static_cast<HeadlessVertexBuffer*>(buffer)->data, data, offsetInByte, sizeInByte);
+}
+
+void HeadlessContext::copy(IndexBuffer* buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte)
+{
+	copy(static_cast<HeadlessIndexBuffer*>(buffer)->data, data, offsetInByte, sizeInByte);
+}
+
+void HeadlessContext::copy(UniformBuffer* buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte)
+{
+	copy(static_cast<HeadlessUniformBuffer*>(buffer)->data, data, offsetInByte, sizeInByte);
+}
+
+void HeadlessContext::copy(ShaderStorageBuffer* buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte)
+{
+	copy(static_cast<HeadlessShaderStorageBuffer*>(buffer)->data, data, offsetInByte, sizeInByte);
+}
+
+void HeadlessContext::copy(IndirectBuffer* buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte)
+{
+	copy(static_cast<HeadlessIndirectBuffer*>(buffer)->data, data, offsetInByte, sizeInByte);
+}
+
+void HeadlessContext::read(ShaderStorageBuffer* buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte)
+{
+	HeadlessShaderStorageBuffer* headlessBuffer = static_cast<HeadlessShaderStorageBuffer*>(buffer);
+	ASSERT(headlessBuffer->get_usage_hint() == BufferUsageHint::StaticRead);
+	ASSERT(uint64_t(offsetInByte) + sizeInByte <= headlessBuffer->data.size());
+	memcpy(data, headlessBuffer->data.data() + offsetInByte, sizeInByte);
+}
+
+void HeadlessContext::copy(Texture* texture, void* data, uint32_t sizeInByte)
+{
+	HeadlessTexture* headlessTexture = static_cast<HeadlessTexture*>(texture);
+	headlessTexture->data.assign(static_cast<uint8_t*>(data), static_cast<uint8_t*>(data) + sizeInByte);
+	m_bytesStaged += sizeInByte;
+}
+
+void HeadlessContext::copy(Texture* texture, void* data, uint32_t sizeInByte, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+	HeadlessTexture* headlessTexture = static_cast<HeadlessTexture*>(texture);
+	uint32_t textureWidth = headlessTexture->get_width();
+	ASSERT(x + width <= textureWidth && y + height <= headlessTexture->get_height());
+	ASSERT(sizeInByte % (width * height) == 0);
+	// Texel size from the first copy of the whole texture
+	uint32_t texelSize = sizeInByte / (width * height);
+	ASSERT(headlessTexture->data.size() == uint64_t(textureWidth) * headlessTexture->get_height() * texelSize);
+
+	const uint8_t* src = static_cast<const uint8_t*>(data);
+	for (uint32_t row = 0; row < height; ++row)
+		memcpy(&headlessTexture->data[(uint64_t(y + row) * textureWidth + x) * texelSize], src + uint64_t(row) * width * texelSize, width * texelSize);
+	m_bytesStaged += sizeInByte;
+}
+
+HeadlessContext::~HeadlessContext()
+{
+	ImGui::EndFrame();
+	ImGui::DestroyContext();
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "renderer/context.h"
+#include "renderer/buffer.h"
+#include "renderer/texture.h"
+#include "renderer/pipeline.h"
+#include "renderer/shaderbinding.h"
+
+#include <vector>
+
+// Implementation of Device and Context without gpu for the tests, buffers and textures are kept in
+// memory and the copies are written right away so that the tests can read back what has been uploaded
+// Draws and dispatches are ignored
+template<typename T>
+class HeadlessBuffer : public T
+{
+public:
+	HeadlessBuffer(BufferUsageHint usage, uint32_t sizeInByte) : data(sizeInByte), m_usage(usage) {}
+
+	BufferUsageHint get_usage_hint() const override { return m_usage; }
+	int get_size() const override { return static_cast<int>(data.size()); }
+
+	std::vector<uint8_t> data;
+private:
+	BufferUsageHint m_usage;
+};
+
+typedef HeadlessBuffer<VertexBuffer> HeadlessVertexBuffer;
+typedef HeadlessBuffer<IndexBuffer> HeadlessIndexBuffer;
+typedef HeadlessBuffer<UniformBuffer> HeadlessUniformBuffer;
+typedef HeadlessBuffer<ShaderStorageBuffer> HeadlessShaderStorageBuffer;
+typedef HeadlessBuffer<IndirectBuffer> HeadlessIndirectBuffer;
+
+class HeadlessTexture : public Texture
+{
+public:
+	HeadlessTexture(const TextureDescription& desc) : m_width(desc.width), m_height(desc.height) {}
+
+	uint32_t get_width() override { return m_width; }
+	uint32_t get_height() override { return m_height; }
+
+	// Texels of the last copy, tightly packed
+	std::vector<uint8_t> data;
+private:
+	uint32_t m_width;
+	uint32_t m_height;
+};
+
+class HeadlessPipeline : public Pipeline
+{
+};
+
+class HeadlessShaderBindings : public ShaderBindings
+{
+public:
+	void set_buffer(UniformBuffer* /*buffer*/, uint32_t /*binding*/) override {}
+	void set_buffer(ShaderStorageBuffer* /*buffer*/, uint32_t /*binding*/) override {}
+	void set_buffer(IndirectBuffer* /*buffer*/, uint32_t /*binding*/) override {}
+	void set_texture_sampler(Texture* /*texture*/, uint32_t /*binding*/) override {}
+	void set_storage_image(Texture* /*texture*/, uint32_t /*binding*/) override {}
+};
+
+class HeadlessContext : public Context
+{
+public:
+	// The panels of the terrain classes are built with ImGui during update, a frame is started here
+	HeadlessContext();
+
+	// End the ImGui frame and start the next one, the tests driving the terrain call it once per frame
+	void next_frame();
+
+	GraphicsWindow* get_window() override { return nullptr; }
+
+	void acquire_swapchain_image() override {}
+	void begin() override {}
+	void begin_renderpass(RenderPass* /*renderPass*/, Framebuffer* /*framebuffer*/) override {}
+	void end_renderpass() override {}
+	void set_pipeline(Pipeline* /*pipeline*/) override {}
+	void begin_compute() override {}
+	void end_compute() override {}
+	void begin_async_compute() override {}
+	void end_async_compute() override {}
+	void end() override {}
+	void present() override {}
+
+	void copy(VertexBuffer* buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte) override;
+	void copy(IndexBuffer* buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte) override;
+	void copy(UniformBuffer* buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte) override;
+	void copy(ShaderStorageBuffer* buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte) override;
+	void copy(IndirectBuffer* buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte) override;
+	void read(ShaderStorageBuffer* buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte) override;
+	void copy(Texture* texture, void* data, uint32_t sizeInByte) override;
+	void copy(Texture* texture, void* data, uint32_t sizeInByte, uint32_t x, uint32_t y, uint32_t width, uint32_t height) override;
+
+	void draw(uint32_t /*vertexCount*/) override {}
+	void draw_indexed(uint32_t /*indexCount*/) override {}
+	void draw_indexed_indirect(IndirectBuffer* /*buffer*/, uint32_t /*offset*/, uint32_t /*drawCount*/, uint32_t /*stride*/) override {}
+	void draw_indexed_indirect_count(IndirectBuffer* /*buffer*/, uint32_t /*offset*/, IndirectBuffer* /*countBuffer*/, uint32_t /*countOffset*/, uint32_t /*maxDrawCount*/, uint32_t /*stride*/) override {}
+	// The terrain culls on the cpu
+	bool is_draw_indirect_count_supported() override { return false; }
+
+	void dispatch_compute(uint32_t /*workGroupSizeX*/, uint32_t /*workGroupSizeY*/, uint32_t /*workGroupSizeZ*/) override {}
+
+	void set_buffer(VertexBuffer* /*buffer*/, uint32_t /*offset*/) override {}
+	void set_buffer(IndexBuffer* /*buffer*/, uint32_t /*offset*/) override {}
+
+	void transition_layout_for_shader_read(Texture** /*texture*/, uint32_t /*count*/) override {}
+	void transition_layout_for_compute_read(Texture** /*texture*/, uint32_t /*count*/) override {}
+
+	void update_pipeline(Pipeline* /*pipeline*/, ShaderBindings** /*shaderBindings*/, uint32_t /*count*/) override {}
+	void set_uniform(ShaderStage /*shaderStage*/, uint32_t /*offset*/, uint32_t /*size*/, void* /*data*/) override {}
+	void set_line_width(float /*width*/) override {}
+
+	void reset_query(GpuTimestampQuery* /*query*/) override {}
+	void write_timestamp(GpuTimestampQuery* /*query*/, uint32_t /*queryIndex*/) override {}
+	void get_result(GpuTimestampQuery* /*query*/, uint32_t /*firstQuery*/, uint32_t /*queryCount*/, void* /*output*/) override {}
+
+	RenderPass* get_global_renderpass() override { return nullptr; }
+
+	UploadStatistics get_upload_statistics() override { return m_uploadStatistics; }
+
+	// Every copy is complete when it returns, nothing is ever in flight
+	uint32_t get_frames_in_flight() override { return 1; }
+	uint32_t get_frame_index() override { return 0; }
+
+	~HeadlessContext();
+private:
+	UploadStatistics m_uploadStatistics;
+	uint64_t m_bytesStaged = 0;
+
+	void copy(std::vector<uint8_t>& buffer, void* data, uint32_t offsetInByte, uint32_t sizeInByte);
+};
@@ -0,0 +1,160 @@
+#include "test.h"
+#include "terrain_test_util.h"
+
+#include "terrain/terrain_chunk.h"
+#include "terrain/terrain_height_format.h"
+
+#include <cstring>
+
+// Float and 16 bit copy of the test stream, both hold the quantized heights so that their meshes can be compared
+struct StorageStreams
+{
+	Ref<TerrainStream> streams[2];
+	// Owned by streams[1]
+	uint16_t* heights16;
+};
+
+static StorageStreams create_storage_streams()
+{
+	Ref<TerrainStream> source = create_test_stream();
+	int width = source->get_width();
+	int height = source->get_height();
+	uint32_t texelCount = uint32_t(width) * height;
+
+	uint16_t* heights16 = new uint16_t[texelCount];
+	float* heights = new float[texelCount];
+	std::vector<float> row(width);
+	for (int y = 0; y < height; ++y)
+	{
+		source->read_rect(glm::ivec2(0, y), glm::ivec2(width - 1, y), row.data());
+		for (int x = 0; x < width; ++x)
+		{
+			uint32_t index = y * width + x;
+			heights16[index] = encode_height(row[x]);
+			heights[index] = decode_height(heights16[index]);
+		}
+	}
+	source->destroy();
+
+	StorageStreams storage;
+	storage.streams[0] = CreateRef<TerrainStream>(heights, width, height);
+	storage.streams[1] = CreateRef<TerrainStream>(heights16, width, height);
+	storage.heights16 = heights16;
+	return storage;
+}
+
+// Finest lod chunks along the diagonal of the map
+static void create_diagonal_meshes(const Ref<TerrainStream>& stream, uint32_t chunkCount, std::vector<VertexP4N1_Float>& mesh)
+{
+	glm::ivec3 terrainSize = glm::ivec3(TERRAIN_SIZE, MAX_HEIGHT, TERRAIN_SIZE);
+	std::vector<VertexP4N1_Float> vertices;
+	for (uint32_t c = 0; c < chunkCount; ++c)
+	{
+		glm::ivec2 min = glm::ivec2((TERRAIN_SIZE - MIN_CHUNK_SIZE) * c / chunkCount);
+		TerrainChunk::create_mesh(stream, min, min + glm::ivec2(MIN_CHUNK_SIZE), terrainSize, 128, vertices);
+		mesh.insert(mesh.end(), vertices.begin(), vertices.end());
+	}
+}
+
+TEST(uint16_storage_matches_float_storage)
+{
+	StorageStreams storage = create_storage_streams();
+	CHECK(storage.streams[0]->get_format() == HeightFormat::Float);
+	CHECK(storage.streams[1]->get_format() == HeightFormat::UInt16);
+	// Both have the same height pyramid
+	uint64_t texelCount = uint64_t(TERRAIN_SIZE) * TERRAIN_SIZE;
+	CHECK_EQUAL(storage.streams[0]->get_memory_footprint() - storage.streams[1]->get_memory_footprint(), texelCount * 2);
+
+	std::vector<VertexP4N1_Float> meshes[2];
+	for (int i = 0; i < 2; ++i)
+		create_diagonal_meshes(storage.streams[i], 16, meshes[i]);
+	CHECK_EQUAL(meshes[0].size(), meshes[1].size());
+	CHECK(memcmp(meshes[0].data(), meshes[1].data(), meshes[0].size() * sizeof(VertexP4N1_Float)) == 0);
+
+	// Rows of every length so that the vector decode has a remainder
+	std::vector<float> decoded(TERRAIN_SIZE);
+	std::vector<float> reference(TERRAIN_SIZE);
+	for (uint32_t count = 1; count < 64; ++count)
+	{
+		decode_heights(storage.heights16 + count, count, decoded.data());
+		decode_heights_scalar(storage.heights16 + count, count, reference.data());
+		CHECK(memcmp(decoded.data(), reference.data(), count * sizeof(float)) == 0);
+	}
+	decode_heights(storage.heights16, TERRAIN_SIZE, decoded.data());
+	for (uint32_t x = 0; x < TERRAIN_SIZE; ++x)
+		CHECK(decoded[x] == decode_height(storage.heights16[x]));
+
+	for (auto& stream : storage.streams)
+		stream->destroy();
+}
+
+// Sample, read_rect decode and create_mesh rate of the float and 16 bit storage
+BENCHMARK(height_storage)
+{
+	StorageStreams storage = create_storage_streams();
+	int width = storage.streams[0]->get_width();
+	int height = storage.streams[0]->get_height();
+	uint32_t texelCount = uint32_t(width) * height;
+
+	const uint32_t sampleCount = 1 << 20;
+	std::vector<glm::vec2> positions(sampleCount);
+	uint32_t seed = 12345;
+	for (auto& position : positions)
+	{
+		seed = seed * 1664525u + 1013904223u;
+		position.x = float(seed >> 8) / float(1 << 24) * float(width - 1);
+		seed = seed * 1664525u + 1013904223u;
+		position.y = float(seed >> 8) / float(1 << 24) * float(height - 1);
+	}
+
+	const float megaByte = 1.0f / (1024.0f * 1024.0f);
+	const int blockSize = 256;
+	const uint32_t chunkCount = 16;
+	std::vector<float> block(blockSize * blockSize);
+	const char* names[] = { "float", "uint16" };
+	float sink = 0.0f;
+	for (int i = 0; i < 2; ++i)
+	{
+		Ref<TerrainStream> stream = storage.streams[i];
+
+		Clock::time_point start = Clock::now();
+		float sum = 0.0f;
+		for (auto& position : positions)
+			sum += stream->sample(position.x, position.y);
+		float sampleRate = float(sampleCount) / (get_elapsed_ms(start) * 1000.0f);
+		sink += sum;
+
+		start = Clock::now();
+		uint64_t decodedCount = 0;
+		for (int y = 0; y < height; y += blockSize)
+		{
+			for (int x = 0; x < width; x += blockSize)
+			{
+				stream->read_rect(glm::ivec2(x, y), glm::ivec2(x + blockSize - 1, y + blockSize - 1), block.data());
+				sink += block[0];
+				decodedCount += blockSize * blockSize;
+			}
+		}
+		float decodeRate = float(decodedCount) / (get_elapsed_ms(start) * 1000.0f);
+
+		start = Clock::now();
+		std::vector<VertexP4N1_Float> mesh;
+		create_diagonal_meshes(stream, chunkCount, mesh);
+		float meshTime = get_elapsed_ms(start) / float(chunkCount);
+
+		printf("  %s: %.2fMB, sample: %.1fM/s, decode: %.1fM/s, mesh: %.3fms\n", names[i], float(stream->get_memory_footprint()) * megaByte,
+			sampleRate, decodeRate, meshTime);
+	}
+
+	std::vector<float> row(width);
+	Clock::time_point start = Clock::now();
+	for (int y = 0; y < height; ++y)
+		decode_heights_scalar(storage.heights16 + y * width, width, row.data());
+	float scalarDecodeRate = float(texelCount) / (get_elapsed_ms(start) * 1000.0f);
+	sink += row[0];
+
+	printf("  uint16 scalar decode: %.1fM/s\n", scalarDecodeRate);
+	printf("  sink: %f\n", sink);
+	for (auto& stream : storage.streams)
+		stream->destroy();
+}
@@ -0,0 +1,53 @@
+#include "test.h"
+
+#include <cstring>
+#include <string>
+
+// Usage: terrain_tests [--bench] [name]
+// Runs the tests, or the benchmarks with --bench, whose name contains name
+// Must be started from the vulkan directory, the terrain classes load their shaders from spirv/
+
+static uint32_t g_failureCount = 0;
+
+std::vector<TestCase>& get_test_cases()
+{
+	static std::vector<TestCase> testCases;
+	return testCases;
+}
+
+void report_failure(const char* expr, const char* file, int line)
+{
+	printf("  FAILED: %s, in file: %s, line: %d\n", expr, file, line);
+	g_failureCount++;
+}
+
+int main(int argc, char** argv)
+{
+	bool benchmark = false;
+	std::string filter;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--bench") == 0)
+			benchmark = true;
+		else
+			filter = argv[i];
+	}
+
+	uint32_t runCount = 0;
+	uint32_t failedCount = 0;
+	for (const TestCase& testCase : get_test_cases())
+	{
+		if (testCase.benchmark != benchmark || std::string(testCase.name).find(filter) == std::string::npos)
+			continue;
+
+		printf("[%s]\n", testCase.name);
+		uint32_t failureCount = g_failureCount;
+		testCase.function();
+		runCount++;
+		if (g_failureCount != failureCount)
+			failedCount++;
+	}
+
+	printf("%d %s run, %d failed\n", runCount, benchmark ? "benchmarks" : "tests", failedCount);
+	return failedCount == 0 ? 0 : 1;
+}
@@ -0,0 +1,201 @@
+#include "test.h"
+#include "terrain_test_util.h"
+
+#include "terrain/terrain_chunk.h"
+
+#include <cstring>
+
+static const uint32_t VERTEX_COUNT = 128;
+
+// Cpu version of sample_terrain_height in shaders/terrain/terrain_vertex.h, the heights
+// TerrainMeshMode::VertexTextureFetch draws
+static float fetch_height_texel(const Ref<TerrainStream>& stream, const glm::ivec2& p)
+{
+	glm::ivec2 size = glm::ivec2(stream->get_width(), stream->get_height());
+	if (glm::any(glm::lessThan(p, glm::ivec2(0))) || glm::any(glm::greaterThanEqual(p, size)))
+		return 0.0f;
+	return stream->get(p.x, p.y);
+}
+
+static float sample_terrain_height(const Ref<TerrainStream>& stream, const glm::vec2& p)
+{
+	glm::ivec2 size = glm::ivec2(stream->get_width(), stream->get_height());
+	glm::ivec2 i = glm::ivec2(p);
+	float a = fetch_height_texel(stream, i);
+	float b = fetch_height_texel(stream, i + glm::ivec2(1, 0));
+	float c = fetch_height_texel(stream, i + glm::ivec2(0, 1));
+	float d = fetch_height_texel(stream, i + glm::ivec2(1, 1));
+
+	glm::vec2 f = p - glm::vec2(i);
+	float h = glm::mix(glm::mix(a, b, f.x), glm::mix(c, d, f.x), f.y) * 2.0f - 1.0f;
+
+	float maxHeight = float(MAX_HEIGHT);
+	const float transitionRegion = 200.0f;
+	glm::vec2 halfSize = glm::vec2(size) * 0.5f;
+	float radius = glm::max(halfSize.x, halfSize.y) - transitionRegion;
+	float edgeDistance = glm::length(p - halfSize) - radius;
+	if (edgeDistance < 0.0f)
+		return h * maxHeight;
+	float factor = glm::smoothstep(0.0f, 1.0f, edgeDistance / transitionRegion);
+	return glm::mix(h * maxHeight, -maxHeight, factor);
+}
+
+// get_chunk_position followed by get_heightmap_uv
+static float sample_chunk_height(const Ref<TerrainStream>& stream, const ChunkRect& chunk, const glm::ivec2& grid)
+{
+	glm::vec2 size = glm::vec2(chunk.max - chunk.min);
+	glm::vec2 xz = glm::vec2(chunk.min) + glm::vec2(grid) / float(VERTEX_COUNT) * size;
+	glm::vec2 heightmapSize = glm::vec2(float(stream->get_width()), float(stream->get_height()));
+	glm::vec2 uv = xz / float(TERRAIN_SIZE) * (heightmapSize - 3.0f) + 1.0f;
+	return sample_terrain_height(stream, uv);
+}
+
+TEST(create_mesh_matches_reference)
+{
+	Ref<TerrainStream> stream = create_test_stream();
+	glm::ivec3 terrainSize = glm::ivec3(TERRAIN_SIZE, MAX_HEIGHT, TERRAIN_SIZE);
+	std::vector<VertexP4N1_Float> references;
+	std::vector<VertexP4N1_Float> vertices;
+	for (const ChunkRect& chunk : get_diagonal_chunks())
+	{
+		TerrainChunk::create_mesh_reference(stream, chunk.min, chunk.max, terrainSize, VERTEX_COUNT, references);
+		TerrainChunk::create_mesh(stream, chunk.min, chunk.max, terrainSize, VERTEX_COUNT, vertices);
+		CHECK_EQUAL(vertices.size(), references.size());
+		CHECK(memcmp(vertices.data(), references.data(), references.size() * sizeof(VertexP4N1_Float)) == 0);
+	}
+	stream->destroy();
+}
+
+// The cpu mesh matches the surface of the texture fetch mode as computed by the cpu port of terrain_vertex.h above,
+// the shader itself is not run, up to the 16 bit quantization of the cpu mesh which also clamps to
+// [-maxHeight, maxHeight], the generated heights go slightly below
+// The sample positions are computed in a different order, the tolerance leaves 0.0001 for their rounding
+TEST(cpu_mesh_matches_texture_fetch_reference_port)
+{
+	Ref<TerrainStream> stream = create_test_stream();
+	glm::ivec3 terrainSize = glm::ivec3(TERRAIN_SIZE, MAX_HEIGHT, TERRAIN_SIZE);
+	// Decoded as the vertex shader does with TerrainChunkGpuData::heightRange
+	const float step = 2.0f * float(MAX_HEIGHT) / 65535.0f;
+	const float tolerance = 0.5f * step + 0.0001f;
+
+	std::vector<VertexP4N1_Float> vertices;
+	std::vector<TerrainVertex> compressed;
+	float maxError = 0.0f;
+	for (const ChunkRect& chunk : get_diagonal_chunks())
+	{
+		glm::vec2 heightRange;
+		TerrainChunk::create_mesh(stream, chunk.min, chunk.max, terrainSize, VERTEX_COUNT, vertices);
+		TerrainChunk::compress_mesh(vertices, float(MAX_HEIGHT), compressed, heightRange);
+		for (int z = 0; z <= int(VERTEX_COUNT); ++z)
+		{
+			for (int x = 0; x <= int(VERTEX_COUNT); ++x)
+			{
+				const TerrainVertex& vertex = compressed[(z + 1) * (VERTEX_COUNT + 3) + (x + 1)];
+				float height = -float(MAX_HEIGHT) + float(vertex.height) * step;
+				float morphHeight = -float(MAX_HEIGHT) + float(vertex.morphHeight) * step;
+
+				// Morph target of fetch_terrain_vertex
+				glm::ivec2 grid = glm::ivec2(x, z);
+				float expectedHeight = sample_chunk_height(stream, chunk, grid);
+				float expectedMorphHeight = expectedHeight;
+				glm::ivec2 offset = grid & 1;
+				if (offset.x + offset.y > 0)
+				{
+					if (offset.x + offset.y == 2)
+						offset.y = -1;
+					float h1 = sample_chunk_height(stream, chunk, grid + offset);
+					float h2 = sample_chunk_height(stream, chunk, grid - offset);
+					expectedMorphHeight = (h1 + h2) * 0.5f;
+				}
+				expectedHeight = glm::clamp(expectedHeight, -float(MAX_HEIGHT), float(MAX_HEIGHT));
+				expectedMorphHeight = glm::clamp(expectedMorphHeight, -float(MAX_HEIGHT), float(MAX_HEIGHT));
+				maxError = glm::max(maxError, glm::max(glm::abs(height - expectedHeight), glm::abs(morphHeight - expectedMorphHeight)));
+			}
+		}
+	}
+	CHECK(maxError <= tolerance);
+	if (maxError > tolerance)
+		printf("    max error: %f, tolerance: %f\n", maxError, tolerance);
+	stream->destroy();
+}
+
+// What it takes to make a chunk drawable in each TerrainMeshMode
+BENCHMARK(mesh_mode)
+{
+	Ref<TerrainStream> stream = create_test_stream();
+	glm::ivec3 terrainSize = glm::ivec3(TERRAIN_SIZE, MAX_HEIGHT, TERRAIN_SIZE);
+	const uint32_t chunkCount = 16;
+	std::vector<VertexP4N1_Float> vertices;
+	std::vector<TerrainVertex> compressed;
+
+	// Milliseconds of cpu work, create_mesh and compress_mesh against get_height_bounds
+	float readyTime[2] = {};
+	uint32_t totalChunkCount = 0;
+	for (uint32_t lod = 0; (MIN_CHUNK_SIZE << lod) <= TERRAIN_SIZE; ++lod)
+	{
+		uint32_t chunkSize = MIN_CHUNK_SIZE << lod;
+		for (uint32_t c = 0; c < chunkCount; ++c)
+		{
+			glm::ivec2 min = glm::ivec2((TERRAIN_SIZE - chunkSize) * c / chunkCount / chunkSize * chunkSize);
+			glm::ivec2 max = min + glm::ivec2(chunkSize);
+
+			Clock::time_point start = Clock::now();
+			glm::vec2 heightRange;
+			TerrainChunk::create_mesh(stream, min, max, terrainSize, VERTEX_COUNT, vertices);
+			TerrainChunk::compress_mesh(vertices, float(MAX_HEIGHT), compressed, heightRange);
+			readyTime[0] += get_elapsed_ms(start);
+
+			start = Clock::now();
+			TerrainChunk::get_height_bounds(stream, min, max, terrainSize, VERTEX_COUNT);
+			readyTime[1] += get_elapsed_ms(start);
+			totalChunkCount++;
+		}
+	}
+
+	const float megaByte = 1.0f / (1024.0f * 1024.0f);
+	uint64_t uploadSize[2] = { compressed.size() * sizeof(TerrainVertex) + sizeof(TerrainChunkGpuData), sizeof(TerrainChunkGpuData) };
+	// Vertex slot of a chunk in the pool against the heights resident for the whole terrain
+	uint64_t memory[2] = { compressed.size() * sizeof(TerrainVertex), uint64_t(stream->get_width()) * stream->get_height() * sizeof(float) };
+	const char* names[] = { "cpu mesh", "texture fetch" };
+	printf("  chunks: %d\n", totalChunkCount);
+	for (int i = 0; i < 2; ++i)
+	{
+		printf("  %s: %.3fms per chunk, upload %.1fKB per chunk, %s %.2fMB\n", names[i], readyTime[i] / float(totalChunkCount),
+			float(uploadSize[i]) / 1024.0f, i == 0 ? "memory per chunk" : "memory", float(memory[i]) * megaByte);
+	}
+	stream->destroy();
+}
+
+// Scalar and SIMD create_mesh on the same chunks, per lod
+BENCHMARK(mesh_kernel)
+{
+	Ref<TerrainStream> stream = create_test_stream();
+	glm::ivec3 terrainSize = glm::ivec3(TERRAIN_SIZE, MAX_HEIGHT, TERRAIN_SIZE);
+	const uint32_t chunkCount = 16;
+	std::vector<VertexP4N1_Float> references;
+	std::vector<VertexP4N1_Float> vertices;
+	for (uint32_t lod = 0; (MIN_CHUNK_SIZE << lod) <= TERRAIN_SIZE; ++lod)
+	{
+		uint32_t chunkSize = MIN_CHUNK_SIZE << lod;
+		float referenceTime = 0.0f;
+		float simdTime = 0.0f;
+		uint32_t vertexCount = 0;
+		// Chunks along the diagonal of the map
+		for (uint32_t c = 0; c < chunkCount; ++c)
+		{
+			glm::ivec2 min = glm::ivec2((TERRAIN_SIZE - chunkSize) * c / chunkCount / chunkSize * chunkSize);
+			glm::ivec2 max = min + glm::ivec2(chunkSize);
+
+			Clock::time_point start = Clock::now();
+			TerrainChunk::create_mesh_reference(stream, min, max, terrainSize, VERTEX_COUNT, references);
+			referenceTime += get_elapsed_ms(start);
+
+			start = Clock::now();
+			TerrainChunk::create_mesh(stream, min, max, terrainSize, VERTEX_COUNT, vertices);
+			simdTime += get_elapsed_ms(start);
+			vertexCount += uint32_t(vertices.size());
+		}
+		printf("  lod %d: scalar %.2fM vertex/s, simd %.2fM vertex/s\n", int(lod), float(vertexCount) / (referenceTime * 1000.0f), float(vertexCount) / (simdTime * 1000.0f));
+	}
+	stream->destroy();
+}
@@ -0,0 +1,281 @@
+#include "test.h"
+#include "headless_device.h"
+#include "terrain_test_util.h"
+
+#include "scene/camera.h"
+#include "terrain/terrain_chunk.h"
+#include "terrain/terrain_quadtree.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <thread>
+
+typedef QuadTree::Direction Direction;
+
+static glm::ivec2 get_direction_offset(Direction direction)
+{
+	switch (direction)
+	{
+	case Direction::N: return glm::ivec2(0, -1);
+	case Direction::S: return glm::ivec2(0, 1);
+	case Direction::E: return glm::ivec2(1, 0);
+	case Direction::W: return glm::ivec2(-1, 0);
+	}
+	return glm::ivec2(0);
+}
+
+// Neighbour of the node from its position, through get_node_position and get_node_index
+static void check_neighbours(const QuadTree& quadTree, uint32_t id)
+{
+	uint32_t depth = QuadTree::get_node_depth(id);
+	glm::uvec2 position = QuadTree::get_node_position(id, depth);
+	CHECK_EQUAL(QuadTree::get_node_index(position, depth), id);
+	if (id > 0)
+		CHECK(QuadTree::get_node_position(QuadTree::get_parent(id), depth - 1) == position / 2u);
+
+	int nodePerSide = 1 << depth;
+	for (int i = 0; i < 4; ++i)
+	{
+		glm::ivec2 expected = glm::ivec2(position) + get_direction_offset(Direction(i));
+		uint32_t neighbour = quadTree.find_neighbour(id, Direction(i));
+		bool border = expected.x < 0 || expected.y < 0 || expected.x >= nodePerSide || expected.y >= nodePerSide;
+		if (border)
+		{
+			CHECK_EQUAL(neighbour, UINT32_MAX);
+			continue;
+		}
+		CHECK_EQUAL(neighbour, QuadTree::get_node_index(glm::uvec2(expected), depth));
+		if (neighbour != UINT32_MAX)
+			CHECK_EQUAL(quadTree.find_neighbour(neighbour, Direction(i ^ 1)), id);
+	}
+}
+
+// Direction from a to b if the two rects share an edge, -1 otherwise
+static int get_shared_edge(const TerrainChunk* a, const TerrainChunk* b)
+{
+	glm::ivec2 aMin = a->get_min(), aMax = a->get_max();
+	glm::ivec2 bMin = b->get_min(), bMax = b->get_max();
+	bool overlapX = aMin.x < bMax.x && bMin.x < aMax.x;
+	bool overlapZ = aMin.y < bMax.y && bMin.y < aMax.y;
+	if (overlapX && aMin.y == bMax.y)
+		return int(Direction::N);
+	if (overlapX && aMax.y == bMin.y)
+		return int(Direction::S);
+	if (overlapZ && aMax.x == bMin.x)
+		return int(Direction::E);
+	if (overlapZ && aMin.x == bMax.x)
+		return int(Direction::W);
+	return -1;
+}
+
+struct DrawnTreeStats
+{
+	uint32_t frameCount = 0;
+	uint32_t stitchedChunkCount = 0;
+	uint32_t maxChunkCount = 0;
+};
+
+// Split tree of the frame before the chunks are loaded: the neighbours of a split node have a split parent
+// so that the leaves are at most one lod apart, the children of the root are always split
+static void check_split_tree(const QuadTree& quadTree, uint32_t depth)
+{
+	for (uint32_t nodeDepth = 2; nodeDepth < depth; ++nodeDepth)
+	{
+		for (uint32_t id : quadTree.get_split_nodes(nodeDepth))
+		{
+			CHECK(quadTree.is_split(QuadTree::get_parent(id)));
+			for (int i = 0; i < 4; ++i)
+			{
+				uint32_t neighbour = quadTree.find_neighbour(id, Direction(i));
+				if (neighbour != UINT32_MAX)
+					CHECK(quadTree.is_split(QuadTree::get_parent(neighbour)));
+			}
+		}
+	}
+}
+
+// Drawn leaves against each other: no overlap, at most one lod apart across an edge and a stitch bit
+// exactly on the edges shared with a coarser leaf
+static void check_drawn_tree(const QuadTree& quadTree, const std::vector<TerrainChunk*>& chunks, DrawnTreeStats& stats)
+{
+	for (const TerrainChunk* a : chunks)
+	{
+		check_neighbours(quadTree, a->get_id());
+
+		uint32_t expectedMask = 0;
+		for (const TerrainChunk* b : chunks)
+		{
+			if (a == b)
+				continue;
+			bool overlap = a->get_min().x < b->get_max().x && b->get_min().x < a->get_max().x &&
+				a->get_min().y < b->get_max().y && b->get_min().y < a->get_max().y;
+			CHECK(!overlap);
+
+			int edge = get_shared_edge(a, b);
+			if (edge < 0)
+				continue;
+			int lodA = int(a->get_lod_level());
+			int lodB = int(b->get_lod_level());
+			CHECK(std::abs(lodA - lodB) <= 1);
+			if (lodB > lodA)
+				expectedMask |= 1u << edge;
+		}
+		uint32_t stitchMask = quadTree.get_stitch_mask(a);
+		CHECK_EQUAL(stitchMask, expectedMask);
+		stats.stitchedChunkCount += stitchMask != 0 ? 1 : 0;
+	}
+	stats.maxChunkCount = std::max(stats.maxChunkCount, uint32_t(chunks.size()));
+	stats.frameCount++;
+}
+
+TEST(quadtree_node_neighbours)
+{
+	Ref<TerrainStream> stream = create_test_stream();
+	HeadlessContext context;
+	uint32_t depth = 5;
+	QuadTree quadTree(&context, stream, depth, TERRAIN_SIZE, MAX_HEIGHT, TerrainMeshMode::CpuMesh, 16);
+
+	// Every depth holds 4 ^ depth nodes after the ones above it
+	uint32_t id = 0;
+	for (uint32_t nodeDepth = 0; nodeDepth <= depth; ++nodeDepth)
+	{
+		for (uint32_t i = 0; i < (1u << (2 * nodeDepth)); ++i, ++id)
+		{
+			CHECK_EQUAL(QuadTree::get_node_depth(id), nodeDepth);
+			check_neighbours(quadTree, id);
+		}
+	}
+	quadTree.destroy();
+	stream->destroy();
+}
+
+// Lines, a circle and a low diagonal across the map, the chunks load over several frames so that the
+// drawn tree is checked while some splits are still waiting for their children
+TEST(quadtree_camera_paths_are_balanced)
+{
+	Ref<TerrainStream> stream = create_test_stream();
+	HeadlessContext context;
+	uint32_t depth = 0;
+	while ((MIN_CHUNK_SIZE << depth) < TERRAIN_SIZE)
+		depth++;
+	QuadTree quadTree(&context, stream, depth, TERRAIN_SIZE, MAX_HEIGHT, TerrainMeshMode::CpuMesh, 150);
+	Ref<Camera> camera = CreateRef<Camera>();
+
+	DrawnTreeStats stats;
+	const uint32_t pathCount = 4;
+	const uint32_t frameCount = 150;
+	const float size = float(TERRAIN_SIZE);
+	for (uint32_t path = 0; path < pathCount; ++path)
+	{
+		for (uint32_t frame = 0; frame < frameCount; ++frame)
+		{
+			float t = float(frame) / float(frameCount);
+			glm::vec3 position;
+			float yaw = 0.0f;
+			switch (path)
+			{
+			case 0:
+				position = glm::vec3(0.02f + t * 0.96f, 0.0f, 0.5f) * size;
+				yaw = 1.5708f;
+				break;
+			case 1:
+				position = glm::vec3(0.5f + 0.4f * std::cos(t * 6.2832f), 0.0f, 0.5f + 0.4f * std::sin(t * 6.2832f)) * size;
+				yaw = -t * 6.2832f;
+				break;
+			case 2:
+				position = glm::vec3(0.01f + t * 0.98f, 0.0f, 0.01f + t * 0.98f) * size;
+				yaw = 0.7854f;
+				break;
+			default:
+				position = glm::vec3(0.98f - t * 0.96f, 0.0f, 0.5f) * size;
+				yaw = -1.5708f;
+				break;
+			}
+			position.y = sample_world_height(stream, position.x, position.z) + 20.0f;
+			camera->set_position(position);
+			camera->set_rotation(glm::vec3(0.2f, yaw, 0.0f));
+			camera->update(0.0f);
+
+			quadTree.update(&context, camera);
+			check_split_tree(quadTree, depth);
+			quadTree.prepass(&context, camera);
+			check_drawn_tree(quadTree, quadTree.get_visible_list(), stats);
+			context.next_frame();
+			// Let the workers finish some of the builds between the frames
+			if (quadTree.get_chunk_manager()->get_pending_build_count() > 0)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+
+	// The paths did go through split and stitched chunks
+	CHECK_EQUAL(stats.frameCount, pathCount * frameCount);
+	CHECK(stats.maxChunkCount > 16);
+	CHECK(stats.stitchedChunkCount > 0);
+	quadTree.destroy();
+	stream->destroy();
+}
+
+// Visible list traversed front to back against the fixed child order followed by a sort, per depth of the drawn tree
+BENCHMARK(visible_list)
+{
+	Ref<TerrainStream> stream = create_test_stream();
+	HeadlessContext context;
+	uint32_t depth = 0;
+	while ((MIN_CHUNK_SIZE << depth) < TERRAIN_SIZE)
+		depth++;
+	QuadTree quadTree(&context, stream, depth, TERRAIN_SIZE, MAX_HEIGHT, TerrainMeshMode::CpuMesh, 500);
+	Ref<Camera> camera = CreateRef<Camera>();
+	glm::vec3 position = glm::vec3(float(TERRAIN_SIZE) * 0.5f, 0.0f, float(TERRAIN_SIZE) * 0.5f);
+	position.y = sample_world_height(stream, position.x, position.z) + 20.0f;
+	camera->set_position(position);
+	camera->set_rotation(glm::vec3(0.2f, 0.7854f, 0.0f));
+	camera->update(0.0f);
+
+	// Same camera until no build was in flight for a few frames, the requests are dispatched over several frames
+	uint32_t idleFrameCount = 0;
+	for (uint32_t frame = 0; frame < 1000 && idleFrameCount < 10; ++frame)
+	{
+		quadTree.update(&context, camera);
+		quadTree.prepass(&context, camera);
+		context.next_frame();
+		bool pending = quadTree.get_chunk_manager()->get_pending_build_count() > 0;
+		idleFrameCount = pending ? 0 : idleFrameCount + 1;
+		if (pending)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	quadTree.update(&context, camera);
+	quadTree.prepass(&context, camera);
+
+	const uint32_t iterationCount = 100;
+	glm::vec2 viewPosition = glm::vec2(position.x, position.z);
+	std::vector<TerrainChunk*> chunks;
+	for (uint32_t maxDepth = 1; maxDepth <= depth; ++maxDepth)
+	{
+		Clock::time_point start = Clock::now();
+		for (uint32_t i = 0; i < iterationCount; ++i)
+		{
+			chunks.clear();
+			quadTree.get_visible_list(maxDepth, viewPosition, chunks);
+		}
+		float orderedTime = get_elapsed_ms(start) * 1000.0f / float(iterationCount);
+
+		// Previous method, the children are visited in a fixed order when the view is at -FLT_MAX
+		start = Clock::now();
+		for (uint32_t i = 0; i < iterationCount; ++i)
+		{
+			chunks.clear();
+			quadTree.get_visible_list(maxDepth, glm::vec2(-FLT_MAX), chunks);
+			std::sort(chunks.begin(), chunks.end(), [&](const TerrainChunk* lhs, const TerrainChunk* rhs)
+				{
+					glm::ivec2 c1 = lhs->get_center();
+					glm::ivec2 c2 = rhs->get_center();
+					return glm::distance2(glm::vec3(c1.x, 0.0f, c1.y), position) < glm::distance2(glm::vec3(c2.x, 0.0f, c2.y), position);
+				});
+		}
+		float sortedTime = get_elapsed_ms(start) * 1000.0f / float(iterationCount);
+		printf("  depth %d: %d chunks, ordered: %.2fus, sorted: %.2fus\n", int(maxDepth), int(chunks.size()), orderedTime, sortedTime);
+	}
+	quadTree.destroy();
+	stream->destroy();
+}
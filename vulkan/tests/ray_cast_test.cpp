@@ -0,0 +1,153 @@
+#include "test.h"
+#include "terrain_test_util.h"
+
+#include "core/job_system.h"
+#include "scene/camera.h"
+#include "terrain/terrain_raycast.h"
+
+static const float MAX_RAY_CAST_DISTANCE = 500.0f;
+
+// Previous ray cast of Terrain, bisects the segment on the sign of the height above the terrain
+// doesn't work properly in steep slope
+static bool binary_search(const Ref<TerrainStream>& stream, const glm::vec3& p0, const glm::vec3& p1, float t, glm::vec3& p_out)
+{
+	float distance = glm::length2(p0 - p1);
+	float h0 = p0.y - sample_world_height(stream, p0.x, p0.z);
+	float h1 = p1.y - sample_world_height(stream, p1.x, p1.z);
+
+	if (distance < t * t)
+	{
+		p_out = (p0 + p1) * 0.5f;
+		return h0 * h1 < 0.0f;
+	}
+
+	glm::vec3 pm = (p0 + p1) * 0.5f;
+	float hm = pm.y - sample_world_height(stream, pm.x, pm.z);
+
+	if (h0 * hm < 0.0f)
+		return binary_search(stream, p0, pm, t, p_out);
+	else
+		return binary_search(stream, pm, p1, t, p_out);
+}
+
+// Grid of camera ray covering a 1280 x 720 window, the cameras look down toward the center of the terrain
+static std::vector<Ray> get_camera_rays(uint32_t gridSize)
+{
+	const glm::vec2 windowSize = glm::vec2(1280.0f, 720.0f);
+	Ref<Camera> camera = CreateRef<Camera>();
+	camera->set_aspect(windowSize.x / windowSize.y);
+
+	std::vector<Ray> rays;
+	const float yaws[] = { 0.0f, 1.0f, 2.5f, 4.0f };
+	for (float yaw : yaws)
+	{
+		camera->set_position(glm::vec3(1024.0f + 300.0f * std::sin(yaw), 200.0f, 1024.0f + 300.0f * std::cos(yaw)));
+		camera->set_rotation(glm::vec3(0.4f, yaw + 3.14159f, 0.0f));
+		camera->update(0.0f);
+		for (uint32_t y = 0; y < gridSize; ++y)
+		{
+			for (uint32_t x = 0; x < gridSize; ++x)
+			{
+				glm::vec2 mouse = (glm::vec2(float(x), float(y)) + 0.5f) / float(gridSize) * windowSize;
+				rays.push_back(camera->generate_ray(mouse, windowSize));
+			}
+		}
+	}
+	return rays;
+}
+
+TEST(batched_ray_cast_matches_single_ray)
+{
+	Ref<TerrainStream> stream = create_test_stream();
+	TerrainRayCaster rayCaster(stream, float(MAX_HEIGHT), 4);
+	std::vector<Ray> rays = get_camera_rays(32);
+	uint32_t rayCount = static_cast<uint32_t>(rays.size());
+
+	std::vector<TerrainRayHit> batchHits(rayCount);
+	rayCaster.ray_cast(rays.data(), rayCount, MAX_RAY_CAST_DISTANCE, batchHits.data());
+
+	uint32_t hitCount = 0;
+	for (uint32_t i = 0; i < rayCount; ++i)
+	{
+		TerrainRayHit hit;
+		bool hitResult = rayCaster.ray_cast(rays[i], MAX_RAY_CAST_DISTANCE, hit);
+		CHECK(hitResult == hit.hit);
+		CHECK(hit.hit == batchHits[i].hit);
+		if (!hit.hit || !batchHits[i].hit)
+			continue;
+
+		CHECK(hit.position == batchHits[i].position);
+		// The hit is on the heightfield
+		CHECK(std::abs(hit.position.y - sample_world_height(stream, hit.position.x, hit.position.z)) < 0.01f);
+		hitCount++;
+	}
+	CHECK(hitCount > 0);
+	rayCaster.destroy();
+	stream->destroy();
+}
+
+// Camera rays with the binary search, the single ray and the batched ray cast
+BENCHMARK(ray_cast)
+{
+	Ref<TerrainStream> stream = create_test_stream();
+	TerrainRayCaster rayCaster(stream, float(MAX_HEIGHT), JobSystem::get_default_worker_count());
+	std::vector<Ray> rays = get_camera_rays(64);
+	uint32_t rayCount = static_cast<uint32_t>(rays.size());
+
+	std::vector<TerrainRayHit> references(rayCount);
+	Clock::time_point start = Clock::now();
+	for (uint32_t i = 0; i < rayCount; ++i)
+	{
+		glm::vec3 p0 = rays[i].origin + 0.01f * rays[i].direction;
+		glm::vec3 p1 = rays[i].origin + MAX_RAY_CAST_DISTANCE * rays[i].direction;
+		references[i].hit = binary_search(stream, p0, p1, 0.001f, references[i].position);
+	}
+	float referenceTime = get_elapsed_ms(start);
+
+	std::vector<TerrainRayHit> hits(rayCount);
+	start = Clock::now();
+	for (uint32_t i = 0; i < rayCount; ++i)
+		rayCaster.ray_cast(rays[i], MAX_RAY_CAST_DISTANCE, hits[i]);
+	float singleThreadTime = get_elapsed_ms(start);
+
+	std::vector<TerrainRayHit> batchHits(rayCount);
+	start = Clock::now();
+	rayCaster.ray_cast(rays.data(), rayCount, MAX_RAY_CAST_DISTANCE, batchHits.data());
+	float batchTime = get_elapsed_ms(start);
+
+	// Ray where both method hit more than a unit apart or only one of them hit
+	uint32_t referenceHitCount = 0;
+	uint32_t hitCount = 0;
+	uint32_t mismatchCount = 0;
+	uint32_t bothHitCount = 0;
+	float totalHitDistance = 0.0f;
+	float maxHitDistance = 0.0f;
+	for (uint32_t i = 0; i < rayCount; ++i)
+	{
+		referenceHitCount += references[i].hit ? 1 : 0;
+		hitCount += hits[i].hit ? 1 : 0;
+		if (references[i].hit != hits[i].hit)
+		{
+			mismatchCount++;
+			continue;
+		}
+		if (!hits[i].hit)
+			continue;
+
+		float distance = glm::distance(references[i].position, hits[i].position);
+		if (distance > 1.0f)
+			mismatchCount++;
+		totalHitDistance += distance;
+		maxHitDistance = std::max(maxHitDistance, distance);
+		bothHitCount++;
+	}
+
+	printf("  rays: %d, workers: %d\n", rayCount, rayCaster.get_worker_count());
+	printf("  binary search: %.3fms (hit: %d)\n", referenceTime, referenceHitCount);
+	printf("  pyramid: %.3fms (hit: %d)\n", singleThreadTime, hitCount);
+	printf("  pyramid batched: %.3fms\n", batchTime);
+	printf("  mismatch: %d\n", mismatchCount);
+	printf("  hit distance mean: %.4f, max: %.4f\n", bothHitCount > 0 ? totalHitDistance / float(bothHitCount) : 0.0f, maxHitDistance);
+	rayCaster.destroy();
+	stream->destroy();
+}
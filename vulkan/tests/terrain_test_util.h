@@ -0,0 +1,56 @@
+#pragma once
+
+#include "core/base.h"
+#include "core/math.h"
+#include "terrain/terrain_generator.h"
+#include "terrain/terrain_stream.h"
+
+#include <chrono>
+#include <vector>
+
+// Terrain shared by the tests and the benchmarks, a generated 2048 x 2048 map in memory
+static const uint32_t TERRAIN_SIZE = 2048;
+static const uint32_t MIN_CHUNK_SIZE = 64;
+static const int MAX_HEIGHT = 150;
+
+struct ChunkRect
+{
+	glm::ivec2 min;
+	glm::ivec2 max;
+	uint32_t lod;
+};
+
+// Chunks of every lod along the diagonal of the terrain, the last one of each lod is on the border
+inline std::vector<ChunkRect> get_diagonal_chunks()
+{
+	std::vector<ChunkRect> chunks;
+	for (uint32_t lod = 0; (MIN_CHUNK_SIZE << lod) <= TERRAIN_SIZE; ++lod)
+	{
+		uint32_t chunkSize = MIN_CHUNK_SIZE << lod;
+		for (uint32_t position = 0; position < TERRAIN_SIZE; position += std::max(chunkSize, TERRAIN_SIZE / 4))
+			chunks.push_back({ glm::ivec2(position), glm::ivec2(position + chunkSize), lod });
+	}
+	return chunks;
+}
+
+inline Ref<TerrainStream> create_test_stream()
+{
+	PerlinGenerator generator;
+	generator.width = TERRAIN_SIZE;
+	generator.height = TERRAIN_SIZE;
+	generator.frequency = 0.01f;
+	return CreateRef<TerrainStream>(generator);
+}
+
+// World space height at the texel coordinate (x, y), as Terrain::get_height
+inline float sample_world_height(const Ref<TerrainStream>& stream, float x, float y)
+{
+	return (stream->sample(x, y) * 2.0f - 1.0f) * float(MAX_HEIGHT);
+}
+
+typedef std::chrono::high_resolution_clock Clock;
+
+inline float get_elapsed_ms(Clock::time_point start)
+{
+	return std::chrono::duration<float, std::milli>(Clock::now() - start).count();
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstdio>
+#include <vector>
+
+// Tests and benchmarks of the terrain run without a gpu, see main.cpp
+// A test fails when one of its CHECK fails, a benchmark only prints what it measures
+typedef void (*TestFunction)();
+
+struct TestCase
+{
+	const char* name;
+	TestFunction function;
+	bool benchmark;
+};
+
+std::vector<TestCase>& get_test_cases();
+void report_failure(const char* expr, const char* file, int line);
+
+struct TestRegistration
+{
+	TestRegistration(const char* name, TestFunction function, bool benchmark)
+	{
+		get_test_cases().push_back({ name, function, benchmark });
+	}
+};
+
+#define TEST(name) \
+static void name(); \
+static TestRegistration name##_registration(#name, name, false); \
+static void name()
+
+#define BENCHMARK(name) \
+static void name(); \
+static TestRegistration name##_registration(#name, name, true); \
+static void name()
+
+#define CHECK(expr) \
+do {\
+	if (!(expr))\
+		report_failure(#expr, __FILE__, __LINE__);\
+} while (0)
+
+// Failed checks are reported with the value compared against the expectation
+#define CHECK_EQUAL(value, expected) \
+do {\
+	if (!((value) == (expected)))\
+	{\
+		report_failure(#value " == " #expected, __FILE__, __LINE__);\
+		printf("    %lld != %lld\n", (long long)(value), (long long)(expected));\
+	}\
+} while (0)